@@ -0,0 +1,417 @@
+/* Batched page I/O for GC data migration in the rewrite engines.
+ * GC adds the pages it reads or writes to a batch and submits it at once:
+ *   - pages are grouped by PU, keeping the order they were added in;
+ *   - consecutive pages of a block with the same mode become one
+ *     fox_read_blk/fox_write_blk call, split in vector commands of
+ *     RW_BATCH_NPPAS sectors instead of the -v size of user I/O;
+ *   - PUs are served by up to RW_BATCH_WORKERS threads, each with its own
+ *     vblk target, block buffer and stats, so they overlap.
+ * rw_batch_copy pipelines a list of page copies: the reads of a chunk are
+ * submitted together with the writes of the previous one. With --gc-copy
+ * device the pages are copied by the device instead (vector copy, up to
+ * RW_BATCH_NPPAS sectors per command) and never reach host memory; if the
+ * device rejects a copy, the batch falls back to the host path for good.
+ * rw_batch_erase erases a list of blocks the same way, one worker per PU, so
+ * the blocks of a superblock cost about one erase latency.
+ * Written by Chuizheng Meng <mengcz13@mails.tsinghua.edu.cn>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "../fox.h"
+#include "fox-rewrite-utils.h"
+
+static int batch_worker_init(struct rw_batch* b, struct rw_batch_worker* w) {
+    struct fox_node* node = b->node;
+    int pg_ppas = node->wl->geo->nsectors * node->wl->geo->nplanes;
+    w->b = b;
+    w->wl = *node->wl;
+    w->wl.nppas = (RW_BATCH_NPPAS / pg_ppas) * pg_ppas;
+    if (w->wl.nppas < node->wl->nppas)
+        w->wl.nppas = node->wl->nppas;
+    // -m compares a read with the last write at its page index through the
+    // same buffer; the reads here are not checked, the writes go to the
+    // reference of the engine in rw_batch_submit
+    w->wl.memcmp = WB_DISABLE;
+    w->node = *node;
+    w->node.wl = &w->wl;
+    memset(&w->node.stats, 0, sizeof(struct fox_stats));
+    w->node.stats.tval = node->stats.tval;
+    pthread_mutex_init(&w->node.stats.s_mutex, NULL);
+    w->ret = 0;
+    return fox_alloc_blk_buf(node, &w->buf);
+}
+
+// sectors of a vector copy, at least one page
+static uint64_t batch_dev_sectors(struct rw_batch* b) {
+    uint64_t pg_ppas = b->node->wl->geo->nsectors * b->node->wl->geo->nplanes;
+    return (RW_BATCH_NPPAS / pg_ppas) ? (RW_BATCH_NPPAS / pg_ppas) * pg_ppas : pg_ppas;
+}
+
+// max pages per submit, copies move copypgs pages per submit
+int rw_batch_init(struct rw_batch* b, struct fox_node* node, struct rewrite_meta* meta, struct fox_blkbuf* ref, uint64_t max, uint64_t copypgs) {
+    uint64_t i;
+    memset(b, 0, sizeof(struct rw_batch));
+    b->node = node;
+    b->meta = meta;
+    b->ref = ref;
+    b->max = max;
+    b->copypgs = (copypgs > max / 2) ? max / 2 : copypgs;
+    b->npus = node->nchs * node->nluns;
+    b->nworkers = (b->npus < RW_BATCH_WORKERS) ? b->npus : RW_BATCH_WORKERS;
+    b->pgs = (struct rw_batch_page*)calloc(max, sizeof(struct rw_batch_page));
+    b->order = (uint64_t*)calloc(max, sizeof(uint64_t));
+    b->pu_first = (uint64_t*)calloc(b->npus + 1, sizeof(uint64_t));
+    b->copybuf = (uint8_t*)calloc(2 * b->copypgs + 1, meta->vpg_sz);
+    b->workers = (struct rw_batch_worker*)calloc(b->nworkers, sizeof(struct rw_batch_worker));
+    b->devcopy = (node->wl->gc_copy == GC_COPY_DEVICE);
+    b->dev_src = (struct nvm_addr*)calloc(batch_dev_sectors(b), sizeof(struct nvm_addr));
+    b->dev_dst = (struct nvm_addr*)calloc(batch_dev_sectors(b), sizeof(struct nvm_addr));
+    if (!b->pgs || !b->order || !b->pu_first || !b->copybuf || !b->workers || !b->dev_src || !b->dev_dst)
+        goto FREE;
+    for (i = 0; i < b->nworkers; i++) {
+        if (batch_worker_init(b, &b->workers[i])) {
+            b->nworkers = i;
+            goto FREE;
+        }
+    }
+    return 0;
+
+FREE:
+    rw_batch_free(b);
+    return 1;
+}
+
+void rw_batch_free(struct rw_batch* b) {
+    uint64_t i;
+    for (i = 0; i < b->nworkers; i++) {
+        fox_free_blkbuf(&b->workers[i].buf, 1);
+        pthread_mutex_destroy(&b->workers[i].node.stats.s_mutex);
+    }
+    free(b->pgs);
+    free(b->order);
+    free(b->pu_first);
+    free(b->copybuf);
+    free(b->workers);
+    free(b->dev_src);
+    free(b->dev_dst);
+    memset(b, 0, sizeof(struct rw_batch));
+}
+
+int rw_batch_add(struct rw_batch* b, struct nodegeoaddr* addr, uint64_t state_i, uint8_t* data, int mode) {
+    struct rw_batch_page* p;
+    if (b->n == b->max)
+        return 1;
+    p = &b->pgs[b->n++];
+    p->addr = *addr;
+    p->addr.offset_in_page = 0;
+    p->state_i = state_i;
+    p->data = data;
+    p->mode = mode;
+    p->done = 0;
+    return 0;
+}
+
+static uint64_t batch_pu(struct rw_batch* b, struct rw_batch_page* p) {
+    return p->addr.ch_i + p->addr.lun_i * b->node->nchs;
+}
+
+// one read or write of pages order[first, first + len), same block, consecutive
+static int batch_run(struct rw_batch_worker* w, uint64_t first, uint64_t len) {
+    struct rw_batch* b = w->b;
+    struct rewrite_meta* meta = b->meta;
+    struct rw_batch_page* p0 = &b->pgs[b->order[first]];
+    size_t vpg_sz = meta->vpg_sz;
+    uint64_t i;
+    fox_vblk_tgt(&w->node, w->node.ch[p0->addr.ch_i], w->node.lun[p0->addr.lun_i], p0->addr.blk_i);
+    if (p0->mode == ERASE_MODE) {
+        uint32_t fails = w->node.stats.fail_e;
+        if (fox_erase_blk(&w->node.vblk_tgt, &w->node))
+            return 1;
+        // a failed erase leaves the block dirty, see rw_replace_blk
+        p0->done = (w->node.stats.fail_e == fails);
+    } else if (p0->mode == READ_MODE) {
+        if (fox_read_blk(&w->node.vblk_tgt, &w->node, &w->buf, len, p0->addr.pg_i))
+            return 1;
+        for (i = 0; i < len; i++) {
+            struct rw_batch_page* p = &b->pgs[b->order[first + i]];
+            meta->heatmap[p->state_i].readt++;
+            memcpy(p->data, w->buf.buf_r + vpg_sz * p->addr.pg_i, vpg_sz);
+        }
+    } else {
+        for (i = 0; i < len; i++) {
+            struct rw_batch_page* p = &b->pgs[b->order[first + i]];
+            if (get_pg_state(meta, p->state_i) == PAGE_DIRTY) {
+                printf("Writing to dirty page!\n");
+                return 1;
+            }
+            memcpy(w->buf.buf_w + vpg_sz * p->addr.pg_i, p->data, vpg_sz);
+            if (meta->oob)
+                rw_oob_stamp(meta, &w->buf, p->addr.pg_i, &p->oob);
+        }
+        if (fox_write_blk(&w->node.vblk_tgt, &w->node, &w->buf, len, p0->addr.pg_i))
+            return 1;
+        for (i = 0; i < len; i++) {
+            struct rw_batch_page* p = &b->pgs[b->order[first + i]];
+            meta->heatmap[p->state_i].writet++;
+            // page states share words across PUs, set after the workers join
+            p->done = 1;
+        }
+    }
+    return 0;
+}
+
+static int batch_same_run(struct rw_batch_page* p, struct rw_batch_page* q) {
+    return (q->mode == p->mode && q->mode != ERASE_MODE && q->addr.ch_i == p->addr.ch_i && q->addr.lun_i == p->addr.lun_i &&
+            q->addr.blk_i == p->addr.blk_i && q->addr.pg_i == p->addr.pg_i + 1);
+}
+
+static void* batch_worker(void* arg) {
+    struct rw_batch_worker* w = (struct rw_batch_worker*)arg;
+    struct rw_batch* b = w->b;
+    uint64_t pu, i, len;
+    // worker k serves PUs k, k + nworkers, ...
+    for (pu = w - b->workers; pu < b->npus; pu += b->nworkers) {
+        for (i = b->pu_first[pu]; i < b->pu_first[pu + 1]; i += len) {
+            for (len = 1; i + len < b->pu_first[pu + 1]; len++) {
+                if (!batch_same_run(&b->pgs[b->order[i + len - 1]], &b->pgs[b->order[i + len]]))
+                    break;
+            }
+            w->ret |= batch_run(w, i, len);
+        }
+    }
+    return NULL;
+}
+
+// device work of the workers belongs to the node
+static void batch_merge_stats(struct rw_batch* b, struct rw_batch_worker* w) {
+    struct fox_stats* st = &b->node->stats;
+    struct fox_stats* wst = &w->node.stats;
+    pthread_mutex_lock(&st->s_mutex);
+    st->read_t += wst->read_t;
+    st->write_t += wst->write_t;
+    st->erase_t += wst->erase_t;
+    st->erased_blks += wst->erased_blks;
+    st->rw_sect += wst->rw_sect;
+    st->pgs_r += wst->pgs_r;
+    st->pgs_w += wst->pgs_w;
+    st->io_count += wst->io_count;
+    st->bread += wst->bread;
+    st->bwritten += wst->bwritten;
+    st->brw_sec += wst->brw_sec;
+    st->iops += wst->iops;
+    st->pgs_done += wst->pgs_done;
+    st->fail_e += wst->fail_e;
+    st->fail_w += wst->fail_w;
+    st->fail_r += wst->fail_r;
+    st->fail_cmp += wst->fail_cmp;
+    pthread_mutex_unlock(&st->s_mutex);
+    wst->read_t = wst->write_t = wst->erase_t = wst->rw_sect = 0;
+    wst->erased_blks = wst->fail_e = 0;
+    wst->pgs_r = wst->pgs_w = wst->io_count = 0;
+    wst->bread = wst->bwritten = wst->brw_sec = 0;
+    wst->iops = wst->pgs_done = 0;
+    wst->fail_w = wst->fail_r = wst->fail_cmp = 0;
+}
+
+int rw_batch_submit(struct rw_batch* b) {
+    uint64_t i, pu, nbusy = 0, npgs = 0;
+    int ret = 0;
+    if (b->n == 0)
+        return 0;
+    // owners of the pages to write, the workers do not share the meta
+    for (i = 0; b->meta->oob && i < b->n; i++) {
+        if (b->pgs[i].mode == WRITE_MODE)
+            rw_oob_take(b->meta, b->pgs[i].state_i, &b->pgs[i].oob);
+    }
+    // stable counting sort of the pages by PU
+    memset(b->pu_first, 0, (b->npus + 1) * sizeof(uint64_t));
+    for (i = 0; i < b->n; i++)
+        b->pu_first[batch_pu(b, &b->pgs[i]) + 1]++;
+    for (pu = 0; pu < b->npus; pu++)
+        b->pu_first[pu + 1] += b->pu_first[pu];
+    for (i = 0; i < b->n; i++)
+        b->order[b->pu_first[batch_pu(b, &b->pgs[i])]++] = i;
+    for (pu = b->npus; pu > 0; pu--)
+        b->pu_first[pu] = b->pu_first[pu - 1];
+    b->pu_first[0] = 0;
+
+    for (i = 0; i < b->nworkers; i++) {
+        b->workers[i].busy = 0;
+        for (pu = i; pu < b->npus; pu += b->nworkers)
+            b->workers[i].busy |= (b->pu_first[pu + 1] > b->pu_first[pu]);
+        nbusy += b->workers[i].busy;
+    }
+    for (i = 0; i < b->nworkers; i++) {
+        struct rw_batch_worker* w = &b->workers[i];
+        // vblks are allocated once the node runs, after rw_batch_init
+        w->wl.vblks = b->node->wl->vblks;
+        w->ret = 0;
+        w->spawned = 0;
+        if (!w->busy)
+            continue;
+        // a single busy worker runs in the caller
+        if (nbusy > 1 && pthread_create(&w->tid, NULL, batch_worker, w) == 0)
+            w->spawned = 1;
+        else
+            batch_worker(w);
+    }
+    for (i = 0; i < b->nworkers; i++) {
+        struct rw_batch_worker* w = &b->workers[i];
+        if (w->spawned)
+            pthread_join(w->tid, NULL);
+        if (w->busy)
+            batch_merge_stats(b, w);
+        ret |= w->ret;
+    }
+    for (i = 0; i < b->n; i++) {
+        if (b->pgs[i].mode == ERASE_MODE) {
+            // page states follow the engine layout, the caller resets them
+            if (b->pgs[i].done) {
+                set_blk_state(b->meta, &b->pgs[i].addr, BLOCK_CLEAN);
+                b->meta->blk_erases[geoaddr2vblk(b->node, &b->pgs[i].addr)]++;
+            }
+            continue;
+        }
+        npgs++;
+        if (b->pgs[i].done) {
+            set_pg_state(b->meta, b->pgs[i].state_i, PAGE_DIRTY);
+            set_blk_state(b->meta, &b->pgs[i].addr, BLOCK_DIRTY);
+            rw_prog(b->meta, 1);
+            // as if written through the buffer of the engine, in add order
+            if (b->ref && b->node->wl->memcmp && b->pgs[i].mode == WRITE_MODE)
+                memcpy(b->ref->buf_w + b->meta->vpg_sz * b->pgs[i].addr.pg_i, b->pgs[i].data, b->meta->vpg_sz);
+        }
+    }
+    b->ncmds++;
+    b->npages += npgs;
+    b->host_bytes += npgs * b->meta->vpg_sz;
+    b->n = 0;
+    return ret;
+}
+
+// sector addresses of a page, as laid out by the vblk of its block
+static void batch_dev_addrs(struct rw_batch* b, struct nodegeoaddr* addr, struct nvm_addr* ppas) {
+    struct fox_node* node = b->node;
+    const struct nvm_geo* geo = node->wl->geo;
+    struct nvm_vblk* vblk = node->wl->vblks[fox_vblk_get_pblk(node->wl, node->ch[addr->ch_i], node->lun[addr->lun_i], addr->blk_i)];
+    uint64_t i;
+    for (i = 0; i < geo->nsectors * geo->nplanes; i++) {
+        ppas[i] = vblk->blks[0];
+        ppas[i].g.pg = addr->pg_i;
+        ppas[i].g.pl = (i / geo->nsectors) % geo->nplanes;
+        ppas[i].g.sec = i % geo->nsectors;
+    }
+}
+
+/*
+ * Copies cps[0, n) on the device, one vector command per batch_dev_sectors.
+ * Returns the pages copied, less than n if the device rejected a command.
+ */
+static uint64_t batch_dev_copy(struct rw_batch* b, struct rw_copy* cps, uint64_t n) {
+    struct fox_node* node = b->node;
+    struct rewrite_meta* meta = b->meta;
+    uint64_t pg_ppas = node->wl->geo->nsectors * node->wl->geo->nplanes;
+    uint64_t cmd_pgs = batch_dev_sectors(b) / pg_ppas;
+    uint64_t c, i, len;
+    for (c = 0; c < n; c += len) {
+        len = (n - c < cmd_pgs) ? n - c : cmd_pgs;
+        for (i = 0; i < len; i++) {
+            if (get_pg_state(meta, cps[c + i].dst_i) == PAGE_DIRTY) {
+                printf("Writing to dirty page!\n");
+                return c;
+            }
+            batch_dev_addrs(b, &cps[c + i].src, b->dev_src + i * pg_ppas);
+            batch_dev_addrs(b, &cps[c + i].dst, b->dev_dst + i * pg_ppas);
+        }
+        fox_timestamp_tmp_start(&node->stats);
+        if (prov_addr_copy(b->dev_src, b->dev_dst, len * pg_ppas) < 0)
+            return c;
+        fox_timestamp_end(FOX_STATS_WRITE_T, &node->stats);
+        // flash work of a copy, no host transfer
+        fox_set_stats(FOX_STATS_PGS_R, &node->stats, len);
+        fox_set_stats(FOX_STATS_PGS_W, &node->stats, len);
+        fox_set_stats(FOX_STATS_IOPS, &node->stats, 1);
+        for (i = 0; i < len; i++) {
+            struct rw_oob oob;
+            // the device copies the metadata, owner included
+            if (meta->oob)
+                rw_oob_take(meta, cps[c + i].dst_i, &oob);
+            meta->heatmap[cps[c + i].src_i].readt++;
+            meta->heatmap[cps[c + i].dst_i].writet++;
+            set_pg_state(meta, cps[c + i].dst_i, PAGE_DIRTY);
+            set_blk_state(meta, &cps[c + i].dst, BLOCK_DIRTY);
+        }
+        rw_prog(meta, len);
+        b->dev_cmds++;
+        b->dev_bytes += len * meta->vpg_sz;
+    }
+    return n;
+}
+
+int rw_batch_copy(struct rw_batch* b, struct rw_copy* cps, uint64_t n) {
+    uint64_t chunk = b->copypgs;
+    uint64_t c, i, prev = 0, nprev = 0;
+    int ret = 0;
+    if (b->devcopy) {
+        uint64_t done = batch_dev_copy(b, cps, n);
+        if (done == n)
+            return 0;
+        printf(" Node %d: device copy failed, GC copies go through the host\n", b->node->nid);
+        b->devcopy = 0;
+        cps += done;
+        n -= done;
+    }
+    if (chunk == 0)
+        return 1;
+    for (c = 0; c < n || nprev > 0; c += chunk) {
+        uint64_t ncur = (c < n) ? ((n - c < chunk) ? n - c : chunk) : 0;
+        // two halves of copybuf, chunk c / chunk lands in half (c / chunk) % 2
+        uint8_t* curbuf = b->copybuf + ((c / chunk) % 2) * chunk * b->meta->vpg_sz;
+        uint8_t* prevbuf = b->copybuf + (((c / chunk) + 1) % 2) * chunk * b->meta->vpg_sz;
+        for (i = 0; i < ncur; i++)
+            rw_batch_add(b, &cps[c + i].src, cps[c + i].src_i, curbuf + i * b->meta->vpg_sz, READ_MODE);
+        for (i = 0; i < nprev; i++)
+            rw_batch_add(b, &cps[prev + i].dst, cps[prev + i].dst_i, prevbuf + i * b->meta->vpg_sz, WRITE_MODE);
+        ret |= rw_batch_submit(b);
+        prev = c;
+        nprev = ncur;
+    }
+    return ret;
+}
+
+/*
+ * Erases the blocks blks[0, n) with the PUs in parallel and sets them
+ * BLOCK_CLEAN; a block the device failed to erase keeps its state. Page
+ * states are left to the caller. The batch must be empty.
+ */
+int rw_batch_erase(struct rw_batch* b, struct nodegeoaddr* blks, uint64_t n) {
+    struct timeval tvalst, tvaled;
+    uint64_t c, i, len;
+    int ret = 0;
+    if (n == 0)
+        return 0;
+    gettimeofday(&tvalst, NULL);
+    for (c = 0; c < n; c += len) {
+        len = (n - c < b->max) ? n - c : b->max;
+        for (i = 0; i < len; i++)
+            rw_batch_add(b, &blks[c + i], 0, NULL, ERASE_MODE);
+        ret |= rw_batch_submit(b);
+    }
+    gettimeofday(&tvaled, NULL);
+    b->erase_cmds++;
+    b->erase_blks += n;
+    b->erase_us += ((uint64_t)(tvaled.tv_sec - tvalst.tv_sec) * 1000000L + tvaled.tv_usec) - tvalst.tv_usec;
+    return ret;
+}
+
+void rw_batch_print(struct rw_batch* b) {
+    printf(" Node %d: GC data, %.1f MB through the host, %.1f MB copied on the device (%" PRIu64 " commands)\n",
+            b->node->nid, b->host_bytes / 1048576.0, b->dev_bytes / 1048576.0, b->dev_cmds);
+    if (b->erase_cmds)
+        printf(" Node %d: %" PRIu64 " parallel erases of %.1f blocks, %.1f us each\n",
+                b->node->nid, b->erase_cmds, (double)b->erase_blks / b->erase_cmds, (double)b->erase_us / b->erase_cmds);
+}
@@ -0,0 +1,443 @@
+/* Checkpoint and journal of the page mapping of the log-structured engines.
+ * The checkpointed image holds nimg = total_pagenum + nblocks entries: the
+ * vpg2ppg table, then the write pointer of each block. Its values are read
+ * through the engine callback (get), the image is never kept twice in DRAM.
+ *   - the engine reserves 2 regions of rblks blocks, written in turn; a
+ *     checkpoint is the image cut in chunk pages of epp entries and the
+ *     directory of the flash page of every chunk, written last in nroot root
+ *     pages. Once the root pages are on flash the checkpoint is committed;
+ *   - every mapping update goes to rw_ckpt_log, which dirties the chunk of the
+ *     entry (and of the write pointer of the target block) and appends an
+ *     (idx, val) record to the journal; erases are records of the write
+ *     pointer of the block;
+ *   - rw_ckpt_tick, called by the engine between I/Os, writes the full
+ *     journal pages, and every `every` updates an incremental checkpoint: the
+ *     dirty chunks and the root. When they do not fit in the region, the other
+ *     region is erased and gets a full checkpoint, the old one stays valid
+ *     until then.
+ * rw_ckpt_recover simulates a power loss at the end of the run: the records
+ * still in DRAM are lost, the mapping is rebuilt from the last committed
+ * checkpoint and the journal pages behind it, then the valid page counts of
+ * the blocks. Pages carry the sequence number of their checkpoint, the scan
+ * of a region stops at the first page older than the ones before it.
+ * Written by Chuizheng Meng <mengcz13@mails.tsinghua.edu.cn>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include "../fox.h"
+#include "fox-rewrite-utils.h"
+
+#define CKPT_MAGIC 0x43504b46
+#define CKPT_CHUNK 1
+#define CKPT_ROOT 2
+#define CKPT_JOURNAL 3
+
+struct ckpt_hdr {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t seq;
+    uint32_t idx; // chunk, root part or journal page
+    uint32_t n; // entries in the page
+};
+
+static uint64_t ceil_div(uint64_t a, uint64_t b) {
+    return (a + b - 1) / b;
+}
+
+static uint64_t ckpt_nblocks(struct rewrite_meta* meta) {
+    return (uint64_t)meta->node->nchs * meta->node->nluns * meta->node->nblks;
+}
+
+static void ckpt_dirty(struct rw_ckpt* ck, uint64_t c) {
+    if (ck->dirty[c / 64] & (1ULL << (c % 64)))
+        return;
+    ck->dirty[c / 64] |= 1ULL << (c % 64);
+    ck->ndirty++;
+}
+
+/*
+ * every == 0: checkpoints are off, all the calls do nothing. The pages are
+ * written through a buffer of their own: -m compares a read with the last
+ * write at its page index in the buffer of the engine, which must only see
+ * host data.
+ */
+int rw_ckpt_init(struct rw_ckpt* ck, struct rewrite_meta* meta, uint64_t every, rw_ckpt_get_fn get, void* ctx) {
+    uint64_t hdr = sizeof(struct ckpt_hdr);
+    uint64_t rneed;
+    memset(ck, 0, sizeof(struct rw_ckpt));
+    ck->meta = meta;
+    ck->get = get;
+    ck->ctx = ctx;
+    if (every == 0)
+        return 0;
+    ck->nimg = meta->total_pagenum + ckpt_nblocks(meta);
+    ck->epp = (meta->vpg_sz - hdr) / sizeof(uint32_t);
+    ck->dpp = (meta->vpg_sz - hdr) / sizeof(rw_pgno);
+    ck->rpp = (meta->vpg_sz - hdr) / (2 * sizeof(uint32_t));
+    ck->nchunks = ceil_div(ck->nimg, ck->epp);
+    ck->nroot = ceil_div(ck->nchunks, ck->dpp);
+    // room for a full checkpoint, one incremental and its journal
+    rneed = 2 * (ck->nchunks + ck->nroot) + every / ck->rpp + 1;
+    ck->rblks = ceil_div(rneed, meta->node->npgs);
+    ck->rpgs = ck->rblks * meta->node->npgs;
+    ck->nblks = 2 * ck->rblks;
+    ck->jcap = ck->rpp;
+    ck->dirty = (uint64_t*)calloc(ceil_div(ck->nchunks, 64), sizeof(uint64_t));
+    ck->dir = (rw_pgno*)calloc(ck->nchunks, sizeof(rw_pgno));
+    ck->blks = (uint64_t*)calloc(ck->nblks, sizeof(uint64_t));
+    ck->pagebuf = (uint8_t*)calloc(1, meta->vpg_sz);
+    ck->jrec = (uint32_t*)calloc(2 * ck->jcap, sizeof(uint32_t));
+    if (!ck->dirty || !ck->dir || !ck->blks || !ck->pagebuf || !ck->jrec) {
+        rw_ckpt_free(ck);
+        return 1;
+    }
+    if (fox_alloc_blk_buf(meta->node, &ck->buf)) {
+        rw_ckpt_free(ck);
+        return 1;
+    }
+    ck->every = every;
+    return 0;
+}
+
+void rw_ckpt_free(struct rw_ckpt* ck) {
+    fox_free_blkbuf(&ck->buf, 1);
+    memset(&ck->buf, 0, sizeof(struct fox_blkbuf));
+    free(ck->dirty);
+    free(ck->dir);
+    free(ck->blks);
+    free(ck->pagebuf);
+    free(ck->jrec);
+    ck->dirty = NULL;
+    ck->dir = NULL;
+    ck->blks = NULL;
+    ck->pagebuf = NULL;
+    ck->jrec = NULL;
+    ck->every = 0;
+}
+
+static struct nodegeoaddr ckpt_geo(struct rw_ckpt* ck, int region, uint64_t p) {
+    struct nodegeoaddr geo = vblk2geoaddr(ck->meta->node, ck->blks[region * ck->rblks + p / ck->meta->node->npgs]);
+    geo.pg_i = p % ck->meta->node->npgs;
+    geo.offset_in_page = 0;
+    return geo;
+}
+
+// appends pagebuf to the current region
+static int ckpt_write(struct rw_ckpt* ck, uint32_t type, uint64_t seq, uint64_t idx, uint64_t n) {
+    struct ckpt_hdr* h = (struct ckpt_hdr*)ck->pagebuf;
+    struct nodegeoaddr geo = ckpt_geo(ck, ck->region, ck->wp);
+    h->magic = CKPT_MAGIC;
+    h->type = type;
+    h->seq = seq;
+    h->idx = idx;
+    h->n = n;
+    ck->wp++;
+    int src = rw_prog_src(ck->meta, RW_PROG_MAP);
+    int ret = rw_inside_page(ck->meta->node, &ck->buf, ck->pagebuf, ck->meta, &geo, ck->meta->vpg_sz, WRITE_MODE);
+    rw_prog_src(ck->meta, src);
+    return ret;
+}
+
+// erases the written blocks of the other region and moves to it
+static int ckpt_switch(struct rw_ckpt* ck) {
+    uint64_t b, used = ceil_div(ck->owp, ck->meta->node->npgs);
+    int ret = 0;
+    ck->region ^= 1;
+    for (b = 0; b < used; b++) {
+        struct nodegeoaddr geo = ckpt_geo(ck, ck->region, b * ck->meta->node->npgs);
+        ret |= erase_block(ck->meta->node, ck->meta, &geo);
+    }
+    ck->owp = ck->wp;
+    ck->wp = 0;
+    memset(ck->dirty, 0xff, ceil_div(ck->nchunks, 64) * sizeof(uint64_t));
+    ck->ndirty = ck->nchunks;
+    ck->full_ckpts++;
+    return ret;
+}
+
+// dirty chunks, then the root pages that commit them
+static int ckpt_write_ckpt(struct rw_ckpt* ck) {
+    uint32_t* ents = (uint32_t*)(ck->pagebuf + sizeof(struct ckpt_hdr));
+    rw_pgno* dents = (rw_pgno*)(ck->pagebuf + sizeof(struct ckpt_hdr));
+    uint64_t seq = ck->seq + 1;
+    uint64_t c, i, n;
+    int ret = 0;
+    if (ck->wp + ck->ndirty + ck->nroot > ck->rpgs)
+        ret |= ckpt_switch(ck);
+    for (c = 0; c < ck->nchunks; c++) {
+        if (!(ck->dirty[c / 64] & (1ULL << (c % 64))))
+            continue;
+        n = (ck->nimg - c * ck->epp < ck->epp) ? ck->nimg - c * ck->epp : ck->epp;
+        for (i = 0; i < n; i++)
+            ents[i] = ck->get(ck->ctx, c * ck->epp + i);
+        ck->dir[c] = ck->wp;
+        ret |= ckpt_write(ck, CKPT_CHUNK, seq, c, n);
+        ck->chunk_pgs++;
+    }
+    for (c = 0; c < ck->nroot; c++) {
+        n = (ck->nchunks - c * ck->dpp < ck->dpp) ? ck->nchunks - c * ck->dpp : ck->dpp;
+        memcpy(dents, ck->dir + c * ck->dpp, n * sizeof(rw_pgno));
+        ret |= ckpt_write(ck, CKPT_ROOT, seq, c, n);
+        ck->root_pgs++;
+    }
+    memset(ck->dirty, 0, ceil_div(ck->nchunks, 64) * sizeof(uint64_t));
+    ck->ndirty = 0;
+    ck->seq = seq;
+    ck->jn = 0;
+    ck->since = 0;
+    ck->ckpts++;
+    return ret;
+}
+
+// the first checkpoint, before any update
+int rw_ckpt_start(struct rw_ckpt* ck) {
+    if (ck->every == 0)
+        return 0;
+    memset(ck->dirty, 0xff, ceil_div(ck->nchunks, 64) * sizeof(uint64_t));
+    ck->ndirty = ck->nchunks;
+    ck->full_ckpts++;
+    return ckpt_write_ckpt(ck);
+}
+
+// idx < total_pagenum: vpg2ppg[idx] = val, else the write pointer of block idx - total_pagenum
+void rw_ckpt_log(struct rw_ckpt* ck, uint64_t idx, uint64_t val) {
+    struct rewrite_meta* meta = ck->meta;
+    if (ck->every == 0)
+        return;
+    ckpt_dirty(ck, idx / ck->epp);
+    if (idx < meta->total_pagenum && val < meta->total_pagenum)
+        ckpt_dirty(ck, (meta->total_pagenum + vpg2vblk(meta->node, val)) / ck->epp);
+    if (ck->jn == ck->jcap) {
+        uint32_t* jrec = (uint32_t*)realloc(ck->jrec, 4 * ck->jcap * sizeof(uint32_t));
+        if (jrec == NULL) {
+            fprintf(stderr, " Checkpoint: out of memory for the journal\n");
+            exit(1);
+        }
+        ck->jrec = jrec;
+        ck->jcap *= 2;
+    }
+    ck->jrec[2 * ck->jn] = idx;
+    ck->jrec[2 * ck->jn + 1] = val;
+    ck->jn++;
+    ck->since++;
+}
+
+void rw_ckpt_erase(struct rw_ckpt* ck, uint64_t blk) {
+    rw_ckpt_log(ck, ck->meta->total_pagenum + blk, 0);
+}
+
+// journal pages of the full record pages, then the checkpoint when due
+int rw_ckpt_tick(struct rw_ckpt* ck) {
+    uint32_t* ents = (uint32_t*)(ck->pagebuf + sizeof(struct ckpt_hdr));
+    uint64_t done = 0;
+    int ret = 0;
+    if (ck->every == 0)
+        return 0;
+    if (ck->since >= ck->every)
+        return ckpt_write_ckpt(ck);
+    while (ck->jn - done >= ck->rpp && ck->wp + 1 + ck->ndirty + ck->nroot <= ck->rpgs) {
+        memcpy(ents, ck->jrec + 2 * done, 2 * ck->rpp * sizeof(uint32_t));
+        ret |= ckpt_write(ck, CKPT_JOURNAL, ck->seq, ck->jpgs, ck->rpp);
+        done += ck->rpp;
+        ck->jpgs++;
+        ck->jrecs += ck->rpp;
+    }
+    if (ck->jn - done >= ck->rpp)
+        return ret | ckpt_write_ckpt(ck); // region full, checkpoint instead
+    if (done) {
+        memmove(ck->jrec, ck->jrec + 2 * done, 2 * (ck->jn - done) * sizeof(uint32_t));
+        ck->jn -= done;
+    }
+    return ret;
+}
+
+struct ckpt_scan {
+    struct fox_node* node;
+    struct fox_blkbuf buf;
+    rw_pgno* dir; // of the committed checkpoint
+    rw_pgno* tdir; // root being read
+    uint64_t seq; // committed
+    uint64_t tseq;
+    uint64_t tparts;
+    uint32_t* jrec; // journal records after the committed root
+    uint64_t jn;
+    uint64_t jcap;
+    uint64_t pgs_r;
+};
+
+static struct ckpt_hdr* ckpt_read(struct rw_ckpt* ck, struct ckpt_scan* sc, int region, uint64_t p) {
+    struct nodegeoaddr geo = ckpt_geo(ck, region, p);
+    struct fox_node* node = sc->node;
+    fox_vblk_tgt(node, node->ch[geo.ch_i], node->lun[geo.lun_i], geo.blk_i);
+    sc->pgs_r++;
+    if (fox_read_blk(&node->vblk_tgt, node, &sc->buf, 1, geo.pg_i))
+        return NULL;
+    return (struct ckpt_hdr*)(sc->buf.buf_r + ck->meta->vpg_sz * geo.pg_i);
+}
+
+// 1 if the region holds a committed checkpoint
+static int ckpt_scan_region(struct rw_ckpt* ck, struct ckpt_scan* sc, int region) {
+    uint64_t p, last = 0;
+    sc->seq = 0;
+    sc->tseq = 0;
+    sc->tparts = 0;
+    sc->jn = 0;
+    for (p = 0; p < ck->rpgs; p++) {
+        struct ckpt_hdr* h = ckpt_read(ck, sc, region, p);
+        if (h == NULL || h->magic != CKPT_MAGIC || h->seq < last)
+            break;
+        last = h->seq;
+        if (h->type == CKPT_ROOT) {
+            if (h->seq != sc->tseq) {
+                sc->tseq = h->seq;
+                sc->tparts = 0;
+            }
+            memcpy(sc->tdir + (uint64_t)h->idx * ck->dpp, h + 1, h->n * sizeof(rw_pgno));
+            if (++sc->tparts == ck->nroot) {
+                memcpy(sc->dir, sc->tdir, ck->nchunks * sizeof(rw_pgno));
+                sc->seq = sc->tseq;
+                sc->jn = 0;
+            }
+        } else if (h->type == CKPT_JOURNAL && sc->seq && h->seq == sc->seq) {
+            if (sc->jn + h->n > sc->jcap) {
+                sc->jcap = 2 * (sc->jn + h->n);
+                sc->jrec = (uint32_t*)realloc(sc->jrec, 2 * sc->jcap * sizeof(uint32_t));
+                if (sc->jrec == NULL)
+                    return 0;
+            }
+            memcpy(sc->jrec + 2 * sc->jn, h + 1, 2 * h->n * sizeof(uint32_t));
+            sc->jn += h->n;
+        }
+    }
+    return (sc->seq != 0);
+}
+
+static uint64_t ckpt_peek(struct rw_ckpt* ck, struct ckpt_scan* sc, int region) {
+    struct ckpt_hdr* h = ckpt_read(ck, sc, region, 0);
+    return (h != NULL && h->magic == CKPT_MAGIC) ? h->seq : 0;
+}
+
+// rebuilds the image from flash as after a power loss and checks it against the engine
+int rw_ckpt_recover(struct rw_ckpt* ck) {
+    struct rewrite_meta* meta = ck->meta;
+    struct fox_node rnode;
+    struct ckpt_scan sc;
+    struct timeval tst, ted;
+    uint64_t total = meta->total_pagenum, nblocks = ckpt_nblocks(meta);
+    uint64_t c, i, n, diff = 0, lost = 0, nvalid = 0, nstale = 0, nfree = 0;
+    uint32_t* rec = NULL;
+    uint32_t* valid = NULL;
+    uint8_t* touched = NULL;
+    int region, ret = 1;
+    if (ck->every == 0)
+        return 0;
+    memset(&sc, 0, sizeof(sc));
+    rnode = *meta->node;
+    memset(&rnode.stats, 0, sizeof(struct fox_stats));
+    rnode.stats.tval = meta->node->stats.tval;
+    pthread_mutex_init(&rnode.stats.s_mutex, NULL);
+    sc.node = &rnode;
+    sc.dir = (rw_pgno*)calloc(ck->nchunks, sizeof(rw_pgno));
+    sc.tdir = (rw_pgno*)calloc(ck->nchunks, sizeof(rw_pgno));
+    rec = (uint32_t*)calloc(ck->nimg, sizeof(uint32_t));
+    valid = (uint32_t*)calloc(nblocks, sizeof(uint32_t));
+    touched = (uint8_t*)calloc(ck->nimg, sizeof(uint8_t));
+    if (!sc.dir || !sc.tdir || !rec || !valid || !touched || fox_alloc_blk_buf(meta->node, &sc.buf))
+        goto OUT;
+
+    gettimeofday(&tst, NULL);
+    // the region with the newest first page, the other one if it has no committed root
+    region = (ckpt_peek(ck, &sc, 1) > ckpt_peek(ck, &sc, 0)) ? 1 : 0;
+    if (!ckpt_scan_region(ck, &sc, region)) {
+        region ^= 1;
+        if (!ckpt_scan_region(ck, &sc, region)) {
+            printf(" Node %d: checkpoint recovery found no committed checkpoint\n", meta->node->nid);
+            fox_free_blkbuf(&sc.buf, 1);
+            goto OUT;
+        }
+    }
+    for (c = 0; c < ck->nchunks; c++) {
+        struct ckpt_hdr* h = ckpt_read(ck, &sc, region, sc.dir[c]);
+        n = (ck->nimg - c * ck->epp < ck->epp) ? ck->nimg - c * ck->epp : ck->epp;
+        if (h == NULL || h->magic != CKPT_MAGIC || h->type != CKPT_CHUNK || h->idx != c || h->n != n) {
+            printf(" Node %d: checkpoint recovery, chunk %" PRIu64 " is damaged\n", meta->node->nid, c);
+            fox_free_blkbuf(&sc.buf, 1);
+            goto OUT;
+        }
+        memcpy(rec + c * ck->epp, h + 1, n * sizeof(uint32_t));
+    }
+    for (i = 0; i < sc.jn; i++) {
+        uint64_t idx = sc.jrec[2 * i], val = sc.jrec[2 * i + 1];
+        rec[idx] = val;
+        if (idx < total && val < total) {
+            uint64_t b = total + vpg2vblk(meta->node, val);
+            uint64_t pg = vpg2geoaddr(meta->node, val).pg_i + 1;
+            rec[b] = (rec[b] > pg) ? rec[b] : pg;
+        }
+    }
+    // valid pages of each block from the recovered map
+    for (i = 0; i < total; i++)
+        if (rec[i] < total)
+            valid[vpg2vblk(meta->node, rec[i])]++;
+    gettimeofday(&ted, NULL);
+    fox_free_blkbuf(&sc.buf, 1);
+
+    for (i = 0; i < ck->nblks; i++)
+        touched[total + ck->blks[i]] = 2; // reserved, not counted
+    for (i = 0; i < nblocks; i++) {
+        if (touched[total + i] == 2)
+            continue;
+        if (rec[total + i] == 0)
+            nfree++;
+        else if (valid[i])
+            nvalid++;
+        else
+            nstale++;
+    }
+    // the records left in DRAM at the power loss
+    for (i = 0; i < ck->jn; i++) {
+        uint64_t idx = ck->jrec[2 * i], val = ck->jrec[2 * i + 1];
+        touched[idx] = 1;
+        if (idx < total && val < total)
+            touched[total + vpg2vblk(meta->node, val)] = 1;
+    }
+    for (i = 0; i < ck->nimg; i++) {
+        if (touched[i] == 2 || rec[i] == ck->get(ck->ctx, i))
+            continue;
+        if (touched[i])
+            lost++;
+        else
+            diff++;
+    }
+    printf(" Node %d: recovery from checkpoint %" PRIu64 " + %" PRIu64 " journal records in %.3f ms, %" PRIu64 " pages read,"
+            " blocks %" PRIu64 " with valid data, %" PRIu64 " stale, %" PRIu64 " free\n",
+            meta->node->nid, sc.seq, sc.jn,
+            ((ted.tv_sec - tst.tv_sec) * 1000000.0 + ted.tv_usec - tst.tv_usec) / 1000.0,
+            sc.pgs_r, nvalid, nstale, nfree);
+    printf(" Node %d: recovered map, %" PRIu64 " records lost in DRAM (%" PRIu64 " entries behind), %" PRIu64 " other entries differ\n",
+            meta->node->nid, ck->jn, lost, diff);
+    ret = (diff != 0);
+
+OUT:
+    pthread_mutex_destroy(&rnode.stats.s_mutex);
+    free(sc.dir);
+    free(sc.tdir);
+    free(sc.jrec);
+    free(rec);
+    free(valid);
+    free(touched);
+    return ret;
+}
+
+void rw_ckpt_print(struct rw_ckpt* ck) {
+    if (ck->every == 0)
+        return;
+    printf(" Node %d: checkpoint every %" PRIu64 " updates, %" PRIu64 " blocks reserved, %" PRIu64 " checkpoints (%" PRIu64 " full),"
+            " %" PRIu64 " chunk + %" PRIu64 " root pages, journal %" PRIu64 " pages (%" PRIu64 " records)\n",
+            ck->meta->node->nid, ck->every, ck->nblks, ck->ckpts, ck->full_ckpts,
+            ck->chunk_pgs, ck->root_pgs, ck->jpgs, ck->jrecs);
+}
@@ -0,0 +1,317 @@
+/* Page mapping table of the log-structured engines, whole in DRAM or
+ * demand-paged like DFTL.
+ * Entries are addressed by id: ids below total_pagenum are logical pages,
+ * id total_pagenum + 1 + t is translation page t (see rw_dftl_tp_id), so
+ * the engines move translation pages in GC like any other page.
+ * With --map-cache N the logical page entries live in translation pages on
+ * flash, epp = vpg_sz / 4 entries each, and the flash page of every
+ * translation page is kept in the global translation directory (gtd). Up to
+ * N entries are cached in DRAM in LRU order:
+ *   - a miss reads the translation page of the entry, a page never written
+ *     holds unmapped entries only;
+ *   - updates only dirty the cached entry;
+ *   - rw_dftl_evict, called by the engine between I/Os, drops LRU entries
+ *     down to N. A dirty one is written back with all the dirty entries of
+ *     its translation page: the page is read, patched and written to a new
+ *     flash page by the engine (tp_write), which remaps its id.
+ * The cache may grow past N inside one I/O or GC, writes back never happen
+ * in the middle of an allocation.
+ * Written by Chuizheng Meng <mengcz13@mails.tsinghua.edu.cn>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../fox.h"
+#include "fox-rewrite-utils.h"
+
+static uint64_t dftl_hash(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static void dftl_hash_put(struct rw_dftl* d, uint32_t e) {
+    uint64_t i = dftl_hash(d->ents[e].vpg) & (d->hcap - 1);
+    while (d->hash[i])
+        i = (i + 1) & (d->hcap - 1);
+    d->hash[i] = e + 1;
+}
+
+// slot of vpg in hash, or of the empty slot ending its probe
+static uint64_t dftl_hash_slot(struct rw_dftl* d, uint64_t vpg) {
+    uint64_t i = dftl_hash(vpg) & (d->hcap - 1);
+    while (d->hash[i] && d->ents[d->hash[i] - 1].vpg != vpg)
+        i = (i + 1) & (d->hcap - 1);
+    return i;
+}
+
+static uint32_t dftl_find(struct rw_dftl* d, uint64_t vpg) {
+    uint32_t h = d->hash[dftl_hash_slot(d, vpg)];
+    return (h) ? h - 1 : RW_DFTL_NIL;
+}
+
+// backward shift deletion of linear probing
+static void dftl_hash_del(struct rw_dftl* d, uint64_t vpg) {
+    uint64_t i = dftl_hash_slot(d, vpg), j = i, k;
+    for (;;) {
+        d->hash[i] = 0;
+        for (;;) {
+            j = (j + 1) & (d->hcap - 1);
+            if (!d->hash[j])
+                return;
+            k = dftl_hash(d->ents[d->hash[j] - 1].vpg) & (d->hcap - 1);
+            // move j to i unless its home lies cyclically in (i, j]
+            if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+                continue;
+            break;
+        }
+        d->hash[i] = d->hash[j];
+        i = j;
+    }
+}
+
+static void lru_unlink(struct rw_dftl* d, uint32_t e) {
+    struct rw_dftl_ent* p = &d->ents[e];
+    if (p->prev != RW_DFTL_NIL)
+        d->ents[p->prev].next = p->next;
+    else
+        d->lru_head = p->next;
+    if (p->next != RW_DFTL_NIL)
+        d->ents[p->next].prev = p->prev;
+    else
+        d->lru_tail = p->prev;
+}
+
+static void lru_append(struct rw_dftl* d, uint32_t e) {
+    d->ents[e].prev = d->lru_tail;
+    d->ents[e].next = RW_DFTL_NIL;
+    if (d->lru_tail != RW_DFTL_NIL)
+        d->ents[d->lru_tail].next = e;
+    else
+        d->lru_head = e;
+    d->lru_tail = e;
+}
+
+static int dftl_grow(struct rw_dftl* d) {
+    uint64_t cap = d->cap * 2, i;
+    struct rw_dftl_ent* ents = (struct rw_dftl_ent*)realloc(d->ents, cap * sizeof(struct rw_dftl_ent));
+    uint32_t* hash = (uint32_t*)calloc(cap * 2, sizeof(uint32_t));
+    if (!ents || !hash) {
+        free(hash);
+        if (ents)
+            d->ents = ents;
+        return 1;
+    }
+    d->ents = ents;
+    for (i = d->cap; i < cap; i++)
+        d->ents[i].next = (i + 1 < cap) ? i + 1 : RW_DFTL_NIL;
+    d->free_head = d->cap;
+    free(d->hash);
+    d->hash = hash;
+    d->hcap = cap * 2;
+    for (i = 0; i < d->cap; i++)
+        dftl_hash_put(d, i); // all in use when growing
+    d->cap = cap;
+    return 0;
+}
+
+static uint32_t dftl_insert(struct rw_dftl* d, uint64_t vpg, uint64_t ppg) {
+    uint32_t e;
+    if (d->free_head == RW_DFTL_NIL && dftl_grow(d)) {
+        fprintf(stderr, " DFTL: out of memory for the mapping cache\n");
+        exit(1);
+    }
+    e = d->free_head;
+    d->free_head = d->ents[e].next;
+    d->ents[e].vpg = vpg;
+    d->ents[e].ppg = ppg;
+    d->ents[e].dirty = 0;
+    dftl_hash_put(d, e);
+    lru_append(d, e);
+    d->nents++;
+    return e;
+}
+
+static void dftl_remove(struct rw_dftl* d, uint32_t e) {
+    dftl_hash_del(d, d->ents[e].vpg);
+    lru_unlink(d, e);
+    d->ents[e].next = d->free_head;
+    d->free_head = e;
+    d->nents--;
+}
+
+// cached entry of vpg, read from its translation page on a miss
+static uint32_t dftl_load(struct rw_dftl* d, uint64_t vpg) {
+    uint64_t t = vpg / d->epp;
+    uint64_t ppg = d->meta->total_pagenum;
+    uint32_t e = dftl_find(d, vpg);
+    d->lookups++;
+    if (e != RW_DFTL_NIL) {
+        d->hits++;
+        lru_unlink(d, e);
+        lru_append(d, e);
+        return e;
+    }
+    if (t == d->wb_tp) {
+        // written back by tp_write, which may run GC: wbuf holds the page,
+        // its old flash page may be abandoned already
+        ppg = ((rw_pgno*)d->wbuf)[vpg % d->epp];
+    } else if (d->gtd[t] != d->meta->total_pagenum) {
+        d->tp_read(d->ctx, d->gtd[t], d->rbuf);
+        d->tp_reads++;
+        ppg = ((rw_pgno*)d->rbuf)[vpg % d->epp];
+    }
+    return dftl_insert(d, vpg, ppg);
+}
+
+// max == 0: the whole table is kept in DRAM
+int rw_dftl_init(struct rw_dftl* d, struct rewrite_meta* meta, uint64_t max, rw_dftl_tp_read_fn tp_read, rw_dftl_tp_write_fn tp_write, void* ctx) {
+    uint64_t i;
+    memset(d, 0, sizeof(struct rw_dftl));
+    d->meta = meta;
+    d->max = max;
+    d->tp_read = tp_read;
+    d->tp_write = tp_write;
+    d->ctx = ctx;
+    d->epp = meta->vpg_sz / sizeof(rw_pgno);
+    d->ntps = (meta->total_pagenum + d->epp - 1) / d->epp;
+    d->wb_tp = d->ntps;
+    d->gtd = (rw_pgno*)malloc(d->ntps * sizeof(rw_pgno));
+    if (d->gtd == NULL)
+        return 1;
+    for (i = 0; i < d->ntps; i++)
+        d->gtd[i] = meta->total_pagenum;
+    if (max == 0) {
+        d->table = (rw_pgno*)malloc(meta->total_pagenum * sizeof(rw_pgno));
+        if (d->table == NULL)
+            return 1;
+        for (i = 0; i < meta->total_pagenum; i++)
+            d->table[i] = meta->total_pagenum;
+        return 0;
+    }
+    d->cap = 1;
+    while (d->cap < max)
+        d->cap *= 2;
+    d->ents = (struct rw_dftl_ent*)malloc(d->cap * sizeof(struct rw_dftl_ent));
+    d->hcap = d->cap * 2;
+    d->hash = (uint32_t*)calloc(d->hcap, sizeof(uint32_t));
+    d->rbuf = (uint8_t*)malloc(meta->vpg_sz);
+    d->wbuf = (uint8_t*)malloc(meta->vpg_sz);
+    if (!d->ents || !d->hash || !d->rbuf || !d->wbuf)
+        return 1;
+    for (i = 0; i < d->cap; i++)
+        d->ents[i].next = (i + 1 < d->cap) ? i + 1 : RW_DFTL_NIL;
+    d->free_head = 0;
+    d->lru_head = d->lru_tail = RW_DFTL_NIL;
+    return 0;
+}
+
+void rw_dftl_free(struct rw_dftl* d) {
+    free(d->gtd);
+    free(d->table);
+    free(d->ents);
+    free(d->hash);
+    free(d->rbuf);
+    free(d->wbuf);
+    d->gtd = d->table = NULL;
+    d->ents = NULL;
+    d->hash = NULL;
+    d->rbuf = d->wbuf = NULL;
+}
+
+uint64_t rw_dftl_tp_id(struct rw_dftl* d, uint64_t t) {
+    return d->meta->total_pagenum + 1 + t;
+}
+
+uint64_t rw_dftl_get(struct rw_dftl* d, uint64_t id) {
+    uint32_t e;
+    if (id > d->meta->total_pagenum)
+        return d->gtd[id - d->meta->total_pagenum - 1];
+    if (d->table)
+        return d->table[id];
+    e = dftl_load(d, id); // may grow ents
+    return d->ents[e].ppg;
+}
+
+void rw_dftl_set(struct rw_dftl* d, uint64_t id, uint64_t ppg) {
+    uint32_t e;
+    if (id > d->meta->total_pagenum) {
+        d->gtd[id - d->meta->total_pagenum - 1] = ppg;
+        return;
+    }
+    if (d->table) {
+        d->table[id] = ppg;
+        return;
+    }
+    e = dftl_load(d, id);
+    d->ents[e].ppg = ppg;
+    d->ents[e].dirty = 1;
+}
+
+// writes the dirty cached entries of translation page t to flash
+static int dftl_writeback(struct rw_dftl* d, uint64_t t) {
+    rw_pgno* tp = (rw_pgno*)d->wbuf;
+    uint64_t first = t * d->epp, i, n = 0;
+    if (d->gtd[t] != d->meta->total_pagenum) {
+        if (d->tp_read(d->ctx, d->gtd[t], d->wbuf))
+            return 1;
+        d->tp_reads++;
+    } else {
+        for (i = 0; i < d->epp; i++)
+            tp[i] = d->meta->total_pagenum;
+    }
+    for (i = 0; i < d->epp && first + i < d->meta->total_pagenum; i++) {
+        uint32_t e = dftl_find(d, first + i);
+        if (e != RW_DFTL_NIL && d->ents[e].dirty) {
+            tp[i] = d->ents[e].ppg;
+            // cleared first, an update made while tp_write runs GC stays dirty
+            d->ents[e].dirty = 0;
+            n++;
+        }
+    }
+    d->wb_tp = t;
+    int ret = d->tp_write(d->ctx, t, d->wbuf);
+    d->wb_tp = d->ntps;
+    if (ret) {
+        for (i = 0; i < d->epp && first + i < d->meta->total_pagenum; i++) {
+            uint32_t e = dftl_find(d, first + i);
+            if (e != RW_DFTL_NIL && d->ents[e].ppg == tp[i])
+                d->ents[e].dirty = 1;
+        }
+        return 1;
+    }
+    d->tp_writes++;
+    d->wb_ents += n;
+    return 0;
+}
+
+// drops least recently used entries until max are cached
+int rw_dftl_evict(struct rw_dftl* d) {
+    while (d->table == NULL && d->nents > d->max) {
+        uint32_t e = d->lru_head;
+        if (d->ents[e].dirty) {
+            if (dftl_writeback(d, d->ents[e].vpg / d->epp))
+                return 1;
+            // GC under tp_write may have changed the list
+            continue;
+        }
+        dftl_remove(d, e);
+        d->evictions++;
+    }
+    return 0;
+}
+
+void rw_dftl_print(struct rw_dftl* d) {
+    uint64_t whole = d->meta->total_pagenum * sizeof(rw_pgno);
+    if (d->table)
+        return;
+    printf(" Node %d: mapping cache %" PRIu64 " of %" PRIu64 " entries, %" PRIu64 " KB of DRAM for %" PRIu64 " KB of table,"
+            " %" PRIu64 " lookups, %" PRIu64 " hits (%.1f %%)\n",
+            d->meta->node->nid, d->max, d->meta->total_pagenum,
+            (d->cap * sizeof(struct rw_dftl_ent) + d->hcap * sizeof(uint32_t) + d->ntps * sizeof(rw_pgno)) >> 10,
+            whole >> 10, d->lookups, d->hits, (d->lookups) ? 100.0 * d->hits / d->lookups : 0.0);
+    printf(" Node %d: translation pages %" PRIu64 ", %" PRIu64 " reads, %" PRIu64 " writes (%" PRIu64 " entries written back)\n",
+            d->meta->node->nid, d->ntps, d->tp_reads, d->tp_writes, d->wb_ents);
+}
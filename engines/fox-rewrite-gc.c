@@ -0,0 +1,226 @@
+/* GC victim selection shared by the log-structured rewrite engines.
+ * A unit is whatever the engine reclaims at once (a block, a superblock).
+ * Engines report when a unit becomes full and when one of its pages is
+ * invalidated, and ask for a victim among the full units:
+ *   greedy: fewest valid pages, O(1) from buckets indexed by valid count;
+ *   cb:     cost-benefit, max (1 - u) * age / (1 + u), u = valid ratio and
+ *           age = units filled since this one was (Rosenblum, LFS);
+ *   window: greedy among the <window> oldest full units;
+ *   random: any full unit.
+ * Units without invalid pages are never chosen.
+ * Written by Chuizheng Meng <mengcz13@mails.tsinghua.edu.cn>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../fox.h"
+#include "fox-rewrite-utils.h"
+
+int gc_victims_init(struct gc_victims* gv, struct fox_node* node, uint64_t nunits, uint64_t npgs) {
+    uint64_t i;
+    gv->policy = node->wl->gc_policy;
+    gv->window = (node->wl->gc_window) ? node->wl->gc_window : 16;
+    gv->nunits = nunits;
+    gv->npgs = npgs;
+    gv->clock = 0;
+    gv->rng = 0x9E3779B97F4A7C15ULL * (node->nid + 1);
+    gv->units = (struct gc_unit*)calloc(nunits, sizeof(struct gc_unit));
+    gv->buckets = (struct gc_unit_list*)calloc(npgs + 1, sizeof(struct gc_unit_list));
+    gv->full = (uint64_t*)calloc(nunits, sizeof(uint64_t));
+    if (!gv->units || !gv->buckets || !gv->full) {
+        gc_victims_free(gv);
+        return 1;
+    }
+    for (i = 0; i <= npgs; i++)
+        TAILQ_INIT(&gv->buckets[i]);
+    TAILQ_INIT(&gv->fifo);
+    gv->min_bucket = npgs;
+    gv->nfull = 0;
+    for (i = 0; i < nunits; i++)
+        gv->units[i].id = i;
+    return 0;
+}
+
+void gc_victims_free(struct gc_victims* gv) {
+    free(gv->units);
+    free(gv->buckets);
+    free(gv->full);
+    gv->units = NULL;
+    gv->buckets = NULL;
+    gv->full = NULL;
+}
+
+void gc_unit_full(struct gc_victims* gv, uint64_t id, uint64_t nvalid) {
+    struct gc_unit* u = &gv->units[id];
+    u->nvalid = nvalid;
+    u->stamp = gv->clock++;
+    u->full = 1;
+    u->pos = gv->nfull;
+    gv->full[gv->nfull++] = id;
+    TAILQ_INSERT_TAIL(&gv->buckets[nvalid], u, bt);
+    TAILQ_INSERT_TAIL(&gv->fifo, u, ft);
+    if (nvalid < gv->min_bucket)
+        gv->min_bucket = nvalid;
+}
+
+void gc_unit_invalidate(struct gc_victims* gv, uint64_t id) {
+    struct gc_unit* u = &gv->units[id];
+    if (!u->full || u->nvalid == 0)
+        return;
+    TAILQ_REMOVE(&gv->buckets[u->nvalid], u, bt);
+    u->nvalid--;
+    TAILQ_INSERT_TAIL(&gv->buckets[u->nvalid], u, bt);
+    if (u->nvalid < gv->min_bucket)
+        gv->min_bucket = u->nvalid;
+}
+
+void gc_unit_remove(struct gc_victims* gv, uint64_t id) {
+    struct gc_unit* u = &gv->units[id];
+    if (!u->full)
+        return;
+    TAILQ_REMOVE(&gv->buckets[u->nvalid], u, bt);
+    TAILQ_REMOVE(&gv->fifo, u, ft);
+    // swap with the last full unit
+    gv->full[u->pos] = gv->full[--gv->nfull];
+    gv->units[gv->full[u->pos]].pos = u->pos;
+    u->full = 0;
+}
+
+/*
+ * Ties go to the unit that reached the lowest valid count first. The scan
+ * of the PU lists that engine 6 had before took the first one in PU order
+ * from its write cursor, so runs pick other victims among equal blocks.
+ */
+static uint64_t gc_greedy(struct gc_victims* gv) {
+    while (gv->min_bucket < gv->npgs && TAILQ_EMPTY(&gv->buckets[gv->min_bucket]))
+        gv->min_bucket++;
+    if (gv->min_bucket == gv->npgs)
+        return gv->nunits;
+    return TAILQ_FIRST(&gv->buckets[gv->min_bucket])->id;
+}
+
+static uint64_t gc_costbenefit(struct gc_victims* gv) {
+    struct gc_unit* u;
+    uint64_t victim = gv->nunits;
+    double best = -1;
+    TAILQ_FOREACH(u, &gv->fifo, ft) {
+        double util = (double)u->nvalid / gv->npgs;
+        double score = (1.0 - util) * (gv->clock - u->stamp) / (1.0 + util);
+        if (u->nvalid < gv->npgs && score > best) {
+            best = score;
+            victim = u->id;
+        }
+    }
+    return victim;
+}
+
+static uint64_t gc_windowed(struct gc_victims* gv) {
+    struct gc_unit* u;
+    uint64_t victim = gv->nunits;
+    uint64_t minvalid = gv->npgs;
+    uint64_t n = 0;
+    TAILQ_FOREACH(u, &gv->fifo, ft) {
+        if (n++ == gv->window)
+            break;
+        if (u->nvalid < minvalid) {
+            minvalid = u->nvalid;
+            victim = u->id;
+        }
+    }
+    // nothing to reclaim in the window
+    return (victim == gv->nunits) ? gc_greedy(gv) : victim;
+}
+
+static uint64_t gc_random(struct gc_victims* gv) {
+    uint64_t id;
+    if (gv->nfull == 0)
+        return gv->nunits;
+    // xorshift64
+    gv->rng ^= gv->rng << 13;
+    gv->rng ^= gv->rng >> 7;
+    gv->rng ^= gv->rng << 17;
+    id = gv->full[gv->rng % gv->nfull];
+    return (gv->units[id].nvalid < gv->npgs) ? id : gc_greedy(gv);
+}
+
+uint64_t gc_victim(struct gc_victims* gv) {
+    switch (gv->policy) {
+        case GC_COSTBENEFIT:
+            return gc_costbenefit(gv);
+        case GC_WINDOWED:
+            return gc_windowed(gv);
+        case GC_RANDOM:
+            return gc_random(gv);
+        case GC_GREEDY:
+        default:
+            return gc_greedy(gv);
+    }
+}
+
+/*
+ * Victim of the policy, or if busy(ctx, id) says it is in use, the first
+ * unit of its bucket that is not: same valid pages, same copy cost. Falls
+ * back on the policy's choice when the whole bucket is busy.
+ */
+uint64_t gc_victim_idle(struct gc_victims* gv, int (*busy)(void*, uint64_t), void* ctx) {
+    uint64_t victim = gc_victim(gv);
+    struct gc_unit* u;
+    if (victim == gv->nunits || !busy(ctx, victim))
+        return victim;
+    TAILQ_FOREACH(u, &gv->buckets[gv->units[victim].nvalid], bt) {
+        if (!busy(ctx, u->id))
+            return u->id;
+    }
+    return victim;
+}
+
+const char* gc_policy_name(int policy) {
+    switch (policy) {
+        case GC_COSTBENEFIT:
+            return "cost-benefit";
+        case GC_WINDOWED:
+            return "windowed greedy";
+        case GC_RANDOM:
+            return "random";
+        case GC_GREEDY:
+        default:
+            return "greedy";
+    }
+}
+
+static int cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void print_percentiles(const char* name, uint64_t* lat, uint64_t n) {
+    if (n == 0)
+        return;
+    qsort(lat, n, sizeof(uint64_t), cmp_u64);
+    printf("   %s (%" PRIu64 "): p50 %" PRIu64 ", p99 %" PRIu64 ", p99.9 %" PRIu64 ", max %" PRIu64 "\n",
+            name, n, lat[n * 50 / 100], lat[n * 99 / 100], lat[n * 999 / 1000], lat[n - 1]);
+}
+
+// I/O latency percentiles (us), reads and writes apart, and how many blocks GC reclaimed
+void gc_print_latency(struct fox_node* node, struct rewrite_meta* meta, uint64_t fg_gc, uint64_t inc_gc, uint64_t bg_gc) {
+    uint64_t *lat, *rlat, *wlat;
+    uint64_t t, nr = 0, nw = 0, n = meta->ioseqlen;
+    if (n == 0)
+        return;
+    lat = (uint64_t*)calloc(2 * n, sizeof(uint64_t));
+    if (!lat)
+        return;
+    rlat = lat;
+    wlat = lat + n;
+    for (t = 0; t < n; t++) {
+        if (meta->ioseq[t].iotype == 'r')
+            rlat[nr++] = meta->ioseq[t].exetime;
+        else if (meta->ioseq[t].iotype == 'w')
+            wlat[nw++] = meta->ioseq[t].exetime;
+    }
+    printf(" Node %d: latency us, GC %" PRIu64 " foreground / %" PRIu64 " incremental / %" PRIu64 " background\n",
+            node->nid, fg_gc, inc_gc, bg_gc);
+    print_percentiles("read ", rlat, nr);
+    print_percentiles("write", wlat, nw);
+    free(lat);
+}
@@ -0,0 +1,221 @@
+/* Synthetic I/O sequences for the rewrite engines (4-8).
+ * Instead of reading a trace file, the fox_iounit sequence of a node is
+ * generated in memory from a distribution over the node logical space:
+ *   uniform: every page has the same probability;
+ *   zipf:    page rank k is chosen with probability ~ 1/k^theta (0 < theta < 1),
+ *            following Gray et al., "Quickly generating billion-record
+ *            synthetic databases";
+ *   hotcold: <hot data %> of the space receives <hot access %> of the I/Os.
+ * Each I/O continues the previous one with probability <seq %>, otherwise
+ * starts at a page drawn from the distribution. Sizes follow --gen-bs.
+ * Read/write mix comes from -r/-w; --gen-trim turns that percentage of the
+ * I/Os into trims of the same range. Trims are drawn from their own stream,
+ * so the other I/Os are the same as without them.
+ * Written by Chuizheng Meng <mengcz13@mails.tsinghua.edu.cn>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "../fox.h"
+#include "fox-rewrite-utils.h"
+
+#define GEN_MAX_SIZES 16
+
+struct gen_size {
+    uint64_t lo; // size range [lo, hi], lo == hi for a fixed size
+    uint64_t hi;
+    double weight;
+};
+
+struct gen_state {
+    uint64_t rng;
+    uint64_t npgs; // logical pages used by the generator
+    size_t vpg_sz;
+    // zipf
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+    // hot/cold
+    uint64_t hot_pgs;
+    double hot_access;
+    // sizes
+    struct gen_size sizes[GEN_MAX_SIZES];
+    int nsizes;
+    double wsum;
+};
+
+static uint64_t gen_next(struct gen_state* gs) {
+    // xorshift64*
+    gs->rng ^= gs->rng >> 12;
+    gs->rng ^= gs->rng << 25;
+    gs->rng ^= gs->rng >> 27;
+    return gs->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static double gen_unit(struct gen_state* gs) {
+    return (gen_next(gs) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t gen_range(struct gen_state* gs, uint64_t n) {
+    return (n == 0) ? 0 : gen_next(gs) % n;
+}
+
+static void zipf_init(struct gen_state* gs) {
+    uint64_t i;
+    double zeta2 = 1.0 + pow(0.5, gs->theta);
+    gs->zetan = 0;
+    for (i = 1; i <= gs->npgs; i++)
+        gs->zetan += 1.0 / pow((double)i, gs->theta);
+    gs->alpha = 1.0 / (1.0 - gs->theta);
+    gs->eta = (1.0 - pow(2.0 / gs->npgs, 1.0 - gs->theta)) / (1.0 - zeta2 / gs->zetan);
+}
+
+static uint64_t zipf_next(struct gen_state* gs) {
+    double u = gen_unit(gs);
+    double uz = u * gs->zetan;
+    uint64_t k;
+    if (uz < 1.0)
+        return 0;
+    if (uz < 1.0 + pow(0.5, gs->theta))
+        return 1;
+    k = (uint64_t)(gs->npgs * pow(gs->eta * u - gs->eta + 1.0, gs->alpha));
+    return (k >= gs->npgs) ? gs->npgs - 1 : k;
+}
+
+static uint64_t gen_page(struct gen_state* gs, int dist) {
+    switch (dist) {
+        case GEN_ZIPF:
+            return zipf_next(gs);
+        case GEN_HOTCOLD:
+            if (gen_unit(gs) < gs->hot_access)
+                return gen_range(gs, gs->hot_pgs);
+            return gs->hot_pgs + gen_range(gs, gs->npgs - gs->hot_pgs);
+        case GEN_UNIFORM:
+        default:
+            return gen_range(gs, gs->npgs);
+    }
+}
+
+/*
+ * Size spec, comma-separated entries with an optional ':weight':
+ *   16384                 fixed size
+ *   4096-65536            uniform in range, multiples of 4096
+ *   4096:70,65536:30      weighted mix
+ */
+static int parse_sizes(struct gen_state* gs, const char* spec) {
+    char buf[CMDARG_LEN];
+    char *tok, *save, *p;
+    gs->nsizes = 0;
+    gs->wsum = 0;
+    if (spec == NULL || spec[0] == '\0') {
+        gs->sizes[0].lo = gs->sizes[0].hi = gs->vpg_sz;
+        gs->sizes[0].weight = 1;
+        gs->nsizes = 1;
+        gs->wsum = 1;
+        return 0;
+    }
+    strncpy(buf, spec, CMDARG_LEN - 1);
+    buf[CMDARG_LEN - 1] = '\0';
+    for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        struct gen_size* sz;
+        if (gs->nsizes == GEN_MAX_SIZES)
+            return 1;
+        sz = &gs->sizes[gs->nsizes];
+        sz->lo = strtoull(tok, &p, 10);
+        sz->hi = (*p == '-') ? strtoull(p + 1, &p, 10) : sz->lo;
+        sz->weight = (*p == ':') ? atof(p + 1) : 1.0;
+        if (sz->lo == 0 || sz->hi < sz->lo || sz->weight <= 0)
+            return 1;
+        gs->wsum += sz->weight;
+        gs->nsizes++;
+    }
+    return (gs->nsizes == 0);
+}
+
+static uint64_t gen_size(struct gen_state* gs) {
+    double w = gen_unit(gs) * gs->wsum;
+    int i;
+    for (i = 0; i < gs->nsizes - 1; i++) {
+        if (w < gs->sizes[i].weight)
+            break;
+        w -= gs->sizes[i].weight;
+    }
+    struct gen_size* sz = &gs->sizes[i];
+    if (sz->lo == sz->hi)
+        return sz->lo;
+    return (sz->lo + gen_range(gs, (sz->hi - sz->lo) / 4096 + 1) * 4096);
+}
+
+int gen_ioseq(struct fox_node* node, struct rewrite_meta* meta) {
+    struct fox_workload* wl = node->wl;
+    struct gen_state gs, ts;
+    uint64_t span, nios, nfill, t, next = 0;
+    // r/w factors are reduced to their ratio by fox_setup_io_factor
+    double wprob = (wl->w_factor + wl->r_factor) ? (double)wl->w_factor / (wl->w_factor + wl->r_factor) : 0;
+
+    memset(&gs, 0, sizeof(gs));
+    gs.rng = (wl->gen_seed ? wl->gen_seed : 1) * 0x9E3779B97F4A7C15ULL + node->nid + 1;
+    memset(&ts, 0, sizeof(ts));
+    ts.rng = gs.rng ^ 0xD1B54A32D192ED03ULL;
+    gs.vpg_sz = meta->vpg_sz;
+    gs.npgs = meta->logical_pagenum * (wl->gen_span ? wl->gen_span : 100) / 100;
+    if (gs.npgs == 0)
+        gs.npgs = 1;
+    span = gs.npgs * gs.vpg_sz;
+
+    if (parse_sizes(&gs, wl->gen_bs)) {
+        printf(" Invalid I/O size distribution: %s\n", wl->gen_bs);
+        return 1;
+    }
+    if (wl->gen_dist == GEN_ZIPF) {
+        gs.theta = wl->gen_theta;
+        if (gs.theta <= 0 || gs.theta >= 1) {
+            printf(" Zipf theta must be in (0, 1).\n");
+            return 1;
+        }
+        zipf_init(&gs);
+    } else if (wl->gen_dist == GEN_HOTCOLD) {
+        gs.hot_pgs = gs.npgs * wl->gen_hot_data / 100;
+        gs.hot_pgs = (gs.hot_pgs == 0) ? 1 : gs.hot_pgs;
+        gs.hot_access = wl->gen_hot_access / 100.0;
+    }
+
+    nios = (wl->gen_nios) ? wl->gen_nios : 4 * gs.npgs;
+    nfill = (wl->gen_fill) ? (gs.npgs + node->npgs - 1) / node->npgs : 0;
+    meta->ioseqlen = nfill + nios;
+    meta->ioseq = (struct fox_iounit*)calloc(meta->ioseqlen, sizeof(struct fox_iounit));
+    if (meta->ioseq == NULL)
+        return 1;
+
+    // precondition: write the whole space sequentially, one block per I/O
+    for (t = 0; t < nfill; t++) {
+        meta->ioseq[t].iotype = 'w';
+        meta->ioseq[t].offset = t * node->npgs * gs.vpg_sz;
+        meta->ioseq[t].size = node->npgs * gs.vpg_sz;
+        if (meta->ioseq[t].offset + meta->ioseq[t].size > span)
+            meta->ioseq[t].size = span - meta->ioseq[t].offset;
+    }
+
+    for (t = nfill; t < meta->ioseqlen; t++) {
+        struct fox_iounit* io = &meta->ioseq[t];
+        uint64_t size = gen_size(&gs);
+        if (size > span)
+            size = span;
+        if (t == nfill || gen_range(&gs, 100) >= wl->gen_seq)
+            next = gen_page(&gs, wl->gen_dist) * gs.vpg_sz;
+        if (next + size > span)
+            next = (next >= span) ? 0 : span - size;
+        io->iotype = (gen_unit(&gs) < wprob) ? 'w' : 'r';
+        if (wl->gen_trim && gen_range(&ts, 100) < wl->gen_trim)
+            io->iotype = 't';
+        io->offset = next;
+        io->size = size;
+        next += size;
+    }
+
+    printf(" Node %d: generated %" PRIu64 " I/Os (%" PRIu64 " fill) over %" PRIu64 " pages\n", node->nid, meta->ioseqlen, nfill, gs.npgs);
+    return 0;
+}
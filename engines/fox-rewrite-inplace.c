@@ -30,6 +30,7 @@
 
 /* ENGINE 4: Rewrite sequences:
  * Read/write in place, erase if necessary
+ * Trims mark pages abandoned, read as zeros and dropped by the next erase of the block
  * Written by Chuizheng Meng <mengcz13@mails.tsinghua.edu.cn>
  */
 
@@ -39,6 +40,15 @@
 #include "../fox.h"
 #include "fox-rewrite-utils.h"
 
+// read part of a page, pages without valid data (never written or trimmed) read as zeros
+static int read_inplace(struct fox_node* node, struct fox_blkbuf* buf, uint8_t* databuf, struct rewrite_meta* meta, struct nodegeoaddr* geo, uint64_t size) {
+    if (get_page_state(meta, geo) != PAGE_DIRTY) {
+        memset(databuf, 0, size);
+        return 0;
+    }
+    return rw_inside_page(node, buf, databuf, meta, geo, size, READ_MODE);
+}
+
 static int iterate_inplace_io(struct fox_node* node, struct fox_blkbuf* buf, struct rewrite_meta* meta, uint8_t* resbuf, uint64_t offset, uint64_t size, int mode) {
     size_t vpg_sz = node->wl->geo->page_nbytes * node->wl->geo->nplanes;
     // main func to handle each IO...
@@ -53,27 +63,40 @@ static int iterate_inplace_io(struct fox_node* node, struct fox_blkbuf* buf, str
     uint64_t vpg_i_begin = offset / vpg_sz;
     uint64_t vpg_i_end = (offset + size - 1) / vpg_sz;
 
+    if (mode == TRIM_MODE) {
+        uint64_t first, end, vpgi;
+        if (!rw_trim_range(meta, offset, size, &first, &end))
+            return 0;
+        for (vpgi = first; vpgi < end; vpgi++) {
+            if (get_pg_state(meta, vpgi) == PAGE_DIRTY) {
+                set_pg_state(meta, vpgi, PAGE_ABANDONED);
+                meta->trim_valid++;
+            }
+        }
+        return 0;
+    }
+
     if (mode == WRITE_MODE) {
         // erase if necessary...
         uint64_t vpgi;
         struct nodegeoaddr vpgibyteaddr;
         struct nodegeoaddr vpgibegingeo = vpg2geoaddr(node, vpg_i_begin);
         if (((vpg_i_begin == vpg_i_end) && (offset_begin.offset_in_page != 0 || offset_end.offset_in_page != vpg_sz - 1)) || ((vpg_i_begin < vpg_i_end) && (offset_begin.offset_in_page != 0)))
-            rw_inside_page(node, buf, meta->begin_pagebuf, meta, &vpgibegingeo, vpg_sz, READ_MODE);
+            read_inplace(node, buf, meta->begin_pagebuf, meta, &vpgibegingeo, vpg_sz);
         struct nodegeoaddr vpgiendgeo = vpg2geoaddr(node, vpg_i_end);
         if ((vpg_i_begin < vpg_i_end) && (offset_end.offset_in_page != vpg_sz - 1))
-            rw_inside_page(node, buf, meta->end_pagebuf, meta, &vpgiendgeo, vpg_sz, READ_MODE);
+            read_inplace(node, buf, meta->end_pagebuf, meta, &vpgiendgeo, vpg_sz);
         for (vpgi = vpg_i_begin; vpgi <= vpg_i_end; vpgi++) {
             vpgibyteaddr = vpg2geoaddr(node, vpgi);
-            if (*get_p_blk_state(meta, &vpgibyteaddr) == BLOCK_DIRTY) {
+            if (get_blk_state(meta, &vpgibyteaddr) == BLOCK_DIRTY) {
                 uint8_t covered_blk_state = BLOCK_CLEAN;
                 struct nodegeoaddr tgeo = vpgibyteaddr;
                 int begin_pgi_inblk = vpgibyteaddr.pg_i;
                 int end_pgi_inblk;
-                // only erase when covered area has dirty pages
+                // only erase when covered area has written (dirty or trimmed) pages
                 // or we can write directly
                 for (; tgeo.pg_i < node->npgs && geoaddr2vpg(node, &tgeo) <= vpg_i_end; tgeo.pg_i++) {
-                    if (*get_p_page_state(meta, &tgeo) == PAGE_DIRTY) {
+                    if (get_page_state(meta, &tgeo) != PAGE_CLEAN) {
                         covered_blk_state = BLOCK_DIRTY;
                     }
                 }
@@ -82,7 +105,7 @@ static int iterate_inplace_io(struct fox_node* node, struct fox_blkbuf* buf, str
                     struct nodegeoaddr tgeo = vpgibyteaddr;
                     // collect page states in the block
                     for (tgeo.pg_i = 0; tgeo.pg_i < node->npgs; tgeo.pg_i++) {
-                        meta->temp_page_state_inblk[tgeo.pg_i] = *get_p_page_state(meta, &tgeo);
+                        meta->temp_page_state_inblk[tgeo.pg_i] = get_page_state(meta, &tgeo);
                         if (tgeo.pg_i < begin_pgi_inblk || tgeo.pg_i > end_pgi_inblk) {
                             if (meta->temp_page_state_inblk[tgeo.pg_i] == PAGE_DIRTY) {
                                 rw_inside_page(node, buf, buf->buf_r + tgeo.pg_i * vpg_sz, meta, &tgeo, vpg_sz, READ_MODE);
@@ -90,19 +113,22 @@ static int iterate_inplace_io(struct fox_node* node, struct fox_blkbuf* buf, str
                         }
                     }
                     erase_block(node, meta, &vpgibyteaddr);
-                    // rewrite former dirty pages outside covered area
+                    // rewrite former dirty pages outside covered area, the
+                    // WAF counts them as GC
+                    int src = rw_prog_src(meta, RW_PROG_GC);
                     for (tgeo.pg_i = 0; tgeo.pg_i < node->npgs; tgeo.pg_i++) {
-                        assert(*get_p_page_state(meta, &tgeo) == PAGE_CLEAN);
+                        assert(get_page_state(meta, &tgeo) == PAGE_CLEAN);
                         if (tgeo.pg_i < begin_pgi_inblk || tgeo.pg_i > end_pgi_inblk) {
                             if (meta->temp_page_state_inblk[tgeo.pg_i] == PAGE_DIRTY) {
                                 rw_inside_page(node, buf, buf->buf_r + tgeo.pg_i * vpg_sz, meta, &tgeo, vpg_sz, WRITE_MODE);
                             }
                         }
                     }
+                    rw_prog_src(meta, src);
                 }
                 // mark checked blocks with BLOCK_CLEAN
                 // this should be fine since these blocks will be written later and go to BLOCK_DIRTY again
-                *get_p_blk_state(meta, &vpgibyteaddr) = BLOCK_CLEAN;
+                set_blk_state(meta, &vpgibyteaddr, BLOCK_CLEAN);
             }
         }
     }
@@ -114,7 +140,7 @@ static int iterate_inplace_io(struct fox_node* node, struct fox_blkbuf* buf, str
         // read or write...
         if (vpg_i_begin == vpg_i_end) {
             if (mode == READ_MODE) {
-                rw_inside_page(node, buf, resbuf_t, meta, &offset_begin, size, mode);
+                read_inplace(node, buf, resbuf_t, meta, &offset_begin, size);
             } else if (mode == WRITE_MODE) {
                 if (offset_begin.offset_in_page != 0 || offset_end.offset_in_page != vpg_sz - 1) {
                     memcpy(meta->begin_pagebuf + offset_begin.offset_in_page, resbuf_t, size);
@@ -127,7 +153,7 @@ static int iterate_inplace_io(struct fox_node* node, struct fox_blkbuf* buf, str
         } else {
             // rw begin page
             if (mode == READ_MODE) {
-                rw_inside_page(node, buf, resbuf_t, meta, &offset_begin, vpg_sz - offset_begin.offset_in_page, mode);
+                read_inplace(node, buf, resbuf_t, meta, &offset_begin, vpg_sz - offset_begin.offset_in_page);
             } else if (mode == WRITE_MODE) {
                 if (offset_begin.offset_in_page != 0) {
                     memcpy(meta->begin_pagebuf + offset_begin.offset_in_page, resbuf_t, vpg_sz - offset_begin.offset_in_page);
@@ -142,13 +168,16 @@ static int iterate_inplace_io(struct fox_node* node, struct fox_blkbuf* buf, str
                 uint64_t middle_pgi;
                 for (middle_pgi = vpg_i_begin + 1; middle_pgi < vpg_i_end; middle_pgi++) {
                     struct nodegeoaddr tgeo = vpg2geoaddr(node, middle_pgi);
-                    rw_inside_page(node, buf, resbuf_t, meta, &tgeo, vpg_sz, mode);
+                    if (mode == READ_MODE)
+                        read_inplace(node, buf, resbuf_t, meta, &tgeo, vpg_sz);
+                    else
+                        rw_inside_page(node, buf, resbuf_t, meta, &tgeo, vpg_sz, mode);
                     resbuf_t += vpg_sz;
                 }
             }
             // rw end page
             if (mode == READ_MODE) {
-                rw_inside_page(node, buf, resbuf_t, meta, &vpg_geo_end, offset_end.offset_in_page + 1, mode);
+                read_inplace(node, buf, resbuf_t, meta, &vpg_geo_end, offset_end.offset_in_page + 1);
             } else if (mode == WRITE_MODE) {
                 if (offset_end.offset_in_page != vpg_sz - 1) {
                     memcpy(meta->end_pagebuf, resbuf_t, offset_end.offset_in_page + 1);
@@ -164,6 +193,18 @@ static int iterate_inplace_io(struct fox_node* node, struct fox_blkbuf* buf, str
     return 0;
 }
 
+struct inplace_ctx {
+    struct fox_node* node;
+    struct fox_blkbuf* buf;
+    struct rewrite_meta* meta;
+};
+
+// engine entry of the write buffer
+static int inplace_io(void* ctx, uint8_t* data, uint64_t offset, uint64_t size, int mode) {
+    struct inplace_ctx* c = (struct inplace_ctx*)ctx;
+    return iterate_inplace_io(c->node, c->buf, c->meta, data, offset, size, mode);
+}
+
 static int rewrite_inplace_start (struct fox_node *node)
 {
     node->stats.pgs_done = 0;
@@ -173,8 +214,16 @@ static int rewrite_inplace_start (struct fox_node *node)
         goto OUT;
 
     struct rewrite_meta meta;
-    init_rewrite_meta(node, &meta);
-    
+    if (init_rewrite_meta(node, &meta))
+        goto OUT;
+    struct inplace_ctx ctx = { node, &nbuf, &meta };
+    struct rw_rcache rc;
+    struct rw_wbuf wb;
+    if (rw_rcache_init(&rc, &meta, node->wl->rcache_pgs, node->wl->rcache_policy, node->wl->readahead, inplace_io, &ctx))
+        goto OUT;
+    if (rw_wbuf_init(&wb, &meta, node->wl->wbuf_pgs, rw_rcache_io, &rc))
+        goto OUT;
+
     uint64_t max_iosize = 0;
     uint64_t t = 0;
     for (t = 0; t < meta.ioseqlen; t++) {
@@ -194,16 +243,32 @@ static int rewrite_inplace_start (struct fox_node *node)
             mode = READ_MODE;
         else if (meta.ioseq[t].iotype == 'w')
             mode = WRITE_MODE;
+        else if (meta.ioseq[t].iotype == 't')
+            mode = TRIM_MODE;
 
         gettimeofday(&tvalst, NULL);
-        iterate_inplace_io(node, &nbuf, &meta, databuf, meta.ioseq[t].offset, meta.ioseq[t].size, mode);
+        rw_wbuf_io(&wb, databuf, meta.ioseq[t].offset, meta.ioseq[t].size, mode);
         gettimeofday(&tvaled, NULL);
         meta.ioseq[t].exetime = ((uint64_t)(tvaled.tv_sec - tvalst.tv_sec) * 1000000L + tvaled.tv_usec) - tvalst.tv_usec;
+        // readahead is timed apart from the I/O, see rw_rcache_print
+        rw_rcache_prefetch(&rc);
+        meta.ioseq[t].cache_lookups = rc.lookups;
+        meta.ioseq[t].cache_hits = rc.hits;
+        meta.ioseq[t].cache_saved = rc.saved + rc.rmw_saved;
+        rw_waf_record(&meta, &meta.ioseq[t]);
     }
+    rw_wbuf_drain(&wb);
     fox_end_node (node);
 
     write_meta_stats(&meta);
+    rw_waf_print(&meta, NULL);
+    rw_wbuf_print(&wb);
+    rw_rcache_print(&rc);
+    rw_trim_print(&meta);
+    rw_wear_print(&meta);
 
+    rw_wbuf_free(&wb);
+    rw_rcache_free(&rc);
     fox_free_blkbuf (&nbuf, 1);
     free(databuf);
     free_rewrite_meta(&meta);
@@ -32,7 +32,23 @@
  * Read as usual;
  * Write like log-structured file systems;
  * Erase when garbage collection.
- * GC: always choose 
+ * GC: choose a full block with the --gc policy (fox-rewrite-gc.c), greedy
+ * by default: min dirty pages, found in O(1) from buckets.
+ * With --gc-bg a background thread reclaims blocks between the low and high
+ * free block watermarks, foreground GC only runs when it falls behind.
+ * With --gc-step GC is incremental: the victim is migrated K pages at a time
+ * before user I/Os, see gc_incremental.
+ * Foreground GC moves pages in batches (fox-rewrite-batch.c): the victim is
+ * read with multi-page commands and the copies are written to all PUs at once.
+ * Streams: each stream writes to its own active block. With --streams N user
+ * pages are split in N classes by update count, see page_stream; with
+ * --gc-stream pages moved by GC get a stream of their own.
+ * Mapping: with --map-cache the vpg2ppg table is demand-paged
+ * (fox-rewrite-dftl.c), translation pages are written like user pages and
+ * moved by GC, the cache is trimmed after each I/O.
+ * Wear leveling: with --wl new user blocks are the least erased empty block
+ * of the PU, GC copies go to the most erased one, and wear_level moves the
+ * data of the least erased full block when the spread exceeds --wl.
  * Written by Chuizheng Meng <mengcz13@mails.tsinghua.edu.cn>
  */
 
@@ -40,6 +56,8 @@
 #include <stdlib.h>
 #include <sys/time.h>
 #include <sys/queue.h>
+#include <pthread.h>
+#include <sched.h>
 #include "../fox.h"
 #include "fox-rewrite-utils.h"
 
@@ -57,10 +75,12 @@ struct blk_entry {
 
 TAILQ_HEAD(blk_entry_list, blk_entry);
 
+#define LS_MAX_STREAMS 9 // 8 user streams + GC
+
 struct blk_list {
     struct blk_entry_list empty_blks;
     struct blk_entry_list non_empty_blks;
-    struct blk_entry* active_blk;
+    struct blk_entry* active_blk[LS_MAX_STREAMS]; // one per stream
 };
 
 struct ls_meta {
@@ -74,16 +94,96 @@ struct ls_meta {
     uint64_t gc_count;
     uint64_t gc_time;
     uint64_t gc_map_change_count;
-    uint64_t* vpg2ppg;
-    uint64_t* ppg2vpg;
+    struct rw_dftl map; // vpg2ppg, whole or cached with --map-cache
+    struct rw_ckpt ckpt; // checkpoint and journal of map, see map_set
+    rw_pgno* ppg2vpg; // NULL with --oob
     struct blk_list* blk_lists; // 1 for each PU
     struct blk_entry* blk_entries;
     struct blk_meta* blk_metas; // storing meta info of blocks
+    struct gc_victims gv; // full blocks, valid pages = ndirtypgs
+    uint64_t user_pg_count;
     uint64_t next_ch_lun_i; // used to iterate over chs and luns
     uint8_t* blkbuf;
     uint64_t* blkvpgs;
+    struct rw_batch batch; // foreground GC migration
+    struct rw_copy* copies; // pages of a gc_step_batch
+    uint64_t free_blk_count; // blocks in empty_blks lists
+    struct blk_entry* gc_reserve; // erased block out of the lists, see reclaim_block
+    int nospace; // pages of a retired victim found no room, the run stops
+    // streams, see page_stream
+    uint64_t nstreams; // user streams, GC stream is nstreams if gc_stream
+    int gc_stream;
+    uint32_t* vpg_writes; // user writes of each logical page
+    uint64_t written_vpgs; // logical pages written at least once
+    uint64_t stream_pgs[LS_MAX_STREAMS]; // pages written to each stream
+    // victim reclaimed in steps by gc_step
+    struct blk_entry* step_victim;
+    uint64_t step_pg_i; // next page of step_victim to migrate
+    uint64_t step_map_change_count;
+    // incremental GC, see gc_incremental
+    uint64_t inc_pgs; // pages per step, 0 if disabled
+    uint64_t inc_low; // run when free blocks < inc_low
+    uint64_t inc_gc_count;
+    uint64_t inc_gc_time;
+    // wear leveling, see wear_level
+    uint64_t wl_spread; // max erase count spread, 0 if disabled
+    uint64_t wl_erases; // erases since the last check
+    uint64_t wl_count;
+    uint64_t wl_pgs; // pages moved out of cold blocks
+    uint64_t wl_time;
+    // background GC, see bg_gc_thread
+    int bg_enabled;
+    uint64_t bg_low; // start when free blocks < bg_low
+    uint64_t bg_high; // stop when free blocks >= bg_high
+    int bg_active;
+    int bg_stop;
+    uint64_t bg_gc_count;
+    uint64_t bg_gc_time;
+    uint64_t bg_busy_victims; // bg victims on a PU of the last user I/Os
+    uint64_t* pu_stamp; // user I/O that last used each PU, see user_pu
+    uint64_t io_stamp; // user I/Os started
+    struct fox_node bg_node; // own vblk target and stats, merged at the end
+    struct fox_workload bg_wl; // of bg_node, without -m, see bg_gc_start
+    struct fox_blkbuf bg_buf;
+    uint8_t* bg_pagebuf;
+    pthread_t bg_tid;
+    pthread_mutex_t mutex; // metadata, held by the user I/O and by GC except during bg device I/O
+    pthread_cond_t bg_cond; // wakes the bg thread
+    pthread_cond_t bg_done; // step_victim was reclaimed
 };
 
+static int map_tp_read(void* ctx, uint64_t ppg, uint8_t* data);
+
+// an empty block of the last PU that has one becomes the GC reserve
+static void take_reserve(struct ls_meta* lm) {
+    uint64_t npus = lm->meta->node->nchs * lm->meta->node->nluns;
+    uint64_t i;
+    for (i = npus; lm->gc_reserve == NULL && i > 0; i--) {
+        struct blk_list* listi = &(lm->blk_lists[i - 1]);
+        if (TAILQ_EMPTY(&(listi->empty_blks)))
+            continue;
+        lm->gc_reserve = TAILQ_LAST(&(listi->empty_blks), blk_entry_list);
+        TAILQ_REMOVE(&(listi->empty_blks), lm->gc_reserve, pt);
+        lm->free_blk_count--;
+        lm->clean_pg_count -= lm->meta->node->npgs;
+    }
+}
+
+// the GC reserve goes back to the free blocks of its PU
+static int use_reserve(struct ls_meta* lm) {
+    struct fox_node* node = lm->meta->node;
+    if (lm->gc_reserve == NULL)
+        return 0;
+    struct nodegeoaddr geo = vblk2geoaddr(node, lm->gc_reserve->pblk_i);
+    TAILQ_INSERT_TAIL(&(lm->blk_lists[geo.ch_i + geo.lun_i * node->nchs].empty_blks), lm->gc_reserve, pt);
+    lm->gc_reserve = NULL;
+    lm->free_blk_count++;
+    lm->clean_pg_count += node->npgs;
+    return 1;
+}
+static int map_tp_write(void* ctx, uint64_t t, uint8_t* data);
+static uint64_t ckpt_get(void* ctx, uint64_t idx);
+
 static int init_ls_meta(struct rewrite_meta* meta, struct fox_blkbuf* blockbuf, struct ls_meta* lm) {
     lm->meta = meta;
     lm->blockbuf = blockbuf;
@@ -95,16 +195,48 @@ static int init_ls_meta(struct rewrite_meta* meta, struct fox_blkbuf* blockbuf,
     lm->gc_count = 0;
     lm->gc_time = 0;
     lm->gc_map_change_count = 0;
-    lm->vpg2ppg = (uint64_t*)calloc(meta->total_pagenum, sizeof(uint64_t));
-    lm->ppg2vpg = (uint64_t*)calloc(meta->total_pagenum, sizeof(uint64_t));
+    if (rw_dftl_init(&(lm->map), meta, meta->node->wl->map_cache, map_tp_read, map_tp_write, lm))
+        return 1;
+    lm->ppg2vpg = (meta->oob) ? NULL : (rw_pgno*)calloc(meta->total_pagenum, sizeof(rw_pgno));
     lm->next_ch_lun_i = 0;
+    lm->free_blk_count = meta->node->nchs * meta->node->nluns * meta->node->nblks;
+    lm->nstreams = (meta->node->wl->streams) ? meta->node->wl->streams : 1;
+    lm->gc_stream = meta->node->wl->gc_stream;
+    lm->vpg_writes = (uint32_t*)calloc(meta->total_pagenum, sizeof(uint32_t));
+    lm->written_vpgs = 0;
+    memset(lm->stream_pgs, 0, sizeof(lm->stream_pgs));
+    lm->step_victim = NULL;
+    lm->step_map_change_count = 0;
+    lm->inc_pgs = meta->node->wl->gc_step;
+    lm->inc_low = 2 * meta->node->nchs * meta->node->nluns;
+    lm->inc_gc_count = 0;
+    lm->inc_gc_time = 0;
+    lm->wl_spread = meta->node->wl->wl_spread;
+    lm->wl_erases = 0;
+    lm->wl_count = 0;
+    lm->wl_pgs = 0;
+    lm->wl_time = 0;
+    lm->bg_enabled = 0;
+    lm->bg_gc_count = 0;
+    lm->bg_gc_time = 0;
+    lm->bg_busy_victims = 0;
+    lm->pu_stamp = (uint64_t*)calloc(meta->node->nchs * meta->node->nluns, sizeof(uint64_t));
+    lm->io_stamp = 0;
+    pthread_mutex_init(&(lm->mutex), NULL);
+    pthread_cond_init(&(lm->bg_cond), NULL);
+    pthread_cond_init(&(lm->bg_done), NULL);
     lm->blkbuf = (uint8_t*)calloc(meta->node->npgs * meta->vpg_sz, sizeof(uint8_t));
     lm->blkvpgs = (uint64_t*)calloc(meta->node->npgs, sizeof(uint64_t));
+    lm->copies = (struct rw_copy*)calloc(meta->node->npgs, sizeof(struct rw_copy));
+    if (lm->copies == NULL || rw_batch_init(&(lm->batch), meta->node, meta, blockbuf, meta->node->npgs, meta->node->npgs / 2))
+        return 1;
 
     lm->blk_metas = (struct blk_meta*)calloc(meta->node->nchs * meta->node->nluns * meta->node->nblks, sizeof(struct blk_meta));
     lm->blk_entries = (struct blk_entry*)calloc(meta->node->nchs * meta->node->nluns * meta->node->nblks, sizeof(struct blk_entry));
     
     lm->blk_lists = (struct blk_list*)calloc(meta->node->nchs * meta->node->nluns, sizeof(struct blk_list));
+    gc_victims_init(&(lm->gv), meta->node, meta->node->nchs * meta->node->nluns * meta->node->nblks, meta->node->npgs);
+    lm->user_pg_count = 0;
     struct nodegeoaddr tgeoblk = {0, 0, 0, 0, 0};
     int chi, luni, blki;
     for (chi = 0; chi < meta->node->nchs; chi++) {
@@ -122,39 +254,100 @@ static int init_ls_meta(struct rewrite_meta* meta, struct fox_blkbuf* blockbuf,
                 tblk_entry->meta = &(lm->blk_metas[tblk]);
                 TAILQ_INSERT_TAIL(&(listi->empty_blks), tblk_entry, pt);
             }
-            listi->active_blk = NULL;
+            memset(listi->active_blk, 0, sizeof(listi->active_blk));
         }
     }
 
-    int vpi;
-    for (vpi = 0; vpi < meta->total_pagenum; vpi++) {
-        // lm->vpg2ppg[pi] = pi;
-        lm->vpg2ppg[vpi] = meta->total_pagenum;
-    }
     int ppi;
-    for (ppi = 0; ppi < meta->total_pagenum; ppi++) {
+    for (ppi = 0; lm->ppg2vpg && ppi < meta->total_pagenum; ppi++) {
         lm->ppg2vpg[ppi] = meta->total_pagenum;
     }
+
+    // checkpoint region blocks are taken from the end of the PUs in turn
+    uint64_t ckpt_every = meta->node->wl->ckpt;
+    uint64_t npus = meta->node->nchs * meta->node->nluns;
+    if (ckpt_every && meta->node->wl->map_cache) {
+        printf(" Node %d: --ckpt does not support --map-cache, checkpoints disabled\n", meta->node->nid);
+        ckpt_every = 0;
+    }
+    if (rw_ckpt_init(&(lm->ckpt), meta, ckpt_every, ckpt_get, lm))
+        return 1;
+    if (lm->ckpt.nblks && lm->ckpt.nblks > lm->free_blk_count / 4) {
+        printf(" Node %d: checkpoint needs %" PRIu64 " blocks, too many for the node, checkpoints disabled\n",
+                meta->node->nid, lm->ckpt.nblks);
+        rw_ckpt_free(&(lm->ckpt));
+    }
+    uint64_t ci;
+    for (ci = 0; ci < lm->ckpt.nblks; ci++) {
+        struct blk_list* listi = &(lm->blk_lists[ci % npus]);
+        struct blk_entry* resv = TAILQ_LAST(&(listi->empty_blks), blk_entry_list);
+        TAILQ_REMOVE(&(listi->empty_blks), resv, pt);
+        lm->ckpt.blks[ci] = resv->pblk_i;
+        lm->free_blk_count--;
+        lm->clean_pg_count -= meta->node->npgs;
+    }
+    take_reserve(lm);
     return 0;
 }
 
 static int free_ls_meta(struct ls_meta* lm) {
-    free(lm->vpg2ppg);
+    rw_dftl_free(&(lm->map));
+    rw_ckpt_free(&(lm->ckpt));
     free(lm->ppg2vpg);
     free(lm->blk_metas);
     free(lm->blk_entries);
     free(lm->blk_lists);
+    free(lm->pu_stamp);
+    gc_victims_free(&(lm->gv));
+    pthread_mutex_destroy(&(lm->mutex));
+    pthread_cond_destroy(&(lm->bg_cond));
+    pthread_cond_destroy(&(lm->bg_done));
     free(lm->blkbuf);
     free(lm->blkvpgs);
+    free(lm->copies);
+    free(lm->vpg_writes);
+    rw_batch_free(&(lm->batch));
     return 0;
 }
 
 static uint64_t vpg2ppg(struct ls_meta* lm, uint64_t vpg_i) {
-    return lm->vpg2ppg[vpg_i];
+    return rw_dftl_get(&(lm->map), vpg_i);
 }
 
+/*
+ * Owner of a physical page, total_pagenum if it holds no mapped data. With
+ * --oob the owner comes from the OOB of the page and is valid only while it
+ * still maps to the page: the OOB keeps the owner of a page rewritten or
+ * moved by GC until the block is erased.
+ */
 static uint64_t ppg2vpg(struct ls_meta* lm, uint64_t ppg_i) {
-    return lm->ppg2vpg[ppg_i];
+    uint64_t vpg_i;
+    if (lm->ppg2vpg)
+        return lm->ppg2vpg[ppg_i];
+    vpg_i = rw_oob_read(lm->meta, ppg_i);
+    return (vpg2ppg(lm, vpg_i) == ppg_i) ? vpg_i : lm->meta->total_pagenum;
+}
+
+static void set_ppg2vpg(struct ls_meta* lm, uint64_t ppg_i, uint64_t vpg_i) {
+    if (lm->ppg2vpg)
+        lm->ppg2vpg[ppg_i] = vpg_i;
+}
+
+// every update of a logical page entry is journaled for the checkpoint
+static void map_set(struct ls_meta* lm, uint64_t vpg_i, uint64_t ppg_i) {
+    rw_dftl_set(&(lm->map), vpg_i, ppg_i);
+    if (vpg_i < lm->meta->total_pagenum)
+        rw_ckpt_log(&(lm->ckpt), vpg_i, ppg_i);
+}
+
+// checkpointed image: vpg2ppg, then the write pointer of each block
+static uint64_t ckpt_get(void* ctx, uint64_t idx) {
+    struct ls_meta* lm = (struct ls_meta*)ctx;
+    struct blk_meta* bm;
+    if (idx < lm->meta->total_pagenum)
+        return vpg2ppg(lm, idx);
+    bm = &(lm->blk_metas[idx - lm->meta->total_pagenum]);
+    return bm->ndirtypgs + bm->nabandonedpgs;
 }
 
 static struct nodegeoaddr vaddr2paddr(struct ls_meta* lm, struct nodegeoaddr* vaddr) {
@@ -174,11 +367,218 @@ static int isalloc(struct ls_meta* lm, uint64_t vpg_i) {
         return 1;
 }
 
-static uint64_t allocate_page(struct ls_meta* lm, uint64_t vpg_i);
+// the PU of geo serves the current user I/O
+static void user_pu(struct ls_meta* lm, struct nodegeoaddr* geo) {
+    lm->pu_stamp[geo->ch_i + geo->lun_i * lm->meta->node->nchs] = lm->io_stamp;
+}
+
+// read part of a virtual page, unmapped (never written or trimmed) pages read as zeros
+static int read_vpg(struct ls_meta* lm, uint8_t* databuf, uint64_t vpg_i, uint64_t offset_in_page, uint64_t size) {
+    uint64_t ppg_i = vpg2ppg(lm, vpg_i);
+    if (ppg_i == lm->meta->total_pagenum) {
+        memset(databuf, 0, size);
+        return 0;
+    }
+    struct nodegeoaddr paddr = vpg2geoaddr(lm->meta->node, ppg_i);
+    paddr.offset_in_page = offset_in_page;
+    user_pu(lm, &paddr);
+    return rw_inside_page(lm->meta->node, lm->blockbuf, databuf, lm->meta, &paddr, size, READ_MODE);
+}
+
+static uint64_t allocate_page(struct ls_meta* lm, uint64_t vpg_i, int gc, int borrow);
+static int gc_step(struct ls_meta* lm, int bg, uint64_t maxpgs);
+
+static int blk_isfull(struct ls_meta* lm, struct blk_entry* be) {
+    return (be->meta->ndirtypgs + be->meta->nabandonedpgs == lm->meta->node->npgs);
+}
+
+// one page of pblk_i becomes abandoned
+static void abandon_page(struct ls_meta* lm, uint64_t pblk_i) {
+    struct blk_entry* be = &(lm->blk_entries[pblk_i]);
+    be->meta->ndirtypgs--;
+    be->meta->nabandonedpgs++;
+    gc_unit_invalidate(&(lm->gv), pblk_i);
+}
+
+/*
+ * A full block just erased goes back to the free list of its PU. When the
+ * erase failed (failed, from the fail_e count of the node that erased it) the
+ * block is swapped for a spare of its LUN, or retired when the LUN has none
+ * left, like the superblocks of engines 7 and 8 in erase_sb.
+ */
+static void release_block(struct ls_meta* lm, struct blk_entry* be, int failed) {
+    struct fox_node* node = lm->meta->node;
+    struct nodegeoaddr geo = vblk2geoaddr(node, be->pblk_i);
+    struct blk_list* listi = &(lm->blk_lists[geo.ch_i + geo.lun_i * node->nchs]);
+    rw_ckpt_erase(&(lm->ckpt), be->pblk_i);
+    lm->dirty_pg_count -= be->meta->ndirtypgs;
+    lm->abandoned_pg_count -= be->meta->nabandonedpgs;
+    be->meta->ndirtypgs = 0;
+    be->meta->nabandonedpgs = 0;
+    TAILQ_REMOVE(&(listi->non_empty_blks), be, pt);
+    lm->wl_erases++;
+    if (failed && rw_replace_blk(lm->meta, &geo)) {
+        // erase_block marked it clean, keep it out of the lists for good
+        set_blk_state(lm->meta, &geo, BLOCK_DIRTY);
+        lm->meta->bad_retired++;
+        lm->meta->bad_retired_pgs += node->npgs;
+        return;
+    }
+    lm->clean_pg_count += node->npgs;
+    TAILQ_INSERT_TAIL(&(listi->empty_blks), be, pt);
+    lm->free_blk_count++;
+}
+
+/*
+ * Copies the n pages mapped in lm->copies, their owners in lm->blkvpgs. With
+ * --map-cache a miss reads the translation page of the entry through the
+ * gtd, so a translation page being moved keeps its old flash page there
+ * until the copy is written.
+ */
+static void gc_copy(struct ls_meta* lm, uint64_t n) {
+    uint64_t i;
+    rw_batch_copy(&(lm->batch), lm->copies, n);
+    for (i = 0; i < n; i++) {
+        if (lm->blkvpgs[i] > lm->meta->total_pagenum)
+            map_set(lm, lm->blkvpgs[i], lm->copies[i].dst_i);
+    }
+}
+
+/*
+ * Moves the valid pages of a full block. While there is room outside the
+ * block the pages are mapped to new pages and copied with rw_batch_copy, the
+ * reads of a chunk overlapping the writes of the previous one. The pages left
+ * when there is no room are read in a batch, the block is erased and they are
+ * written to all PUs at once. If the erase retires the block, the pages with
+ * nowhere else to go are written to the GC reserve, taken again from the
+ * free blocks afterwards. Returns the pages moved.
+ */
+static uint64_t reclaim_block(struct ls_meta* lm, uint64_t victim) {
+    struct fox_node* node = lm->meta->node;
+    struct blk_entry* torecyc = &(lm->blk_entries[victim]);
+    struct nodegeoaddr torecyc_geo = vblk2geoaddr(node, torecyc->pblk_i);
+    gc_unit_remove(&(lm->gv), victim);
+    uint64_t ncopies = 0;
+    for (torecyc_geo.pg_i = 0; torecyc_geo.pg_i < node->npgs; torecyc_geo.pg_i++) {
+        uint64_t ppgi = geoaddr2vpg(node, &torecyc_geo);
+        // an OOB owner that maps elsewhere leaves a stale page
+        uint64_t vpgi = (get_pg_state(lm->meta, ppgi) == PAGE_DIRTY) ? ppg2vpg(lm, ppgi) : lm->meta->total_pagenum;
+        if (vpgi == lm->meta->total_pagenum)
+            continue;
+        set_ppg2vpg(lm, ppgi, lm->meta->total_pagenum);
+        map_set(lm, vpgi, lm->meta->total_pagenum);
+        uint64_t newppg = allocate_page(lm, vpgi, 1, 1);
+        if (newppg == lm->meta->total_pagenum) {
+            // no room left, the rest waits for the erase
+            set_ppg2vpg(lm, ppgi, vpgi);
+            map_set(lm, vpgi, ppgi);
+            break;
+        }
+        if (vpgi > lm->meta->total_pagenum)
+            map_set(lm, vpgi, ppgi); // see gc_copy
+        lm->blkvpgs[ncopies] = vpgi;
+        lm->copies[ncopies].src = torecyc_geo;
+        lm->copies[ncopies].src_i = ppgi;
+        lm->copies[ncopies].dst = vpg2geoaddr(node, newppg);
+        lm->copies[ncopies++].dst_i = newppg;
+    }
+    int src = rw_prog_src(lm->meta, RW_PROG_GC);
+    gc_copy(lm, ncopies);
+    rw_prog_src(lm->meta, src);
+    uint64_t read_dpi = 0;
+    for (; torecyc_geo.pg_i < node->npgs; torecyc_geo.pg_i++) {
+        uint64_t ppgi = geoaddr2vpg(node, &torecyc_geo);
+        uint64_t vpgi = (get_pg_state(lm->meta, ppgi) == PAGE_DIRTY) ? ppg2vpg(lm, ppgi) : lm->meta->total_pagenum;
+        if (vpgi != lm->meta->total_pagenum) {
+            rw_batch_add(&(lm->batch), &torecyc_geo, ppgi, lm->blkbuf + read_dpi * lm->meta->vpg_sz, READ_MODE);
+            lm->blkvpgs[read_dpi] = vpgi;
+            set_ppg2vpg(lm, ppgi, lm->meta->total_pagenum);
+            // a translation page is read in place by misses until the batch is done
+            if (vpgi < lm->meta->total_pagenum)
+                map_set(lm, vpgi, lm->meta->total_pagenum);
+            read_dpi++;
+        }
+    }
+    uint64_t total_read = read_dpi;
+    rw_batch_submit(&(lm->batch));
+    for (read_dpi = 0; read_dpi < total_read; read_dpi++) {
+        if (lm->blkvpgs[read_dpi] > lm->meta->total_pagenum)
+            map_set(lm, lm->blkvpgs[read_dpi], lm->meta->total_pagenum);
+    }
+    torecyc_geo.pg_i = 0;
+    uint32_t fails = node->stats.fail_e;
+    erase_block(node, lm->meta, &torecyc_geo);
+    // printf("%d,%d,%d\n", torecyc->meta->nabandonedpgs, torecyc->meta->ndirtypgs, total_read);
+    release_block(lm, torecyc, node->stats.fail_e != fails);
+    for (read_dpi = 0; read_dpi < total_read; read_dpi++) {
+        uint64_t newppg = allocate_page(lm, lm->blkvpgs[read_dpi], 1, 1);
+        // the block was retired with nothing else free, its pages go to the reserve
+        if (newppg == lm->meta->total_pagenum && use_reserve(lm))
+            newppg = allocate_page(lm, lm->blkvpgs[read_dpi], 1, 1);
+        if (newppg == lm->meta->total_pagenum) {
+            printf(" Node %d: block %" PRIu64 " retired, no room for %" PRIu64 " of its valid pages\n",
+                    node->nid, torecyc->pblk_i, total_read - read_dpi);
+            lm->nospace = 1;
+            break;
+        }
+        struct nodegeoaddr newppggeo = vpg2geoaddr(node, newppg);
+        rw_batch_add(&(lm->batch), &newppggeo, newppg, lm->blkbuf + read_dpi * lm->meta->vpg_sz, WRITE_MODE);
+    }
+    src = rw_prog_src(lm->meta, RW_PROG_GC);
+    rw_batch_submit(&(lm->batch));
+    rw_prog_src(lm->meta, src);
+    take_reserve(lm);
+    return ncopies + total_read;
+}
+
+/*
+ * Static wear leveling, with --wl in the user thread after GC erases: every
+ * npus erases, when the most erased block of the node is more than --wl
+ * erases ahead of the least erased full block, the data of the latter, cold
+ * since it stays valid, is moved and the block goes back to the free lists,
+ * where dynamic wear leveling gives it to user writes. Checkpoint blocks are
+ * not part of the spread.
+ */
+static void wear_level(struct ls_meta* lm) {
+    struct fox_node* node = lm->meta->node;
+    uint32_t* erases = lm->meta->blk_erases;
+    uint64_t npus = node->nchs * node->nluns;
+    uint64_t cold = lm->gv.nunits;
+    uint32_t maxe = 0;
+    uint64_t i, s;
+    struct blk_entry* be;
+    struct timeval tvalst, tvaled;
+    if (lm->wl_spread == 0 || lm->wl_erases < npus)
+        return;
+    lm->wl_erases = 0;
+    gettimeofday(&tvalst, NULL);
+    for (i = 0; i < npus; i++) {
+        struct blk_list* listi = &(lm->blk_lists[i]);
+        TAILQ_FOREACH(be, &(listi->empty_blks), pt)
+            maxe = (erases[be->pblk_i] > maxe) ? erases[be->pblk_i] : maxe;
+        TAILQ_FOREACH(be, &(listi->non_empty_blks), pt)
+            maxe = (erases[be->pblk_i] > maxe) ? erases[be->pblk_i] : maxe;
+        for (s = 0; s < LS_MAX_STREAMS; s++) {
+            if (listi->active_blk[s] != NULL && erases[listi->active_blk[s]->pblk_i] > maxe)
+                maxe = erases[listi->active_blk[s]->pblk_i];
+        }
+    }
+    for (i = 0; i < lm->gv.nfull; i++) {
+        if (cold == lm->gv.nunits || erases[lm->gv.full[i]] < erases[cold])
+            cold = lm->gv.full[i];
+    }
+    if (cold != lm->gv.nunits && maxe - erases[cold] > lm->wl_spread) {
+        lm->wl_pgs += reclaim_block(lm, cold);
+        lm->wl_count++;
+    }
+    gettimeofday(&tvaled, NULL);
+    lm->wl_time += ((uint64_t)(tvaled.tv_sec - tvalst.tv_sec) * 1000000L + tvaled.tv_usec) - tvalst.tv_usec;
+}
 
 static int garbage_collection(struct ls_meta* lm, uint64_t vpg_i_begin, uint64_t vpg_i_end) {
     struct fox_node* node = lm->meta->node;
-    if (lm->clean_pg_count == lm->meta->total_pagenum)
+    uint64_t resv = (lm->gc_reserve) ? node->npgs : 0;
+    if (lm->clean_pg_count + resv + lm->ckpt.nblks * node->npgs + lm->meta->bad_retired_pgs == lm->meta->total_pagenum)
         return 0;
     struct timeval tvalst, tvaled;
     gettimeofday(&tvalst, NULL);
@@ -186,122 +586,151 @@ static int garbage_collection(struct ls_meta* lm, uint64_t vpg_i_begin, uint64_t
     uint64_t vpg_i = 0;
     for (vpg_i = vpg_i_begin; vpg_i <= vpg_i_end; vpg_i++) {
         if (isalloc(lm, vpg_i)) {
-            uint64_t oldppg = lm->vpg2ppg[vpg_i];
-            lm->meta->page_state[oldppg] = PAGE_ABANDONED;
+            uint64_t oldppg = vpg2ppg(lm, vpg_i);
+            set_pg_state(lm->meta, oldppg, PAGE_ABANDONED);
             lm->dirty_pg_count--;
             lm->abandoned_pg_count++;
-            lm->vpg2ppg[vpg_i] = lm->meta->total_pagenum;
-            lm->ppg2vpg[oldppg] = lm->meta->total_pagenum;
-            uint64_t oldblk = vpg2vblk(node, oldppg);
-            lm->blk_metas[oldblk].ndirtypgs--;
-            lm->blk_metas[oldblk].nabandonedpgs++;
+            map_set(lm, vpg_i, lm->meta->total_pagenum);
+            set_ppg2vpg(lm, oldppg, lm->meta->total_pagenum);
+            abandon_page(lm, vpg2vblk(node, oldppg));
         }
     }
-    // find the full block with min dirty pages, greedy
-    uint64_t ited_ch_lun_num = 0;
-    struct blk_entry* torecyc = NULL;
-    struct blk_list* torecyc_list = NULL;
-    uint64_t mindirtypgs = node->npgs;
-    for (ited_ch_lun_num = 0; ited_ch_lun_num < node->nchs * node->nluns; ited_ch_lun_num++) {
-        lm->next_ch_lun_i = (lm->next_ch_lun_i + ited_ch_lun_num) % (node->nchs * node->nluns);
-        struct blk_list* listi = &(lm->blk_lists[lm->next_ch_lun_i]);
-        if (!TAILQ_EMPTY(&(listi->non_empty_blks))) {
-            struct blk_entry* tentry;
-            TAILQ_FOREACH(tentry, &(listi->non_empty_blks), pt) {
-                // printf("%d\n", tentry->meta->ndirtypgs);
-                if (tentry->meta->ndirtypgs < mindirtypgs) {
-                    mindirtypgs = tentry->meta->ndirtypgs;
-                    torecyc = tentry;
-                    torecyc_list = listi;
-                }
-            }
+    // pick a full block with the selected policy
+    if (lm->step_victim != NULL && !lm->bg_enabled) {
+        // finish the block incremental GC started
+        int ret;
+        while ((ret = gc_step(lm, 0, node->npgs)) == 0)
+            ;
+        if (ret == 1) {
+            gettimeofday(&tvaled, NULL);
+            lm->gc_count++;
+            lm->gc_time += ((uint64_t)(tvaled.tv_sec - tvalst.tv_sec) * 1000000L + tvaled.tv_usec) - tvalst.tv_usec;
+            return 0;
         }
     }
-    if (torecyc != NULL) {
-        struct nodegeoaddr torecyc_geo = vblk2geoaddr(node, torecyc->pblk_i);
-        uint64_t read_dpi = 0;
-        for (torecyc_geo.pg_i = 0; torecyc_geo.pg_i < node->npgs; torecyc_geo.pg_i++) {
-            uint64_t ppgi = geoaddr2vpg(node, &torecyc_geo);
-            if (lm->meta->page_state[ppgi] == PAGE_DIRTY) {
-                rw_inside_page(node, lm->blockbuf, lm->blkbuf + read_dpi * lm->meta->vpg_sz, lm->meta, &torecyc_geo, lm->meta->vpg_sz, READ_MODE);
-                lm->blkvpgs[read_dpi] = ppg2vpg(lm, ppgi);
-                lm->ppg2vpg[ppgi] = lm->meta->total_pagenum;
-                lm->vpg2ppg[lm->blkvpgs[read_dpi]] = lm->meta->total_pagenum;
-                read_dpi++;
-            }
-        }
-        uint64_t total_read = read_dpi;
-        torecyc_geo.pg_i = 0;
-        erase_block(node, lm->meta, &torecyc_geo);
-        // printf("%d,%d,%d\n", torecyc->meta->nabandonedpgs, torecyc->meta->ndirtypgs, total_read);
-        lm->dirty_pg_count -= torecyc->meta->ndirtypgs;
-        lm->abandoned_pg_count -= torecyc->meta->nabandonedpgs;
-        lm->clean_pg_count += node->npgs;
-        torecyc->meta->ndirtypgs = 0;
-        torecyc->meta->nabandonedpgs = 0;
-        TAILQ_REMOVE(&(torecyc_list->non_empty_blks), torecyc, pt);
-        TAILQ_INSERT_TAIL(&(torecyc_list->empty_blks), torecyc, pt);
-        for (read_dpi = 0; read_dpi < total_read; read_dpi++) {
-            uint64_t newppg = allocate_page(lm, lm->blkvpgs[read_dpi]);
-            struct nodegeoaddr newppggeo = vpg2geoaddr(node, newppg);
-            rw_inside_page(node, lm->blockbuf, lm->blkbuf + read_dpi * lm->meta->vpg_sz, lm->meta, &newppggeo, lm->meta->vpg_sz, WRITE_MODE);
-        }
-        lm->gc_map_change_count += total_read;
+    uint64_t victim = gc_victim(&(lm->gv));
+    if (victim == lm->gv.nunits && lm->step_victim != NULL) {
+        // the only candidate is being reclaimed in background
+        pthread_cond_wait(&(lm->bg_done), &(lm->mutex));
+        return 0;
     }
+    if (victim != lm->gv.nunits)
+        lm->gc_map_change_count += reclaim_block(lm, victim);
     gettimeofday(&tvaled, NULL);
     lm->gc_count++;
     lm->gc_time += ((uint64_t)(tvaled.tv_sec - tvalst.tv_sec) * 1000000L + tvaled.tv_usec) - tvalst.tv_usec;
+    wear_level(lm);
     return 0;
 }
 
-static uint64_t allocate_page(struct ls_meta* lm, uint64_t vpg_i) {
+/*
+ * Stream of a page write. User pages: class of the update count, class k
+ * holds pages written more than 2^(k-1) times the mean of the written
+ * pages, so the hottest data lands in the last user stream. GC copies keep
+ * their class unless --gc-stream gives them their own stream.
+ */
+static uint64_t page_stream(struct ls_meta* lm, uint64_t vpg_i, int gc) {
+    uint64_t s = 0;
+    double t;
+    if (gc && lm->gc_stream)
+        return lm->nstreams;
+    if (vpg_i > lm->meta->total_pagenum) // translation page
+        return (lm->gc_stream) ? lm->nstreams : 0;
+    if (lm->nstreams == 1 || lm->written_vpgs == 0)
+        return 0;
+    t = (double)lm->user_pg_count / lm->written_vpgs;
+    while (s < lm->nstreams - 1 && lm->vpg_writes[vpg_i] > t) {
+        s++;
+        t *= 2;
+    }
+    return s;
+}
+
+/*
+ * Empty block of a PU to open. With --wl user writes get the least erased
+ * one and GC copies, colder, the most erased one.
+ */
+static struct blk_entry* pick_empty_blk(struct ls_meta* lm, struct blk_list* listi, int gc) {
+    uint32_t* erases = lm->meta->blk_erases;
+    struct blk_entry* best = TAILQ_FIRST(&(listi->empty_blks));
+    struct blk_entry* be;
+    if (lm->wl_spread == 0)
+        return best;
+    TAILQ_FOREACH(be, &(listi->empty_blks), pt) {
+        if ((gc) ? erases[be->pblk_i] > erases[best->pblk_i] : erases[be->pblk_i] < erases[best->pblk_i])
+            best = be;
+    }
+    return best;
+}
+
+// PU with an active block of stream s, or with an empty block to open one
+static struct blk_list* find_stream_pu(struct ls_meta* lm, uint64_t s, int gc) {
     struct fox_node* node = lm->meta->node;
-    int allocedflag = isalloc(lm, vpg_i);
-    if (allocedflag) {
-        uint64_t oldppg = lm->vpg2ppg[vpg_i];
-        lm->dirty_pg_count--;
-        lm->abandoned_pg_count++;
-        lm->meta->page_state[oldppg] = PAGE_ABANDONED;
-        lm->ppg2vpg[oldppg] = lm->meta->total_pagenum;
-        lm->vpg2ppg[vpg_i] = lm->meta->total_pagenum;
-        uint64_t oldpblk = vpg2vblk(node, oldppg);
-        lm->blk_metas[oldpblk].ndirtypgs--;
-        lm->blk_metas[oldpblk].nabandonedpgs++;
-    }
-    // find first chlun with available empty blocks
     uint64_t ited_ch_lun_num = 0;
-    struct blk_list* listi = NULL;
     for (ited_ch_lun_num = 0; ited_ch_lun_num <= node->nchs * node->nluns; ited_ch_lun_num++) {
         lm->next_ch_lun_i = (lm->next_ch_lun_i + ited_ch_lun_num) % (node->nchs * node->nluns);
-        if (lm->blk_lists[lm->next_ch_lun_i].active_blk != NULL) {
-            listi = &(lm->blk_lists[lm->next_ch_lun_i]);
-            break;
-        }
+        if (lm->blk_lists[lm->next_ch_lun_i].active_blk[s] != NULL)
+            return &(lm->blk_lists[lm->next_ch_lun_i]);
     }
-    if (listi == NULL) {
-        for (ited_ch_lun_num = 0; ited_ch_lun_num <= node->nchs * node->nluns; ited_ch_lun_num++) {
-            lm->next_ch_lun_i = (lm->next_ch_lun_i + ited_ch_lun_num) % (node->nchs * node->nluns);
-            if (!TAILQ_EMPTY(&(lm->blk_lists[lm->next_ch_lun_i].empty_blks))) {
-                listi = &(lm->blk_lists[lm->next_ch_lun_i]);
-                struct blk_entry* newemp = TAILQ_FIRST(&(listi->empty_blks));
-                TAILQ_REMOVE(&(listi->empty_blks), newemp, pt);
-                listi->active_blk = newemp;
-                break;
+    for (ited_ch_lun_num = 0; ited_ch_lun_num <= node->nchs * node->nluns; ited_ch_lun_num++) {
+        lm->next_ch_lun_i = (lm->next_ch_lun_i + ited_ch_lun_num) % (node->nchs * node->nluns);
+        if (!TAILQ_EMPTY(&(lm->blk_lists[lm->next_ch_lun_i].empty_blks))) {
+            struct blk_list* listi = &(lm->blk_lists[lm->next_ch_lun_i]);
+            struct blk_entry* newemp = pick_empty_blk(lm, listi, gc);
+            TAILQ_REMOVE(&(listi->empty_blks), newemp, pt);
+            listi->active_blk[s] = newemp;
+            lm->free_blk_count--;
+            if (lm->bg_enabled && lm->free_blk_count < lm->bg_low && !lm->bg_active) {
+                lm->bg_active = 1;
+                pthread_cond_signal(&(lm->bg_cond));
             }
+            return listi;
         }
     }
+    return NULL;
+}
+
+/*
+ * Maps vpg_i to a free page of its stream. With borrow, a stream that has no
+ * room left takes a page from the active block of another stream instead of
+ * failing; GC always borrows, user writes only when GC cannot free a block.
+ */
+static uint64_t allocate_page(struct ls_meta* lm, uint64_t vpg_i, int gc, int borrow) {
+    struct fox_node* node = lm->meta->node;
+    uint64_t s = page_stream(lm, vpg_i, gc);
+    uint64_t nstreams = lm->nstreams + lm->gc_stream;
+    uint64_t i;
+    int allocedflag = isalloc(lm, vpg_i);
+    if (allocedflag) {
+        uint64_t oldppg = vpg2ppg(lm, vpg_i);
+        lm->dirty_pg_count--;
+        lm->abandoned_pg_count++;
+        set_pg_state(lm->meta, oldppg, PAGE_ABANDONED);
+        set_ppg2vpg(lm, oldppg, lm->meta->total_pagenum);
+        map_set(lm, vpg_i, lm->meta->total_pagenum);
+        abandon_page(lm, vpg2vblk(node, oldppg));
+    }
+    // find first chlun with an active block of the stream, or available empty blocks
+    struct blk_list* listi = find_stream_pu(lm, s, gc);
+    // no empty block left, fill the active blocks of the other streams
+    for (i = 1; borrow && listi == NULL && i < nstreams; i++) {
+        s = (s + 1) % nstreams;
+        listi = find_stream_pu(lm, s, gc);
+    }
     if (listi == NULL) {
        //  printf("Impossible after GC!\n");
         return lm->meta->total_pagenum;
     } else {
         lm->next_ch_lun_i = (lm->next_ch_lun_i + 1) % (node->nchs * node->nluns);
-        struct blk_entry* act = listi->active_blk;
+        struct blk_entry* act = listi->active_blk[s];
         struct nodegeoaddr tgeo = vblk2geoaddr(node, act->pblk_i);
         tgeo.offset_in_page = 0;
         tgeo.pg_i = act->meta->ndirtypgs + act->meta->nabandonedpgs;
         uint64_t newppg = geoaddr2vpg(node, &tgeo);
-        lm->vpg2ppg[vpg_i] = newppg;
-        lm->ppg2vpg[newppg] = vpg_i;
+        map_set(lm, vpg_i, newppg);
+        set_ppg2vpg(lm, newppg, vpg_i);
+        if (lm->meta->oob)
+            rw_oob_write(lm->meta, newppg, vpg_i); // programmed with the page
         if (allocedflag)
             lm->map_change_count++;
         else
@@ -309,21 +738,355 @@ static uint64_t allocate_page(struct ls_meta* lm, uint64_t vpg_i) {
         lm->clean_pg_count--;
         lm->dirty_pg_count++;
         act->meta->ndirtypgs++;
+        lm->stream_pgs[s]++;
         // remove if used up!
-        if (act->meta->ndirtypgs + act->meta->nabandonedpgs == node->npgs) {
-            listi->active_blk = NULL;
+        if (blk_isfull(lm, act)) {
+            listi->active_blk[s] = NULL;
             TAILQ_INSERT_TAIL(&(listi->non_empty_blks), act, pt);
+            gc_unit_full(&(lm->gv), act->pblk_i, act->meta->ndirtypgs);
         }
         return newppg;
     }
 }
 
+// next valid page of step_victim, total_pagenum if none is left
+static uint64_t next_step_page(struct ls_meta* lm, struct nodegeoaddr* geo) {
+    struct fox_node* node = lm->meta->node;
+    for (; lm->step_pg_i < node->npgs; lm->step_pg_i++) {
+        geo->pg_i = lm->step_pg_i;
+        uint64_t ppgi = geoaddr2vpg(node, geo);
+        if (get_pg_state(lm->meta, ppgi) == PAGE_DIRTY && ppg2vpg(lm, ppgi) != lm->meta->total_pagenum) {
+            lm->step_pg_i++;
+            return ppgi;
+        }
+    }
+    return lm->meta->total_pagenum;
+}
+
+// no room for the copies, give the block back to foreground GC
+static void step_giveup(struct ls_meta* lm) {
+    struct fox_node* node = lm->meta->node;
+    struct blk_entry* torecyc = lm->step_victim;
+    struct nodegeoaddr geo = vblk2geoaddr(node, torecyc->pblk_i);
+    // pages already migrated are stale now
+    for (geo.pg_i = 0; geo.pg_i < lm->step_pg_i; geo.pg_i++) {
+        uint64_t ppgi = geoaddr2vpg(node, &geo);
+        if (get_pg_state(lm->meta, ppgi) == PAGE_DIRTY && ppg2vpg(lm, ppgi) == lm->meta->total_pagenum) {
+            set_pg_state(lm->meta, ppgi, PAGE_ABANDONED);
+            lm->dirty_pg_count--;
+            lm->abandoned_pg_count++;
+            torecyc->meta->ndirtypgs--;
+            torecyc->meta->nabandonedpgs++;
+        }
+    }
+    gc_unit_full(&(lm->gv), torecyc->pblk_i, torecyc->meta->ndirtypgs);
+    lm->step_victim = NULL;
+    pthread_cond_broadcast(&(lm->bg_done));
+}
+
+// no mapping points to step_victim any more, erase it
+static int gc_step_erase(struct ls_meta* lm, struct fox_node* ionode) {
+    struct fox_node* node = lm->meta->node;
+    struct blk_entry* torecyc = lm->step_victim;
+    struct nodegeoaddr torecyc_geo = vblk2geoaddr(node, torecyc->pblk_i);
+    uint32_t fails = ionode->stats.fail_e;
+    if (ionode == node) {
+        erase_block(node, lm->meta, &torecyc_geo);
+    } else {
+        // only the device erase runs unlocked, block and page states share
+        // words with blocks the user thread updates
+        pthread_mutex_unlock(&(lm->mutex));
+        fox_vblk_tgt(ionode, ionode->ch[torecyc_geo.ch_i], ionode->lun[torecyc_geo.lun_i], torecyc_geo.blk_i);
+        int err = fox_erase_blk(&ionode->vblk_tgt, ionode);
+        pthread_mutex_lock(&(lm->mutex));
+        if (!err)
+            erase_block_meta(node, lm->meta, &torecyc_geo);
+    }
+    release_block(lm, torecyc, ionode->stats.fail_e != fails);
+    lm->step_victim = NULL;
+    pthread_cond_broadcast(&(lm->bg_done));
+    return 1;
+}
+
+/*
+ * Foreground step: map up to maxpgs valid pages of step_victim to new
+ * pages, then copy them with rw_batch_copy (a read and a write batch, or
+ * device copies). Returns the pages copied.
+ */
+static uint64_t gc_step_batch(struct ls_meta* lm, uint64_t maxpgs) {
+    struct fox_node* node = lm->meta->node;
+    struct nodegeoaddr geo = vblk2geoaddr(node, lm->step_victim->pblk_i);
+    uint64_t n = 0;
+    int src = rw_prog_src(lm->meta, RW_PROG_GC);
+    while (n < maxpgs && n < node->npgs) {
+        uint64_t ppgi = next_step_page(lm, &geo);
+        if (ppgi == lm->meta->total_pagenum)
+            break;
+        uint64_t vpgi = ppg2vpg(lm, ppgi);
+        set_ppg2vpg(lm, ppgi, lm->meta->total_pagenum);
+        map_set(lm, vpgi, lm->meta->total_pagenum);
+        uint64_t newppg = allocate_page(lm, vpgi, 1, 1);
+        if (newppg == lm->meta->total_pagenum) {
+            // keep this page on the victim, copy the ones already mapped
+            set_ppg2vpg(lm, ppgi, vpgi);
+            map_set(lm, vpgi, ppgi);
+            gc_copy(lm, n);
+            rw_prog_src(lm->meta, src);
+            step_giveup(lm);
+            return 0;
+        }
+        if (vpgi > lm->meta->total_pagenum)
+            map_set(lm, vpgi, ppgi); // see gc_copy
+        lm->blkvpgs[n] = vpgi;
+        lm->copies[n].src = geo;
+        lm->copies[n].src_i = ppgi;
+        lm->copies[n].dst = vpg2geoaddr(node, newppg);
+        lm->copies[n++].dst_i = newppg;
+        lm->step_map_change_count++;
+    }
+    gc_copy(lm, n);
+    rw_prog_src(lm->meta, src);
+    return n;
+}
+
+/*
+ * The bg thread reads and erases its victim while the user thread runs,
+ * keep it off the PUs of the current and the previous user I/O.
+ */
+static int pu_busy(void* ctx, uint64_t blk) {
+    struct ls_meta* lm = (struct ls_meta*)ctx;
+    struct fox_node* node = lm->meta->node;
+    struct nodegeoaddr geo = vblk2geoaddr(node, lm->blk_entries[blk].pblk_i);
+    uint64_t stamp = lm->pu_stamp[geo.ch_i + geo.lun_i * node->nchs];
+    return stamp != 0 && stamp + 1 >= lm->io_stamp;
+}
+
+/*
+ * One GC step, called with lm->mutex held: pick a victim if there is none,
+ * then migrate up to maxpgs of its valid pages, or erase it when no valid
+ * page is left. The victim is kept in step_victim between steps, so a block
+ * can be reclaimed over several user I/Os (--gc-step) or in background
+ * (--gc-bg). In foreground the pages of a step move in two batches. In
+ * background the device read of the victim and its erase run without the
+ * lock, so user I/O to other PUs proceeds meanwhile; all meta updates, the
+ * mapping and the write of the copy are done under the lock, skipping pages
+ * the user rewrote during the read.
+ * Returns 1 when the victim was erased, 0 after copying pages and -1 when
+ * there is nothing to reclaim or no room for the copy.
+ */
+static int gc_step(struct ls_meta* lm, int bg, uint64_t maxpgs) {
+    struct fox_node* node = lm->meta->node;
+    uint64_t ncopied = 0;
+    if (lm->step_victim == NULL) {
+        uint64_t victim = (bg) ? gc_victim_idle(&(lm->gv), pu_busy, lm) : gc_victim(&(lm->gv));
+        if (victim == lm->gv.nunits)
+            return -1;
+        if (bg && pu_busy(lm, victim))
+            lm->bg_busy_victims++;
+        gc_unit_remove(&(lm->gv), victim);
+        lm->step_victim = &(lm->blk_entries[victim]);
+        lm->step_pg_i = 0;
+    }
+    if (!bg) {
+        if (gc_step_batch(lm, maxpgs) > 0)
+            return 0;
+        return (lm->step_victim == NULL) ? -1 : gc_step_erase(lm, node);
+    }
+    struct nodegeoaddr torecyc_geo = vblk2geoaddr(node, lm->step_victim->pblk_i);
+    while (ncopied < maxpgs) {
+        uint64_t ppgi = next_step_page(lm, &torecyc_geo);
+        if (ppgi == lm->meta->total_pagenum)
+            break;
+        uint64_t vpgi = ppg2vpg(lm, ppgi);
+        ncopied++;
+        pthread_mutex_unlock(&(lm->mutex));
+        rw_read_page(&(lm->bg_node), &(lm->bg_buf), lm->bg_pagebuf, &torecyc_geo, lm->meta->vpg_sz);
+        pthread_mutex_lock(&(lm->mutex));
+        lm->meta->heatmap[ppgi].readt++;
+        if (ppg2vpg(lm, ppgi) != vpgi)
+            continue;
+        set_ppg2vpg(lm, ppgi, lm->meta->total_pagenum);
+        map_set(lm, vpgi, lm->meta->total_pagenum);
+        uint64_t newppg = allocate_page(lm, vpgi, 1, 1);
+        if (newppg == lm->meta->total_pagenum) {
+            set_ppg2vpg(lm, ppgi, vpgi);
+            map_set(lm, vpgi, ppgi);
+            step_giveup(lm);
+            return -1;
+        }
+        struct nodegeoaddr newppggeo = vpg2geoaddr(node, newppg);
+        // the user thread may be between two writes, keep its source
+        int src = rw_prog_src(lm->meta, RW_PROG_GC);
+        rw_inside_page(&(lm->bg_node), &(lm->bg_buf), lm->bg_pagebuf, lm->meta, &newppggeo, lm->meta->vpg_sz, WRITE_MODE);
+        rw_prog_src(lm->meta, src);
+        lm->step_map_change_count++;
+    }
+    return (ncopied > 0) ? 0 : gc_step_erase(lm, &(lm->bg_node));
+}
+
+/*
+ * Incremental GC, before a user I/O while free blocks are below inc_low:
+ * run steps of --gc-step pages until --gc-budget us are spent, at least
+ * one step. With --gc-yield reads skip it and are served first, writes pay
+ * for the reclaim; a write that finds no room still runs a whole GC.
+ */
+static void gc_incremental(struct ls_meta* lm, int mode) {
+    struct fox_node* node = lm->meta->node;
+    struct timeval tvalst, tvaled;
+    uint64_t elapsed;
+    int ret;
+    if (lm->inc_pgs == 0 || lm->bg_enabled)
+        return;
+    if (mode != WRITE_MODE && node->wl->gc_yield)
+        return;
+    if (lm->step_victim == NULL && lm->free_blk_count >= lm->inc_low)
+        return;
+    gettimeofday(&tvalst, NULL);
+    do {
+        ret = gc_step(lm, 0, lm->inc_pgs);
+        if (ret == 1)
+            lm->inc_gc_count++;
+        gettimeofday(&tvaled, NULL);
+        elapsed = ((uint64_t)(tvaled.tv_sec - tvalst.tv_sec) * 1000000L + tvaled.tv_usec) - tvalst.tv_usec;
+    } while (ret >= 0 && elapsed < node->wl->gc_budget &&
+            (lm->step_victim != NULL || lm->free_blk_count < lm->inc_low));
+    lm->inc_gc_time += elapsed;
+    wear_level(lm);
+}
+
+static void* bg_gc_thread(void* arg) {
+    struct ls_meta* lm = (struct ls_meta*)arg;
+    struct timeval tvalst, tvaled;
+    pthread_mutex_lock(&(lm->mutex));
+    while (!lm->bg_stop) {
+        if (!lm->bg_active && lm->step_victim == NULL) {
+            pthread_cond_wait(&(lm->bg_cond), &(lm->mutex));
+            continue;
+        }
+        if (lm->step_victim == NULL && lm->free_blk_count >= lm->bg_high) {
+            lm->bg_active = 0;
+            continue;
+        }
+        gettimeofday(&tvalst, NULL);
+        int ret = gc_step(lm, 1, 1);
+        if (ret < 0) // nothing to reclaim, foreground GC takes over
+            lm->bg_active = 0;
+        else if (ret == 1)
+            lm->bg_gc_count++;
+        gettimeofday(&tvaled, NULL);
+        lm->bg_gc_time += ((uint64_t)(tvaled.tv_sec - tvalst.tv_sec) * 1000000L + tvaled.tv_usec) - tvalst.tv_usec;
+        // let the user thread in between two steps
+        pthread_mutex_unlock(&(lm->mutex));
+        sched_yield();
+        pthread_mutex_lock(&(lm->mutex));
+    }
+    pthread_mutex_unlock(&(lm->mutex));
+    return NULL;
+}
+
+// watermarks are percentages of the blocks of the node
+static int bg_gc_start(struct ls_meta* lm) {
+    struct fox_node* node = lm->meta->node;
+    uint64_t nblks_total = node->nchs * node->nluns * node->nblks;
+    if (node->wl->gc_bg_low == 0)
+        return 0;
+    lm->bg_low = nblks_total * node->wl->gc_bg_low / 100;
+    lm->bg_high = nblks_total * node->wl->gc_bg_high / 100;
+    lm->bg_low = (lm->bg_low == 0) ? 1 : lm->bg_low;
+    lm->bg_high = (lm->bg_high < lm->bg_low) ? lm->bg_low : lm->bg_high;
+    lm->bg_node = *node;
+    // -m compares a read with the last write at its page index through the
+    // same buffer; the pages GC moves are not checked
+    lm->bg_wl = *node->wl;
+    lm->bg_wl.memcmp = WB_DISABLE;
+    lm->bg_node.wl = &(lm->bg_wl);
+    memset(&(lm->bg_node.stats), 0, sizeof(struct fox_stats));
+    lm->bg_node.stats.tval = node->stats.tval;
+    pthread_mutex_init(&(lm->bg_node.stats.s_mutex), NULL);
+    if (fox_alloc_blk_buf(node, &(lm->bg_buf)))
+        return 1;
+    lm->bg_pagebuf = (uint8_t*)calloc(lm->meta->vpg_sz, sizeof(uint8_t));
+    lm->bg_active = 0;
+    lm->bg_stop = 0;
+    lm->bg_enabled = 1;
+    if (pthread_create(&(lm->bg_tid), NULL, bg_gc_thread, lm)) {
+        lm->bg_enabled = 0;
+        free(lm->bg_pagebuf);
+        fox_free_blkbuf(&(lm->bg_buf), 1);
+        return 1;
+    }
+    return 0;
+}
+
+static void bg_gc_stop(struct ls_meta* lm) {
+    struct fox_stats* st = &(lm->meta->node->stats);
+    struct fox_stats* bst = &(lm->bg_node.stats);
+    if (!lm->bg_enabled)
+        return;
+    pthread_mutex_lock(&(lm->mutex));
+    lm->bg_stop = 1;
+    pthread_cond_signal(&(lm->bg_cond));
+    pthread_mutex_unlock(&(lm->mutex));
+    pthread_join(lm->bg_tid, NULL);
+    // device work of the bg thread belongs to the node
+    st->read_t += bst->read_t;
+    st->write_t += bst->write_t;
+    st->erase_t += bst->erase_t;
+    st->erased_blks += bst->erased_blks;
+    st->pgs_r += bst->pgs_r;
+    st->pgs_w += bst->pgs_w;
+    st->bread += bst->bread;
+    st->bwritten += bst->bwritten;
+    st->fail_e += bst->fail_e;
+    st->fail_w += bst->fail_w;
+    st->fail_r += bst->fail_r;
+    pthread_mutex_destroy(&(bst->s_mutex));
+    free(lm->bg_pagebuf);
+    fox_free_blkbuf(&(lm->bg_buf), 1);
+    lm->bg_enabled = 0;
+}
+
+// pages written to each stream, coldest user stream first
+static void print_streams(struct ls_meta* lm) {
+    uint64_t s;
+    printf(" Node %d: pages per stream:", lm->meta->node->nid);
+    for (s = 0; s < lm->nstreams; s++)
+        printf("%s user%" PRIu64 " %" PRIu64, (s) ? "," : "", s, lm->stream_pgs[s]);
+    if (lm->gc_stream)
+        printf(", gc %" PRIu64, lm->stream_pgs[lm->nstreams]);
+    printf("\n");
+}
+
+// cost of static wear leveling, its copies are GC programs in rw_waf_print
+static void print_wear_level(struct ls_meta* lm) {
+    uint64_t prog = 0;
+    int i;
+    for (i = 0; i < RW_PROG_NSRC; i++)
+        prog += lm->meta->prog_pgs[i];
+    printf(" Node %d: wear leveling %" PRIu64 " blocks, %" PRIu64 " pages moved (%.1f%% of the flash pages), %.3f ms\n",
+            lm->meta->node->nid, lm->wl_count, lm->wl_pgs, (prog) ? 100.0 * lm->wl_pgs / prog : 0.0, lm->wl_time / 1000.0);
+}
+
 static uint64_t alloc_gc(struct ls_meta* lm, uint64_t vpg_i, uint64_t vpg_i_begin, uint64_t vpg_i_end) {
     // uint64_t newppg = garbage_collection(lm, vpg_i_begin, vpg_i_end);
-    uint64_t newppg = allocate_page(lm, vpg_i);
-    while (newppg  == lm->meta->total_pagenum) {
+    uint64_t newppg, clean;
+    int borrow = 0;
+    if (lm->vpg_writes[vpg_i]++ == 0)
+        lm->written_vpgs++;
+    // a GC reserve used for a retired victim comes back from a GC run ahead
+    if (lm->gc_reserve == NULL && lm->free_blk_count == 0)
+        garbage_collection(lm, 1, 0);
+    newppg = allocate_page(lm, vpg_i, 0, borrow);
+    while (newppg  == lm->meta->total_pagenum && !lm->nospace) {
+        clean = lm->clean_pg_count;
         garbage_collection(lm, vpg_i_begin, vpg_i_end);
-        newppg = allocate_page(lm, vpg_i);
+        // GC freed nothing, the stream has to share
+        borrow = (lm->clean_pg_count == clean);
+        newppg = allocate_page(lm, vpg_i, 0, borrow);
+    }
+    if (newppg != lm->meta->total_pagenum) {
+        struct nodegeoaddr geo = vpg2geoaddr(lm->meta->node, newppg);
+        user_pu(lm, &geo);
     }
     return newppg;
 }
@@ -334,34 +1097,47 @@ static int iterate_ls_io(struct fox_node* node, struct fox_blkbuf* buf, struct r
     struct nodegeoaddr voffset_end;
     set_nodegeoaddr(node, &voffset_begin, offset);
     set_nodegeoaddr(node, &voffset_end, offset + size - 1); // [offset_begin, offset_end]
-    struct nodegeoaddr poffset_begin = vaddr2paddr(lm, &voffset_begin);
-    struct nodegeoaddr poffset_end = vaddr2paddr(lm, &voffset_end);
     uint64_t vpg_i_begin = offset / vpg_sz;
     uint64_t vpg_i_end = (offset + size - 1) / vpg_sz;
 
     if (mode == READ_MODE) {
-        struct nodegeoaddr ppg_geo_end = vpg2geoaddr(node, vpg2ppg(lm, vpg_i_end));
         uint8_t* resbuf_t = resbuf;
         // read
         if (vpg_i_begin == vpg_i_end) {
-            rw_inside_page(node, buf, resbuf_t, meta, &poffset_begin, size, mode);
+            read_vpg(lm, resbuf_t, vpg_i_begin, voffset_begin.offset_in_page, size);
             resbuf_t += size;
         } else {
             // read begin page
-            rw_inside_page(node, buf, resbuf_t, meta, &poffset_begin, vpg_sz - poffset_begin.offset_in_page, mode);
-            resbuf_t += (vpg_sz - poffset_begin.offset_in_page);
+            read_vpg(lm, resbuf_t, vpg_i_begin, voffset_begin.offset_in_page, vpg_sz - voffset_begin.offset_in_page);
+            resbuf_t += (vpg_sz - voffset_begin.offset_in_page);
             // read middle pages
             if (vpg_i_end - vpg_i_begin > 1) {
                 uint64_t middle_pgi;
                 for (middle_pgi = vpg_i_begin + 1; middle_pgi < vpg_i_end; middle_pgi++) {
-                    struct nodegeoaddr tgeo = vpg2geoaddr(node, vpg2ppg(lm, middle_pgi));
-                    rw_inside_page(node, buf, resbuf_t, meta, &tgeo, vpg_sz, mode);
+                    read_vpg(lm, resbuf_t, middle_pgi, 0, vpg_sz);
                     resbuf_t += vpg_sz;
                 }
             }
             // read end page
-            rw_inside_page(node, buf, resbuf_t, meta, &ppg_geo_end, poffset_end.offset_in_page + 1, mode);
-            resbuf_t += (poffset_end.offset_in_page + 1);
+            read_vpg(lm, resbuf_t, vpg_i_end, 0, voffset_end.offset_in_page + 1);
+            resbuf_t += (voffset_end.offset_in_page + 1);
+        }
+    } else if (mode == TRIM_MODE) {
+        uint64_t first, end, vpg_i;
+        if (!rw_trim_range(meta, offset, size, &first, &end))
+            return 0;
+        // same as the abandon loop of garbage_collection, no flash I/O
+        for (vpg_i = first; vpg_i < end; vpg_i++) {
+            uint64_t oldppg = vpg2ppg(lm, vpg_i);
+            if (oldppg == meta->total_pagenum)
+                continue;
+            set_pg_state(meta, oldppg, PAGE_ABANDONED);
+            lm->dirty_pg_count--;
+            lm->abandoned_pg_count++;
+            map_set(lm, vpg_i, meta->total_pagenum);
+            set_ppg2vpg(lm, oldppg, meta->total_pagenum);
+            abandon_page(lm, vpg2vblk(node, oldppg));
+            meta->trim_valid++;
         }
     } else if (mode == WRITE_MODE) {
         struct nodegeoaddr vpg_geo_begin = vpg2geoaddr(node, vpg_i_begin);
@@ -370,11 +1146,18 @@ static int iterate_ls_io(struct fox_node* node, struct fox_blkbuf* buf, struct r
         struct nodegeoaddr ppg_geo_end = vaddr2paddr(lm, &vpg_geo_end);
         uint8_t* resbuf_t = resbuf;
         // read first and last pages (if necessary) before GC!
-        if (isalloc(lm, vpg_i_begin) && (((vpg_i_begin == vpg_i_end) && (voffset_begin.offset_in_page != 0 || voffset_end.offset_in_page != vpg_sz - 1)) || ((vpg_i_begin < vpg_i_end) && (voffset_begin.offset_in_page != 0))))
+        if (isalloc(lm, vpg_i_begin) && (((vpg_i_begin == vpg_i_end) && (voffset_begin.offset_in_page != 0 || voffset_end.offset_in_page != vpg_sz - 1)) || ((vpg_i_begin < vpg_i_end) && (voffset_begin.offset_in_page != 0)))) {
+            user_pu(lm, &ppg_geo_begin);
             rw_inside_page(node, buf, meta->begin_pagebuf, meta, &ppg_geo_begin, vpg_sz, READ_MODE);
-        if (isalloc(lm, vpg_i_end) && ((vpg_i_begin < vpg_i_end) && (voffset_end.offset_in_page != vpg_sz - 1)))
+        }
+        if (isalloc(lm, vpg_i_end) && ((vpg_i_begin < vpg_i_end) && (voffset_end.offset_in_page != vpg_sz - 1))) {
+            user_pu(lm, &ppg_geo_end);
             rw_inside_page(node, buf, meta->end_pagebuf, meta, &ppg_geo_end, vpg_sz, READ_MODE);
-        while (lm->clean_pg_count < vpg_i_end - vpg_i_begin + 1) {
+        }
+        if (lm->nospace)
+            return 1;
+        lm->user_pg_count += vpg_i_end - vpg_i_begin + 1;
+        while (lm->clean_pg_count < vpg_i_end - vpg_i_begin + 1 && !lm->nospace) {
             garbage_collection(lm, vpg_i_begin, vpg_i_end);
         }
         // read or write...
@@ -383,6 +1166,8 @@ static int iterate_ls_io(struct fox_node* node, struct fox_blkbuf* buf, struct r
             }
             // alloc a new page here
             uint64_t newppg = alloc_gc(lm, vpg_i_begin, vpg_i_begin, vpg_i_end);
+            if (newppg == meta->total_pagenum)
+                return 1;
             struct nodegeoaddr newppgaddr = vpg2geoaddr(node, newppg);
             memcpy(meta->begin_pagebuf + voffset_begin.offset_in_page, resbuf_t, size);
             rw_inside_page(node, buf, meta->begin_pagebuf, meta, &newppgaddr, vpg_sz, mode);
@@ -392,6 +1177,8 @@ static int iterate_ls_io(struct fox_node* node, struct fox_blkbuf* buf, struct r
             if (isalloc(lm, vpg_i_begin) && (voffset_begin.offset_in_page != 0)) {
             }
             uint64_t newppg = alloc_gc(lm, vpg_i_begin, vpg_i_begin, vpg_i_end);
+            if (newppg == meta->total_pagenum)
+                return 1;
             struct nodegeoaddr newppgaddr = vpg2geoaddr(node, newppg);
             memcpy(meta->begin_pagebuf + voffset_begin.offset_in_page, resbuf_t, vpg_sz - voffset_begin.offset_in_page);
             rw_inside_page(node, buf, meta->begin_pagebuf, meta, &newppgaddr, vpg_sz, mode);
@@ -401,6 +1188,8 @@ static int iterate_ls_io(struct fox_node* node, struct fox_blkbuf* buf, struct r
                 uint64_t middle_pgi;
                 for (middle_pgi = vpg_i_begin + 1; middle_pgi < vpg_i_end; middle_pgi++) {
                     newppg = alloc_gc(lm, middle_pgi, 1, 0);
+                    if (newppg == meta->total_pagenum)
+                        return 1;
                     newppgaddr = vpg2geoaddr(node, newppg);
                     rw_inside_page(node, buf, resbuf_t, meta, &newppgaddr, vpg_sz, mode);
                     resbuf_t += vpg_sz;
@@ -410,15 +1199,49 @@ static int iterate_ls_io(struct fox_node* node, struct fox_blkbuf* buf, struct r
             if (isalloc(lm, vpg_i_end) && (voffset_end.offset_in_page != vpg_sz - 1)) {
             }
             newppg = alloc_gc(lm, vpg_i_end, 1, 0);
+            if (newppg == meta->total_pagenum)
+                return 1;
             newppgaddr = vpg2geoaddr(node, newppg);
             memcpy(meta->end_pagebuf, resbuf_t, voffset_end.offset_in_page + 1);
             rw_inside_page(node, buf, meta->end_pagebuf, meta, &newppgaddr, vpg_sz, mode);
             resbuf_t += (voffset_end.offset_in_page + 1);
         }
     }
+    rw_dftl_evict(&(lm->map));
     return 0;
 }
 
+static int map_tp_read(void* ctx, uint64_t ppg, uint8_t* data) {
+    struct ls_meta* lm = (struct ls_meta*)ctx;
+    struct nodegeoaddr geo = vpg2geoaddr(lm->meta->node, ppg);
+    return rw_inside_page(lm->meta->node, lm->blockbuf, data, lm->meta, &geo, lm->meta->vpg_sz, READ_MODE);
+}
+
+// called by rw_dftl_evict between I/Os, may run GC for room
+static int map_tp_write(void* ctx, uint64_t t, uint8_t* data) {
+    struct ls_meta* lm = (struct ls_meta*)ctx;
+    uint64_t id = rw_dftl_tp_id(&(lm->map), t);
+    uint64_t newppg = allocate_page(lm, id, 1, 1);
+    while (newppg == lm->meta->total_pagenum) {
+        uint64_t clean = lm->clean_pg_count;
+        garbage_collection(lm, 1, 0);
+        if (lm->clean_pg_count == clean)
+            return 1;
+        newppg = allocate_page(lm, id, 1, 1);
+    }
+    struct nodegeoaddr geo = vpg2geoaddr(lm->meta->node, newppg);
+    int src = rw_prog_src(lm->meta, RW_PROG_MAP);
+    int ret = rw_inside_page(lm->meta->node, lm->blockbuf, data, lm->meta, &geo, lm->meta->vpg_sz, WRITE_MODE);
+    rw_prog_src(lm->meta, src);
+    return ret;
+}
+
+// engine entry of the write buffer
+static int ls_io(void* ctx, uint8_t* data, uint64_t offset, uint64_t size, int mode) {
+    struct ls_meta* lm = (struct ls_meta*)ctx;
+    return iterate_ls_io(lm->meta->node, lm->blockbuf, lm->meta, lm, data, offset, size, mode);
+}
+
 static int rewrite_ls_start (struct fox_node *node)
 {
     node->stats.pgs_done = 0;
@@ -428,9 +1251,23 @@ static int rewrite_ls_start (struct fox_node *node)
         goto OUT;
 
     struct rewrite_meta meta;
-    init_rewrite_meta(node, &meta);
+    if (init_rewrite_meta(node, &meta))
+        goto OUT;
     struct ls_meta lm;
-    init_ls_meta(&meta, &nbuf, &lm);
+    memset(&lm, 0, sizeof(struct ls_meta));
+    if (init_ls_meta(&meta, &nbuf, &lm)) {
+        // lm was zeroed, free_ls_meta only frees what init_ls_meta got to
+        free_ls_meta(&lm);
+        free_rewrite_meta(&meta);
+        fox_free_blkbuf (&nbuf, 1);
+        goto OUT;
+    }
+    struct rw_rcache rc;
+    struct rw_wbuf wb;
+    if (rw_rcache_init(&rc, &meta, node->wl->rcache_pgs, node->wl->rcache_policy, node->wl->readahead, ls_io, &lm))
+        goto OUT;
+    if (rw_wbuf_init(&wb, &meta, node->wl->wbuf_pgs, rw_rcache_io, &rc))
+        goto OUT;
 
     uint64_t max_iosize = 0;
     uint64_t t = 0;
@@ -441,8 +1278,14 @@ static int rewrite_ls_start (struct fox_node *node)
     uint8_t* databuf = (uint8_t*)calloc(max_iosize, sizeof(uint8_t));
     struct timeval tvalst, tvaled;
 
+    if (rw_ckpt_start(&(lm.ckpt)))
+        printf(" Node %d: cannot write the first checkpoint.\n", node->nid);
+
     fox_start_node (node);
 
+    if (bg_gc_start(&lm))
+        printf(" Node %d: cannot start background GC.\n", node->nid);
+
     for (t = 0; t < meta.ioseqlen; t++) {
         if (t % 100 == 0) {
             printf("%d/%d\n", t, meta.ioseqlen);
@@ -452,12 +1295,30 @@ static int rewrite_ls_start (struct fox_node *node)
             mode = READ_MODE;
         else if (meta.ioseq[t].iotype == 'w')
             mode = WRITE_MODE;
+        else if (meta.ioseq[t].iotype == 't')
+            mode = TRIM_MODE;
 
         gettimeofday(&tvalst, NULL);
-        iterate_ls_io(node, &nbuf, &meta, &lm, databuf, meta.ioseq[t].offset, meta.ioseq[t].size, mode);
+        pthread_mutex_lock(&lm.mutex);
+        lm.io_stamp++;
+        gc_incremental(&lm, mode);
+        rw_wbuf_io(&wb, databuf, meta.ioseq[t].offset, meta.ioseq[t].size, mode);
+        if (lm.nospace) {
+            pthread_mutex_unlock(&lm.mutex);
+            printf(" Node %d: no room left for host data, %" PRIu64 " blocks retired, run stopped at I/O %" PRIu64 "/%" PRIu64 "\n",
+                    node->nid, meta.bad_retired, t, meta.ioseqlen);
+            break;
+        }
+        rw_ckpt_tick(&(lm.ckpt));
         gettimeofday(&tvaled, NULL);
         // record time
         meta.ioseq[t].exetime = ((uint64_t)(tvaled.tv_sec - tvalst.tv_sec) * 1000000L + tvaled.tv_usec) - tvalst.tv_usec;
+        // readahead is timed apart from the I/O, see rw_rcache_print
+        rw_rcache_prefetch(&rc);
+        meta.ioseq[t].cache_lookups = rc.lookups;
+        meta.ioseq[t].cache_hits = rc.hits;
+        meta.ioseq[t].cache_saved = rc.saved + rc.rmw_saved;
+        rw_waf_record(&meta, &meta.ioseq[t]);
         // record benefit / cost
         meta.ioseq[t].nabandoned = lm.abandoned_pg_count;
         meta.ioseq[t].ndirty = lm.dirty_pg_count;
@@ -475,11 +1336,39 @@ static int rewrite_ls_start (struct fox_node *node)
         meta.ioseq[t].erase_t = st->erase_t;
         meta.ioseq[t].read_t = st->read_t;
         meta.ioseq[t].write_t = st->write_t;
+        pthread_mutex_unlock(&lm.mutex);
     }
+    // no room for the buffered pages either, they are not written
+    pthread_mutex_lock(&lm.mutex);
+    if (!lm.nospace)
+        rw_wbuf_drain(&wb);
+    pthread_mutex_unlock(&lm.mutex);
+    bg_gc_stop(&lm);
     fox_end_node (node);
 
     write_meta_stats(&meta);
+    rw_waf_print(&meta, gc_policy_name(node->wl->gc_policy));
+    gc_print_latency(node, &meta, lm.gc_count, lm.inc_gc_count, lm.bg_gc_count);
+    if (node->wl->gc_bg_low)
+        printf(" Node %d: background GC victims on a PU of user I/O: %" PRIu64 " of %" PRIu64 "\n",
+                node->nid, lm.bg_busy_victims, lm.bg_gc_count);
+    if (lm.nstreams > 1 || lm.gc_stream)
+        print_streams(&lm);
+    if (lm.wl_spread)
+        print_wear_level(&lm);
+    rw_batch_print(&(lm.batch));
+    rw_dftl_print(&(lm.map));
+    rw_ckpt_print(&(lm.ckpt));
+    rw_oob_print(&meta);
+    rw_ckpt_recover(&(lm.ckpt));
+    rw_wbuf_print(&wb);
+    rw_rcache_print(&rc);
+    rw_trim_print(&meta);
+    rw_bad_print(&meta);
+    rw_wear_print(&meta);
 
+    rw_wbuf_free(&wb);
+    rw_rcache_free(&rc);
     fox_free_blkbuf (&nbuf, 1);
     free(databuf);
     free_rewrite_meta(&meta);
@@ -487,7 +1376,7 @@ static int rewrite_ls_start (struct fox_node *node)
 
     printf("\n[%" PRId64 ", %" PRId64 "]\n", lm.map_change_count, lm.map_set_count);
 
-    return 0;
+    return lm.nospace ? -1 : 0;
 
 OUT:
     return -1;
@@ -33,6 +33,11 @@
  * Write like log-structured file systems;
  * Erase when garbage collection.
  * GC: always choose 
+ * Merges copy pages in batches (fox-rewrite-batch.c).
+ * --hybrid fast replaces the log block of each data superblock with one
+ * sequential log block and a fully associative random log area, see
+ * alloc_page_fast.
+ * --log-adapt resizes the log pool at runtime, see log_pool_adapt.
  * Written by Chuizheng Meng <mengcz13@mails.tsinghua.edu.cn>
  */
 
@@ -47,7 +52,8 @@
 struct lbpm_entry {
     uint64_t vsblk_i;
     uint64_t psblk_i;
-    uint64_t* vpg2ppg; // page-aligend mapping inside a superblock
+    rw_pgno* vpg2ppg; // page-aligend mapping inside a superblock
+    uint64_t nmisplaced; // mapped pages not at their own offset, 0 means the log block can be switched
 };
 
 struct sblkaddr {
@@ -69,6 +75,7 @@ struct logblockaddr {
 struct sblk_meta {
     uint64_t ndirtypgs;
     uint64_t nabandonedpgs;
+    int log; // in use as a --hybrid fast log block, GC leaves it alone
 };
 
 struct sblk_entry {
@@ -105,14 +112,55 @@ struct ls_meta {
     uint64_t* vsblk2psblk;
     uint64_t* psblk2vsblk;
     struct lbpm_entry* lbpm; // log block page map table
+    uint64_t* vsblk2lbpm; // vsblk -> index in lbpm, lbpm_entry_num if none
+    uint64_t* lbpm_free; // stack of unused lbpm entries
+    uint64_t lbpm_nfree;
+    uint64_t* lbpm_fitmap; // bit set for used entries with nmisplaced == 0
     struct sblk_list* sblk_lists; // 1 for each mPU
     struct sblk_entry* sblk_entries;
     struct sblk_meta* sblk_metas; // storing meta info of blocks
     uint64_t next_mpu_i; // used to iterate over chs and luns
     uint8_t* sblkbuf;
     uint64_t* sblkvpgs;
+    struct nodegeoaddr* sblkblks; // blocks of an erase_sb
+    uint8_t* sblk_bad; // superblocks with a missing or dead block, never handed out
+    int nospace; // GC freed no superblock, writes fail and the run stops
+    struct rw_batch batch; // merge migration
+    struct rw_copy* copies;
+    // --hybrid fast
+    int fast;
+    uint64_t sw_vsblk; // owner of the sequential log block, sblk_ntotal if none
+    uint64_t sw_psblk;
+    uint64_t sw_next; // the only page offset it accepts next
+    rw_pgno* lpm; // vpg -> page in the random log area, total_pagenum if none
+    rw_pgno* lpm_owner; // page of the random log area -> vpg
+    uint64_t* rwlog; // random log superblocks, ring, oldest first
+    uint64_t rwlog_max;
+    uint64_t rwlog_head;
+    uint64_t rwlog_n;
+    // merges by type, pages copied by partial and full merges
+    uint64_t merge_switch;
+    uint64_t merge_partial;
+    uint64_t merge_partial_pgs;
+    uint64_t merge_full;
+    uint64_t merge_full_pgs;
+    // log pool, lbpm_entry_num / rwlog_max are the allocated sizes
+    uint64_t log_limit; // log superblocks in use at most
+    uint64_t rwlog_lim; // --hybrid fast random log area, from log_limit
+    // --log-adapt
+    uint64_t log_min;
+    uint64_t log_max;
+    int log_dir; // +1 or -1, next resize step
+    double win_cost; // merge pages per user page of the last window, < 0 none
+    uint64_t win_user; // user and merge programs at the start of the window
+    uint64_t win_merge;
+    uint64_t log_grows;
+    uint64_t log_shrinks;
 };
 
+// free superblocks kept for a merge destination and a new log block
+#define LOG_ADAPT_RESERVE 2
+
 static struct nodegeoaddr sblkaddr2geoaddr(struct ls_meta* lm, struct sblkaddr* sblka) {
     struct nodegeoaddr res;
     struct fox_node* node = lm->meta->node;
@@ -228,8 +276,24 @@ static int init_ls_meta(struct rewrite_meta* meta, struct fox_blkbuf* blockbuf,
     uint64_t wl_logblknum = meta->node->wl->logblknum;
     lm->sblk_npus = (wl_npus == 0) ? 1 : wl_npus;
     lm->sblk_nblks = (wl_nblks == 0) ? 1 : wl_nblks;
-    lm->lbpm_entry_num = (wl_logblknum == 0) ? 8 : wl_logblknum;
-    printf("Superblock: %" PRId64 " PUs, %" PRId64 " BLKs, %" PRId64 " LOG BLOCKS\n", lm->sblk_npus, lm->sblk_nblks, lm->lbpm_entry_num);
+    lm->log_limit = (wl_logblknum == 0) ? 8 : wl_logblknum;
+    lm->log_min = meta->node->wl->log_min;
+    lm->log_max = meta->node->wl->log_max;
+    if (lm->log_min) {
+        // tables sized for the largest pool, -L is where it starts
+        if (lm->log_limit < lm->log_min)
+            lm->log_limit = lm->log_min;
+        if (lm->log_limit > lm->log_max)
+            lm->log_limit = lm->log_max;
+        lm->lbpm_entry_num = lm->log_max;
+    } else {
+        lm->lbpm_entry_num = lm->log_limit;
+    }
+    lm->log_dir = 1;
+    lm->win_cost = -1;
+    lm->win_user = lm->win_merge = 0;
+    lm->log_grows = lm->log_shrinks = 0;
+    printf("Superblock: %" PRId64 " PUs, %" PRId64 " BLKs, %" PRId64 " LOG BLOCKS\n", lm->sblk_npus, lm->sblk_nblks, lm->log_limit);
     lm->sblk_tblks = lm->sblk_npus * lm->sblk_nblks;
     lm->sblk_tpgs = lm->sblk_tblks * meta->node->npgs;
     printf("One superblock: %" PRId64 " blocks, %" PRId64 " pages\n", lm->sblk_tblks, lm->sblk_tpgs);
@@ -238,7 +302,7 @@ static int init_ls_meta(struct rewrite_meta* meta, struct fox_blkbuf* blockbuf,
     lm->blockbuf = blockbuf;
     lm->dirty_pg_count = 0;
     lm->abandoned_pg_count = 0;
-    lm->clean_pg_count = meta->total_pagenum;
+    lm->clean_pg_count = meta->total_pagenum - meta->node->lost_pgs;
     lm->map_change_count = 0;
     lm->map_set_count = 0;
     lm->gc_count = 0;
@@ -247,9 +311,41 @@ static int init_ls_meta(struct rewrite_meta* meta, struct fox_blkbuf* blockbuf,
     lm->vsblk2psblk = (uint64_t*)calloc(lm->sblk_ntotal, sizeof(uint64_t));
     lm->psblk2vsblk = (uint64_t*)calloc(lm->sblk_ntotal, sizeof(uint64_t));
     lm->lbpm = (struct lbpm_entry*)calloc(lm->lbpm_entry_num, sizeof(struct lbpm_entry)); 
+    lm->vsblk2lbpm = (uint64_t*)calloc(lm->sblk_ntotal, sizeof(uint64_t));
+    lm->lbpm_free = (uint64_t*)calloc(lm->lbpm_entry_num, sizeof(uint64_t));
+    lm->lbpm_fitmap = (uint64_t*)calloc((lm->lbpm_entry_num + 63) / 64, sizeof(uint64_t));
     lm->next_mpu_i = 0;
     lm->sblkbuf = (uint8_t*)calloc(lm->sblk_tblks * meta->node->npgs * meta->vpg_sz, sizeof(uint8_t));
     lm->sblkvpgs = (uint64_t*)calloc(lm->sblk_tblks * meta->node->npgs, sizeof(uint64_t));
+    lm->sblkblks = (struct nodegeoaddr*)calloc(lm->sblk_tblks, sizeof(struct nodegeoaddr));
+    lm->copies = (struct rw_copy*)calloc(lm->sblk_tpgs, sizeof(struct rw_copy));
+    if (lm->sblkblks == NULL || rw_batch_init(&(lm->batch), meta->node, meta, blockbuf, lm->sblk_tpgs, lm->sblk_npus * 4))
+        return 1;
+    lm->merge_switch = 0;
+    lm->merge_partial = 0;
+    lm->merge_partial_pgs = 0;
+    lm->merge_full = 0;
+    lm->merge_full_pgs = 0;
+    lm->fast = (meta->node->wl->hybrid == HYBRID_FAST);
+    lm->sw_vsblk = lm->sw_psblk = lm->sblk_ntotal;
+    lm->sw_next = 0;
+    lm->lpm = lm->lpm_owner = NULL;
+    lm->rwlog = NULL;
+    if (lm->fast) {
+        // -L log blocks, one of them sequential
+        lm->rwlog_max = (lm->lbpm_entry_num > 2) ? lm->lbpm_entry_num - 1 : 1;
+        lm->rwlog_lim = (lm->log_limit > 2) ? lm->log_limit - 1 : 1;
+        lm->rwlog_head = 0;
+        lm->rwlog_n = 0;
+        lm->rwlog = (uint64_t*)calloc(lm->rwlog_max, sizeof(uint64_t));
+        lm->lpm = (rw_pgno*)malloc(meta->total_pagenum * sizeof(rw_pgno));
+        lm->lpm_owner = (rw_pgno*)calloc(meta->total_pagenum, sizeof(rw_pgno));
+        if (!lm->rwlog || !lm->lpm || !lm->lpm_owner)
+            return 1;
+        uint64_t i;
+        for (i = 0; i < meta->total_pagenum; i++)
+            lm->lpm[i] = meta->total_pagenum;
+    }
 
     lm->sblk_metas = (struct sblk_meta*)calloc(lm->sblk_ntotal, sizeof(struct sblk_meta));
     lm->sblk_entries = (struct sblk_entry*)calloc(lm->sblk_ntotal, sizeof(struct sblk_entry));
@@ -268,7 +364,8 @@ static int init_ls_meta(struct rewrite_meta* meta, struct fox_blkbuf* blockbuf,
             struct sblk_entry* tsblk_entry = &(lm->sblk_entries[sblk_i]);
             tsblk_entry->sblk_i = sblk_i;
             tsblk_entry->meta = &(lm->sblk_metas[sblk_i]);
-            TAILQ_INSERT_TAIL(&(listi->empty_sblks), tsblk_entry, pt);
+            if (!lm->sblk_bad[sblk_i])
+                TAILQ_INSERT_TAIL(&(listi->empty_sblks), tsblk_entry, pt);
         }
         listi->active_sblk = NULL;
     }
@@ -280,13 +377,17 @@ static int init_ls_meta(struct rewrite_meta* meta, struct fox_blkbuf* blockbuf,
     int vpbi;
     for (vpbi = 0; vpbi < lm->sblk_ntotal; vpbi++) {
         lm->psblk2vsblk[vpbi] = lm->sblk_ntotal;
+        lm->vsblk2lbpm[vpbi] = lm->lbpm_entry_num;
     }
     int lbpmi;
+    lm->lbpm_nfree = 0;
     for (lbpmi = 0; lbpmi < lm->lbpm_entry_num; lbpmi++) {
         struct lbpm_entry* le = &(lm->lbpm[lbpmi]);
         le->vsblk_i = lm->sblk_ntotal;
         le->psblk_i = lm->sblk_ntotal;
-        le->vpg2ppg = (uint64_t*)calloc(lm->sblk_tpgs, sizeof(uint64_t));
+        le->nmisplaced = 0;
+        lm->lbpm_free[lm->lbpm_nfree++] = lbpmi;
+        le->vpg2ppg = (rw_pgno*)calloc(lm->sblk_tpgs, sizeof(rw_pgno));
         int lbpmi_pgi;
         for (lbpmi_pgi = 0; lbpmi_pgi < lm->sblk_tpgs; lbpmi_pgi++)
             le->vpg2ppg[lbpmi_pgi] = lm->sblk_tpgs;
@@ -302,10 +403,20 @@ static int free_ls_meta(struct ls_meta* lm) {
     free(lm->sblk_lists);
     free(lm->sblkbuf);
     free(lm->sblkvpgs);
+    free(lm->copies);
+    free(lm->sblkblks);
+    free(lm->sblk_bad);
+    rw_batch_free(&(lm->batch));
     int lbpmi;
-    for (lbpmi = 0; lbpmi < lm->lbpm_entry_num; lbpmi++)
+    for (lbpmi = 0; lm->lbpm && lbpmi < lm->lbpm_entry_num; lbpmi++)
         free(lm->lbpm[lbpmi].vpg2ppg);
     free(lm->lbpm);
+    free(lm->vsblk2lbpm);
+    free(lm->lbpm_free);
+    free(lm->lbpm_fitmap);
+    free(lm->lpm);
+    free(lm->lpm_owner);
+    free(lm->rwlog);
     return 0;
 }
 
@@ -317,26 +428,115 @@ static uint64_t psblk2vsblk(struct ls_meta* lm, uint64_t psbi) {
     return lm->psblk2vsblk[psbi];
 }
 
+// log block page map lookup, O(1) through vsblk2lbpm
+static struct lbpm_entry* find_lbpm(struct ls_meta* lm, uint64_t vsblki) {
+    uint64_t lbpmi = lm->vsblk2lbpm[vsblki];
+    return (lbpmi == lm->lbpm_entry_num) ? NULL : &(lm->lbpm[lbpmi]);
+}
+
+static void update_lbpm_fit(struct ls_meta* lm, struct lbpm_entry* le) {
+    uint64_t lbpmi = le - lm->lbpm;
+    if (le->vsblk_i != lm->sblk_ntotal && le->nmisplaced == 0)
+        lm->lbpm_fitmap[lbpmi / 64] |= (1ULL << (lbpmi % 64));
+    else
+        lm->lbpm_fitmap[lbpmi / 64] &= ~(1ULL << (lbpmi % 64));
+}
+
+static void set_lbpm_page(struct ls_meta* lm, struct lbpm_entry* le, uint64_t insb_pg_i, uint64_t pinsb_pg_i) {
+    uint64_t old = le->vpg2ppg[insb_pg_i];
+    if (old < lm->sblk_tpgs && old != insb_pg_i)
+        le->nmisplaced--;
+    if (pinsb_pg_i < lm->sblk_tpgs && pinsb_pg_i != insb_pg_i)
+        le->nmisplaced++;
+    le->vpg2ppg[insb_pg_i] = pinsb_pg_i;
+    update_lbpm_fit(lm, le);
+}
+
+static struct lbpm_entry* bind_lbpm(struct ls_meta* lm, uint64_t vsblki, uint64_t psblki) {
+    struct lbpm_entry* le = &(lm->lbpm[lm->lbpm_free[--lm->lbpm_nfree]]);
+    le->vsblk_i = vsblki;
+    le->psblk_i = psblki;
+    lm->vsblk2lbpm[vsblki] = le - lm->lbpm;
+    update_lbpm_fit(lm, le);
+    return le;
+}
+
+static void release_lbpm(struct ls_meta* lm, struct lbpm_entry* le) {
+    uint64_t pginsbi;
+    lm->vsblk2lbpm[le->vsblk_i] = lm->lbpm_entry_num;
+    le->vsblk_i = lm->sblk_ntotal;
+    le->psblk_i = lm->sblk_ntotal;
+    for (pginsbi = 0; pginsbi < lm->sblk_tpgs; pginsbi++)
+        le->vpg2ppg[pginsbi] = lm->sblk_tpgs;
+    le->nmisplaced = 0;
+    update_lbpm_fit(lm, le);
+    lm->lbpm_free[lm->lbpm_nfree++] = le - lm->lbpm;
+}
+
+// first entry that can be switched into a data block, the first used one if none
+static struct lbpm_entry* first_fit_lbpm(struct ls_meta* lm) {
+    uint64_t wi;
+    for (wi = 0; wi < (lm->lbpm_entry_num + 63) / 64; wi++)
+        if (lm->lbpm_fitmap[wi])
+            return &(lm->lbpm[wi * 64 + __builtin_ctzll(lm->lbpm_fitmap[wi])]);
+    for (wi = 0; lm->lbpm[wi].vsblk_i == lm->sblk_ntotal; wi++)
+        ;
+    return &(lm->lbpm[wi]);
+}
+
+// first page of a superblock, its pages are contiguous
+static uint64_t sblk_first_pg(struct ls_meta* lm, uint64_t sblki) {
+    struct sblkaddr ta = sblki2sblkaddr(lm, sblki);
+    return sblkaddr2vpgi(lm, &ta);
+}
+
+/*
+ * --hybrid fast lookup, the newest copy of vpgi: the random log area, then
+ * the sequential log block, then the data superblock. Older copies are
+ * abandoned when a page is written to a log, apart from the data
+ * superblock, which holds stale pages until its merge. Returns
+ * total_pagenum for a page never written or trimmed.
+ */
+static uint64_t fast_lookup(struct ls_meta* lm, uint64_t vpgi) {
+    if (lm->lpm[vpgi] != lm->meta->total_pagenum)
+        return lm->lpm[vpgi];
+    uint64_t vsblki = vpgi2sblki(lm, vpgi);
+    uint64_t insbpgi = vpgi - sblk_first_pg(lm, vsblki);
+    uint64_t ppgi;
+    if (lm->sw_vsblk == vsblki && insbpgi < lm->sw_next) {
+        ppgi = sblk_first_pg(lm, lm->sw_psblk) + insbpgi;
+        if (get_pg_state(lm->meta, ppgi) == PAGE_DIRTY)
+            return ppgi;
+    }
+    if (lm->vsblk2psblk[vsblki] != lm->sblk_ntotal) {
+        ppgi = sblk_first_pg(lm, lm->vsblk2psblk[vsblki]) + insbpgi;
+        if (get_pg_state(lm->meta, ppgi) == PAGE_DIRTY)
+            return ppgi;
+    }
+    return lm->meta->total_pagenum;
+}
+
 static struct nodegeoaddr vaddr2paddr(struct ls_meta* lm, struct nodegeoaddr* vaddr) {
+    if (lm->fast) {
+        uint64_t ppgi = fast_lookup(lm, geoaddr2vpg_sb(lm, vaddr));
+        if (ppgi != lm->meta->total_pagenum) {
+            struct nodegeoaddr paddr = vpg2geoaddr_sb(lm, ppgi);
+            paddr.offset_in_page = vaddr->offset_in_page;
+            return paddr;
+        }
+    }
     struct sblkaddr vsblkaddr = geoaddr2sblkaddr(lm, vaddr);
     struct logblockaddr vlogblockaddr = sblkaddr2logblockaddr(lm, &vsblkaddr);
     uint64_t vsblki = vlogblockaddr.sblk_i;
     // first search in log blocks
-    int lbpmi;
-    struct logblockaddr plogblockaddr;
-    plogblockaddr.sblk_i = lm->sblk_ntotal;
-    plogblockaddr.insb_pg_i = lm->sblk_tpgs;
-    plogblockaddr.offset_in_page = vlogblockaddr.offset_in_page;
-    for (lbpmi = 0; lbpmi < lm->lbpm_entry_num; lbpmi++) {
-        if (lm->lbpm[lbpmi].vsblk_i == vsblki) {
-            uint64_t pinsb_pg_i = lm->lbpm[lbpmi].vpg2ppg[vlogblockaddr.insb_pg_i];
-            if (pinsb_pg_i < lm->sblk_tpgs) {
-                plogblockaddr.sblk_i = lm->lbpm[lbpmi].psblk_i;
-                plogblockaddr.insb_pg_i = pinsb_pg_i;
-                struct sblkaddr psblkaddr = logblockaddr2sblkaddr(lm, &plogblockaddr);
-                return sblkaddr2geoaddr(lm, &psblkaddr);
-            }
-        }
+    struct lbpm_entry* le = find_lbpm(lm, vsblki);
+    if (le != NULL && le->vpg2ppg[vlogblockaddr.insb_pg_i] < lm->sblk_tpgs) {
+        struct logblockaddr plogblockaddr;
+        plogblockaddr.sblk_i = le->psblk_i;
+        plogblockaddr.insb_pg_i = le->vpg2ppg[vlogblockaddr.insb_pg_i];
+        plogblockaddr.offset_in_page = vlogblockaddr.offset_in_page;
+        struct sblkaddr psblkaddr = logblockaddr2sblkaddr(lm, &plogblockaddr);
+        return sblkaddr2geoaddr(lm, &psblkaddr);
     }
     // then search in data blocks
     uint64_t psblki = vsblk2psblk(lm, vsblki);
@@ -364,32 +564,43 @@ static int isalloc_sbi(struct ls_meta* lm, uint64_t vsbi) {
 }*/
 
 static int isalloc(struct ls_meta* lm, uint64_t vpgi) {
+    if (lm->fast)
+        return (fast_lookup(lm, vpgi) != lm->meta->total_pagenum);
     struct sblkaddr vpg_sblkaddr = vpgi2sblkaddr(lm, vpgi);
     struct logblockaddr vpg_logblockaddr = sblkaddr2logblockaddr(lm, &vpg_sblkaddr);
     uint64_t vsblki = vpg_logblockaddr.sblk_i;
     // first search in log blocks
-    int lbpmi;
-    for (lbpmi = 0; lbpmi < lm->lbpm_entry_num; lbpmi++) {
-        if (lm->lbpm[lbpmi].vsblk_i == vsblki) {
-            uint64_t pinsb_pg_i = lm->lbpm[lbpmi].vpg2ppg[vpg_logblockaddr.insb_pg_i];
-            if (pinsb_pg_i < lm->sblk_tpgs) {
-                return 1;
-            }
-        }
-    }
+    struct lbpm_entry* le = find_lbpm(lm, vsblki);
+    if (le != NULL && le->vpg2ppg[vpg_logblockaddr.insb_pg_i] < lm->sblk_tpgs)
+        return 1;
     // then search in data blocks
     uint64_t psblki = vsblk2psblk(lm, vsblki);
     if (psblki == lm->sblk_ntotal)
         return 0;
     else {
+        // trimmed pages are abandoned in place
         uint64_t ppgi = vpg2ppg(lm, vpgi);
-        if (lm->meta->page_state[ppgi] == PAGE_CLEAN)
+        if (get_pg_state(lm->meta, ppgi) != PAGE_DIRTY)
             return 0;
         else
             return 1;
     }
 }
 
+static int rw_inside_page_sb(struct ls_meta* lm, struct fox_blkbuf* blockbuf, uint8_t* databuf, struct rewrite_meta* meta, struct nodegeoaddr* geoaddr, uint64_t size, int mode);
+
+// read part of a virtual page, pages never written read as zeros
+static int read_vpg(struct ls_meta* lm, struct fox_blkbuf* buf, uint8_t* databuf, struct rewrite_meta* meta, uint64_t vpg_i, uint64_t offset_in_page, uint64_t size) {
+    if (!isalloc(lm, vpg_i)) {
+        memset(databuf, 0, size);
+        return 0;
+    }
+    struct nodegeoaddr vaddr = vpg2geoaddr_sb(lm, vpg_i);
+    vaddr.offset_in_page = offset_in_page;
+    struct nodegeoaddr paddr = vaddr2paddr(lm, &vaddr);
+    return rw_inside_page_sb(lm, buf, databuf, meta, &paddr, size, READ_MODE);
+}
+
 static struct sblk_entry* find_next_free_sb(struct ls_meta* lm);
 
 static struct sblk_entry* gc_until_find_next_free_sb(struct ls_meta* lm);
@@ -405,65 +616,167 @@ static int abandon_sblk(struct ls_meta* lm, uint64_t data_psblk_i) {
     return 0;
 }
 
-static int check_datafit(struct ls_meta* lm, struct lbpm_entry* le) {
-    uint64_t pginsbi;
-    int datafit = 1;
-    for (pginsbi = 0; pginsbi < lm->sblk_tpgs; pginsbi++) {
-        if (le->vpg2ppg[pginsbi] < lm->sblk_tpgs && le->vpg2ppg[pginsbi] != pginsbi) {
-            datafit = 0;
-            break;
+// abandons a written physical page of any superblock
+static void abandon_ppg(struct ls_meta* lm, uint64_t ppgi) {
+    struct sblk_meta* sm = &(lm->sblk_metas[vpgi2sblki(lm, ppgi)]);
+    set_pg_state(lm->meta, ppgi, PAGE_ABANDONED);
+    sm->ndirtypgs--;
+    sm->nabandonedpgs++;
+    lm->dirty_pg_count--;
+    lm->abandoned_pg_count++;
+}
+
+// --hybrid fast trim, every copy of vpgi
+static int trim_page_fast(struct ls_meta* lm, uint64_t vpgi) {
+    uint64_t vsblki = vpgi2sblki(lm, vpgi);
+    uint64_t insbpgi = vpgi - sblk_first_pg(lm, vsblki);
+    uint64_t psblki = lm->vsblk2psblk[vsblki];
+    uint64_t ppgi;
+    int valid = 0;
+    if (lm->lpm[vpgi] != lm->meta->total_pagenum) {
+        abandon_ppg(lm, lm->lpm[vpgi]);
+        lm->lpm[vpgi] = lm->meta->total_pagenum;
+        valid = 1;
+    }
+    if (lm->sw_vsblk == vsblki && insbpgi < lm->sw_next) {
+        ppgi = sblk_first_pg(lm, lm->sw_psblk) + insbpgi;
+        if (get_pg_state(lm->meta, ppgi) == PAGE_DIRTY) {
+            abandon_ppg(lm, ppgi);
+            valid = 1;
         }
     }
-    return datafit;
+    if (psblki != lm->sblk_ntotal) {
+        ppgi = sblk_first_pg(lm, psblki) + insbpgi;
+        if (get_pg_state(lm->meta, ppgi) == PAGE_DIRTY) {
+            abandon_ppg(lm, ppgi);
+            if (lm->sblk_metas[psblki].ndirtypgs == 0) {
+                lm->vsblk2psblk[vsblki] = lm->sblk_ntotal;
+                lm->psblk2vsblk[psblki] = lm->sblk_ntotal;
+            }
+            valid = 1;
+        }
+    }
+    return valid;
 }
 
-static int check_clean_sblk(struct ls_meta* lm, uint64_t psblk_i) {
-    uint64_t pginsbi;
-    int clean = 1;
-    for (pginsbi = 0; pginsbi < lm->sblk_tpgs; pginsbi++) {
-        struct logblockaddr t_log;
-        t_log.sblk_i = psblk_i;
-        t_log.insb_pg_i = pginsbi;
-        t_log.offset_in_page = 0;
-        struct nodegeoaddr pgi_geo = logblockaddr2geoaddr(lm, &t_log);
-        uint64_t pgi = geoaddr2vpg_sb(lm, &pgi_geo);
-        if (lm->meta->page_state[pgi] != PAGE_CLEAN) {
-            printf("check new clean blk: dirty page at %" PRId64 "\n", pgi);
-            clean = 0;
+// abandons the page of a trimmed vpgi in its log block and data block
+static int trim_page(struct ls_meta* lm, uint64_t vpgi) {
+    if (lm->fast)
+        return trim_page_fast(lm, vpgi);
+    struct sblkaddr vsblkaddr = vpgi2sblkaddr(lm, vpgi);
+    struct logblockaddr vlogblockaddr = sblkaddr2logblockaddr(lm, &vsblkaddr);
+    uint64_t vsblki = vlogblockaddr.sblk_i;
+    uint64_t psblki = vsblk2psblk(lm, vsblki);
+    struct lbpm_entry* le = find_lbpm(lm, vsblki);
+    int valid = 0;
+    if (le != NULL && le->vpg2ppg[vlogblockaddr.insb_pg_i] < lm->sblk_tpgs) {
+        struct sblk_entry* logblk = &(lm->sblk_entries[le->psblk_i]);
+        struct logblockaddr plogblockaddr;
+        plogblockaddr.sblk_i = le->psblk_i;
+        plogblockaddr.insb_pg_i = le->vpg2ppg[vlogblockaddr.insb_pg_i];
+        plogblockaddr.offset_in_page = 0;
+        struct nodegeoaddr pgeo = logblockaddr2geoaddr(lm, &plogblockaddr);
+        set_pg_state(lm->meta, geoaddr2vpg_sb(lm, &pgeo), PAGE_ABANDONED);
+        set_lbpm_page(lm, le, vlogblockaddr.insb_pg_i, lm->sblk_tpgs);
+        logblk->meta->ndirtypgs--;
+        logblk->meta->nabandonedpgs++;
+        lm->dirty_pg_count--;
+        lm->abandoned_pg_count++;
+        // an empty log block is left to GC
+        if (logblk->meta->ndirtypgs == 0)
+            release_lbpm(lm, le);
+        valid = 1;
+    }
+    // the data block copy, stale or not
+    if (psblki != lm->sblk_ntotal) {
+        struct sblkaddr psblkaddr = sblki2sblkaddr(lm, psblki);
+        psblkaddr.inner_blk_i = vsblkaddr.inner_blk_i;
+        psblkaddr.inner_pu_i = vsblkaddr.inner_pu_i;
+        psblkaddr.pg_i = vsblkaddr.pg_i;
+        psblkaddr.offset_in_page = 0;
+        uint64_t ppgi = sblkaddr2vpgi(lm, &psblkaddr);
+        if (get_pg_state(lm->meta, ppgi) == PAGE_DIRTY) {
+            struct sblk_entry* datablk = &(lm->sblk_entries[psblki]);
+            set_pg_state(lm->meta, ppgi, PAGE_ABANDONED);
+            datablk->meta->ndirtypgs--;
+            datablk->meta->nabandonedpgs++;
+            lm->dirty_pg_count--;
+            lm->abandoned_pg_count++;
+            if (datablk->meta->ndirtypgs == 0) {
+                lm->vsblk2psblk[vsblki] = lm->sblk_ntotal;
+                lm->psblk2vsblk[psblki] = lm->sblk_ntotal;
+            }
+            valid = 1;
         }
     }
-    return clean;
+    return valid;
 }
 
-static int merge_cost(struct ls_meta* lm, struct lbpm_entry* le) {
-    int datafit = check_datafit(lm, le);
-    if (datafit == 1)
+/*
+ * The log block can become the data superblock when its pages are in place
+ * and the written part of it holds every valid page of the data superblock
+ * there; the data pages past it are copied in by merge_log_data. Data pages
+ * stay valid when the log gets a newer copy, so only the valid ones are
+ * checked against the log map, found a state word at a time.
+ */
+static int check_datafit(struct ls_meta* lm, struct lbpm_entry* le) {
+    if (le->nmisplaced > 0)
         return 0;
-    else
-        return lm->sblk_tpgs;
+    uint64_t data_psblk_i = lm->vsblk2psblk[le->vsblk_i];
+    if (data_psblk_i == lm->sblk_ntotal)
+        return 1;
+    struct sblk_meta* logm = &(lm->sblk_metas[le->psblk_i]);
+    uint64_t dfirst = sblk_first_pg(lm, data_psblk_i);
+    uint64_t dend = dfirst + logm->ndirtypgs + logm->nabandonedpgs;
+    uint64_t ppgi;
+    for (ppgi = next_pg_state(lm->meta, dfirst, dend, PAGE_DIRTY); ppgi < dend;
+            ppgi = next_pg_state(lm->meta, ppgi + 1, dend, PAGE_DIRTY))
+        if (le->vpg2ppg[ppgi - dfirst] != ppgi - dfirst)
+            return 0;
+    return 1;
 }
 
-static int rw_inside_page_sb(struct ls_meta* lm, struct fox_blkbuf* blockbuf, uint8_t* databuf, struct rewrite_meta* meta, struct nodegeoaddr* geoaddr, uint64_t size, int mode);
+static void add_copy(struct ls_meta* lm, uint64_t i, struct nodegeoaddr* src, struct nodegeoaddr* dst) {
+    struct rw_copy* cp = &(lm->copies[i]);
+    cp->src = *src;
+    cp->src_i = geoaddr2vpg_sb(lm, src);
+    cp->dst = *dst;
+    cp->dst_i = geoaddr2vpg_sb(lm, dst);
+}
 
 static int merge_log_data(struct ls_meta* lm, uint64_t vsblk_i) {
     // merge log block and data block of vsblk_i
     // there must be one mapping in log block page mapping!
-    uint64_t lbpmi;
-    struct lbpm_entry* le = NULL;
-    for (lbpmi = 0; lbpmi < lm->lbpm_entry_num; lbpmi++) {
-        if (lm->lbpm[lbpmi].vsblk_i == vsblk_i) {
-            le = &(lm->lbpm[lbpmi]);
-            break;
-        }
-    }
+    struct lbpm_entry* le = find_lbpm(lm, vsblk_i);
     uint64_t log_psblk_i = le->psblk_i;
     // check if log block can be directly used as data block
     int datafit = check_datafit(lm, le);
     // get data block
     uint64_t data_psblk_i = lm->vsblk2psblk[vsblk_i];
     if (datafit) {
-        // use log block directly as data block!
+        // use log block directly as data block, after a partial merge of
+        // the data pages past its written part
+        uint64_t ncopies = 0;
         if (data_psblk_i != lm->sblk_ntotal) {
+            struct sblk_meta* logm = &(lm->sblk_metas[log_psblk_i]);
+            uint64_t dfirst = sblk_first_pg(lm, data_psblk_i);
+            uint64_t lfirst = sblk_first_pg(lm, log_psblk_i);
+            uint64_t insbpgi;
+            for (insbpgi = logm->ndirtypgs + logm->nabandonedpgs; insbpgi < lm->sblk_tpgs; insbpgi++) {
+                if (get_pg_state(lm->meta, dfirst + insbpgi) != PAGE_DIRTY)
+                    continue;
+                struct nodegeoaddr srcaddr = vpg2geoaddr_sb(lm, dfirst + insbpgi);
+                struct nodegeoaddr dstaddr = vpg2geoaddr_sb(lm, lfirst + insbpgi);
+                add_copy(lm, ncopies++, &srcaddr, &dstaddr);
+            }
+            if (ncopies > 0) {
+                int src = rw_prog_src(lm->meta, RW_PROG_MERGE);
+                rw_batch_copy(&(lm->batch), lm->copies, ncopies);
+                rw_prog_src(lm->meta, src);
+            }
+            logm->ndirtypgs += ncopies;
+            lm->dirty_pg_count += ncopies;
+            lm->clean_pg_count -= ncopies;
             abandon_sblk(lm, data_psblk_i);
         }
         lm->vsblk2psblk[vsblk_i] = log_psblk_i;
@@ -472,9 +785,17 @@ static int merge_log_data(struct ls_meta* lm, uint64_t vsblk_i) {
             lm->map_change_count++;
         else
             lm->map_set_count++;
+        if (ncopies > 0) {
+            lm->merge_partial++;
+            lm->merge_partial_pgs += ncopies;
+        } else {
+            lm->merge_switch++;
+        }
     } else {
         struct sblk_entry* newsblk = gc_until_find_next_free_sb(lm);
-        uint64_t insbpgi;
+        if (newsblk == NULL)
+            return -1;
+        uint64_t insbpgi, ncopies = 0;
         struct logblockaddr t_logblk, t_datablk, t_targetblk;
         t_logblk.offset_in_page = t_datablk.offset_in_page = t_targetblk.offset_in_page = 0;
         t_logblk.sblk_i = log_psblk_i;
@@ -487,22 +808,24 @@ static int merge_log_data(struct ls_meta* lm, uint64_t vsblk_i) {
             if (le->vpg2ppg[insbpgi] < lm->sblk_tpgs) {
                 t_logblk.insb_pg_i = le->vpg2ppg[insbpgi];
                 srcaddr = logblockaddr2geoaddr(lm, &t_logblk);
-                rw_inside_page_sb(lm, lm->blockbuf, lm->meta->pagebuf, lm->meta, &srcaddr, lm->meta->vpg_sz, READ_MODE);
-                rw_inside_page_sb(lm, lm->blockbuf, lm->meta->pagebuf, lm->meta, &dstaddr, lm->meta->vpg_sz, WRITE_MODE);
+                add_copy(lm, ncopies++, &srcaddr, &dstaddr);
                 newsblk->meta->ndirtypgs++;
                 lm->dirty_pg_count++;
                 lm->clean_pg_count--;
             } else if (data_psblk_i != lm->sblk_ntotal) {
                 srcaddr = logblockaddr2geoaddr(lm, &t_datablk);
-                if (lm->meta->page_state[geoaddr2vpg_sb(lm, &srcaddr)] == PAGE_DIRTY) {
-                    rw_inside_page_sb(lm, lm->blockbuf, lm->meta->pagebuf, lm->meta, &srcaddr, lm->meta->vpg_sz, READ_MODE);
-                    rw_inside_page_sb(lm, lm->blockbuf, lm->meta->pagebuf, lm->meta, &dstaddr, lm->meta->vpg_sz, WRITE_MODE);
+                if (get_pg_state(lm->meta, geoaddr2vpg_sb(lm, &srcaddr)) == PAGE_DIRTY) {
+                    add_copy(lm, ncopies++, &srcaddr, &dstaddr);
                     newsblk->meta->ndirtypgs++;
                     lm->dirty_pg_count++;
                     lm->clean_pg_count--;
                 }
             }
         }
+        // copies read the log and data superblocks and write all PUs of the new one
+        int src = rw_prog_src(lm->meta, RW_PROG_MERGE);
+        rw_batch_copy(&(lm->batch), lm->copies, ncopies);
+        rw_prog_src(lm->meta, src);
         // abandon log block and data block (if exists)
         lm->vsblk2psblk[vsblk_i] = newsblk->sblk_i;
         lm->psblk2vsblk[newsblk->sblk_i] = vsblk_i;
@@ -513,64 +836,266 @@ static int merge_log_data(struct ls_meta* lm, uint64_t vsblk_i) {
             lm->map_set_count++;
         }
         abandon_sblk(lm, log_psblk_i);
+        lm->merge_full++;
+        lm->merge_full_pgs += ncopies;
     }
     // clean log table
-    le->vsblk_i = lm->sblk_ntotal;
-    le->psblk_i = lm->sblk_ntotal;
-    int pginsbi;
-    for (pginsbi = 0; pginsbi < lm->sblk_tpgs; pginsbi++) {
-        le->vpg2ppg[pginsbi] = lm->sblk_tpgs;
+    release_lbpm(lm, le);
+    return 0;
+}
+
+// copies the newest copy of pages [from, sblk_tpgs) of vsblki to the same offsets of dst_psblki
+static uint64_t copy_newest(struct ls_meta* lm, uint64_t vsblki, uint64_t from, uint64_t dst_psblki) {
+    uint64_t vfirst = sblk_first_pg(lm, vsblki);
+    uint64_t dfirst = sblk_first_pg(lm, dst_psblki);
+    uint64_t insbpgi, ncopies = 0;
+    for (insbpgi = from; insbpgi < lm->sblk_tpgs; insbpgi++) {
+        uint64_t srcppg = fast_lookup(lm, vfirst + insbpgi);
+        if (srcppg == lm->meta->total_pagenum)
+            continue;
+        struct nodegeoaddr srcaddr = vpg2geoaddr_sb(lm, srcppg);
+        struct nodegeoaddr dstaddr = vpg2geoaddr_sb(lm, dfirst + insbpgi);
+        add_copy(lm, ncopies++, &srcaddr, &dstaddr);
+    }
+    if (ncopies > 0) {
+        int src = rw_prog_src(lm->meta, RW_PROG_MERGE);
+        rw_batch_copy(&(lm->batch), lm->copies, ncopies);
+        rw_prog_src(lm->meta, src);
+    }
+    // the random log copies are stale now
+    for (insbpgi = from; insbpgi < lm->sblk_tpgs; insbpgi++) {
+        if (lm->lpm[vfirst + insbpgi] != lm->meta->total_pagenum) {
+            abandon_ppg(lm, lm->lpm[vfirst + insbpgi]);
+            lm->lpm[vfirst + insbpgi] = lm->meta->total_pagenum;
+        }
+    }
+    lm->sblk_metas[dst_psblki].ndirtypgs += ncopies;
+    lm->dirty_pg_count += ncopies;
+    lm->clean_pg_count -= ncopies;
+    return ncopies;
+}
+
+// psblki becomes the data superblock of vsblki, unmapped if it holds no valid page
+static void remap_data(struct ls_meta* lm, uint64_t vsblki, uint64_t psblki) {
+    uint64_t data_psblk_i = lm->vsblk2psblk[vsblki];
+    if (data_psblk_i != lm->sblk_ntotal) {
+        abandon_sblk(lm, data_psblk_i);
+        lm->map_change_count++;
+    } else {
+        lm->map_set_count++;
+    }
+    lm->sblk_metas[psblki].log = 0;
+    if (lm->sblk_metas[psblki].ndirtypgs == 0) {
+        lm->vsblk2psblk[vsblki] = lm->sblk_ntotal;
+        lm->psblk2vsblk[psblki] = lm->sblk_ntotal;
+        return;
     }
+    lm->vsblk2psblk[vsblki] = psblki;
+    lm->psblk2vsblk[psblki] = vsblki;
+}
+
+/*
+ * --hybrid fast: the sequential log block holds pages [0, sw_next) of its
+ * superblock in place. Full, it is switched into the data superblock as is;
+ * otherwise a partial merge copies the newest copy of the remaining pages
+ * into it first.
+ */
+static void close_sw(struct ls_meta* lm) {
+    uint64_t vsblki = lm->sw_vsblk;
+    uint64_t psblki = lm->sw_psblk;
+    if (lm->sw_next == lm->sblk_tpgs) {
+        lm->merge_switch++;
+    } else {
+        lm->merge_partial++;
+        lm->merge_partial_pgs += copy_newest(lm, vsblki, lm->sw_next, psblki);
+    }
+    lm->sw_vsblk = lm->sw_psblk = lm->sblk_ntotal;
+    lm->sw_next = 0;
+    remap_data(lm, vsblki, psblki);
+}
+
+// --hybrid fast full merge of vsblki into a new data superblock
+static int merge_full_fast(struct ls_meta* lm, uint64_t vsblki) {
+    struct sblk_entry* newsblk = gc_until_find_next_free_sb(lm);
+    if (newsblk == NULL)
+        return -1;
+    lm->merge_full++;
+    lm->merge_full_pgs += copy_newest(lm, vsblki, 0, newsblk->sblk_i);
+    if (lm->sw_vsblk == vsblki) {
+        abandon_sblk(lm, lm->sw_psblk);
+        lm->sblk_metas[lm->sw_psblk].log = 0;
+        lm->sw_vsblk = lm->sw_psblk = lm->sblk_ntotal;
+        lm->sw_next = 0;
+    }
+    remap_data(lm, vsblki, newsblk->sblk_i);
     return 0;
 }
 
-static uint64_t alloc_page(struct ls_meta* lm, uint64_t vpgi, uint64_t vpgi_begin, uint64_t vpgi_end) {
-    struct sblkaddr vsblkaddr = vpgi2sblkaddr(lm, vpgi);
-    struct logblockaddr vlogblockaddr = sblkaddr2logblockaddr(lm, &vsblkaddr);
-    struct lbpm_entry* match = NULL;
-    struct lbpm_entry* avail = NULL;
-    int lbpmi;
-    for (lbpmi = 0; lbpmi < lm->lbpm_entry_num; lbpmi++) {
-        if (lm->lbpm[lbpmi].vsblk_i == vlogblockaddr.sblk_i) {
-            match = &(lm->lbpm[lbpmi]);
+// oldest block of the random log area: full merges of the superblocks it holds valid pages of
+static int rwlog_evict(struct ls_meta* lm) {
+    uint64_t psblki = lm->rwlog[lm->rwlog_head];
+    uint64_t first = sblk_first_pg(lm, psblki);
+    uint64_t ppgi;
+    lm->rwlog_head = (lm->rwlog_head + 1) % lm->rwlog_max;
+    lm->rwlog_n--;
+    for (ppgi = first; ppgi < first + lm->sblk_tpgs; ppgi++) {
+        uint64_t vpgi = lm->lpm_owner[ppgi];
+        if (get_pg_state(lm->meta, ppgi) == PAGE_DIRTY && lm->lpm[vpgi] == ppgi && merge_full_fast(lm, vpgi2sblki(lm, vpgi)))
+            return -1;
+    }
+    // no valid page left, GC erases it
+    lm->sblk_metas[psblki].log = 0;
+    return 0;
+}
+
+// superblocks without valid pages that are not log blocks, free or freed by the next GC
+static uint64_t count_free_sblks(struct ls_meta* lm) {
+    uint64_t sbi, n = 0;
+    for (sbi = 0; sbi < lm->sblk_ntotal; sbi++)
+        if (lm->sblk_metas[sbi].ndirtypgs == 0 && !lm->sblk_metas[sbi].log)
+            n++;
+    return n;
+}
+
+// merges the log blocks over log_limit, oldest random log blocks with --hybrid fast
+static void log_pool_trim(struct ls_meta* lm) {
+    if (lm->fast) {
+        while (lm->rwlog_n > lm->rwlog_lim)
+            rwlog_evict(lm);
+        return;
+    }
+    while (lm->lbpm_entry_num - lm->lbpm_nfree > lm->log_limit) {
+        if (merge_log_data(lm, first_fit_lbpm(lm)->vsblk_i))
+            return;
+    }
+}
+
+/*
+ * --log-adapt, before a new log block is taken: while there is no room left
+ * for it the pool shrinks, merging what is over the limit. Merges of log
+ * blocks with a data superblock free one, switches of new data do not, so
+ * the pool may have to go down to log_min.
+ */
+static void log_pool_pressure(struct ls_meta* lm) {
+    if (!lm->log_min)
+        return;
+    while (lm->log_limit > lm->log_min && count_free_sblks(lm) <= LOG_ADAPT_RESERVE) {
+        lm->log_limit--;
+        lm->log_shrinks++;
+        lm->log_dir = -1;
+        lm->rwlog_lim = (lm->log_limit > 2) ? lm->log_limit - 1 : 1;
+        log_pool_trim(lm);
+    }
+}
+
+// block of the random log area taking the next write
+static struct sblk_entry* rwlog_active(struct ls_meta* lm) {
+    if (lm->rwlog_n > 0) {
+        struct sblk_entry* act = &(lm->sblk_entries[lm->rwlog[(lm->rwlog_head + lm->rwlog_n - 1) % lm->rwlog_max]]);
+        if (act->meta->ndirtypgs + act->meta->nabandonedpgs < lm->sblk_tpgs)
+            return act;
+    }
+    log_pool_pressure(lm);
+    while (lm->rwlog_n >= lm->rwlog_lim)
+        rwlog_evict(lm);
+    struct sblk_entry* res = gc_until_find_next_free_sb(lm);
+    if (res == NULL)
+        return NULL;
+    res->meta->log = 1;
+    lm->rwlog[(lm->rwlog_head + lm->rwlog_n++) % lm->rwlog_max] = res->sblk_i;
+    return res;
+}
+
+/*
+ * --hybrid fast write of vpgi. Offset 0 of a superblock opens the sequential
+ * log block for it, after closing the previous one (close_sw); the pages
+ * that continue it in order follow. Any other write goes to the random log
+ * area, shared by all superblocks and written in order; when it is full its
+ * oldest block is reclaimed with full merges (rwlog_evict).
+ */
+static uint64_t alloc_page_fast(struct ls_meta* lm, uint64_t vpgi) {
+    uint64_t vsblki = vpgi2sblki(lm, vpgi);
+    uint64_t insbpgi = vpgi - sblk_first_pg(lm, vsblki);
+    struct sblk_entry* logblk;
+    uint64_t newppg;
+    int seq = (insbpgi == 0 || (lm->sw_vsblk == vsblki && insbpgi == lm->sw_next));
+    if (seq) {
+        if (insbpgi == 0) {
+            if (lm->sw_psblk != lm->sblk_ntotal)
+                close_sw(lm);
+            log_pool_pressure(lm);
+            logblk = gc_until_find_next_free_sb(lm);
+            if (logblk == NULL)
+                return lm->meta->total_pagenum;
+            logblk->meta->log = 1;
+            lm->sw_vsblk = vsblki;
+            lm->sw_psblk = logblk->sblk_i;
         }
-        if (lm->lbpm[lbpmi].vsblk_i == lm->sblk_ntotal) {
-            avail = &(lm->lbpm[lbpmi]);
+        logblk = &(lm->sblk_entries[lm->sw_psblk]);
+        newppg = sblk_first_pg(lm, lm->sw_psblk) + lm->sw_next++;
+    } else {
+        // may merge vsblki, look for its copies after
+        logblk = rwlog_active(lm);
+        if (logblk == NULL)
+            return lm->meta->total_pagenum;
+        if (lm->sw_vsblk == vsblki && insbpgi < lm->sw_next) {
+            uint64_t swppg = sblk_first_pg(lm, lm->sw_psblk) + insbpgi;
+            if (get_pg_state(lm->meta, swppg) == PAGE_DIRTY)
+                abandon_ppg(lm, swppg);
         }
+        newppg = sblk_first_pg(lm, logblk->sblk_i) + logblk->meta->ndirtypgs + logblk->meta->nabandonedpgs;
     }
+    if (lm->lpm[vpgi] != lm->meta->total_pagenum) {
+        abandon_ppg(lm, lm->lpm[vpgi]);
+        lm->lpm[vpgi] = lm->meta->total_pagenum;
+        lm->map_change_count++;
+    } else {
+        lm->map_set_count++;
+    }
+    if (!seq) {
+        lm->lpm[vpgi] = newppg;
+        lm->lpm_owner[newppg] = vpgi;
+    }
+    logblk->meta->ndirtypgs++;
+    lm->dirty_pg_count++;
+    lm->clean_pg_count--;
+    return newppg;
+}
+
+static uint64_t alloc_page(struct ls_meta* lm, uint64_t vpgi, uint64_t vpgi_begin, uint64_t vpgi_end) {
+    if (lm->fast)
+        return alloc_page_fast(lm, vpgi);
+    struct sblkaddr vsblkaddr = vpgi2sblkaddr(lm, vpgi);
+    struct logblockaddr vlogblockaddr = sblkaddr2logblockaddr(lm, &vsblkaddr);
+    struct lbpm_entry* match = find_lbpm(lm, vlogblockaddr.sblk_i);
     if (match == NULL) {
         // set a new match!
-        if (avail == NULL) {
-            // find one to merge
-            int min_cost = (1 << 30);
-            struct lbpm_entry* to_merge = NULL;
-            for (lbpmi = 0; lbpmi < lm->lbpm_entry_num; lbpmi++) {
-                int costi = merge_cost(lm, &(lm->lbpm[lbpmi]));
-                if (costi < min_cost) {
-                    min_cost = costi;
-                    to_merge = &(lm->lbpm[lbpmi]);
-                }
-            }
-            merge_log_data(lm, to_merge->vsblk_i);
-            avail = to_merge;
+        log_pool_pressure(lm);
+        if (lm->lbpm_entry_num - lm->lbpm_nfree >= lm->log_limit) {
+            // find one to merge, the cheapest is a log block that can be switched
+            struct lbpm_entry* to_merge = first_fit_lbpm(lm);
+            if (merge_log_data(lm, to_merge->vsblk_i))
+                return lm->meta->total_pagenum;
             lm->map_set_count += 2;
         } else {
             lm->map_change_count += 2;
         }
         struct sblk_entry* newlogblk = gc_until_find_next_free_sb(lm);
-        avail->vsblk_i = vlogblockaddr.sblk_i;
-        avail->psblk_i = newlogblk->sblk_i;
-        match = avail;
+        if (newlogblk == NULL)
+            return lm->meta->total_pagenum;
+        match = bind_lbpm(lm, vlogblockaddr.sblk_i, newlogblk->sblk_i);
     }
     // if (match != NULL) {
     if (1) {
         // merge current page if full
         struct sblk_entry* logblk = &(lm->sblk_entries[match->psblk_i]);
         if (logblk->meta->ndirtypgs + logblk->meta->nabandonedpgs == lm->sblk_tpgs) {
-            merge_log_data(lm, match->vsblk_i);
+            if (merge_log_data(lm, match->vsblk_i))
+                return lm->meta->total_pagenum;
             logblk = gc_until_find_next_free_sb(lm);
-            match->vsblk_i = vlogblockaddr.sblk_i;
-            match->psblk_i = logblk->sblk_i;
+            if (logblk == NULL)
+                return lm->meta->total_pagenum;
+            match = bind_lbpm(lm, vlogblockaddr.sblk_i, logblk->sblk_i);
             lm->map_change_count += 2;
         }
         // write new page
@@ -584,7 +1109,7 @@ static uint64_t alloc_page(struct ls_meta* lm, uint64_t vpgi, uint64_t vpgi_begi
         uint64_t newppg_i = sblkaddr2vpgi(lm, &newpg_sblkaddr);
         uint64_t oldpgmap = match->vpg2ppg[vlogblockaddr.insb_pg_i];
         if (oldpgmap == lm->sblk_tpgs) {
-            match->vpg2ppg[vlogblockaddr.insb_pg_i] = newpgid;
+            set_lbpm_page(lm, match, vlogblockaddr.insb_pg_i, newpgid);
             logblk->meta->ndirtypgs++;
             lm->dirty_pg_count++;
             lm->clean_pg_count--;
@@ -595,14 +1120,14 @@ static uint64_t alloc_page(struct ls_meta* lm, uint64_t vpgi, uint64_t vpgi_begi
             oldmappage.insb_pg_i = oldpgmap;
             oldmappage.offset_in_page = 0;
             struct nodegeoaddr oldmappage_geoaddr = logblockaddr2geoaddr(lm, &oldmappage);
-            lm->meta->page_state[geoaddr2vpg_sb(lm, &oldmappage_geoaddr)] = PAGE_ABANDONED;
-            match->vpg2ppg[vlogblockaddr.insb_pg_i] = newpgid;
+            set_pg_state(lm->meta, geoaddr2vpg_sb(lm, &oldmappage_geoaddr), PAGE_ABANDONED);
+            set_lbpm_page(lm, match, vlogblockaddr.insb_pg_i, newpgid);
             logblk->meta->nabandonedpgs++;
             lm->abandoned_pg_count++;
             lm->clean_pg_count--;
             lm->map_change_count++;
         }
-        if (lm->meta->page_state[newppg_i] != PAGE_CLEAN) {
+        if (get_pg_state(lm->meta, newppg_i) != PAGE_CLEAN) {
             printf("dirty page at %" PRId64 ", %" PRId64 ", %" PRId64 "\n", psblk_i, vpgi, newppg_i);
         }
         return newppg_i;
@@ -629,8 +1154,7 @@ static int rw_inside_page_sb(struct ls_meta* lm, struct fox_blkbuf* blockbuf, ui
         meta->heatmap[vpgofgeoaddr].readt++;
         memcpy(databuf, blockbuf->buf_r + vpg_sz * pg_i + offset, size);
     } else if (mode == WRITE_MODE) {
-        uint8_t* pgst = &(meta->page_state[vpgofgeoaddr]);
-        if (*pgst == PAGE_DIRTY) {
+        if (get_pg_state(meta, vpgofgeoaddr) == PAGE_DIRTY) {
             printf("Writing to dirty page!\n");
             printf("%" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %d\n", ch_i, lun_i, blk_i, pg_i, offset, mode);
             return 1;
@@ -640,33 +1164,30 @@ static int rw_inside_page_sb(struct ls_meta* lm, struct fox_blkbuf* blockbuf, ui
                 return 1;
             }
             meta->heatmap[vpgofgeoaddr].writet++;
+            rw_prog(meta, 1);
         } else {
             // cannot rewrite before erasing!
             return 1;
         }
-        *pgst = PAGE_DIRTY;
-        uint8_t* blkst = get_p_blk_state(meta, geoaddr);
-        *blkst = BLOCK_DIRTY;
+        set_pg_state(meta, vpgofgeoaddr, PAGE_DIRTY);
+        set_blk_state(meta, geoaddr, BLOCK_DIRTY);
     }
     return 0;
 }
 
-static int erase_block_sb(struct ls_meta* lm, struct rewrite_meta* meta, struct nodegeoaddr* geoaddr) {
+// page states of an erased block
+static void clean_block_pgs(struct ls_meta* lm, struct rewrite_meta* meta, struct nodegeoaddr* geoaddr) {
     struct fox_node* node = lm->meta->node;
-    uint64_t ch_i = geoaddr->ch_i;
-    uint64_t lun_i = geoaddr->lun_i;
-    uint64_t blk_i = geoaddr->blk_i;
-    fox_vblk_tgt(node, node->ch[ch_i], node->lun[lun_i], blk_i);
-    if (fox_erase_blk(&node->vblk_tgt, node))
-        return 1;
-    *get_p_blk_state(meta, geoaddr) = BLOCK_CLEAN;
+    // the pages of a block are sblk_npus apart
     struct nodegeoaddr tgeo = *geoaddr;
-    for (tgeo.pg_i = 0; tgeo.pg_i < node->npgs; tgeo.pg_i++) {
-        uint64_t vpgoftgeo = geoaddr2vpg_sb(lm, &tgeo);
-        meta->page_state[vpgoftgeo] = PAGE_CLEAN;
-        meta->heatmap[vpgoftgeo].eraset++;
+    tgeo.pg_i = 0;
+    uint64_t vpgi = geoaddr2vpg_sb(lm, &tgeo);
+    if (lm->sblk_npus == 1) {
+        fill_pg_state(meta, vpgi, node->npgs, PAGE_CLEAN);
+        return;
     }
-    return 0;
+    for (tgeo.pg_i = 0; tgeo.pg_i < node->npgs; tgeo.pg_i++, vpgi += lm->sblk_npus)
+        set_pg_state(meta, vpgi, PAGE_CLEAN);
 }
 
 static int erase_sb(struct ls_meta* lm, uint64_t psblki);
@@ -684,12 +1205,16 @@ static int garbage_collection(struct ls_meta* lm) {
             while (iter != NULL) {
                 struct sblk_entry* iternext = TAILQ_NEXT(iter, pt);
                 uint64_t psblki = iter->sblk_i;
-                if (iter->meta->ndirtypgs == 0) {
+                if (iter->meta->ndirtypgs == 0 && !iter->meta->log) {
                     erase_sb(lm, psblki);
                     TAILQ_REMOVE(nonemptylist, iter, pt);
-                    TAILQ_INSERT_TAIL(&(lm->sblk_lists[lm->next_mpu_i].empty_sblks), iter, pt);
                     lm->abandoned_pg_count -= iter->meta->nabandonedpgs;
                     lm->clean_pg_count += iter->meta->nabandonedpgs;
+                    // a retired superblock leaves the lists for good
+                    if (lm->sblk_bad[psblki])
+                        lm->clean_pg_count -= lm->sblk_tpgs;
+                    else
+                        TAILQ_INSERT_TAIL(&(lm->sblk_lists[lm->next_mpu_i].empty_sblks), iter, pt);
                     iter->meta->nabandonedpgs = 0;
                     recycleflag++;
                     break;
@@ -704,7 +1229,36 @@ static int garbage_collection(struct ls_meta* lm) {
     gettimeofday(&tvaled, NULL);
     lm->gc_time += ((uint64_t)(tvaled.tv_sec - tvalst.tv_sec) * 1000000L + tvaled.tv_usec) - tvalst.tv_usec;
     lm->gc_count++;
-    return 0;
+    return recycleflag;
+}
+
+/*
+ * Empty superblock of an mPU to open. With --wl the least erased one, by the
+ * erases of its blocks, like pick_empty_blk in engine 6.
+ */
+static struct sblk_entry* pick_empty_sb(struct ls_meta* lm, struct sblk_entry_list* emptylist) {
+    struct sblk_entry* best = TAILQ_FIRST(emptylist);
+    struct sblk_entry* be;
+    uint64_t beste = 0, e, inner_pui, inner_blki;
+    if (lm->meta->node->wl->wl_spread == 0)
+        return best;
+    TAILQ_FOREACH(be, emptylist, pt) {
+        struct sblkaddr ta = sblki2sblkaddr(lm, be->sblk_i);
+        e = 0;
+        for (inner_blki = 0; inner_blki < lm->sblk_nblks; inner_blki++) {
+            for (inner_pui = 0; inner_pui < lm->sblk_npus; inner_pui++) {
+                ta.inner_blk_i = inner_blki;
+                ta.inner_pu_i = inner_pui;
+                struct nodegeoaddr spgeo = sblkaddr2geoaddr(lm, &ta);
+                e += lm->meta->blk_erases[geoaddr2vblk(lm->meta->node, &spgeo)];
+            }
+        }
+        if (be == TAILQ_FIRST(emptylist) || e < beste) {
+            best = be;
+            beste = e;
+        }
+    }
+    return best;
 }
 
 static struct sblk_entry* find_next_free_sb(struct ls_meta* lm) {
@@ -713,11 +1267,11 @@ static struct sblk_entry* find_next_free_sb(struct ls_meta* lm) {
     for (offset = 0; offset < total_mpus; offset++) {
         struct sblk_entry_list* emptylist = &(lm->sblk_lists[lm->next_mpu_i].empty_sblks);
         if (!TAILQ_EMPTY(emptylist)) {
-            lm->next_mpu_i = (lm->next_mpu_i + 1) % total_mpus;
-            struct sblk_entry* res = TAILQ_FIRST(emptylist);
+            struct sblk_entry* res = pick_empty_sb(lm, emptylist);
             TAILQ_REMOVE(emptylist, res, pt);
+            // filed under its own mPU, GC removes it from there
             TAILQ_INSERT_TAIL(&(lm->sblk_lists[lm->next_mpu_i].non_empty_sblks), res, pt);
-            // int clean = check_clean_sblk(lm, res->sblk_i);
+            lm->next_mpu_i = (lm->next_mpu_i + 1) % total_mpus;
             return res;
         }
         lm->next_mpu_i = (lm->next_mpu_i + 1) % total_mpus;
@@ -725,17 +1279,31 @@ static struct sblk_entry* find_next_free_sb(struct ls_meta* lm) {
     return NULL;
 }
 
+/*
+ * NULL once a GC pass recycles nothing: every good superblock holds valid
+ * pages or is a log block, the retired ones left too little room for the
+ * host space. The write fails and the run stops, see rewrite_ls_start.
+ */
 static struct sblk_entry* gc_until_find_next_free_sb(struct ls_meta* lm) {
     struct sblk_entry* res = find_next_free_sb(lm);
-    while (res == NULL) {
-        garbage_collection(lm);
+    while (res == NULL && !lm->nospace) {
+        if (!garbage_collection(lm)) {
+            lm->nospace = 1;
+            break;
+        }
         res = find_next_free_sb(lm);
     }
     return res;
 }
 
+/*
+ * Erase the dirty blocks of a superblock, all member PUs at once. A block
+ * failing its erase is swapped for a spare of its PU, the superblock is
+ * retired when the PU has none left.
+ */
 static int erase_sb(struct ls_meta* lm, uint64_t psblki) {
-    uint64_t inner_pui, inner_blki;
+    uint64_t inner_pui, inner_blki, i;
+    uint64_t n = 0;
     struct sblkaddr ta = sblki2sblkaddr(lm, psblki);
     ta.offset_in_page = 0;
     for (inner_blki = 0; inner_blki < lm->sblk_nblks; inner_blki++) {
@@ -744,51 +1312,96 @@ static int erase_sb(struct ls_meta* lm, uint64_t psblki) {
             ta.inner_pu_i = inner_pui;
             ta.pg_i = 0;
             struct nodegeoaddr spgeo = sblkaddr2geoaddr(lm, &ta);
-            if (*get_p_blk_state(lm->meta, &spgeo) == BLOCK_DIRTY) {
-                erase_block_sb(lm, lm->meta, &spgeo);
-            }
+            if (get_blk_state(lm->meta, &spgeo) == BLOCK_DIRTY)
+                lm->sblkblks[n++] = spgeo;
         }
     }
-    return 0;
+    int ret = rw_batch_erase(&(lm->batch), lm->sblkblks, n);
+    for (i = 0; i < n; i++) {
+        if (get_blk_state(lm->meta, &(lm->sblkblks[i])) == BLOCK_DIRTY && rw_replace_blk(lm->meta, &(lm->sblkblks[i])) && !lm->sblk_bad[psblki]) {
+            lm->sblk_bad[psblki] = 1;
+            lm->meta->bad_retired++;
+            lm->meta->bad_retired_pgs += lm->sblk_tpgs;
+            ret = 1;
+        }
+        if (get_blk_state(lm->meta, &(lm->sblkblks[i])) == BLOCK_CLEAN)
+            clean_block_pgs(lm, lm->meta, &(lm->sblkblks[i]));
+    }
+    return ret;
+}
+
+/*
+ * --log-adapt, after each I/O. Once log_limit superblocks of user pages have
+ * been programmed since the last resize, the merge cost of that window (merge
+ * pages per user page) moves the pool by one log block: the step keeps its
+ * direction while the cost does not rise and turns back when it does. Free
+ * space comes first, the pool shrinks with LOG_ADAPT_RESERVE free superblocks
+ * or fewer and only grows with one more than that.
+ */
+static void log_pool_adapt(struct ls_meta* lm) {
+    struct rewrite_meta* meta = lm->meta;
+    uint64_t user = meta->prog_pgs[RW_PROG_USER] - lm->win_user;
+    if (!lm->log_min || user < lm->log_limit * lm->sblk_tpgs)
+        return;
+    double cost = (double)(meta->prog_pgs[RW_PROG_MERGE] - lm->win_merge) / user;
+    uint64_t nfree = count_free_sblks(lm);
+    if (nfree <= LOG_ADAPT_RESERVE)
+        lm->log_dir = -1;
+    else if (lm->win_cost >= 0 && cost > lm->win_cost)
+        lm->log_dir = -lm->log_dir;
+    if (lm->log_dir > 0 && lm->log_limit < lm->log_max && nfree > LOG_ADAPT_RESERVE + 1) {
+        lm->log_limit++;
+        lm->log_grows++;
+    } else if (lm->log_dir < 0 && lm->log_limit > lm->log_min) {
+        lm->log_limit--;
+        lm->log_shrinks++;
+    }
+    lm->rwlog_lim = (lm->log_limit > 2) ? lm->log_limit - 1 : 1;
+    log_pool_trim(lm);
+    // the merges of a shrink are not part of the next window
+    lm->win_cost = cost;
+    lm->win_user = meta->prog_pgs[RW_PROG_USER];
+    lm->win_merge = meta->prog_pgs[RW_PROG_MERGE];
 }
 
 static int iterate_ls_io(struct fox_node* node, struct fox_blkbuf* buf, struct rewrite_meta* meta, struct ls_meta* lm, uint8_t* resbuf, uint64_t offset, uint64_t size, int mode) {
     size_t vpg_sz = node->wl->geo->page_nbytes * node->wl->geo->nplanes;
-    struct nodegeoaddr voffset_begin;
-    struct nodegeoaddr voffset_end;
-    set_nodegeoaddr(node, &voffset_begin, offset);
-    set_nodegeoaddr(node, &voffset_end, offset + size - 1); // [offset_begin, offset_end]
-    struct nodegeoaddr poffset_begin = vaddr2paddr(lm, &voffset_begin);
-    struct nodegeoaddr poffset_end = vaddr2paddr(lm, &voffset_end);
+    // virtual addresses use the superblock layout, same as alloc_page
     uint64_t vpg_i_begin = offset / vpg_sz;
     uint64_t vpg_i_end = (offset + size - 1) / vpg_sz;
+    struct nodegeoaddr voffset_begin = vpg2geoaddr_sb(lm, vpg_i_begin);
+    struct nodegeoaddr voffset_end = vpg2geoaddr_sb(lm, vpg_i_end); // [offset_begin, offset_end]
+    voffset_begin.offset_in_page = offset % vpg_sz;
+    voffset_end.offset_in_page = (offset + size - 1) % vpg_sz;
 
     if (mode == READ_MODE) {
-        struct nodegeoaddr vpg_geo_end = vpg2geoaddr_sb(lm, vpg_i_end);
-        struct nodegeoaddr ppg_geo_end = vaddr2paddr(lm, &vpg_geo_end);
         uint8_t* resbuf_t = resbuf;
         // read
         if (vpg_i_begin == vpg_i_end) {
-            rw_inside_page_sb(lm, buf, resbuf_t, meta, &poffset_begin, size, mode);
+            read_vpg(lm, buf, resbuf_t, meta, vpg_i_begin, voffset_begin.offset_in_page, size);
             resbuf_t += size;
         } else {
             // read begin page
-            rw_inside_page_sb(lm, buf, resbuf_t, meta, &poffset_begin, vpg_sz - poffset_begin.offset_in_page, mode);
-            resbuf_t += (vpg_sz - poffset_begin.offset_in_page);
+            read_vpg(lm, buf, resbuf_t, meta, vpg_i_begin, voffset_begin.offset_in_page, vpg_sz - voffset_begin.offset_in_page);
+            resbuf_t += (vpg_sz - voffset_begin.offset_in_page);
             // read middle pages
             if (vpg_i_end - vpg_i_begin > 1) {
                 uint64_t middle_pgi;
                 for (middle_pgi = vpg_i_begin + 1; middle_pgi < vpg_i_end; middle_pgi++) {
-                    struct nodegeoaddr tvgeo = vpg2geoaddr_sb(lm, middle_pgi);
-                    struct nodegeoaddr tgeo = vaddr2paddr(lm, &tvgeo);
-                    rw_inside_page_sb(lm, buf, resbuf_t, meta, &tgeo, vpg_sz, mode);
+                    read_vpg(lm, buf, resbuf_t, meta, middle_pgi, 0, vpg_sz);
                     resbuf_t += vpg_sz;
                 }
             }
             // read end page
-            rw_inside_page_sb(lm, buf, resbuf_t, meta, &ppg_geo_end, poffset_end.offset_in_page + 1, mode);
-            resbuf_t += (poffset_end.offset_in_page + 1);
+            read_vpg(lm, buf, resbuf_t, meta, vpg_i_end, 0, voffset_end.offset_in_page + 1);
+            resbuf_t += (voffset_end.offset_in_page + 1);
         }
+    } else if (mode == TRIM_MODE) {
+        uint64_t first, end, vpgi;
+        if (!rw_trim_range(meta, offset, size, &first, &end))
+            return 0;
+        for (vpgi = first; vpgi < end; vpgi++)
+            meta->trim_valid += trim_page(lm, vpgi);
     } else if (mode == WRITE_MODE) {
         struct nodegeoaddr vpg_geo_begin = vpg2geoaddr_sb(lm, vpg_i_begin);
         struct nodegeoaddr vpg_geo_end = vpg2geoaddr_sb(lm, vpg_i_end);
@@ -812,6 +1425,8 @@ static int iterate_ls_io(struct fox_node* node, struct fox_blkbuf* buf, struct r
             }
             // alloc a new page here
             uint64_t newppg = alloc_page(lm, vpg_i_begin, vpg_i_begin, vpg_i_end);
+            if (newppg == meta->total_pagenum)
+                return -1;
             struct nodegeoaddr newppgaddr = vpg2geoaddr_sb(lm, newppg);
             memcpy(meta->begin_pagebuf + voffset_begin.offset_in_page, resbuf_t, size);
             rw_inside_page_sb(lm, buf, meta->begin_pagebuf, meta, &newppgaddr, vpg_sz, mode);
@@ -821,6 +1436,8 @@ static int iterate_ls_io(struct fox_node* node, struct fox_blkbuf* buf, struct r
             if (isalloc(lm, vpg_i_begin) && (voffset_begin.offset_in_page != 0)) {
             }
             uint64_t newppg = alloc_page(lm, vpg_i_begin, vpg_i_begin, vpg_i_end);
+            if (newppg == meta->total_pagenum)
+                return -1;
             struct nodegeoaddr newppgaddr = vpg2geoaddr_sb(lm, newppg);
             memcpy(meta->begin_pagebuf + voffset_begin.offset_in_page, resbuf_t, vpg_sz - voffset_begin.offset_in_page);
             rw_inside_page_sb(lm, buf, meta->begin_pagebuf, meta, &newppgaddr, vpg_sz, mode);
@@ -830,6 +1447,8 @@ static int iterate_ls_io(struct fox_node* node, struct fox_blkbuf* buf, struct r
                 uint64_t middle_pgi;
                 for (middle_pgi = vpg_i_begin + 1; middle_pgi < vpg_i_end; middle_pgi++) {
                     newppg = alloc_page(lm, middle_pgi, 1, 0);
+                    if (newppg == meta->total_pagenum)
+                        return -1;
                     newppgaddr = vpg2geoaddr_sb(lm, newppg);
                     rw_inside_page_sb(lm, buf, resbuf_t, meta, &newppgaddr, vpg_sz, mode);
                     resbuf_t += vpg_sz;
@@ -839,6 +1458,8 @@ static int iterate_ls_io(struct fox_node* node, struct fox_blkbuf* buf, struct r
             if (isalloc(lm, vpg_i_end) && (voffset_end.offset_in_page != vpg_sz - 1)) {
             }
             newppg = alloc_page(lm, vpg_i_end, 1, 0);
+            if (newppg == meta->total_pagenum)
+                return -1;
             newppgaddr = vpg2geoaddr_sb(lm, newppg);
             memcpy(meta->end_pagebuf, resbuf_t, voffset_end.offset_in_page + 1);
             rw_inside_page_sb(lm, buf, meta->end_pagebuf, meta, &newppgaddr, vpg_sz, mode);
@@ -848,6 +1469,12 @@ static int iterate_ls_io(struct fox_node* node, struct fox_blkbuf* buf, struct r
     return 0;
 }
 
+// engine entry of the write buffer
+static int ls_io(void* ctx, uint8_t* data, uint64_t offset, uint64_t size, int mode) {
+    struct ls_meta* lm = (struct ls_meta*)ctx;
+    return iterate_ls_io(lm->meta->node, lm->blockbuf, lm->meta, lm, data, offset, size, mode);
+}
+
 static int rewrite_ls_start (struct fox_node *node)
 {
     node->stats.pgs_done = 0;
@@ -856,10 +1483,30 @@ static int rewrite_ls_start (struct fox_node *node)
     if (fox_alloc_blk_buf (node, &nbuf))
         goto OUT;
 
-    struct rewrite_meta meta;
-    init_rewrite_meta(node, &meta);
+    // superblocks are composed from the provisioned blocks
+    fox_wait_for_monitor (node->wl);
     struct ls_meta lm;
-    init_ls_meta(&meta, &nbuf, &lm);
+    memset(&lm, 0, sizeof(struct ls_meta));
+    lm.sblk_bad = rw_sb_compose(node);
+    if (lm.sblk_bad == NULL)
+        goto OUT;
+
+    struct rewrite_meta meta;
+    if (init_rewrite_meta(node, &meta))
+        goto OUT;
+    if (init_ls_meta(&meta, &nbuf, &lm)) {
+        // lm was zeroed, free_ls_meta only frees what init_ls_meta got to
+        free_ls_meta(&lm);
+        free_rewrite_meta(&meta);
+        fox_free_blkbuf (&nbuf, 1);
+        goto OUT;
+    }
+    struct rw_rcache rc;
+    struct rw_wbuf wb;
+    if (rw_rcache_init(&rc, &meta, node->wl->rcache_pgs, node->wl->rcache_policy, node->wl->readahead, ls_io, &lm))
+        goto OUT;
+    if (rw_wbuf_init(&wb, &meta, node->wl->wbuf_pgs, rw_rcache_io, &rc))
+        goto OUT;
 
     uint64_t max_iosize = 0;
     uint64_t t = 0;
@@ -881,12 +1528,26 @@ static int rewrite_ls_start (struct fox_node *node)
             mode = READ_MODE;
         else if (meta.ioseq[t].iotype == 'w')
             mode = WRITE_MODE;
+        else if (meta.ioseq[t].iotype == 't')
+            mode = TRIM_MODE;
 
         gettimeofday(&tvalst, NULL);
-        iterate_ls_io(node, &nbuf, &meta, &lm, databuf, meta.ioseq[t].offset, meta.ioseq[t].size, mode);
+        rw_wbuf_io(&wb, databuf, meta.ioseq[t].offset, meta.ioseq[t].size, mode);
+        if (lm.nospace) {
+            printf(" Node %d: no free superblock left, %" PRIu64 " retired, run stopped at I/O %" PRIu64 "/%" PRIu64 "\n",
+                    node->nid, meta.bad_retired, t, meta.ioseqlen);
+            break;
+        }
+        log_pool_adapt(&lm);
         gettimeofday(&tvaled, NULL);
         // record time
         meta.ioseq[t].exetime = ((uint64_t)(tvaled.tv_sec - tvalst.tv_sec) * 1000000L + tvaled.tv_usec) - tvalst.tv_usec;
+        // readahead is timed apart from the I/O, see rw_rcache_print
+        rw_rcache_prefetch(&rc);
+        meta.ioseq[t].cache_lookups = rc.lookups;
+        meta.ioseq[t].cache_hits = rc.hits;
+        meta.ioseq[t].cache_saved = rc.saved + rc.rmw_saved;
+        rw_waf_record(&meta, &meta.ioseq[t]);
         // record benefit / cost
         meta.ioseq[t].nabandoned = lm.abandoned_pg_count;
         meta.ioseq[t].ndirty = lm.dirty_pg_count;
@@ -895,6 +1556,8 @@ static int rewrite_ls_start (struct fox_node *node)
         meta.ioseq[t].gc_count = lm.gc_count;
         meta.ioseq[t].gc_time = lm.gc_time;
         meta.ioseq[t].gc_map_change_count = lm.gc_map_change_count;
+        meta.ioseq[t].log_pool = lm.log_limit;
+        meta.ioseq[t].log_merges = lm.merge_switch + lm.merge_partial + lm.merge_full;
         struct fox_stats* st = &node->stats;
         meta.ioseq[t].bread = st->bread;
         meta.ioseq[t].pgs_r = st->pgs_r;
@@ -905,16 +1568,33 @@ static int rewrite_ls_start (struct fox_node *node)
         meta.ioseq[t].read_t = st->read_t;
         meta.ioseq[t].write_t = st->write_t;
     }
+    // no room for the buffered pages either, they are not written
+    if (!lm.nospace)
+        rw_wbuf_drain(&wb);
     fox_end_node (node);
 
     write_meta_stats(&meta);
-
+    rw_waf_print(&meta, NULL);
+    printf(" Node %d: merges %" PRIu64 " switch, %" PRIu64 " partial (%" PRIu64 " pages), %" PRIu64 " full (%" PRIu64 " pages)\n",
+            node->nid, lm.merge_switch, lm.merge_partial, lm.merge_partial_pgs, lm.merge_full, lm.merge_full_pgs);
+    if (lm.log_min)
+        printf(" Node %d: log pool %" PRIu64 " log blocks at the end, %" PRIu64 " grows, %" PRIu64 " shrinks\n",
+                node->nid, lm.log_limit, lm.log_grows, lm.log_shrinks);
+    rw_batch_print(&(lm.batch));
+    rw_wbuf_print(&wb);
+    rw_rcache_print(&rc);
+    rw_trim_print(&meta);
+    rw_bad_print(&meta);
+    rw_wear_print(&meta);
+
+    rw_wbuf_free(&wb);
+    rw_rcache_free(&rc);
     fox_free_blkbuf (&nbuf, 1);
     free(databuf);
     free_rewrite_meta(&meta);
     free_ls_meta(&lm);
     printf("\n[%" PRId64 ", %" PRId64 "]\n", lm.map_change_count, lm.map_set_count);
-    return 0;
+    return lm.nospace ? -1 : 0;
 
 OUT:
     return -1;
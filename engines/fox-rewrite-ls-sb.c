@@ -32,7 +32,11 @@
  * Read as usual;
  * Write like log-structured file systems;
  * Erase when garbage collection.
- * GC: always choose 
+ * GC: picks a superblock with the --gc policy. A superblock no longer mapped
+ * is erased; a mapped one with trimmed pages is compacted, its valid pages
+ * are copied to the same offsets of a free superblock (or written back after
+ * an erase when there is none), so the trimmed offsets can be written again
+ * without a merge.
  * Written by Chuizheng Meng <mengcz13@mails.tsinghua.edu.cn>
  */
 
@@ -87,6 +91,14 @@ struct ls_meta {
     uint64_t gc_count;
     uint64_t gc_time;
     uint64_t gc_map_change_count;
+    uint64_t sblk_tpgs; // pages in one superblock
+    struct gc_victims gv; // mapped or abandoned superblocks, valid pages = sblk_tpgs - nabandonedpgs
+    struct rw_batch batch; // superblock migration
+    struct rw_batch stripe; // user pages of a write, programmed on the PUs at once
+    struct rw_copy* copies; // pages of a migration
+    uint64_t gc_erased; // superblocks freed by GC
+    uint64_t gc_compacted; // mapped superblocks compacted by GC
+    uint64_t gc_moved_pgs; // valid pages GC copied
     uint64_t* vsblk2psblk;
     uint64_t* psblk2vsblk;
     struct sblk_list* sblk_lists; // 1 for each mPU
@@ -95,6 +107,9 @@ struct ls_meta {
     uint64_t next_mpu_i; // used to iterate over chs and luns
     uint8_t* sblkbuf;
     uint64_t* sblkvpgs;
+    struct nodegeoaddr* sblkblks; // blocks of an erase_sb
+    uint8_t* sblk_bad; // superblocks with a missing or dead block, never handed out
+    int nospace; // no superblock left for host data, writes fail and the run stops
 };
 
 static struct nodegeoaddr sblkaddr2geoaddr(struct ls_meta* lm, struct sblkaddr* sblka) {
@@ -187,22 +202,33 @@ static int init_ls_meta(struct rewrite_meta* meta, struct fox_blkbuf* blockbuf,
     lm->sblk_nblks = (wl_nblks == 0) ? 1 : wl_nblks;
     printf("Superblock: %" PRId64 " PUs, %" PRId64 " BLKs\n", lm->sblk_npus, lm->sblk_nblks);
     lm->sblk_tblks = lm->sblk_npus * lm->sblk_nblks;
+    lm->sblk_tpgs = lm->sblk_tblks * meta->node->npgs;
     lm->sblk_ntotal = (meta->node->nblks / lm->sblk_nblks) * (meta->node->nchs * meta->node->nluns / lm->sblk_npus);
     lm->meta = meta;
     lm->blockbuf = blockbuf;
     lm->dirty_pg_count = 0;
     lm->abandoned_pg_count = 0;
-    lm->clean_pg_count = meta->total_pagenum;
+    lm->clean_pg_count = meta->total_pagenum - meta->node->lost_pgs;
     lm->map_change_count = 0;
     lm->map_set_count = 0;
     lm->gc_count = 0;
     lm->gc_time = 0;
     lm->gc_map_change_count = 0;
+    lm->gc_erased = 0;
+    lm->gc_compacted = 0;
+    lm->gc_moved_pgs = 0;
     lm->vsblk2psblk = (uint64_t*)calloc(lm->sblk_ntotal, sizeof(uint64_t));
     lm->psblk2vsblk = (uint64_t*)calloc(lm->sblk_ntotal, sizeof(uint64_t));
     lm->next_mpu_i = 0;
-    lm->sblkbuf = (uint8_t*)calloc(lm->sblk_tblks * meta->node->npgs * meta->vpg_sz, sizeof(uint8_t));
-    lm->sblkvpgs = (uint64_t*)calloc(lm->sblk_tblks * meta->node->npgs, sizeof(uint64_t));
+    lm->sblkbuf = (uint8_t*)calloc(lm->sblk_tpgs * meta->vpg_sz, sizeof(uint8_t));
+    lm->sblkvpgs = (uint64_t*)calloc(lm->sblk_tpgs, sizeof(uint64_t));
+    lm->sblkblks = (struct nodegeoaddr*)calloc(lm->sblk_tblks, sizeof(struct nodegeoaddr));
+    lm->copies = (struct rw_copy*)calloc(lm->sblk_tpgs, sizeof(struct rw_copy));
+    if (lm->sblkblks == NULL || lm->copies == NULL || rw_batch_init(&(lm->batch), meta->node, meta, blockbuf, lm->sblk_tpgs, lm->sblk_npus * 4))
+        return 1;
+    if (rw_batch_init(&(lm->stripe), meta->node, meta, blockbuf, lm->sblk_tpgs, 0))
+        return 1;
+    gc_victims_init(&(lm->gv), meta->node, lm->sblk_ntotal, lm->sblk_tpgs);
 
     lm->sblk_metas = (struct sblk_meta*)calloc(lm->sblk_ntotal, sizeof(struct sblk_meta));
     lm->sblk_entries = (struct sblk_entry*)calloc(lm->sblk_ntotal, sizeof(struct sblk_entry));
@@ -221,7 +247,8 @@ static int init_ls_meta(struct rewrite_meta* meta, struct fox_blkbuf* blockbuf,
             struct sblk_entry* tsblk_entry = &(lm->sblk_entries[sblk_i]);
             tsblk_entry->sblk_i = sblk_i;
             tsblk_entry->meta = &(lm->sblk_metas[sblk_i]);
-            TAILQ_INSERT_TAIL(&(listi->empty_sblks), tsblk_entry, pt);
+            if (!lm->sblk_bad[sblk_i])
+                TAILQ_INSERT_TAIL(&(listi->empty_sblks), tsblk_entry, pt);
         }
         listi->active_sblk = NULL;
     }
@@ -245,6 +272,12 @@ static int free_ls_meta(struct ls_meta* lm) {
     free(lm->sblk_lists);
     free(lm->sblkbuf);
     free(lm->sblkvpgs);
+    free(lm->copies);
+    free(lm->sblkblks);
+    free(lm->sblk_bad);
+    gc_victims_free(&(lm->gv));
+    rw_batch_free(&(lm->batch));
+    rw_batch_free(&(lm->stripe));
     return 0;
 }
 
@@ -289,8 +322,9 @@ static int isalloc(struct ls_meta* lm, uint64_t vpgi) {
     if (psblki == lm->sblk_ntotal)
         return 0;
     else {
+        // trimmed pages are abandoned in place
         uint64_t ppgi = vpg2ppg(lm, vpgi);
-        if (lm->meta->page_state[ppgi] == PAGE_CLEAN)
+        if (get_pg_state(lm->meta, ppgi) != PAGE_DIRTY)
             return 0;
         else
             return 1;
@@ -317,8 +351,7 @@ static int rw_inside_page_sb(struct ls_meta* lm, struct fox_blkbuf* blockbuf, ui
         meta->heatmap[vpgofgeoaddr].readt++;
         memcpy(databuf, blockbuf->buf_r + vpg_sz * pg_i + offset, size);
     } else if (mode == WRITE_MODE) {
-        uint8_t* pgst = &(meta->page_state[vpgofgeoaddr]);
-        if (*pgst == PAGE_DIRTY) {
+        if (get_pg_state(meta, vpgofgeoaddr) == PAGE_DIRTY) {
             printf("Writing to dirty page!\n");
             printf("%" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %d\n", ch_i, lun_i, blk_i, pg_i, offset, mode);
             return 1;
@@ -328,71 +361,279 @@ static int rw_inside_page_sb(struct ls_meta* lm, struct fox_blkbuf* blockbuf, ui
                 return 1;
             }
             meta->heatmap[vpgofgeoaddr].writet++;
+            rw_prog(meta, 1);
         } else {
             // cannot rewrite before erasing!
             return 1;
         }
-        *pgst = PAGE_DIRTY;
-        uint8_t* blkst = get_p_blk_state(meta, geoaddr);
-        *blkst = BLOCK_DIRTY;
+        set_pg_state(meta, vpgofgeoaddr, PAGE_DIRTY);
+        set_blk_state(meta, geoaddr, BLOCK_DIRTY);
     }
     return 0;
 }
 
-static int erase_block_sb(struct ls_meta* lm, struct rewrite_meta* meta, struct nodegeoaddr* geoaddr) {
+// read part of a virtual page, pages never written read as zeros
+static int read_vpg(struct ls_meta* lm, struct fox_blkbuf* buf, uint8_t* databuf, struct rewrite_meta* meta, uint64_t vpg_i, uint64_t offset_in_page, uint64_t size) {
+    if (!isalloc(lm, vpg_i)) {
+        memset(databuf, 0, size);
+        return 0;
+    }
+    struct nodegeoaddr vaddr = vpg2geoaddr_sb(lm, vpg_i);
+    vaddr.offset_in_page = offset_in_page;
+    struct nodegeoaddr paddr = vaddr2paddr(lm, &vaddr);
+    return rw_inside_page_sb(lm, buf, databuf, meta, &paddr, size, READ_MODE);
+}
+
+// page states of an erased block
+static void clean_block_pgs(struct ls_meta* lm, struct rewrite_meta* meta, struct nodegeoaddr* geoaddr) {
     struct fox_node* node = lm->meta->node;
-    uint64_t ch_i = geoaddr->ch_i;
-    uint64_t lun_i = geoaddr->lun_i;
-    uint64_t blk_i = geoaddr->blk_i;
-    fox_vblk_tgt(node, node->ch[ch_i], node->lun[lun_i], blk_i);
-    if (fox_erase_blk(&node->vblk_tgt, node))
-        return 1;
-    *get_p_blk_state(meta, geoaddr) = BLOCK_CLEAN;
+    // the pages of a block are sblk_npus apart
     struct nodegeoaddr tgeo = *geoaddr;
-    for (tgeo.pg_i = 0; tgeo.pg_i < node->npgs; tgeo.pg_i++) {
-        uint64_t vpgoftgeo = geoaddr2vpg_sb(lm, &tgeo);
-        meta->page_state[vpgoftgeo] = PAGE_CLEAN;
-        meta->heatmap[vpgoftgeo].eraset++;
+    tgeo.pg_i = 0;
+    uint64_t vpgi = geoaddr2vpg_sb(lm, &tgeo);
+    if (lm->sblk_npus == 1) {
+        fill_pg_state(meta, vpgi, node->npgs, PAGE_CLEAN);
+        return;
     }
-    return 0;
+    for (tgeo.pg_i = 0; tgeo.pg_i < node->npgs; tgeo.pg_i++, vpgi += lm->sblk_npus)
+        set_pg_state(meta, vpgi, PAGE_CLEAN);
+}
+
+// queue a user page, consecutive pages of a superblock lie on its PUs in turn
+static int write_vpg(struct ls_meta* lm, uint8_t* databuf, uint64_t vpg_i) {
+    struct nodegeoaddr vaddr = vpg2geoaddr_sb(lm, vpg_i);
+    struct nodegeoaddr paddr = vaddr2paddr(lm, &vaddr);
+    uint64_t ppg_i = geoaddr2vpg_sb(lm, &paddr);
+    int ret = 0;
+    if (rw_batch_add(&(lm->stripe), &paddr, ppg_i, databuf, WRITE_MODE)) {
+        ret = rw_batch_submit(&(lm->stripe));
+        rw_batch_add(&(lm->stripe), &paddr, ppg_i, databuf, WRITE_MODE);
+    }
+    return ret;
 }
 
 static int erase_sb(struct ls_meta* lm, uint64_t psblki);
 
+static struct sblk_entry* find_next_free_sb(struct ls_meta* lm);
+
+static uint64_t sblk_first_pg(struct ls_meta* lm, uint64_t psblki) {
+    struct sblkaddr ta = sblki2sblkaddr(lm, psblki);
+    return sblkaddr2vpgi(lm, &ta);
+}
+
+/*
+ * Move the valid pages of psblki to the same offsets of dst, with a copy
+ * batch. dst == psblki reads them into sblkbuf, erases the superblock and
+ * writes them back. The offsets are left in sblkvpgs, returns the pages.
+ */
+static uint64_t move_valid(struct ls_meta* lm, uint64_t psblki, uint64_t dst) {
+    uint64_t sbfirst = sblk_first_pg(lm, psblki);
+    uint64_t sbend = sbfirst + lm->sblk_tpgs;
+    uint64_t dstfirst = sblk_first_pg(lm, dst);
+    uint64_t ppg_i, dpi;
+    uint64_t dpcount = 0;
+    for (ppg_i = next_pg_state(lm->meta, sbfirst, sbend, PAGE_DIRTY); ppg_i < sbend; ppg_i = next_pg_state(lm->meta, ppg_i + 1, sbend, PAGE_DIRTY)) {
+        struct nodegeoaddr spgeo = vpg2geoaddr_sb(lm, ppg_i);
+        lm->sblkvpgs[dpcount] = ppg_i - sbfirst;
+        if (dst != psblki) {
+            lm->copies[dpcount].src = spgeo;
+            lm->copies[dpcount].src_i = ppg_i;
+            lm->copies[dpcount].dst_i = dstfirst + lm->sblkvpgs[dpcount];
+            lm->copies[dpcount].dst = vpg2geoaddr_sb(lm, lm->copies[dpcount].dst_i);
+        } else {
+            rw_batch_add(&(lm->batch), &spgeo, ppg_i, lm->sblkbuf + dpcount * lm->meta->vpg_sz, READ_MODE);
+        }
+        dpcount++;
+    }
+    if (dst != psblki) {
+        rw_batch_copy(&(lm->batch), lm->copies, dpcount);
+        return dpcount;
+    }
+    rw_batch_submit(&(lm->batch));
+    // the pages cannot go back to a retired superblock, see rehome_sb
+    if (erase_sb(lm, psblki) && lm->sblk_bad[psblki])
+        return dpcount;
+    for (dpi = 0; dpi < dpcount; dpi++) {
+        struct nodegeoaddr spgeo = vpg2geoaddr_sb(lm, sbfirst + lm->sblkvpgs[dpi]);
+        rw_batch_add(&(lm->batch), &spgeo, sbfirst + lm->sblkvpgs[dpi], lm->sblkbuf + dpi * lm->meta->vpg_sz, WRITE_MODE);
+    }
+    rw_batch_submit(&(lm->batch));
+    return dpcount;
+}
+
+// a retired superblock leaves the lists and the host superblock it backed is unmapped
+static void drop_sb(struct ls_meta* lm, uint64_t psblki) {
+    uint64_t total_mpus = lm->meta->node->nchs * lm->meta->node->nluns / lm->sblk_npus;
+    struct sblk_entry* entry = &(lm->sblk_entries[psblki]);
+    lm->vsblk2psblk[psblk2vsblk(lm, psblki)] = lm->sblk_ntotal;
+    lm->psblk2vsblk[psblki] = lm->sblk_ntotal;
+    gc_unit_remove(&(lm->gv), psblki);
+    TAILQ_REMOVE(&(lm->sblk_lists[psblki % total_mpus].non_empty_sblks), entry, pt);
+    lm->dirty_pg_count -= entry->meta->ndirtypgs;
+    lm->abandoned_pg_count -= entry->meta->nabandonedpgs;
+    lm->clean_pg_count -= lm->sblk_tpgs - entry->meta->ndirtypgs - entry->meta->nabandonedpgs;
+    entry->meta->ndirtypgs = 0;
+    entry->meta->nabandonedpgs = 0;
+}
+
+// erase a superblock without valid pages and give it back to its mPU
+static void erase_free_sb(struct ls_meta* lm, uint64_t psblki) {
+    uint64_t total_mpus = lm->meta->node->nchs * lm->meta->node->nluns / lm->sblk_npus;
+    struct sblk_entry* entry = &(lm->sblk_entries[psblki]);
+    struct sblk_list* listi = &(lm->sblk_lists[psblki % total_mpus]);
+    gc_unit_remove(&(lm->gv), psblki);
+    erase_sb(lm, psblki);
+    TAILQ_REMOVE(&(listi->non_empty_sblks), entry, pt);
+    lm->abandoned_pg_count -= entry->meta->nabandonedpgs;
+    lm->clean_pg_count += entry->meta->nabandonedpgs;
+    // a retired superblock leaves the lists for good
+    if (lm->sblk_bad[psblki])
+        lm->clean_pg_count -= lm->sblk_tpgs;
+    else
+        TAILQ_INSERT_TAIL(&(listi->empty_sblks), entry, pt);
+    entry->meta->nabandonedpgs = 0;
+}
+
+/*
+ * A superblock retired while compacted in place, for want of a free one: the
+ * valid pages move_valid left in sblkbuf go to the same offsets of another
+ * superblock, which backs its host superblock from now on with nnew pages
+ * more to be written. The other one comes from erasing a superblock without
+ * valid pages. Returns 1 when there is none: the pages are lost and the run
+ * stops.
+ */
+static int rehome_sb(struct ls_meta* lm, uint64_t psblki, uint64_t dpcount, uint64_t nnew) {
+    uint64_t vsblki = psblk2vsblk(lm, psblki);
+    struct sblk_entry* dst = find_next_free_sb(lm);
+    struct gc_unit* u = TAILQ_FIRST(&(lm->gv.buckets[0]));
+    while (dst == NULL && u != NULL) {
+        struct gc_unit* next = TAILQ_NEXT(u, bt);
+        if (lm->sblk_metas[u->id].ndirtypgs == 0 && lm->psblk2vsblk[u->id] == lm->sblk_ntotal) {
+            erase_free_sb(lm, u->id);
+            lm->gc_erased++;
+            dst = find_next_free_sb(lm);
+        }
+        u = next;
+    }
+    drop_sb(lm, psblki);
+    if (dst == NULL) {
+        printf("Node %d: superblock %" PRIu64 " retired, no free superblock for its %" PRIu64 " valid pages\n", lm->meta->node->nid, psblki, dpcount);
+        lm->nospace = 1;
+        return 1;
+    }
+    uint64_t dstfirst = sblk_first_pg(lm, dst->sblk_i);
+    uint64_t dpi;
+    for (dpi = 0; dpi < dpcount; dpi++) {
+        struct nodegeoaddr dpgeo = vpg2geoaddr_sb(lm, dstfirst + lm->sblkvpgs[dpi]);
+        rw_batch_add(&(lm->batch), &dpgeo, dstfirst + lm->sblkvpgs[dpi], lm->sblkbuf + dpi * lm->meta->vpg_sz, WRITE_MODE);
+    }
+    rw_batch_submit(&(lm->batch));
+    dst->meta->ndirtypgs = dpcount + nnew;
+    lm->dirty_pg_count += dpcount + nnew;
+    lm->clean_pg_count -= dpcount + nnew;
+    lm->vsblk2psblk[vsblki] = dst->sblk_i;
+    lm->psblk2vsblk[dst->sblk_i] = vsblki;
+    lm->map_change_count++;
+    gc_unit_full(&(lm->gv), dst->sblk_i, lm->sblk_tpgs);
+    return 0;
+}
+
+/*
+ * Reclaim the victim of the --gc policy. Returns 1 when a superblock was
+ * freed, 0 when a mapped one was compacted, -1 when there is no victim.
+ */
 static int garbage_collection(struct ls_meta* lm) {
     struct timeval tvalst, tvaled;
     gettimeofday(&tvalst, NULL);
-    int offset = 0;
-    int recycleflag = 0;
-    uint64_t total_mpus = lm->meta->node->nchs * lm->meta->node->nluns / lm->sblk_npus;
-    for (offset = 0; offset < total_mpus; offset++) {
-        struct sblk_entry_list* nonemptylist = &(lm->sblk_lists[lm->next_mpu_i].non_empty_sblks);
-        if (!TAILQ_EMPTY(nonemptylist)) {
-            struct sblk_entry* iter = TAILQ_FIRST(nonemptylist);
-            while (iter != NULL) {
-                struct sblk_entry* iternext = TAILQ_NEXT(iter, pt);
-                uint64_t psblki = iter->sblk_i;
-                if (iter->meta->ndirtypgs == 0) {
-                    erase_sb(lm, psblki);
-                    TAILQ_REMOVE(nonemptylist, iter, pt);
-                    TAILQ_INSERT_TAIL(&(lm->sblk_lists[lm->next_mpu_i].empty_sblks), iter, pt);
-                    lm->abandoned_pg_count -= iter->meta->nabandonedpgs;
-                    lm->clean_pg_count += iter->meta->nabandonedpgs;
-                    iter->meta->nabandonedpgs = 0;
-                    recycleflag++;
-                    break;
+    int ret = -1;
+    uint64_t victim = gc_victim(&(lm->gv));
+    if (victim != lm->gv.nunits) {
+        struct sblk_meta* vmeta = &(lm->sblk_metas[victim]);
+        int src = rw_prog_src(lm->meta, RW_PROG_GC);
+        if (vmeta->ndirtypgs == 0) {
+            erase_free_sb(lm, victim);
+            lm->gc_erased++;
+            ret = 1;
+        } else {
+            uint64_t vsblki = psblk2vsblk(lm, victim);
+            struct sblk_entry* dst = find_next_free_sb(lm);
+            gc_unit_remove(&(lm->gv), victim);
+            if (dst != NULL) {
+                lm->gc_moved_pgs += move_valid(lm, victim, dst->sblk_i);
+                dst->meta->ndirtypgs = vmeta->ndirtypgs;
+                vmeta->ndirtypgs = 0;
+                lm->vsblk2psblk[vsblki] = dst->sblk_i;
+                lm->psblk2vsblk[dst->sblk_i] = vsblki;
+                lm->psblk2vsblk[victim] = lm->sblk_ntotal;
+                // the dirty pages left on the victim go with the erase
+                vmeta->nabandonedpgs += dst->meta->ndirtypgs;
+                lm->abandoned_pg_count += dst->meta->ndirtypgs;
+                lm->clean_pg_count -= dst->meta->ndirtypgs;
+                erase_free_sb(lm, victim);
+                gc_unit_full(&(lm->gv), dst->sblk_i, lm->sblk_tpgs);
+                lm->gc_map_change_count++;
+            } else {
+                uint64_t dpcount = move_valid(lm, victim, victim);
+                lm->gc_moved_pgs += dpcount;
+                if (lm->sblk_bad[victim]) {
+                    rehome_sb(lm, victim, dpcount, 0);
+                } else {
+                    lm->abandoned_pg_count -= vmeta->nabandonedpgs;
+                    lm->clean_pg_count += vmeta->nabandonedpgs;
+                    vmeta->nabandonedpgs = 0;
+                    gc_unit_full(&(lm->gv), victim, lm->sblk_tpgs);
                 }
-                iter = iternext;
             }
-            if (recycleflag > 0)
-                break;
+            lm->gc_compacted++;
+            ret = 0;
         }
-        lm->next_mpu_i = (lm->next_mpu_i + 1) % total_mpus;
+        rw_prog_src(lm->meta, src);
     }
     gettimeofday(&tvaled, NULL);
     lm->gc_time += ((uint64_t)(tvaled.tv_sec - tvalst.tv_sec) * 1000000L + tvaled.tv_usec) - tvalst.tv_usec;
     lm->gc_count++;
-    return 0;
+    return ret;
+}
+
+/*
+ * A free superblock, collected if needed. Only superblocks no longer mapped
+ * (no valid page to keep) can be freed, compacting a mapped one cannot give
+ * a free superblock, so NULL when none is left.
+ */
+static struct sblk_entry* gc_free_sb(struct ls_meta* lm) {
+    struct sblk_entry* res = find_next_free_sb(lm);
+    while (res == NULL && !TAILQ_EMPTY(&(lm->gv.buckets[0])) && garbage_collection(lm) >= 0)
+        res = find_next_free_sb(lm);
+    return res;
+}
+
+/*
+ * Empty superblock of an mPU to open. With --wl the least erased one, by the
+ * erases of its blocks, like pick_empty_blk in engine 6.
+ */
+static struct sblk_entry* pick_empty_sb(struct ls_meta* lm, struct sblk_entry_list* emptylist) {
+    struct sblk_entry* best = TAILQ_FIRST(emptylist);
+    struct sblk_entry* be;
+    uint64_t beste = 0, e, inner_pui, inner_blki;
+    if (lm->meta->node->wl->wl_spread == 0)
+        return best;
+    TAILQ_FOREACH(be, emptylist, pt) {
+        struct sblkaddr ta = sblki2sblkaddr(lm, be->sblk_i);
+        e = 0;
+        for (inner_blki = 0; inner_blki < lm->sblk_nblks; inner_blki++) {
+            for (inner_pui = 0; inner_pui < lm->sblk_npus; inner_pui++) {
+                ta.inner_blk_i = inner_blki;
+                ta.inner_pu_i = inner_pui;
+                struct nodegeoaddr spgeo = sblkaddr2geoaddr(lm, &ta);
+                e += lm->meta->blk_erases[geoaddr2vblk(lm->meta->node, &spgeo)];
+            }
+        }
+        if (be == TAILQ_FIRST(emptylist) || e < beste) {
+            best = be;
+            beste = e;
+        }
+    }
+    return best;
 }
 
 static struct sblk_entry* find_next_free_sb(struct ls_meta* lm) {
@@ -401,10 +642,10 @@ static struct sblk_entry* find_next_free_sb(struct ls_meta* lm) {
     for (offset = 0; offset < total_mpus; offset++) {
         struct sblk_entry_list* emptylist = &(lm->sblk_lists[lm->next_mpu_i].empty_sblks);
         if (!TAILQ_EMPTY(emptylist)) {
-            lm->next_mpu_i = (lm->next_mpu_i + 1) % total_mpus;
-            struct sblk_entry* res = TAILQ_FIRST(emptylist);
+            struct sblk_entry* res = pick_empty_sb(lm, emptylist);
             TAILQ_REMOVE(emptylist, res, pt);
             TAILQ_INSERT_TAIL(&(lm->sblk_lists[lm->next_mpu_i].non_empty_sblks), res, pt);
+            lm->next_mpu_i = (lm->next_mpu_i + 1) % total_mpus;
             return res;
         }
         lm->next_mpu_i = (lm->next_mpu_i + 1) % total_mpus;
@@ -412,8 +653,14 @@ static struct sblk_entry* find_next_free_sb(struct ls_meta* lm) {
     return NULL;
 }
 
+/*
+ * Erase the dirty blocks of a superblock, all member PUs at once. A block
+ * failing its erase is swapped for a spare of its PU, the superblock is
+ * retired when the PU has none left.
+ */
 static int erase_sb(struct ls_meta* lm, uint64_t psblki) {
-    uint64_t inner_pui, inner_blki;
+    uint64_t inner_pui, inner_blki, i;
+    uint64_t n = 0;
     struct sblkaddr ta = sblki2sblkaddr(lm, psblki);
     ta.offset_in_page = 0;
     for (inner_blki = 0; inner_blki < lm->sblk_nblks; inner_blki++) {
@@ -422,12 +669,22 @@ static int erase_sb(struct ls_meta* lm, uint64_t psblki) {
             ta.inner_pu_i = inner_pui;
             ta.pg_i = 0;
             struct nodegeoaddr spgeo = sblkaddr2geoaddr(lm, &ta);
-            if (*get_p_blk_state(lm->meta, &spgeo) == BLOCK_DIRTY) {
-                erase_block_sb(lm, lm->meta, &spgeo);
-            }
+            if (get_blk_state(lm->meta, &spgeo) == BLOCK_DIRTY)
+                lm->sblkblks[n++] = spgeo;
         }
     }
-    return 0;
+    int ret = rw_batch_erase(&(lm->batch), lm->sblkblks, n);
+    for (i = 0; i < n; i++) {
+        if (get_blk_state(lm->meta, &(lm->sblkblks[i])) == BLOCK_DIRTY && rw_replace_blk(lm->meta, &(lm->sblkblks[i])) && !lm->sblk_bad[psblki]) {
+            lm->sblk_bad[psblki] = 1;
+            lm->meta->bad_retired++;
+            lm->meta->bad_retired_pgs += lm->sblk_tpgs;
+            ret = 1;
+        }
+        if (get_blk_state(lm->meta, &(lm->sblkblks[i])) == BLOCK_CLEAN)
+            clean_block_pgs(lm, lm->meta, &(lm->sblkblks[i]));
+    }
+    return ret;
 }
 
 static int realloc_sb(struct ls_meta* lm, uint64_t vpg_i_begin, uint64_t vpg_i_end) {
@@ -449,86 +706,56 @@ static int realloc_sb(struct ls_meta* lm, uint64_t vpg_i_begin, uint64_t vpg_i_e
             uint64_t vpg_i = 0;
             for (vpg_i = vpg_sbfst; vpg_i <= vpg_sblst; vpg_i++) {
                 uint64_t ppg_i = vpg2ppg(lm, vpg_i);
-                if (lm->meta->page_state[ppg_i] == PAGE_DIRTY) {
+                // a trimmed page cannot be programmed again before an erase
+                if (get_pg_state(lm->meta, ppg_i) != PAGE_CLEAN)
                     rewriteflag++;
-                    lm->meta->page_state[ppg_i] = PAGE_ABANDONED;
-                }
+                if (get_pg_state(lm->meta, ppg_i) == PAGE_DIRTY)
+                    set_pg_state(lm->meta, ppg_i, PAGE_ABANDONED);
             }
             if (rewriteflag > 0) {
                 // get a new superblock and merge
-                struct sblk_entry* nextemp = find_next_free_sb(lm);
-                uint64_t trycount = 0;
-                while (nextemp == NULL && trycount < lm->sblk_tblks) {
-                    garbage_collection(lm);
-                    nextemp = find_next_free_sb(lm);
-                    trycount++;
-                }
-                // read all dirty pages in superblock
-                struct sblkaddr ta = sblki2sblkaddr(lm, psblki);
-                ta.offset_in_page = 0;
-                uint64_t inner_pui, inner_blki, pgi;
-                uint64_t dpcount = 0;
-                for (inner_blki = 0; inner_blki < lm->sblk_nblks; inner_blki++) {
-                    for (pgi = 0; pgi < lm->meta->node->npgs; pgi++) {
-                        for (inner_pui = 0; inner_pui < lm->sblk_npus; inner_pui++) {
-                            ta.inner_blk_i = inner_blki;
-                            ta.inner_pu_i = inner_pui;
-                            ta.pg_i = pgi;
-                            struct nodegeoaddr spgeo = sblkaddr2geoaddr(lm, &ta);
-                            uint64_t ppg_i = geoaddr2vpg_sb(lm, &spgeo);
-                            uint64_t innerpg = ta.inner_blk_i * lm->sblk_npus * lm->meta->node->npgs + ta.pg_i * lm->sblk_npus + ta.inner_pu_i;
-                            if (lm->meta->page_state[ppg_i] == PAGE_DIRTY) {
-                                lm->sblkvpgs[dpcount] = innerpg;
-                                rw_inside_page_sb(lm, lm->blockbuf, lm->sblkbuf + dpcount * lm->meta->vpg_sz, lm->meta, &spgeo, lm->meta->vpg_sz, READ_MODE);
-                                dpcount++;
-                            }
-                        }
-                    }
-                }
+                gc_unit_remove(&(lm->gv), psblki);
+                struct sblk_entry* nextemp = gc_free_sb(lm);
+                // the valid pages moved along count as merge programs
+                int src = rw_prog_src(lm->meta, RW_PROG_MERGE);
+                uint64_t oldndpgs = lm->sblk_metas[psblki].ndirtypgs;
+                uint64_t oldnapgs = lm->sblk_metas[psblki].nabandonedpgs; // trimmed
                 if (nextemp == NULL) {
                     // clean and rewrite this super block, no remap
-                    erase_sb(lm, psblki);
-                    uint64_t dpi = 0;
-                    for (dpi = 0; dpi < dpcount; dpi++) {
-                        uint64_t innerpg = lm->sblkvpgs[dpi];
-                        struct sblkaddr ta = sblki2sblkaddr(lm, psblki);
-                        ta.inner_blk_i = innerpg / (lm->sblk_npus * lm->meta->node->npgs);
-                        ta.pg_i = innerpg / lm->sblk_npus % lm->meta->node->npgs;
-                        ta.inner_pu_i = innerpg % lm->sblk_npus;
-                        ta.offset_in_page = 0;
-                        struct nodegeoaddr spgeo = sblkaddr2geoaddr(lm, &ta);
-                        rw_inside_page_sb(lm, lm->blockbuf, lm->sblkbuf + dpi * lm->meta->vpg_sz, lm->meta, &spgeo, lm->meta->vpg_sz, WRITE_MODE);
+                    uint64_t dpcount = move_valid(lm, psblki, psblki);
+                    if (lm->sblk_bad[psblki]) {
+                        int ret = rehome_sb(lm, psblki, dpcount, vpgnum);
+                        rw_prog_src(lm->meta, src);
+                        if (ret)
+                            return 1;
+                        vpg_sbfst = vpg_sblst + 1;
+                        vpg_sblst = vpg_sbfst;
+                        continue;
                     }
-                    uint64_t oldndpgs = lm->sblk_metas[psblki].ndirtypgs;
                     lm->sblk_metas[psblki].ndirtypgs = dpcount + vpgnum;
+                    lm->sblk_metas[psblki].nabandonedpgs = 0;
                     lm->dirty_pg_count += (dpcount + vpgnum - oldndpgs);
-                    lm->clean_pg_count -= (dpcount + vpgnum - oldndpgs);
+                    lm->abandoned_pg_count -= oldnapgs;
+                    lm->clean_pg_count -= (dpcount + vpgnum - oldndpgs - oldnapgs);
+                    gc_unit_full(&(lm->gv), psblki, lm->sblk_tpgs);
                 } else {
-                    // remap
+                    // remap, the old superblock is left for GC to erase
                     uint64_t newpsblki = nextemp->sblk_i;
-                    uint64_t dpi = 0;
-                    for (dpi = 0; dpi < dpcount; dpi++) {
-                        uint64_t innerpg = lm->sblkvpgs[dpi];
-                        struct sblkaddr ta = sblki2sblkaddr(lm, newpsblki);
-                        ta.inner_blk_i = innerpg / (lm->sblk_npus * lm->meta->node->npgs);
-                        ta.pg_i = innerpg / lm->sblk_npus % lm->meta->node->npgs;
-                        ta.inner_pu_i = innerpg % lm->sblk_npus;
-                        ta.offset_in_page = 0;
-                        struct nodegeoaddr spgeo = sblkaddr2geoaddr(lm, &ta);
-                        rw_inside_page_sb(lm, lm->blockbuf, lm->sblkbuf + dpi * lm->meta->vpg_sz, lm->meta, &spgeo, lm->meta->vpg_sz, WRITE_MODE);
-                    }
-                    uint64_t oldndpgs = lm->sblk_metas[psblki].ndirtypgs;
+                    uint64_t dpcount = move_valid(lm, psblki, newpsblki);
                     lm->sblk_metas[newpsblki].ndirtypgs = dpcount + vpgnum;
                     lm->sblk_metas[psblki].ndirtypgs = 0;
-                    lm->sblk_metas[psblki].nabandonedpgs = lm->sblk_tblks;
+                    lm->sblk_metas[psblki].nabandonedpgs = lm->sblk_tpgs;
                     lm->dirty_pg_count += (dpcount + vpgnum - oldndpgs);
-                    lm->clean_pg_count -= (dpcount + vpgnum + lm->sblk_tblks - oldndpgs);
-                    lm->abandoned_pg_count += lm->sblk_tblks;
+                    lm->clean_pg_count -= (dpcount + vpgnum + lm->sblk_tpgs - oldndpgs - oldnapgs);
+                    lm->abandoned_pg_count += lm->sblk_tpgs - oldnapgs;
                     lm->vsblk2psblk[csblki] = newpsblki;
                     lm->psblk2vsblk[newpsblki] = csblki;
                     lm->psblk2vsblk[psblki] = lm->sblk_ntotal;
                     lm->map_change_count++;
+                    gc_unit_full(&(lm->gv), newpsblki, lm->sblk_tpgs);
+                    gc_unit_full(&(lm->gv), psblki, 0);
                 }
+                rw_prog_src(lm->meta, src);
             } else {
                 // no need to modify mapping
                 lm->sblk_metas[psblki].ndirtypgs += vpgnum;
@@ -536,10 +763,11 @@ static int realloc_sb(struct ls_meta* lm, uint64_t vpg_i_begin, uint64_t vpg_i_e
                 lm->clean_pg_count -= vpgnum;
             }
         } else { // map not set, alloc a new superblock
-            struct sblk_entry* nextemp = find_next_free_sb(lm);
-            while (nextemp == NULL) {
-                garbage_collection(lm);
-                nextemp = find_next_free_sb(lm);
+            struct sblk_entry* nextemp = gc_free_sb(lm);
+            if (nextemp == NULL) {
+                printf("Node %d: no free superblock for superblock %" PRIu64 "\n", lm->meta->node->nid, csblki);
+                lm->nospace = 1;
+                return 1;
             }
             uint64_t psblki = nextemp->sblk_i;
             nextemp->meta->ndirtypgs = vpgnum;
@@ -548,6 +776,7 @@ static int realloc_sb(struct ls_meta* lm, uint64_t vpg_i_begin, uint64_t vpg_i_e
             lm->vsblk2psblk[csblki] = psblki;
             lm->psblk2vsblk[psblki] = csblki;
             lm->map_set_count++;
+            gc_unit_full(&(lm->gv), psblki, lm->sblk_tpgs);
         }
         vpg_sbfst = vpg_sblst + 1;
         vpg_sblst = vpg_sbfst;
@@ -561,36 +790,57 @@ static int iterate_ls_io(struct fox_node* node, struct fox_blkbuf* buf, struct r
     struct nodegeoaddr voffset_end;
     set_nodegeoaddr(node, &voffset_begin, offset);
     set_nodegeoaddr(node, &voffset_end, offset + size - 1); // [offset_begin, offset_end]
-    struct nodegeoaddr poffset_begin = vaddr2paddr(lm, &voffset_begin);
-    struct nodegeoaddr poffset_end = vaddr2paddr(lm, &voffset_end);
     uint64_t vpg_i_begin = offset / vpg_sz;
     uint64_t vpg_i_end = (offset + size - 1) / vpg_sz;
 
     if (mode == READ_MODE) {
-        struct nodegeoaddr vpg_geo_end = vpg2geoaddr_sb(lm, vpg_i_end);
-        struct nodegeoaddr ppg_geo_end = vaddr2paddr(lm, &vpg_geo_end);
         uint8_t* resbuf_t = resbuf;
         // read
         if (vpg_i_begin == vpg_i_end) {
-            rw_inside_page_sb(lm, buf, resbuf_t, meta, &poffset_begin, size, mode);
+            read_vpg(lm, buf, resbuf_t, meta, vpg_i_begin, voffset_begin.offset_in_page, size);
             resbuf_t += size;
         } else {
             // read begin page
-            rw_inside_page_sb(lm, buf, resbuf_t, meta, &poffset_begin, vpg_sz - poffset_begin.offset_in_page, mode);
-            resbuf_t += (vpg_sz - poffset_begin.offset_in_page);
+            read_vpg(lm, buf, resbuf_t, meta, vpg_i_begin, voffset_begin.offset_in_page, vpg_sz - voffset_begin.offset_in_page);
+            resbuf_t += (vpg_sz - voffset_begin.offset_in_page);
             // read middle pages
             if (vpg_i_end - vpg_i_begin > 1) {
                 uint64_t middle_pgi;
                 for (middle_pgi = vpg_i_begin + 1; middle_pgi < vpg_i_end; middle_pgi++) {
-                    struct nodegeoaddr tvgeo = vpg2geoaddr_sb(lm, middle_pgi);
-                    struct nodegeoaddr tgeo = vaddr2paddr(lm, &tvgeo);
-                    rw_inside_page_sb(lm, buf, resbuf_t, meta, &tgeo, vpg_sz, mode);
+                    read_vpg(lm, buf, resbuf_t, meta, middle_pgi, 0, vpg_sz);
                     resbuf_t += vpg_sz;
                 }
             }
             // read end page
-            rw_inside_page_sb(lm, buf, resbuf_t, meta, &ppg_geo_end, poffset_end.offset_in_page + 1, mode);
-            resbuf_t += (poffset_end.offset_in_page + 1);
+            read_vpg(lm, buf, resbuf_t, meta, vpg_i_end, 0, voffset_end.offset_in_page + 1);
+            resbuf_t += (voffset_end.offset_in_page + 1);
+        }
+    } else if (mode == TRIM_MODE) {
+        uint64_t first, end, vpg_i;
+        if (!rw_trim_range(meta, offset, size, &first, &end))
+            return 0;
+        for (vpg_i = first; vpg_i < end; vpg_i++) {
+            uint64_t vsblki = vpgi2sblki(lm, vpg_i);
+            uint64_t psblki = vsblk2psblk(lm, vsblki);
+            if (psblki == lm->sblk_ntotal)
+                continue;
+            uint64_t ppg_i = vpg2ppg(lm, vpg_i);
+            if (get_pg_state(meta, ppg_i) != PAGE_DIRTY)
+                continue;
+            set_pg_state(meta, ppg_i, PAGE_ABANDONED);
+            lm->sblk_metas[psblki].ndirtypgs--;
+            lm->sblk_metas[psblki].nabandonedpgs++;
+            lm->dirty_pg_count--;
+            lm->abandoned_pg_count++;
+            meta->trim_valid++;
+            gc_unit_invalidate(&(lm->gv), psblki);
+            // nothing left, unmap so that GC can erase it
+            if (lm->sblk_metas[psblki].ndirtypgs == 0) {
+                lm->vsblk2psblk[vsblki] = lm->sblk_ntotal;
+                lm->psblk2vsblk[psblki] = lm->sblk_ntotal;
+                gc_unit_remove(&(lm->gv), psblki);
+                gc_unit_full(&(lm->gv), psblki, 0);
+            }
         }
     } else if (mode == WRITE_MODE) {
         struct nodegeoaddr vpg_geo_begin = vpg2geoaddr_sb(lm, vpg_i_begin);
@@ -598,63 +848,51 @@ static int iterate_ls_io(struct fox_node* node, struct fox_blkbuf* buf, struct r
         struct nodegeoaddr ppg_geo_begin = vaddr2paddr(lm, &vpg_geo_begin);
         struct nodegeoaddr ppg_geo_end = vaddr2paddr(lm, &vpg_geo_end);
         uint8_t* resbuf_t = resbuf;
+        if (lm->nospace)
+            return 1;
         // read first and last pages (if necessary) before GC!
         if (isalloc(lm, vpg_i_begin) && (((vpg_i_begin == vpg_i_end) && (voffset_begin.offset_in_page != 0 || voffset_end.offset_in_page != vpg_sz - 1)) || ((vpg_i_begin < vpg_i_end) && (voffset_begin.offset_in_page != 0))))
             rw_inside_page_sb(lm, buf, meta->begin_pagebuf, meta, &ppg_geo_begin, vpg_sz, READ_MODE);
         if (isalloc(lm, vpg_i_end) && ((vpg_i_begin < vpg_i_end) && (voffset_end.offset_in_page != vpg_sz - 1)))
             rw_inside_page_sb(lm, buf, meta->end_pagebuf, meta, &ppg_geo_end, vpg_sz, READ_MODE);
         
-        while (lm->clean_pg_count < vpg_i_end - vpg_i_begin + 1) {
-            garbage_collection(lm);
-        }
-        realloc_sb(lm, vpg_i_begin, vpg_i_end);    
+        while (lm->clean_pg_count < vpg_i_end - vpg_i_begin + 1 && garbage_collection(lm) >= 0)
+            ;
+        if (realloc_sb(lm, vpg_i_begin, vpg_i_end))
+            return 1;
         
-        // read or write...
+        // write, a stripe of the superblock goes to all its PUs at once
         if (vpg_i_begin == vpg_i_end) {
-            if (isalloc(lm, vpg_i_begin) && (voffset_begin.offset_in_page != 0 || voffset_end.offset_in_page != vpg_sz - 1)) {
-            }
-            // alloc a new page here
-            // uint64_t newppg = alloc_gc(lm, vpg_i_begin, vpg_i_begin, vpg_i_end);
-            struct nodegeoaddr vaddr = vpg2geoaddr_sb(lm, vpg_i_begin);
-            struct nodegeoaddr newppgaddr = vaddr2paddr(lm, &vaddr);
             memcpy(meta->begin_pagebuf + voffset_begin.offset_in_page, resbuf_t, size);
-            rw_inside_page_sb(lm, buf, meta->begin_pagebuf, meta, &newppgaddr, vpg_sz, mode);
+            write_vpg(lm, meta->begin_pagebuf, vpg_i_begin);
             resbuf_t += size;
         } else {
-            // rw begin page
-            if (isalloc(lm, vpg_i_begin) && (voffset_begin.offset_in_page != 0)) {
-            }
-            // uint64_t newppg = alloc_gc(lm, vpg_i_begin, vpg_i_begin, vpg_i_end);
-            struct nodegeoaddr vaddr = vpg2geoaddr_sb(lm, vpg_i_begin);
-            struct nodegeoaddr newppgaddr = vaddr2paddr(lm, &vaddr);
+            // begin page
             memcpy(meta->begin_pagebuf + voffset_begin.offset_in_page, resbuf_t, vpg_sz - voffset_begin.offset_in_page);
-            rw_inside_page_sb(lm, buf, meta->begin_pagebuf, meta, &newppgaddr, vpg_sz, mode);
+            write_vpg(lm, meta->begin_pagebuf, vpg_i_begin);
             resbuf_t += (vpg_sz - voffset_begin.offset_in_page);
-            // rw middle pages
-            if (vpg_i_end - vpg_i_begin > 1) {
-                uint64_t middle_pgi;
-                for (middle_pgi = vpg_i_begin + 1; middle_pgi < vpg_i_end; middle_pgi++) {
-                    //newppg = alloc_gc(lm, middle_pgi, 1, 0);
-                    vaddr = vpg2geoaddr_sb(lm, middle_pgi);
-                    newppgaddr = vaddr2paddr(lm, &vaddr);
-                    rw_inside_page_sb(lm, buf, resbuf_t, meta, &newppgaddr, vpg_sz, mode);
-                    resbuf_t += vpg_sz;
-                }
-            }
-            // rw end page
-            if (isalloc(lm, vpg_i_end) && (voffset_end.offset_in_page != vpg_sz - 1)) {
+            // middle pages
+            uint64_t middle_pgi;
+            for (middle_pgi = vpg_i_begin + 1; middle_pgi < vpg_i_end; middle_pgi++) {
+                write_vpg(lm, resbuf_t, middle_pgi);
+                resbuf_t += vpg_sz;
             }
-            // newppg = alloc_gc(lm, vpg_i_end, 1, 0);
-            vaddr = vpg2geoaddr_sb(lm, vpg_i_end);
-            newppgaddr = vaddr2paddr(lm, &vaddr);
+            // end page
             memcpy(meta->end_pagebuf, resbuf_t, voffset_end.offset_in_page + 1);
-            rw_inside_page_sb(lm, buf, meta->end_pagebuf, meta, &newppgaddr, vpg_sz, mode);
+            write_vpg(lm, meta->end_pagebuf, vpg_i_end);
             resbuf_t += (voffset_end.offset_in_page + 1);
         }
+        return rw_batch_submit(&(lm->stripe));
     }
     return 0;
 }
 
+// engine entry of the write buffer
+static int ls_io(void* ctx, uint8_t* data, uint64_t offset, uint64_t size, int mode) {
+    struct ls_meta* lm = (struct ls_meta*)ctx;
+    return iterate_ls_io(lm->meta->node, lm->blockbuf, lm->meta, lm, data, offset, size, mode);
+}
+
 static int rewrite_ls_start (struct fox_node *node)
 {
     node->stats.pgs_done = 0;
@@ -663,10 +901,30 @@ static int rewrite_ls_start (struct fox_node *node)
     if (fox_alloc_blk_buf (node, &nbuf))
         goto OUT;
 
-    struct rewrite_meta meta;
-    init_rewrite_meta(node, &meta);
+    // superblocks are composed from the provisioned blocks
+    fox_wait_for_monitor (node->wl);
     struct ls_meta lm;
-    init_ls_meta(&meta, &nbuf, &lm);
+    memset(&lm, 0, sizeof(struct ls_meta));
+    lm.sblk_bad = rw_sb_compose(node);
+    if (lm.sblk_bad == NULL)
+        goto OUT;
+
+    struct rewrite_meta meta;
+    if (init_rewrite_meta(node, &meta))
+        goto OUT;
+    if (init_ls_meta(&meta, &nbuf, &lm)) {
+        // lm was zeroed, free_ls_meta only frees what init_ls_meta got to
+        free_ls_meta(&lm);
+        free_rewrite_meta(&meta);
+        fox_free_blkbuf (&nbuf, 1);
+        goto OUT;
+    }
+    struct rw_rcache rc;
+    struct rw_wbuf wb;
+    if (rw_rcache_init(&rc, &meta, node->wl->rcache_pgs, node->wl->rcache_policy, node->wl->readahead, ls_io, &lm))
+        goto OUT;
+    if (rw_wbuf_init(&wb, &meta, node->wl->wbuf_pgs, rw_rcache_io, &rc))
+        goto OUT;
 
     uint64_t max_iosize = 0;
     uint64_t t = 0;
@@ -688,12 +946,25 @@ static int rewrite_ls_start (struct fox_node *node)
             mode = READ_MODE;
         else if (meta.ioseq[t].iotype == 'w')
             mode = WRITE_MODE;
+        else if (meta.ioseq[t].iotype == 't')
+            mode = TRIM_MODE;
 
         gettimeofday(&tvalst, NULL);
-        iterate_ls_io(node, &nbuf, &meta, &lm, databuf, meta.ioseq[t].offset, meta.ioseq[t].size, mode);
+        rw_wbuf_io(&wb, databuf, meta.ioseq[t].offset, meta.ioseq[t].size, mode);
+        if (lm.nospace) {
+            printf(" Node %d: no superblock left for host data, %" PRIu64 " retired, run stopped at I/O %" PRIu64 "/%" PRIu64 "\n",
+                    node->nid, meta.bad_retired, t, meta.ioseqlen);
+            break;
+        }
         gettimeofday(&tvaled, NULL);
         // record time
         meta.ioseq[t].exetime = ((uint64_t)(tvaled.tv_sec - tvalst.tv_sec) * 1000000L + tvaled.tv_usec) - tvalst.tv_usec;
+        // readahead is timed apart from the I/O, see rw_rcache_print
+        rw_rcache_prefetch(&rc);
+        meta.ioseq[t].cache_lookups = rc.lookups;
+        meta.ioseq[t].cache_hits = rc.hits;
+        meta.ioseq[t].cache_saved = rc.saved + rc.rmw_saved;
+        rw_waf_record(&meta, &meta.ioseq[t]);
         // record benefit / cost
         meta.ioseq[t].nabandoned = lm.abandoned_pg_count;
         meta.ioseq[t].ndirty = lm.dirty_pg_count;
@@ -712,16 +983,30 @@ static int rewrite_ls_start (struct fox_node *node)
         meta.ioseq[t].read_t = st->read_t;
         meta.ioseq[t].write_t = st->write_t;
     }
+    // no room for the buffered pages either, they are not written
+    if (!lm.nospace)
+        rw_wbuf_drain(&wb);
     fox_end_node (node);
 
     write_meta_stats(&meta);
+    printf(" Node %d: GC erased %" PRIu64 " superblocks, compacted %" PRIu64 ", %" PRIu64 " pages moved\n",
+            node->nid, lm.gc_erased, lm.gc_compacted, lm.gc_moved_pgs);
+    rw_waf_print(&meta, gc_policy_name(node->wl->gc_policy));
+    rw_batch_print(&(lm.batch));
+    rw_wbuf_print(&wb);
+    rw_rcache_print(&rc);
+    rw_trim_print(&meta);
+    rw_bad_print(&meta);
+    rw_wear_print(&meta);
 
+    rw_wbuf_free(&wb);
+    rw_rcache_free(&rc);
     fox_free_blkbuf (&nbuf, 1);
     free(databuf);
     free_rewrite_meta(&meta);
     free_ls_meta(&lm);
     printf("\n[%" PRId64 ", %" PRId64 "]\n", lm.map_change_count, lm.map_set_count);
-    return 0;
+    return lm.nospace ? -1 : 0;
 
 OUT:
     return -1;
@@ -32,6 +32,9 @@
  * Read as usual;
  * Write like log-structured file systems;
  * Erase when garbage collection.
+ * GC moves the valid pages of a stripe in batches (fox-rewrite-batch.c).
+ * With --ckpt the last stripes hold the checkpoint regions (fox-rewrite-ckpt.c)
+ * and the log wraps before them.
  * Written by Chuizheng Meng <mengcz13@mails.tsinghua.edu.cn>
  */
 
@@ -46,6 +49,8 @@ struct ls_meta {
     struct fox_blkbuf* blockbuf;
     uint64_t used_end_ppg;
     uint64_t used_begin_ppg;
+    uint64_t log_pagenum; // pages of the log, the stripes after it are the checkpoint's
+    uint64_t log_nblks; // stripes of the log
     uint64_t dirty_pg_count;
     uint64_t abandoned_pg_count;
     uint64_t clean_pg_count;
@@ -54,12 +59,18 @@ struct ls_meta {
     uint64_t gc_count;
     uint64_t gc_time;
     uint64_t gc_map_change_count;
-    uint64_t* vpg2ppg;
-    uint64_t* ppg2vpg;
+    rw_pgno* vpg2ppg;
+    rw_pgno* ppg2vpg; // NULL with --oob
+    struct rw_ckpt ckpt; // checkpoint and journal of vpg2ppg, see map_set
     uint8_t* clblocks_buf;
     uint64_t* clblocks_vpgbuf;
+    struct rw_batch batch; // GC migration, one stripe of blocks at most
+    struct rw_copy* copies;
+    uint64_t ncopies;
 };
 
+static uint64_t ckpt_get(void* ctx, uint64_t idx);
+
 static int init_ls_meta(struct rewrite_meta* meta, struct fox_blkbuf* blockbuf, struct ls_meta* lm) {
     lm->meta = meta;
     lm->blockbuf = blockbuf;
@@ -73,27 +84,54 @@ static int init_ls_meta(struct rewrite_meta* meta, struct fox_blkbuf* blockbuf,
     lm->gc_count = 0;
     lm->gc_time = 0;
     lm->gc_map_change_count = 0;
-    lm->vpg2ppg = (uint64_t*)calloc(meta->total_pagenum, sizeof(uint64_t));
-    lm->ppg2vpg = (uint64_t*)calloc(meta->total_pagenum, sizeof(uint64_t));
+    lm->vpg2ppg = (rw_pgno*)calloc(meta->total_pagenum, sizeof(rw_pgno));
+    lm->ppg2vpg = (meta->oob) ? NULL : (rw_pgno*)calloc(meta->total_pagenum, sizeof(rw_pgno));
     lm->clblocks_buf = (uint8_t*)calloc((uint64_t)meta->node->nluns * meta->node->nchs * 1 * meta->node->npgs * meta->vpg_sz, sizeof(uint8_t));
     lm->clblocks_vpgbuf = (uint64_t*)calloc((uint64_t)meta->node->nluns * meta->node->nchs * 1 * meta->node->npgs, sizeof(uint64_t));
+    lm->copies = (struct rw_copy*)calloc((uint64_t)meta->node->nluns * meta->node->nchs * meta->node->npgs, sizeof(struct rw_copy));
+    lm->ncopies = 0;
+    if (rw_batch_init(&(lm->batch), meta->node, meta, blockbuf, (uint64_t)meta->node->nluns * meta->node->nchs * meta->node->npgs, (uint64_t)meta->node->nluns * meta->node->nchs * 4))
+        return 1;
     int vpi;
     for (vpi = 0; vpi < meta->total_pagenum; vpi++) {
         // lm->vpg2ppg[pi] = pi;
         lm->vpg2ppg[vpi] = meta->total_pagenum;
     }
     int ppi;
-    for (ppi = 0; ppi < meta->total_pagenum; ppi++) {
+    for (ppi = 0; lm->ppg2vpg && ppi < meta->total_pagenum; ppi++) {
         lm->ppg2vpg[ppi] = meta->total_pagenum;
     }
+
+    // GC erases whole stripes, the checkpoint regions take the last ones
+    uint64_t npus = (uint64_t)meta->node->nchs * meta->node->nluns;
+    uint64_t rstripes, ci;
+    lm->log_nblks = meta->node->nblks;
+    lm->log_pagenum = meta->total_pagenum;
+    if (rw_ckpt_init(&(lm->ckpt), meta, meta->node->wl->ckpt, ckpt_get, lm))
+        return 1;
+    rstripes = (lm->ckpt.nblks + npus - 1) / npus;
+    if (rstripes && rstripes > meta->node->nblks / 4) {
+        printf(" Node %d: checkpoint needs %" PRIu64 " stripes, too many for the node, checkpoints disabled\n",
+                meta->node->nid, rstripes);
+        rw_ckpt_free(&(lm->ckpt));
+        rstripes = 0;
+    }
+    lm->log_nblks -= rstripes;
+    lm->log_pagenum -= rstripes * npus * meta->node->npgs;
+    lm->clean_pg_count = lm->log_pagenum;
+    for (ci = 0; ci < lm->ckpt.nblks; ci++)
+        lm->ckpt.blks[ci] = lm->log_nblks * npus + ci;
     return 0;
 }
 
 static int free_ls_meta(struct ls_meta* lm) {
+    rw_ckpt_free(&(lm->ckpt));
     free(lm->vpg2ppg);
     free(lm->ppg2vpg);
     free(lm->clblocks_buf);
     free(lm->clblocks_vpgbuf);
+    free(lm->copies);
+    rw_batch_free(&(lm->batch));
     return 0;
 }
 
@@ -101,8 +139,43 @@ static uint64_t vpg2ppg(struct ls_meta* lm, uint64_t vpg_i) {
     return lm->vpg2ppg[vpg_i];
 }
 
+// owner of a valid page, from the OOB of the page with --oob
 static uint64_t ppg2vpg(struct ls_meta* lm, uint64_t ppg_i) {
-    return lm->ppg2vpg[ppg_i];
+    return (lm->ppg2vpg) ? lm->ppg2vpg[ppg_i] : rw_oob_read(lm->meta, ppg_i);
+}
+
+// the OOB is only written with the page, stale owners are left behind
+static void set_ppg2vpg(struct ls_meta* lm, uint64_t ppg_i, uint64_t vpg_i) {
+    if (lm->ppg2vpg)
+        lm->ppg2vpg[ppg_i] = vpg_i;
+    else if (vpg_i != lm->meta->total_pagenum)
+        rw_oob_write(lm->meta, ppg_i, vpg_i);
+}
+
+// every update of a logical page entry is journaled for the checkpoint
+static void map_set(struct ls_meta* lm, uint64_t vpg_i, uint64_t ppg_i) {
+    lm->vpg2ppg[vpg_i] = ppg_i;
+    rw_ckpt_log(&(lm->ckpt), vpg_i, ppg_i);
+}
+
+// checkpointed image: vpg2ppg, then the write pointer of each block
+static uint64_t ckpt_get(void* ctx, uint64_t idx) {
+    struct ls_meta* lm = (struct ls_meta*)ctx;
+    struct nodegeoaddr geo;
+    if (idx < lm->meta->total_pagenum)
+        return vpg2ppg(lm, idx);
+    // the log fills the pages of a block in order, up to the first clean one
+    geo = vblk2geoaddr(lm->meta->node, idx - lm->meta->total_pagenum);
+    for (geo.pg_i = 0; geo.pg_i < lm->meta->node->npgs; geo.pg_i++)
+        if (get_page_state(lm->meta, &geo) == PAGE_CLEAN)
+            break;
+    return geo.pg_i;
+}
+
+// erase_block and the record of the erase in the journal
+static int erase_log_block(struct ls_meta* lm, struct nodegeoaddr* geo) {
+    rw_ckpt_erase(&(lm->ckpt), geoaddr2vblk(lm->meta->node, geo));
+    return erase_block(lm->meta->node, lm->meta, geo);
 }
 
 static struct nodegeoaddr vaddr2paddr(struct ls_meta* lm, struct nodegeoaddr* vaddr) {
@@ -122,9 +195,22 @@ static int isalloc(struct ls_meta* lm, uint64_t vpg_i) {
         return 1;
 }
 
+// read part of a virtual page, unmapped (never written or trimmed) pages read as zeros
+static int read_vpg(struct ls_meta* lm, uint8_t* databuf, uint64_t vpg_i, uint64_t offset_in_page, uint64_t size) {
+    uint64_t ppg_i = vpg2ppg(lm, vpg_i);
+    if (ppg_i == lm->meta->total_pagenum) {
+        memset(databuf, 0, size);
+        return 0;
+    }
+    struct nodegeoaddr paddr = vpg2geoaddr(lm->meta->node, ppg_i);
+    paddr.offset_in_page = offset_in_page;
+    return rw_inside_page(lm->meta->node, lm->blockbuf, databuf, lm->meta, &paddr, size, READ_MODE);
+}
+
 static int garbage_collection(struct ls_meta* lm, uint64_t vpg_i_begin, uint64_t vpg_i_end) {
-    if (lm->clean_pg_count == lm->meta->total_pagenum)
+    if (lm->clean_pg_count == lm->log_pagenum)
         return 0;
+    int src = rw_prog_src(lm->meta, RW_PROG_GC);
     struct timeval tvalst, tvaled;
     gettimeofday(&tvalst, NULL);
     // abandon pages to rewrite
@@ -132,18 +218,18 @@ static int garbage_collection(struct ls_meta* lm, uint64_t vpg_i_begin, uint64_t
     for (vpg_i = vpg_i_begin; vpg_i <= vpg_i_end; vpg_i++) {
         if (isalloc(lm, vpg_i)) {
             uint64_t oldppg = lm->vpg2ppg[vpg_i];
-            lm->meta->page_state[oldppg] = PAGE_ABANDONED;
+            set_pg_state(lm->meta, oldppg, PAGE_ABANDONED);
             lm->dirty_pg_count--;
             lm->abandoned_pg_count++;
-            lm->vpg2ppg[vpg_i] = lm->meta->total_pagenum;
-            lm->ppg2vpg[oldppg] = lm->meta->total_pagenum;
+            map_set(lm, vpg_i, lm->meta->total_pagenum);
+            set_ppg2vpg(lm, oldppg, lm->meta->total_pagenum);
         }
     }
-    uint64_t used_last_ppg = (lm->used_end_ppg + lm->meta->total_pagenum - 1) % (lm->meta->total_pagenum);
+    uint64_t used_last_ppg = (lm->used_end_ppg + lm->log_pagenum - 1) % lm->log_pagenum;
     struct nodegeoaddr used_last_paddr = vpg2geoaddr(lm->meta->node, used_last_ppg);
     struct nodegeoaddr used_begin_paddr = vpg2geoaddr(lm->meta->node, lm->used_begin_ppg);
     uint64_t begin_clblock_i = used_begin_paddr.blk_i;
-    uint64_t end_clblock_i = (used_last_paddr.blk_i + 1) % (lm->meta->node->nblks);
+    uint64_t end_clblock_i = (used_last_paddr.blk_i + 1) % lm->log_nblks;
     struct nodegeoaddr nfblk_start;
     nfblk_start.offset_in_page = 0;
     nfblk_start.ch_i = 0;
@@ -158,13 +244,14 @@ static int garbage_collection(struct ls_meta* lm, uint64_t vpg_i_begin, uint64_t
         uint64_t dirty_i = 0;
         uint64_t pgoff = 0;
         for (pgoff = 0; pgoff < lm->dirty_pg_count + lm->abandoned_pg_count + 1; pgoff++) {
-            uint64_t currpg = (lm->used_begin_ppg + pgoff) % lm->meta->total_pagenum;
+            uint64_t currpg = (lm->used_begin_ppg + pgoff) % lm->log_pagenum;
             struct nodegeoaddr currpgaddr = vpg2geoaddr(lm->meta->node, currpg);
             if (pgoff > 0 && (pgoff % (lm->meta->node->nchs * lm->meta->node->nluns * lm->meta->node->npgs) == 0 || pgoff == lm->dirty_pg_count + lm->abandoned_pg_count)) {
                 uint64_t dirty_in_one = dirty_i;
+                rw_batch_submit(&(lm->batch));
                 struct nodegeoaddr to_erase_block_addr = currpgaddr;
                 if (pgoff % (lm->meta->node->nchs * lm->meta->node->nluns * lm->meta->node->npgs) == 0)
-                    to_erase_block_addr.blk_i = (to_erase_block_addr.blk_i + lm->meta->node->nblks - 1) % lm->meta->node->nblks;
+                    to_erase_block_addr.blk_i = (to_erase_block_addr.blk_i + lm->log_nblks - 1) % lm->log_nblks;
                 to_erase_block_addr.offset_in_page = to_erase_block_addr.pg_i = 0;
                 uint64_t ch_i = 0;
                 uint64_t lun_i = 0;
@@ -172,29 +259,30 @@ static int garbage_collection(struct ls_meta* lm, uint64_t vpg_i_begin, uint64_t
                     for (ch_i = 0; ch_i < lm->meta->node->nchs; ch_i++) {
                         to_erase_block_addr.ch_i = ch_i;
                         to_erase_block_addr.lun_i = lun_i;
-                        erase_block(lm->meta->node, lm->meta, &to_erase_block_addr);
+                        erase_log_block(lm, &to_erase_block_addr);
                     }
                 }
                 // after cleaning, write from buffer to new clean area
                 for (dirty_i = 0; dirty_i < dirty_in_one; dirty_i++) {
-                    rw_inside_page(lm->meta->node, lm->blockbuf, lm->clblocks_buf + dirty_i * lm->meta->vpg_sz, lm->meta, &nfblk, lm->meta->vpg_sz, WRITE_MODE);
+                    rw_batch_add(&(lm->batch), &nfblk, nfblkppg, lm->clblocks_buf + dirty_i * lm->meta->vpg_sz, WRITE_MODE);
                     uint64_t vpgi = lm->clblocks_vpgbuf[dirty_i];
                     uint64_t oldppgi = lm->vpg2ppg[vpgi];
-                    lm->ppg2vpg[oldppgi] = lm->meta->total_pagenum;
-                    lm->vpg2ppg[vpgi] = nfblkppg;
-                    lm->ppg2vpg[nfblkppg] = vpgi;
+                    set_ppg2vpg(lm, oldppgi, lm->meta->total_pagenum);
+                    map_set(lm, vpgi, nfblkppg);
+                    set_ppg2vpg(lm, nfblkppg, vpgi);
                     lm->map_change_count++;
                     lm->gc_map_change_count++;
-                    nfblkppg = (nfblkppg + 1) % lm->meta->total_pagenum;
+                    nfblkppg = (nfblkppg + 1) % lm->log_pagenum;
                     nfblk = vpg2geoaddr(lm->meta->node, nfblkppg);
                 }
+                rw_batch_submit(&(lm->batch));
                 dirty_i = 0;
                 if (pgoff == lm->dirty_pg_count + lm->abandoned_pg_count)
                     break;
             }
-            if (lm->meta->page_state[currpg] == PAGE_DIRTY && pgoff < lm->dirty_pg_count + lm->abandoned_pg_count) {
-                rw_inside_page(lm->meta->node, lm->blockbuf, lm->clblocks_buf + dirty_i * lm->meta->vpg_sz, lm->meta, &currpgaddr, lm->meta->vpg_sz, READ_MODE);
-                lm->clblocks_vpgbuf[dirty_i] = lm->ppg2vpg[currpg];
+            if (get_pg_state(lm->meta, currpg) == PAGE_DIRTY && pgoff < lm->dirty_pg_count + lm->abandoned_pg_count) {
+                rw_batch_add(&(lm->batch), &currpgaddr, currpg, lm->clblocks_buf + dirty_i * lm->meta->vpg_sz, READ_MODE);
+                lm->clblocks_vpgbuf[dirty_i] = ppg2vpg(lm, currpg);
                 dirty_i++;
             }
         }
@@ -206,12 +294,15 @@ static int garbage_collection(struct ls_meta* lm, uint64_t vpg_i_begin, uint64_t
         uint64_t nfblkppg = nfblkppg_start;
         uint64_t pgoff = 0;
         for (pgoff = 0; pgoff < lm->dirty_pg_count + lm->abandoned_pg_count + 1; pgoff++) {
-            uint64_t currpg = (lm->used_begin_ppg + pgoff) % lm->meta->total_pagenum;
+            uint64_t currpg = (lm->used_begin_ppg + pgoff) % lm->log_pagenum;
             struct nodegeoaddr currpgaddr = vpg2geoaddr(lm->meta->node, currpg);
             if (pgoff > 0 && (pgoff % (lm->meta->node->nchs * lm->meta->node->nluns * lm->meta->node->npgs) == 0 || pgoff == lm->dirty_pg_count + lm->abandoned_pg_count)) {
+                // move the valid pages of the stripe before erasing it
+                rw_batch_copy(&(lm->batch), lm->copies, lm->ncopies);
+                lm->ncopies = 0;
                 struct nodegeoaddr to_erase_block_addr = currpgaddr;
                 if (pgoff % (lm->meta->node->nchs * lm->meta->node->nluns * lm->meta->node->npgs) == 0)
-                    to_erase_block_addr.blk_i = (to_erase_block_addr.blk_i + lm->meta->node->nblks - 1) % lm->meta->node->nblks;
+                    to_erase_block_addr.blk_i = (to_erase_block_addr.blk_i + lm->log_nblks - 1) % lm->log_nblks;
                 to_erase_block_addr.offset_in_page = to_erase_block_addr.pg_i = 0;
                 uint64_t ch_i = 0;
                 uint64_t lun_i = 0;
@@ -219,22 +310,25 @@ static int garbage_collection(struct ls_meta* lm, uint64_t vpg_i_begin, uint64_t
                     for (ch_i = 0; ch_i < lm->meta->node->nchs; ch_i++) {
                         to_erase_block_addr.ch_i = ch_i;
                         to_erase_block_addr.lun_i = lun_i;
-                        erase_block(lm->meta->node, lm->meta, &to_erase_block_addr);
+                        erase_log_block(lm, &to_erase_block_addr);
                     }
                 }
                 if (pgoff == lm->dirty_pg_count + lm->abandoned_pg_count)
                     break;
             }
-            if (lm->meta->page_state[currpg] == PAGE_DIRTY) {
-                rw_inside_page(lm->meta->node, lm->blockbuf, lm->meta->pagebuf, lm->meta, &currpgaddr, lm->meta->vpg_sz, READ_MODE);
-                rw_inside_page(lm->meta->node, lm->blockbuf, lm->meta->pagebuf, lm->meta, &nfblk, lm->meta->vpg_sz, WRITE_MODE);
-                uint64_t vpgi = lm->ppg2vpg[currpg];
-                lm->ppg2vpg[currpg] = lm->meta->total_pagenum;
-                lm->vpg2ppg[vpgi] = nfblkppg;
-                lm->ppg2vpg[nfblkppg] = vpgi;
+            if (get_pg_state(lm->meta, currpg) == PAGE_DIRTY) {
+                struct rw_copy* cp = &(lm->copies[lm->ncopies++]);
+                cp->src = currpgaddr;
+                cp->src_i = currpg;
+                cp->dst = nfblk;
+                cp->dst_i = nfblkppg;
+                uint64_t vpgi = ppg2vpg(lm, currpg);
+                set_ppg2vpg(lm, currpg, lm->meta->total_pagenum);
+                map_set(lm, vpgi, nfblkppg);
+                set_ppg2vpg(lm, nfblkppg, vpgi);
                 lm->map_change_count++;
                 lm->gc_map_change_count++;
-                nfblkppg = (nfblkppg + 1) % (lm->meta->total_pagenum);
+                nfblkppg = (nfblkppg + 1) % lm->log_pagenum;
                 nfblk = vpg2geoaddr(lm->meta->node, nfblkppg);
             }
         }
@@ -246,6 +340,7 @@ static int garbage_collection(struct ls_meta* lm, uint64_t vpg_i_begin, uint64_t
     lm->gc_count++;
     gettimeofday(&tvaled, NULL);
     lm->gc_time += ((uint64_t)(tvaled.tv_sec - tvalst.tv_sec) * 1000000L + tvaled.tv_usec) - tvalst.tv_usec;
+    rw_prog_src(lm->meta, src);
     return 0;
 }
 
@@ -253,16 +348,16 @@ static uint64_t allocate_page(struct ls_meta* lm, uint64_t vpg_i) {
     int isallocflag = isalloc(lm, vpg_i);
     if (isallocflag) {
         uint64_t oldppg = lm->vpg2ppg[vpg_i];
-        lm->meta->page_state[oldppg] = PAGE_ABANDONED;
+        set_pg_state(lm->meta, oldppg, PAGE_ABANDONED);
         lm->dirty_pg_count--;
         lm->abandoned_pg_count++;
-        lm->ppg2vpg[oldppg] = lm->meta->total_pagenum;
-        lm->vpg2ppg[vpg_i] = lm->meta->total_pagenum;
+        set_ppg2vpg(lm, oldppg, lm->meta->total_pagenum);
+        map_set(lm, vpg_i, lm->meta->total_pagenum);
     }
     uint64_t newppg = lm->used_end_ppg;
-    lm->used_end_ppg = (lm->used_end_ppg + 1) % lm->meta->total_pagenum;
-    lm->vpg2ppg[vpg_i] = newppg;
-    lm->ppg2vpg[newppg] = vpg_i;
+    lm->used_end_ppg = (lm->used_end_ppg + 1) % lm->log_pagenum;
+    map_set(lm, vpg_i, newppg);
+    set_ppg2vpg(lm, newppg, vpg_i);
     if (isallocflag)
         lm->map_change_count++;
     else
@@ -280,34 +375,45 @@ static int iterate_ls_io(struct fox_node* node, struct fox_blkbuf* buf, struct r
     struct nodegeoaddr voffset_end;
     set_nodegeoaddr(node, &voffset_begin, offset);
     set_nodegeoaddr(node, &voffset_end, offset + size - 1); // [offset_begin, offset_end]
-    struct nodegeoaddr poffset_begin = vaddr2paddr(lm, &voffset_begin);
-    struct nodegeoaddr poffset_end = vaddr2paddr(lm, &voffset_end);
     uint64_t vpg_i_begin = offset / vpg_sz;
     uint64_t vpg_i_end = (offset + size - 1) / vpg_sz;
 
     if (mode == READ_MODE) {
-        struct nodegeoaddr ppg_geo_end = vpg2geoaddr(node, vpg2ppg(lm, vpg_i_end));
         uint8_t* resbuf_t = resbuf;
         // read
         if (vpg_i_begin == vpg_i_end) {
-            rw_inside_page(node, buf, resbuf_t, meta, &poffset_begin, size, mode);
+            read_vpg(lm, resbuf_t, vpg_i_begin, voffset_begin.offset_in_page, size);
             resbuf_t += size;
         } else {
             // read begin page
-            rw_inside_page(node, buf, resbuf_t, meta, &poffset_begin, vpg_sz - poffset_begin.offset_in_page, mode);
-            resbuf_t += (vpg_sz - poffset_begin.offset_in_page);
+            read_vpg(lm, resbuf_t, vpg_i_begin, voffset_begin.offset_in_page, vpg_sz - voffset_begin.offset_in_page);
+            resbuf_t += (vpg_sz - voffset_begin.offset_in_page);
             // read middle pages
             if (vpg_i_end - vpg_i_begin > 1) {
                 uint64_t middle_pgi;
                 for (middle_pgi = vpg_i_begin + 1; middle_pgi < vpg_i_end; middle_pgi++) {
-                    struct nodegeoaddr tgeo = vpg2geoaddr(node, vpg2ppg(lm, middle_pgi));
-                    rw_inside_page(node, buf, resbuf_t, meta, &tgeo, vpg_sz, mode);
+                    read_vpg(lm, resbuf_t, middle_pgi, 0, vpg_sz);
                     resbuf_t += vpg_sz;
                 }
             }
             // read end page
-            rw_inside_page(node, buf, resbuf_t, meta, &ppg_geo_end, poffset_end.offset_in_page + 1, mode);
-            resbuf_t += (poffset_end.offset_in_page + 1);
+            read_vpg(lm, resbuf_t, vpg_i_end, 0, voffset_end.offset_in_page + 1);
+            resbuf_t += (voffset_end.offset_in_page + 1);
+        }
+    } else if (mode == TRIM_MODE) {
+        uint64_t first, end, vpg_i;
+        if (!rw_trim_range(meta, offset, size, &first, &end))
+            return 0;
+        for (vpg_i = first; vpg_i < end; vpg_i++) {
+            if (isalloc(lm, vpg_i)) {
+                uint64_t oldppg = lm->vpg2ppg[vpg_i];
+                set_pg_state(meta, oldppg, PAGE_ABANDONED);
+                lm->dirty_pg_count--;
+                lm->abandoned_pg_count++;
+                map_set(lm, vpg_i, meta->total_pagenum);
+                set_ppg2vpg(lm, oldppg, meta->total_pagenum);
+                meta->trim_valid++;
+            }
         }
     } else if (mode == WRITE_MODE) {
         struct nodegeoaddr vpg_geo_begin = vpg2geoaddr(node, vpg_i_begin);
@@ -372,6 +478,12 @@ static int iterate_ls_io(struct fox_node* node, struct fox_blkbuf* buf, struct r
     return 0;
 }
 
+// engine entry of the write buffer
+static int ls_io(void* ctx, uint8_t* data, uint64_t offset, uint64_t size, int mode) {
+    struct ls_meta* lm = (struct ls_meta*)ctx;
+    return iterate_ls_io(lm->meta->node, lm->blockbuf, lm->meta, lm, data, offset, size, mode);
+}
+
 static int rewrite_ls_start (struct fox_node *node)
 {
     node->stats.pgs_done = 0;
@@ -381,9 +493,23 @@ static int rewrite_ls_start (struct fox_node *node)
         goto OUT;
 
     struct rewrite_meta meta;
-    init_rewrite_meta(node, &meta);
+    if (init_rewrite_meta(node, &meta))
+        goto OUT;
     struct ls_meta lm;
-    init_ls_meta(&meta, &nbuf, &lm);
+    memset(&lm, 0, sizeof(struct ls_meta));
+    if (init_ls_meta(&meta, &nbuf, &lm)) {
+        // lm was zeroed, free_ls_meta only frees what init_ls_meta got to
+        free_ls_meta(&lm);
+        free_rewrite_meta(&meta);
+        fox_free_blkbuf (&nbuf, 1);
+        goto OUT;
+    }
+    struct rw_rcache rc;
+    struct rw_wbuf wb;
+    if (rw_rcache_init(&rc, &meta, node->wl->rcache_pgs, node->wl->rcache_policy, node->wl->readahead, ls_io, &lm))
+        goto OUT;
+    if (rw_wbuf_init(&wb, &meta, node->wl->wbuf_pgs, rw_rcache_io, &rc))
+        goto OUT;
 
     uint64_t max_iosize = 0;
     uint64_t t = 0;
@@ -394,6 +520,9 @@ static int rewrite_ls_start (struct fox_node *node)
     uint8_t* databuf = (uint8_t*)calloc(max_iosize, sizeof(uint8_t));
     struct timeval tvalst, tvaled;
 
+    if (rw_ckpt_start(&(lm.ckpt)))
+        printf(" Node %d: cannot write the first checkpoint.\n", node->nid);
+
     fox_start_node (node);
 
     for (t = 0; t < meta.ioseqlen; t++) {
@@ -405,16 +534,25 @@ static int rewrite_ls_start (struct fox_node *node)
             mode = READ_MODE;
         else if (meta.ioseq[t].iotype == 'w')
             mode = WRITE_MODE;
+        else if (meta.ioseq[t].iotype == 't')
+            mode = TRIM_MODE;
 
         gettimeofday(&tvalst, NULL);
-        iterate_ls_io(node, &nbuf, &meta, &lm, databuf, meta.ioseq[t].offset, meta.ioseq[t].size, mode);
+        rw_wbuf_io(&wb, databuf, meta.ioseq[t].offset, meta.ioseq[t].size, mode);
+        rw_ckpt_tick(&(lm.ckpt));
         gettimeofday(&tvaled, NULL);
         // record time
         meta.ioseq[t].exetime = ((uint64_t)(tvaled.tv_sec - tvalst.tv_sec) * 1000000L + tvaled.tv_usec) - tvalst.tv_usec;
+        // readahead is timed apart from the I/O, see rw_rcache_print
+        rw_rcache_prefetch(&rc);
+        meta.ioseq[t].cache_lookups = rc.lookups;
+        meta.ioseq[t].cache_hits = rc.hits;
+        meta.ioseq[t].cache_saved = rc.saved + rc.rmw_saved;
+        rw_waf_record(&meta, &meta.ioseq[t]);
         // record benefit / cost
         struct nodegeoaddr used_begin_geoaddr = vpg2geoaddr(node, lm.used_begin_ppg);
-        struct nodegeoaddr used_end_geoaddr = vpg2geoaddr(node, (lm.used_end_ppg + meta.total_pagenum - 1) % meta.total_pagenum);
-        int nclblk = (used_end_geoaddr.blk_i >= used_begin_geoaddr.blk_i) ? (used_end_geoaddr.blk_i - used_begin_geoaddr.blk_i + 1) : (node->nblks - (used_begin_geoaddr.blk_i - used_end_geoaddr.blk_i - 1));
+        struct nodegeoaddr used_end_geoaddr = vpg2geoaddr(node, (lm.used_end_ppg + lm.log_pagenum - 1) % lm.log_pagenum);
+        int nclblk = (used_end_geoaddr.blk_i >= used_begin_geoaddr.blk_i) ? (used_end_geoaddr.blk_i - used_begin_geoaddr.blk_i + 1) : (lm.log_nblks - (used_begin_geoaddr.blk_i - used_end_geoaddr.blk_i - 1));
         nclblk = nclblk * node->nchs * node->nluns;
         meta.ioseq[t].gc_becost = (double)(lm.abandoned_pg_count) / (5 * nclblk + lm.dirty_pg_count);
         meta.ioseq[t].nabandoned = lm.abandoned_pg_count;
@@ -437,10 +575,22 @@ static int rewrite_ls_start (struct fox_node *node)
         meta.ioseq[t].write_t = st->write_t;
 
     }
+    rw_wbuf_drain(&wb);
     fox_end_node (node);
 
     write_meta_stats(&meta);
+    rw_waf_print(&meta, "whole log");
+    rw_batch_print(&(lm.batch));
+    rw_ckpt_print(&(lm.ckpt));
+    rw_oob_print(&meta);
+    rw_ckpt_recover(&(lm.ckpt));
+    rw_wbuf_print(&wb);
+    rw_rcache_print(&rc);
+    rw_trim_print(&meta);
+    rw_wear_print(&meta);
 
+    rw_wbuf_free(&wb);
+    rw_rcache_free(&rc);
     fox_free_blkbuf (&nbuf, 1);
     free(databuf);
     free_rewrite_meta(&meta);
@@ -0,0 +1,293 @@
+/* Read cache of logical pages in front of the rewrite engines (4-8).
+ * Only whole logical pages are cached, so the cache never depends on where
+ * the engine put the data and GC moves need no invalidation:
+ *   - reads copy cached pages and read the missing ones from the engine in
+ *     page-aligned runs, which are then cached;
+ *   - a write updates the cached copy of the pages it covers; a write of part
+ *     of a cached page is merged with the cached copy and sent as a whole
+ *     page, the engine does not read the page back for its read-modify-write;
+ *   - a read continuing the previous one is sequential; after two of them the
+ *     next pages are read ahead into the cache by rw_rcache_prefetch, called
+ *     by the engines once the I/O is timed; its time is kept apart in ra_us
+ *     and printed with the readahead counters. The window starts at
+ *     RW_RCACHE_RA_MIN pages and doubles up to --readahead on every
+ *     sequential read, a random read resets it.
+ * A trim drops the cached pages it covers whole and goes to the engine.
+ * Replacement is LRU or CLOCK (one reference bit, no list update on hits).
+ * Written by Chuizheng Meng <mengcz13@mails.tsinghua.edu.cn>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "../fox.h"
+#include "fox-rewrite-utils.h"
+
+// npgs == 0: reads and writes go straight to the engine
+int rw_rcache_init(struct rw_rcache* rc, struct rewrite_meta* meta, uint64_t npgs, int policy, uint64_t ra_max, rw_io_fn io, void* ctx) {
+    uint64_t i;
+    memset(rc, 0, sizeof(struct rw_rcache));
+    rc->meta = meta;
+    rc->io = io;
+    rc->ctx = ctx;
+    rc->npgs = npgs;
+    rc->policy = policy;
+    rc->ra_max = (npgs) ? ra_max : 0;
+    rc->seq_end = UINT64_MAX;
+    TAILQ_INIT(&rc->lru);
+    TAILQ_INIT(&rc->free);
+    if (npgs == 0)
+        return 0;
+    rc->pgs = (struct rw_rcache_page*)calloc(npgs, sizeof(struct rw_rcache_page));
+    rc->data = (uint8_t*)calloc(npgs, meta->vpg_sz);
+    rc->slot = (uint32_t*)calloc(meta->total_pagenum, sizeof(uint32_t));
+    rc->runbuf = (uint8_t*)calloc(RW_RCACHE_RUN, meta->vpg_sz);
+    if (!rc->pgs || !rc->data || !rc->slot || !rc->runbuf) {
+        rw_rcache_free(rc);
+        return 1;
+    }
+    for (i = 0; i < npgs; i++) {
+        rc->pgs[i].data = rc->data + i * meta->vpg_sz;
+        TAILQ_INSERT_TAIL(&rc->free, &rc->pgs[i], lt);
+    }
+    return 0;
+}
+
+void rw_rcache_free(struct rw_rcache* rc) {
+    free(rc->pgs);
+    free(rc->data);
+    free(rc->slot);
+    free(rc->runbuf);
+    rc->pgs = NULL;
+    rc->data = NULL;
+    rc->slot = NULL;
+    rc->runbuf = NULL;
+    rc->npgs = 0;
+    rc->ra_max = 0;
+}
+
+static struct rw_rcache_page* rcache_find(struct rw_rcache* rc, uint64_t vpg) {
+    return (rc->slot[vpg]) ? &rc->pgs[rc->slot[vpg] - 1] : NULL;
+}
+
+static void rcache_touch(struct rw_rcache* rc, struct rw_rcache_page* p) {
+    if (rc->policy == RCACHE_CLOCK) {
+        p->ref = 1;
+        return;
+    }
+    TAILQ_REMOVE(&rc->lru, p, lt);
+    TAILQ_INSERT_TAIL(&rc->lru, p, lt);
+}
+
+static struct rw_rcache_page* rcache_victim(struct rw_rcache* rc) {
+    struct rw_rcache_page* p;
+    if (rc->policy != RCACHE_CLOCK) {
+        p = TAILQ_FIRST(&rc->lru);
+        TAILQ_REMOVE(&rc->lru, p, lt);
+        return p;
+    }
+    // all pages are in use once the free list is empty
+    for (;;) {
+        p = &rc->pgs[rc->hand];
+        rc->hand = (rc->hand + 1) % rc->npgs;
+        if (!p->ref)
+            return p;
+        p->ref = 0;
+    }
+}
+
+// caches a copy of the logical page, ra: read ahead, not asked for yet
+static void rcache_insert(struct rw_rcache* rc, uint64_t vpg, uint8_t* data, int ra) {
+    struct rw_rcache_page* p = rcache_find(rc, vpg);
+    if (p == NULL) {
+        if (!TAILQ_EMPTY(&rc->free)) {
+            p = TAILQ_FIRST(&rc->free);
+            TAILQ_REMOVE(&rc->free, p, lt);
+        } else {
+            p = rcache_victim(rc);
+            rc->slot[p->vpg] = 0;
+            rc->evictions++;
+            if (p->ra)
+                rc->ra_unused++;
+        }
+        if (rc->policy != RCACHE_CLOCK)
+            TAILQ_INSERT_TAIL(&rc->lru, p, lt);
+        p->vpg = vpg;
+        p->ra = ra;
+        p->ref = 0;
+        rc->slot[vpg] = p - rc->pgs + 1;
+    } else {
+        rcache_touch(rc, p);
+    }
+    memcpy(p->data, data, rc->meta->vpg_sz);
+}
+
+// reads ahead after a sequential read ending at page last
+static void rcache_seq(struct rw_rcache* rc, uint64_t offset, uint64_t size) {
+    uint64_t last = (offset + size - 1) / rc->meta->vpg_sz;
+    if (offset != rc->seq_end) {
+        rc->seq_run = 0;
+        rc->ra_win = 0;
+    } else {
+        rc->seq_run++;
+    }
+    rc->seq_end = offset + size;
+    if (rc->ra_max == 0 || rc->seq_run == 0)
+        return;
+    if (rc->ra_win == 0)
+        rc->ra_win = (RW_RCACHE_RA_MIN < rc->ra_max) ? RW_RCACHE_RA_MIN : rc->ra_max;
+    else
+        rc->ra_win = (rc->ra_win * 2 < rc->ra_max) ? rc->ra_win * 2 : rc->ra_max;
+    rc->ra_from = last + 1;
+    rc->ra_len = rc->ra_win;
+}
+
+static int rcache_read(struct rw_rcache* rc, uint8_t* data, uint64_t offset, uint64_t size) {
+    size_t vpg_sz = rc->meta->vpg_sz;
+    uint64_t end = offset + size;
+    uint64_t vpg = offset / vpg_sz;
+    uint64_t last = (end - 1) / vpg_sz;
+    uint64_t i, n;
+    int ret = 0;
+    while (vpg <= last) {
+        struct rw_rcache_page* p = rcache_find(rc, vpg);
+        if (p != NULL) {
+            uint64_t lo = (offset > vpg * vpg_sz) ? offset - vpg * vpg_sz : 0;
+            uint64_t hi = (end - vpg * vpg_sz < vpg_sz) ? end - vpg * vpg_sz : vpg_sz;
+            memcpy(data + (vpg * vpg_sz + lo - offset), p->data + lo, hi - lo);
+            rcache_touch(rc, p);
+            if (p->ra) {
+                p->ra = 0;
+                rc->ra_hits++;
+            }
+            rc->lookups++;
+            rc->hits++;
+            rc->saved++;
+            vpg++;
+            continue;
+        }
+        // run of missing pages, read whole
+        for (n = 1; vpg + n <= last && n < RW_RCACHE_RUN && !rc->slot[vpg + n]; n++)
+            ;
+        ret |= rc->io(rc->ctx, rc->runbuf, vpg * vpg_sz, n * vpg_sz, READ_MODE);
+        for (i = 0; i < n; i++)
+            rcache_insert(rc, vpg + i, rc->runbuf + i * vpg_sz, 0);
+        {
+            uint64_t lo = (offset > vpg * vpg_sz) ? offset : vpg * vpg_sz;
+            uint64_t hi = (end < (vpg + n) * vpg_sz) ? end : (vpg + n) * vpg_sz;
+            memcpy(data + (lo - offset), rc->runbuf + (lo - vpg * vpg_sz), hi - lo);
+        }
+        rc->lookups += n;
+        vpg += n;
+    }
+    rcache_seq(rc, offset, size);
+    return ret;
+}
+
+static int rcache_write(struct rw_rcache* rc, uint8_t* data, uint64_t offset, uint64_t size) {
+    size_t vpg_sz = rc->meta->vpg_sz;
+    uint64_t base = offset, end = offset + size;
+    uint64_t run = offset; // start of the bytes not sent to the engine yet
+    int ret = 0;
+    while (offset < end) {
+        uint64_t vpg = offset / vpg_sz;
+        uint64_t lo = offset % vpg_sz;
+        uint64_t hi = (end - vpg * vpg_sz < vpg_sz) ? end - vpg * vpg_sz : vpg_sz;
+        struct rw_rcache_page* p = rcache_find(rc, vpg);
+        if (p != NULL) {
+            memcpy(p->data + lo, data + (offset - base), hi - lo);
+            p->ra = 0;
+            rcache_touch(rc, p);
+            if (hi - lo < vpg_sz) {
+                // send the merged page, no read-modify-write in the engine
+                if (run < offset)
+                    ret |= rc->io(rc->ctx, data + (run - base), run, offset - run, WRITE_MODE);
+                ret |= rc->io(rc->ctx, p->data, vpg * vpg_sz, vpg_sz, WRITE_MODE);
+                rc->rmw_saved++;
+                run = offset + hi - lo;
+            }
+        }
+        offset += hi - lo;
+    }
+    if (run < end)
+        ret |= rc->io(rc->ctx, data + (run - base), run, end - run, WRITE_MODE);
+    return ret;
+}
+
+static int rcache_trim(struct rw_rcache* rc, uint8_t* data, uint64_t offset, uint64_t size) {
+    size_t vpg_sz = rc->meta->vpg_sz;
+    uint64_t vpg;
+    for (vpg = (offset + vpg_sz - 1) / vpg_sz; (vpg + 1) * vpg_sz <= offset + size; vpg++) {
+        struct rw_rcache_page* p = rcache_find(rc, vpg);
+        if (p == NULL)
+            continue;
+        // clock pages are on no list while cached
+        if (rc->policy != RCACHE_CLOCK)
+            TAILQ_REMOVE(&rc->lru, p, lt);
+        TAILQ_INSERT_TAIL(&rc->free, p, lt);
+        rc->slot[vpg] = 0;
+        rc->trimmed++;
+    }
+    return rc->io(rc->ctx, data, offset, size, TRIM_MODE);
+}
+
+// rw_io_fn of the cache, ctx is the struct rw_rcache
+int rw_rcache_io(void* ctx, uint8_t* data, uint64_t offset, uint64_t size, int mode) {
+    struct rw_rcache* rc = (struct rw_rcache*)ctx;
+    if (rc->npgs == 0)
+        return rc->io(rc->ctx, data, offset, size, mode);
+    if (mode == WRITE_MODE)
+        return rcache_write(rc, data, offset, size);
+    if (mode == TRIM_MODE)
+        return rcache_trim(rc, data, offset, size);
+    return rcache_read(rc, data, offset, size);
+}
+
+// reads the pending readahead window, pages already cached are skipped
+int rw_rcache_prefetch(struct rw_rcache* rc) {
+    size_t vpg_sz;
+    uint64_t vpg, end, i, n;
+    struct timeval tvalst, tvaled;
+    int ret = 0;
+    if (rc->ra_len == 0)
+        return 0;
+    gettimeofday(&tvalst, NULL);
+    vpg_sz = rc->meta->vpg_sz;
+    vpg = rc->ra_from;
+    end = (rc->ra_from + rc->ra_len < rc->meta->total_pagenum) ? rc->ra_from + rc->ra_len : rc->meta->total_pagenum;
+    rc->ra_len = 0;
+    while (vpg < end) {
+        if (rc->slot[vpg]) {
+            vpg++;
+            continue;
+        }
+        for (n = 1; vpg + n < end && n < RW_RCACHE_RUN && !rc->slot[vpg + n]; n++)
+            ;
+        ret |= rc->io(rc->ctx, rc->runbuf, vpg * vpg_sz, n * vpg_sz, READ_MODE);
+        for (i = 0; i < n; i++)
+            rcache_insert(rc, vpg + i, rc->runbuf + i * vpg_sz, 1);
+        rc->ra_cmds++;
+        rc->ra_pgs += n;
+        vpg += n;
+    }
+    gettimeofday(&tvaled, NULL);
+    rc->ra_us += ((uint64_t)(tvaled.tv_sec - tvalst.tv_sec) * 1000000L + tvaled.tv_usec) - tvalst.tv_usec;
+    return ret;
+}
+
+void rw_rcache_print(struct rw_rcache* rc) {
+    if (rc->npgs == 0)
+        return;
+    printf(" Node %d: read cache %" PRIu64 " pages (%s), %" PRIu64 " lookups, %" PRIu64 " hits (%.1f %%),"
+            " flash reads saved %" PRIu64 " + %" PRIu64 " on writes, %" PRIu64 " evictions\n",
+            rc->meta->node->nid, rc->npgs, (rc->policy == RCACHE_CLOCK) ? "clock" : "lru",
+            rc->lookups, rc->hits, (rc->lookups) ? 100.0 * rc->hits / rc->lookups : 0.0,
+            rc->saved, rc->rmw_saved, rc->evictions);
+    if (rc->trimmed)
+        printf(" Node %d: read cache dropped %" PRIu64 " trimmed pages\n", rc->meta->node->nid, rc->trimmed);
+    if (rc->ra_max)
+        printf(" Node %d: readahead up to %" PRIu64 " pages, %" PRIu64 " pages in %" PRIu64 " reads, %" PRIu64 " hit, %" PRIu64 " evicted unused,"
+                " %.3f ms outside the I/O latencies\n",
+                rc->meta->node->nid, rc->ra_max, rc->ra_pgs, rc->ra_cmds, rc->ra_hits, rc->ra_unused, rc->ra_us / 1000.0);
+}
@@ -55,50 +55,328 @@ uint64_t vblk2vpg(struct fox_node* node, uint64_t vblk_i) {
     return geoaddr2vpg(node, &tgeo);
 }
 
-uint8_t* get_p_page_state(struct rewrite_meta* meta, struct nodegeoaddr* geoaddr) {
-    return &(meta->page_state[geoaddr2vpg(meta->node, geoaddr)]);
+uint8_t get_page_state(struct rewrite_meta* meta, struct nodegeoaddr* geoaddr) {
+    return get_pg_state(meta, geoaddr2vpg(meta->node, geoaddr));
 }
 
-uint8_t* get_p_blk_state(struct rewrite_meta* meta, struct nodegeoaddr* geoaddr) {
-    return &(meta->blk_state[geoaddr2vblk(meta->node, geoaddr)]);
+void set_page_state(struct rewrite_meta* meta, struct nodegeoaddr* geoaddr, uint8_t st) {
+    set_pg_state(meta, geoaddr2vpg(meta->node, geoaddr), st);
+}
+
+uint8_t get_blk_state(struct rewrite_meta* meta, struct nodegeoaddr* geoaddr) {
+    uint64_t i = geoaddr2vblk(meta->node, geoaddr);
+    return (meta->blk_state[i >> 6] >> (i & 63)) & 1;
+}
+
+void set_blk_state(struct rewrite_meta* meta, struct nodegeoaddr* geoaddr, uint8_t st) {
+    uint64_t i = geoaddr2vblk(meta->node, geoaddr);
+    if (st == BLOCK_DIRTY)
+        meta->blk_state[i >> 6] |= 1ULL << (i & 63);
+    else
+        meta->blk_state[i >> 6] &= ~(1ULL << (i & 63));
+}
+
+/*
+ * Scans of page_state one word (32 pages) at a time: the word is xor-ed with
+ * st repeated, a page matches when both of its bits are 0. The match mask has
+ * the low bit of every matching page set.
+ */
+#define PG_STATE_LO 0x5555555555555555ULL
+
+static uint64_t pg_state_match(uint64_t w, uint8_t st) {
+    uint64_t x = w ^ (st * PG_STATE_LO);
+    return ~(x | (x >> 1)) & PG_STATE_LO;
+}
+
+// bits of the pages [first, end) in word w
+static uint64_t pg_state_mask(uint64_t w, uint64_t first, uint64_t end) {
+    uint64_t lo = (first > (w << 5)) ? first - (w << 5) : 0;
+    uint64_t hi = (end < ((w + 1) << 5)) ? end - (w << 5) : 32;
+    uint64_t m = (hi == 32) ? ~0ULL : (1ULL << (hi << 1)) - 1;
+    return m & ~((1ULL << (lo << 1)) - 1);
+}
+
+// pages of [first, first + n) in state st
+uint64_t count_pg_state(struct rewrite_meta* meta, uint64_t first, uint64_t n, uint8_t st) {
+    uint64_t end = first + n, w, cnt = 0;
+    if (n == 0)
+        return 0;
+    for (w = first >> 5; w <= (end - 1) >> 5; w++)
+        cnt += __builtin_popcountll(pg_state_match(meta->page_state[w], st) & pg_state_mask(w, first, end));
+    return cnt;
+}
+
+// first page of [i, end) in state st, end if none
+uint64_t next_pg_state(struct rewrite_meta* meta, uint64_t i, uint64_t end, uint8_t st) {
+    uint64_t w;
+    if (i >= end)
+        return end;
+    for (w = i >> 5; w <= (end - 1) >> 5; w++) {
+        uint64_t m = pg_state_match(meta->page_state[w], st) & pg_state_mask(w, i, end);
+        if (m)
+            return (w << 5) + (__builtin_ctzll(m) >> 1);
+    }
+    return end;
+}
+
+void fill_pg_state(struct rewrite_meta* meta, uint64_t first, uint64_t n, uint8_t st) {
+    uint64_t end = first + n, w;
+    if (n == 0)
+        return;
+    for (w = first >> 5; w <= (end - 1) >> 5; w++) {
+        uint64_t m = pg_state_mask(w, first, end);
+        meta->page_state[w] = (meta->page_state[w] & ~m) | (st * PG_STATE_LO & m);
+    }
+}
+
+/* picks the trace of this node from the comma-separated inputiopath */
+static int get_node_trace(struct fox_node* node, char* path, uint64_t* ntraces) {
+    const char* p = node->wl->inputiopath;
+    const char* q;
+    uint64_t i = 0, target;
+    *ntraces = 1;
+    for (q = p; *q; q++)
+        if (*q == ',')
+            (*ntraces)++;
+    target = node->nid % *ntraces;
+    for (q = p; i < target; q++)
+        if (*q == ',')
+            i++;
+    for (i = 0; q[i] && q[i] != ',' && i < CMDARG_LEN - 1; i++)
+        path[i] = q[i];
+    path[i] = '\0';
+    return 0;
+}
+
+static uint64_t shard_hash(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* dense renumbering of the logical pages owned by a hash shard */
+struct shard_pgmap {
+    uint64_t* keys; // lpn + 1, 0 means empty
+    uint64_t* vals;
+    uint64_t cap;
+    uint64_t used;
+};
+
+static int shard_pgmap_grow(struct shard_pgmap* pm);
+
+static uint64_t shard_pgmap_get(struct shard_pgmap* pm, uint64_t lpn) {
+    uint64_t i;
+    if ((pm->used + 1) * 2 > pm->cap)
+        shard_pgmap_grow(pm);
+    i = shard_hash(lpn) & (pm->cap - 1);
+    while (pm->keys[i] != 0 && pm->keys[i] != lpn + 1)
+        i = (i + 1) & (pm->cap - 1);
+    if (pm->keys[i] == 0) {
+        pm->keys[i] = lpn + 1;
+        pm->vals[i] = pm->used++;
+    }
+    return pm->vals[i];
+}
+
+static int shard_pgmap_grow(struct shard_pgmap* pm) {
+    struct shard_pgmap old = *pm;
+    uint64_t i, j;
+    pm->cap = (old.cap) ? old.cap * 2 : 1024;
+    pm->keys = (uint64_t*)calloc(pm->cap, sizeof(uint64_t));
+    pm->vals = (uint64_t*)calloc(pm->cap, sizeof(uint64_t));
+    for (i = 0; i < old.cap; i++) {
+        if (old.keys[i] == 0)
+            continue;
+        j = shard_hash(old.keys[i] - 1) & (pm->cap - 1);
+        while (pm->keys[j] != 0)
+            j = (j + 1) & (pm->cap - 1);
+        pm->keys[j] = old.keys[i];
+        pm->vals[j] = old.vals[i];
+    }
+    free(old.keys);
+    free(old.vals);
+    return 0;
+}
+
+static void add_iounit(struct rewrite_meta* meta, uint64_t* cap, char iotype, uint64_t offset, uint64_t size) {
+    if (meta->ioseqlen == *cap) {
+        *cap = (*cap) ? *cap * 2 : 1024;
+        meta->ioseq = (struct fox_iounit*)realloc(meta->ioseq, *cap * sizeof(struct fox_iounit));
+    }
+    memset(&meta->ioseq[meta->ioseqlen], 0, sizeof(struct fox_iounit));
+    meta->ioseq[meta->ioseqlen].iotype = iotype;
+    meta->ioseq[meta->ioseqlen].offset = offset;
+    meta->ioseq[meta->ioseqlen].size = size;
+    meta->ioseqlen++;
+}
+
+/*
+ * Loads the I/O sequence of a node. With several comma-separated traces,
+ * node i replays trace (i % ntraces). Nodes replaying the same trace split
+ * it according to wl->trace_shard:
+ *   range: the LBA span is cut into equal contiguous ranges, one per node;
+ *   hash:  each logical page goes to node hash(lpn) % nshards and is renumbered
+ *          densely inside the shard.
+ * I/Os crossing a shard boundary are split, offsets become shard-local.
+ */
+static int load_ioseq(struct fox_node* node, struct rewrite_meta* meta) {
+    char path[CMDARG_LEN];
+    uint64_t ntraces, nshards, shard_i;
+    get_node_trace(node, path, &ntraces);
+    nshards = node->wl->nthreads / ntraces + ((node->nid % ntraces) < (node->wl->nthreads % ntraces) ? 1 : 0);
+    shard_i = node->nid / ntraces;
+
+    FILE* pfile = fopen(path, "r");
+    if (pfile == NULL) {
+        printf(" Node %d: cannot open trace %s\n", node->nid, path);
+        return 1;
+    }
+    uint64_t t_offset, t_size, t_recnum;
+    char t_iotype;
+    if (fscanf(pfile, "%" PRId64, &t_recnum) == EOF) {
+        fclose(pfile);
+        return 1;
+    }
+    struct fox_iounit* recs = (struct fox_iounit*)calloc(t_recnum, sizeof(struct fox_iounit));
+    uint64_t t_recnum_i, max_end = 0;
+    for (t_recnum_i = 0; t_recnum_i < t_recnum; t_recnum_i++) {
+        fscanf(pfile, "%" PRId64 ",%" PRId64 ",%c", &t_offset, &t_size, &t_iotype);
+        recs[t_recnum_i].iotype = t_iotype;
+        recs[t_recnum_i].offset = t_offset;
+        recs[t_recnum_i].size = t_size;
+        if (t_offset + t_size > max_end)
+            max_end = t_offset + t_size;
+    }
+    fclose(pfile);
+
+    if (node->wl->trace_shard == TRACE_SHARD_NONE || nshards < 2) {
+        meta->ioseq = recs;
+        meta->ioseqlen = t_recnum;
+        printf(" Node %d: %s, %" PRIu64 " I/Os\n", node->nid, path, meta->ioseqlen);
+        return 0;
+    }
+
+    uint64_t vpg_sz = meta->vpg_sz;
+    uint64_t cap = 0;
+    meta->ioseq = NULL;
+    meta->ioseqlen = 0;
+    if (node->wl->trace_shard == TRACE_SHARD_RANGE) {
+        uint64_t width = (max_end + nshards - 1) / nshards;
+        width = (width + vpg_sz - 1) / vpg_sz * vpg_sz;
+        uint64_t lo = shard_i * width;
+        uint64_t hi = lo + width;
+        for (t_recnum_i = 0; t_recnum_i < t_recnum; t_recnum_i++) {
+            uint64_t b = recs[t_recnum_i].offset;
+            uint64_t e = b + recs[t_recnum_i].size;
+            if (e <= lo || b >= hi)
+                continue;
+            b = (b < lo) ? lo : b;
+            e = (e > hi) ? hi : e;
+            add_iounit(meta, &cap, recs[t_recnum_i].iotype, b - lo, e - b);
+        }
+    } else {
+        struct shard_pgmap pm;
+        memset(&pm, 0, sizeof(pm));
+        for (t_recnum_i = 0; t_recnum_i < t_recnum; t_recnum_i++) {
+            uint64_t b = recs[t_recnum_i].offset;
+            uint64_t e = b + recs[t_recnum_i].size;
+            uint64_t lpn, last_end = UINT64_MAX;
+            for (lpn = b / vpg_sz; lpn * vpg_sz < e; lpn++) {
+                if (shard_hash(lpn) % nshards != shard_i)
+                    continue;
+                uint64_t pb = (b > lpn * vpg_sz) ? b : lpn * vpg_sz;
+                uint64_t pe = (e < (lpn + 1) * vpg_sz) ? e : (lpn + 1) * vpg_sz;
+                uint64_t loff = shard_pgmap_get(&pm, lpn) * vpg_sz + pb % vpg_sz;
+                if (loff == last_end)
+                    meta->ioseq[meta->ioseqlen - 1].size += pe - pb;
+                else
+                    add_iounit(meta, &cap, recs[t_recnum_i].iotype, loff, pe - pb);
+                last_end = loff + pe - pb;
+            }
+        }
+        free(pm.keys);
+        free(pm.vals);
+    }
+    free(recs);
+    printf(" Node %d: %s, shard %" PRIu64 "/%" PRIu64 ", %" PRIu64 " I/Os\n", node->nid, path, shard_i, nshards, meta->ioseqlen);
+    return 0;
+}
+
+// keeps the I/Os inside the logical space, --op hides the end of the node
+static void clip_ioseq(struct fox_node* node, struct rewrite_meta* meta) {
+    uint64_t span = meta->logical_pagenum * meta->vpg_sz;
+    uint64_t t, n = 0, clipped = 0;
+    for (t = 0; t < meta->ioseqlen; t++) {
+        struct fox_iounit* io = &meta->ioseq[t];
+        if (io->offset >= span)
+            continue;
+        if (io->offset + io->size > span) {
+            io->size = span - io->offset;
+            clipped++;
+        }
+        meta->ioseq[n++] = *io;
+    }
+    if (n < meta->ioseqlen || clipped)
+        printf(" Node %d: %" PRIu64 " I/Os beyond the logical space dropped, %" PRIu64 " clipped\n",
+                node->nid, meta->ioseqlen - n, clipped);
+    meta->ioseqlen = n;
 }
 
 int init_rewrite_meta(struct fox_node* node, struct rewrite_meta* meta) {
     meta->node = node;
     meta->vpg_sz = node->wl->geo->page_nbytes * node->wl->geo->nplanes;
-    meta->total_pagenum = node->nluns * node->nchs * node->nblks * node->npgs;
-    meta->page_state = (uint8_t*)calloc(node->nluns * node->nchs * node->nblks * node->npgs, sizeof(uint8_t));
-    meta->blk_state = (uint8_t*)calloc(node->nluns * node->nchs * node->nblks, sizeof(uint8_t));
+    meta->total_pagenum = (uint64_t)node->nluns * node->nchs * node->nblks * node->npgs;
+    if (meta->total_pagenum > RW_MAX_PAGES) {
+        printf(" Node %d: %" PRIu64 " pages, the mapping tables hold up to %" PRIu64 "\n", node->nid, meta->total_pagenum, RW_MAX_PAGES);
+        return 1;
+    }
+    meta->logical_pagenum = (meta->total_pagenum - node->lost_pgs) * (100 - node->wl->op) / 100;
+    if (meta->logical_pagenum == 0)
+        meta->logical_pagenum = 1;
+    meta->page_state = (uint64_t*)calloc((meta->total_pagenum + 31) / 32, sizeof(uint64_t));
+    meta->blk_state = (uint64_t*)calloc(((uint64_t)node->nluns * node->nchs * node->nblks + 63) / 64, sizeof(uint64_t));
+    meta->blk_erases = (uint32_t*)calloc((uint64_t)node->nluns * node->nchs * node->nblks, sizeof(uint32_t));
     meta->temp_page_state_inblk = (uint8_t*)calloc(node->npgs, sizeof(uint8_t));
     size_t vpg_sz = meta->vpg_sz;
     meta->begin_pagebuf = (uint8_t*)calloc(vpg_sz, sizeof(uint8_t));
     meta->end_pagebuf = (uint8_t*)calloc(vpg_sz, sizeof(uint8_t));
     meta->pagebuf = (uint8_t*)calloc(vpg_sz, sizeof(uint8_t));
     meta->heatmap = (struct fox_heatmap_unit*)calloc(meta->total_pagenum, sizeof(struct fox_heatmap_unit));
+    meta->oob = node->wl->oob;
+    meta->oob_pend = NULL;
+    meta->oob_cap = 0;
+    meta->oob_npend = 0;
+    meta->oob_peak = 0;
+    meta->oob_pgmeta = NULL;
+    if (meta->oob) {
+        const struct nvm_geo* geo = node->wl->geo;
+        if (geo->meta_nbytes < sizeof(struct rw_oob)) {
+            printf(" Node %d: %d bytes of sector metadata, --oob needs %zu\n", node->nid, (int)geo->meta_nbytes, sizeof(struct rw_oob));
+            return 1;
+        }
+        meta->oob_pgmeta = (uint8_t*)malloc(geo->nsectors * geo->nplanes * geo->meta_nbytes);
+    }
+    meta->oob_seq = 0;
+    meta->oob_reads = 0;
+    meta->trims = 0;
+    meta->trim_pgs = 0;
+    meta->trim_valid = 0;
+    meta->host_pgs = 0;
+    meta->bad_replaced = 0;
+    meta->bad_retired = 0;
+    meta->bad_retired_pgs = 0;
+    memset(meta->prog_pgs, 0, sizeof(meta->prog_pgs));
+    meta->prog_src = RW_PROG_USER;
 
-    // read io sequence from file
-    FILE* pfile = fopen(node->wl->inputiopath, "r");
-    if (pfile == NULL)
-        return 1;
-    uint64_t t_offset, t_size, t_recnum;
-    char t_iotype;
-    if (fscanf(pfile, "%" PRId64, &t_recnum) == EOF)
+    // generate io sequence or read it from file
+    if (node->wl->gen_dist != GEN_NONE) {
+        if (gen_ioseq(node, meta))
+            return 1;
+    } else if (load_ioseq(node, meta)) {
         return 1;
-    meta->ioseq = (struct fox_iounit*)calloc(t_recnum, sizeof(struct fox_iounit));
-    meta->ioseqlen = t_recnum;
-    uint64_t t_recnum_i;
-    for (t_recnum_i = 0; t_recnum_i < t_recnum; t_recnum_i++) {
-        fscanf(pfile, "%" PRId64 ",%" PRId64 ",%c", &t_offset, &t_size, &t_iotype);
-        meta->ioseq[t_recnum_i].iotype = t_iotype;
-        meta->ioseq[t_recnum_i].offset = t_offset;
-        meta->ioseq[t_recnum_i].size = t_size;
-        meta->ioseq[t_recnum_i].exetime = 0;
-        meta->ioseq[t_recnum_i].gc_becost = 0;
-        meta->ioseq[t_recnum_i].nabandoned = 0;
-        meta->ioseq[t_recnum_i].ndirty = 0;
-        meta->ioseq[t_recnum_i].nblock = 0;
     }
-    fclose(pfile);
+    clip_ioseq(node, meta);
 
     return 0;
 }
@@ -107,15 +385,263 @@ int free_rewrite_meta(struct rewrite_meta* meta) {
     meta->node = NULL;
     free(meta->page_state);
     free(meta->blk_state);
+    free(meta->blk_erases);
     free(meta->temp_page_state_inblk);
     free(meta->begin_pagebuf);
     free(meta->end_pagebuf);
     free(meta->pagebuf);
     free(meta->ioseq);
     free(meta->heatmap);
+    free(meta->oob_pend);
+    free(meta->oob_pgmeta);
+    return 0;
+}
+
+/*
+ * Page owners in the OOB. The owner of a page goes to the metadata of its
+ * first sector when the page is programmed and GC reads it back from the
+ * device, the engines keep no reverse map in host memory with --oob. Only
+ * the owners of pages allocated but not programmed yet are held here, in a
+ * small hash on the physical page; the writes take them with rw_oob_take.
+ */
+static uint64_t oob_slot(struct rewrite_meta* meta, uint64_t ppg) {
+    uint64_t i = (ppg * 2654435761u) & (meta->oob_cap - 1);
+    while (meta->oob_pend[i].ppg != meta->total_pagenum && meta->oob_pend[i].ppg != ppg)
+        i = (i + 1) & (meta->oob_cap - 1);
+    return i;
+}
+
+static int oob_grow(struct rewrite_meta* meta) {
+    struct rw_oob_pend* old = meta->oob_pend;
+    uint64_t oldcap = meta->oob_cap;
+    uint64_t i;
+    meta->oob_cap = (oldcap) ? oldcap * 2 : 64;
+    meta->oob_pend = (struct rw_oob_pend*)malloc(meta->oob_cap * sizeof(struct rw_oob_pend));
+    if (meta->oob_pend == NULL) {
+        meta->oob_pend = old;
+        meta->oob_cap = oldcap;
+        return 1;
+    }
+    for (i = 0; i < meta->oob_cap; i++)
+        meta->oob_pend[i].ppg = meta->total_pagenum;
+    for (i = 0; i < oldcap; i++) {
+        if (old[i].ppg != meta->total_pagenum)
+            meta->oob_pend[oob_slot(meta, old[i].ppg)] = old[i];
+    }
+    free(old);
+    if (meta->oob_cap > meta->oob_peak)
+        meta->oob_peak = meta->oob_cap;
+    return 0;
+}
+
+void rw_oob_write(struct rewrite_meta* meta, uint64_t ppg, uint64_t vpg) {
+    uint64_t i;
+    if ((meta->oob_npend + 1) * 2 > meta->oob_cap && oob_grow(meta)) {
+        printf(" Node %d: out of memory for the owner of page %" PRIu64 "\n", meta->node->nid, ppg);
+        return;
+    }
+    i = oob_slot(meta, ppg);
+    if (meta->oob_pend[i].ppg == meta->total_pagenum)
+        meta->oob_npend++;
+    meta->oob_pend[i].ppg = ppg;
+    meta->oob_pend[i].oob.vpg = vpg;
+    meta->oob_pend[i].oob.seq = ++meta->oob_seq;
+}
+
+// owner to program with page ppg, all ones if none; the pending entry is dropped
+void rw_oob_take(struct rewrite_meta* meta, uint64_t ppg, struct rw_oob* oob) {
+    uint64_t i, j, home;
+    memset(oob, 0xff, sizeof(struct rw_oob));
+    if (meta->oob_npend == 0)
+        return;
+    i = oob_slot(meta, ppg);
+    if (meta->oob_pend[i].ppg == meta->total_pagenum)
+        return;
+    *oob = meta->oob_pend[i].oob;
+    meta->oob_npend--;
+    // backward shift, keeps the probe chains without tombstones
+    for (j = (i + 1) & (meta->oob_cap - 1); meta->oob_pend[j].ppg != meta->total_pagenum; j = (j + 1) & (meta->oob_cap - 1)) {
+        home = (meta->oob_pend[j].ppg * 2654435761u) & (meta->oob_cap - 1);
+        if (((j - home) & (meta->oob_cap - 1)) >= ((j - i) & (meta->oob_cap - 1))) {
+            meta->oob_pend[i] = meta->oob_pend[j];
+            i = j;
+        }
+    }
+    meta->oob_pend[i].ppg = meta->total_pagenum;
+}
+
+// metadata of page pg_i of buf: the owner in the first sector, the rest erased
+void rw_oob_stamp(struct rewrite_meta* meta, struct fox_blkbuf* buf, uint64_t pg_i, struct rw_oob* oob) {
+    const struct nvm_geo* geo = meta->node->wl->geo;
+    size_t pgmeta_sz = geo->nsectors * geo->nplanes * geo->meta_nbytes;
+    memset(buf->meta + pg_i * pgmeta_sz, 0xff, pgmeta_sz);
+    memcpy(buf->meta + pg_i * pgmeta_sz, oob, sizeof(struct rw_oob));
+}
+
+uint64_t rw_oob_read(struct rewrite_meta* meta, uint64_t ppg) {
+    struct fox_node* node = meta->node;
+    struct nodegeoaddr geo = vpg2geoaddr(node, ppg);
+    struct fox_tgt_blk tgt;
+    struct rw_oob oob;
+    uint64_t i;
+    meta->oob_reads++;
+    // not programmed yet
+    if (meta->oob_npend) {
+        i = oob_slot(meta, ppg);
+        if (meta->oob_pend[i].ppg != meta->total_pagenum)
+            return meta->oob_pend[i].oob.vpg;
+    }
+    tgt.ch = node->ch[geo.ch_i];
+    tgt.lun = node->lun[geo.lun_i];
+    tgt.blk = geo.blk_i;
+    tgt.vblk = node->wl->vblks[fox_vblk_get_pblk(node->wl, tgt.ch, tgt.lun, tgt.blk)];
+    // the data lands in the spare page buffer of the meta
+    if (fox_read_meta(&tgt, node, geo.pg_i, meta->pagebuf, meta->oob_pgmeta))
+        return meta->total_pagenum;
+    memcpy(&oob, meta->oob_pgmeta, sizeof(struct rw_oob));
+    return (oob.vpg == (rw_pgno)~0) ? meta->total_pagenum : oob.vpg;
+}
+
+void rw_oob_print(struct rewrite_meta* meta) {
+    if (!meta->oob)
+        return;
+    uint64_t map_bytes = meta->total_pagenum * sizeof(rw_pgno);
+    uint64_t host_bytes = meta->oob_peak * sizeof(struct rw_oob_pend);
+    printf(" Node %d: reverse map in OOB, %" PRIu64 " owner reads, %" PRIu32 " writes stamped\n",
+            meta->node->nid, meta->oob_reads, meta->oob_seq);
+    printf(" Node %d: host reverse map of %" PRIu64 " KB dropped, %.1f KB of owners not yet programmed at peak\n",
+            meta->node->nid, map_bytes >> 10, host_bytes / 1024.0);
+}
+
+/*
+ * Trims only drop whole logical pages: [*first, *end) are the pages covered
+ * by [offset, offset + size), the bytes of partly covered pages stay valid.
+ * Returns 0 when no page is covered. The engines invalidate the mappings
+ * of these pages without any flash I/O.
+ */
+int rw_trim_range(struct rewrite_meta* meta, uint64_t offset, uint64_t size, uint64_t* first, uint64_t* end) {
+    *first = (offset + meta->vpg_sz - 1) / meta->vpg_sz;
+    *end = (offset + size) / meta->vpg_sz;
+    if (*end > meta->total_pagenum)
+        *end = meta->total_pagenum;
+    meta->trims++;
+    if (*end <= *first)
+        return 0;
+    meta->trim_pgs += *end - *first;
+    return 1;
+}
+
+void rw_trim_print(struct rewrite_meta* meta) {
+    if (meta->trims == 0)
+        return;
+    printf(" Node %d: trims %" PRIu64 ", %" PRIu64 " pages, %" PRIu64 " valid pages invalidated\n",
+            meta->node->nid, meta->trims, meta->trim_pgs, meta->trim_valid);
+}
+
+/*
+ * Superblocks of --sb-pus x --sb-blks blocks, as laid out by engines 7 and 8:
+ * superblock i = mpu + bo * nmpus holds blocks bo * nblks .. of PUs
+ * mpu * npus .., PU p being (p % nchs, p / nchs). Provisioning backs the
+ * blocks of a LUN with its good blocks in order, the blocks of a LUN short
+ * of good ones come last and are left without. A superblock with such a
+ * block is unusable: the returned map has it set, and its pages are left
+ * out of the host space through node->lost_pgs. The node blocks must be
+ * provisioned, see fox_wait_for_monitor.
+ */
+uint8_t* rw_sb_compose(struct fox_node* node) {
+    struct fox_workload* wl = node->wl;
+    uint64_t npus = (wl->sb_pus == 0) ? 1 : wl->sb_pus;
+    uint64_t nblks = (wl->sb_blks == 0) ? 1 : wl->sb_blks;
+    uint64_t nmpus = node->nchs * node->nluns / npus;
+    uint64_t nsbs = (node->nblks / nblks) * nmpus;
+    uint64_t sb, pu, blk, nbad = 0;
+    uint8_t* bad = (uint8_t*)calloc(nsbs + 1, sizeof(uint8_t));
+    if (bad == NULL)
+        return NULL;
+    for (sb = 0; sb < nsbs; sb++) {
+        for (pu = (sb % nmpus) * npus; pu < (sb % nmpus + 1) * npus && !bad[sb]; pu++) {
+            for (blk = (sb / nmpus) * nblks; blk < (sb / nmpus + 1) * nblks && !bad[sb]; blk++)
+                bad[sb] = (wl->vblks[fox_vblk_get_pblk(wl, node->ch[pu % node->nchs], node->lun[pu / node->nchs % node->nluns], blk)] == NULL);
+        }
+        nbad += bad[sb];
+    }
+    node->lost_pgs = nbad * npus * nblks * node->npgs;
+    return bad;
+}
+
+/*
+ * A block whose erase failed (left BLOCK_DIRTY by rw_batch_erase) is swapped
+ * for a spare good block of its LUN, the spare comes erased. Returns 1 when
+ * the LUN has none left.
+ */
+int rw_replace_blk(struct rewrite_meta* meta, struct nodegeoaddr* addr) {
+    struct fox_node* node = meta->node;
+    if (fox_vblk_replace(node->wl, node->ch[addr->ch_i], node->lun[addr->lun_i], addr->blk_i) == NULL)
+        return 1;
+    set_blk_state(meta, addr, BLOCK_CLEAN);
+    meta->blk_erases[geoaddr2vblk(node, addr)] = 0;
+    meta->bad_replaced++;
     return 0;
 }
 
+void rw_bad_print(struct rewrite_meta* meta) {
+    struct fox_node* node = meta->node;
+    uint64_t lost = node->lost_pgs + meta->bad_retired_pgs;
+    uint64_t b, missing = 0;
+    for (b = 0; b < node->nluns * node->nchs * node->nblks; b++) {
+        struct nodegeoaddr tgeo = vblk2geoaddr(node, b);
+        missing += (node->wl->vblks[fox_vblk_get_pblk(node->wl, node->ch[tgeo.ch_i], node->lun[tgeo.lun_i], tgeo.blk_i)] == NULL);
+    }
+    if (missing == 0 && meta->bad_replaced == 0 && meta->bad_retired == 0)
+        return;
+    printf(" Node %d: bad blocks, %" PRIu64 " missing at start, %" PRIu64 " replaced by a spare, %" PRIu64 " retired\n",
+            node->nid, missing, meta->bad_replaced, meta->bad_retired);
+    printf(" Node %d: %" PRIu64 " pages lost (%.1f%% of the capacity), %" PRIu64 " left out of the host space\n",
+            node->nid, lost, 100.0 * lost / meta->total_pagenum, node->lost_pgs);
+}
+
+// erase counts of the blocks backed by a good block, nothing before the first erase
+void rw_wear_print(struct rewrite_meta* meta) {
+    struct fox_node* node = meta->node;
+    uint64_t b, n = 0, sum = 0;
+    uint32_t mine = UINT32_MAX, maxe = 0;
+    for (b = 0; b < node->nluns * node->nchs * node->nblks; b++) {
+        struct nodegeoaddr tgeo = vblk2geoaddr(node, b);
+        if (node->wl->vblks[fox_vblk_get_pblk(node->wl, node->ch[tgeo.ch_i], node->lun[tgeo.lun_i], tgeo.blk_i)] == NULL)
+            continue;
+        mine = (meta->blk_erases[b] < mine) ? meta->blk_erases[b] : mine;
+        maxe = (meta->blk_erases[b] > maxe) ? meta->blk_erases[b] : maxe;
+        sum += meta->blk_erases[b];
+        n++;
+    }
+    if (maxe == 0)
+        return;
+    printf(" Node %d: block erases min %" PRIu32 ", mean %.1f, max %" PRIu32 ", spread %" PRIu32 "\n",
+            node->nid, mine, (double)sum / n, maxe, maxe - mine);
+}
+
+void rw_waf_record(struct rewrite_meta* meta, struct fox_iounit* io) {
+    io->host_pgs = meta->host_pgs;
+    io->prog_user = meta->prog_pgs[RW_PROG_USER];
+    io->prog_gc = meta->prog_pgs[RW_PROG_GC];
+    io->prog_merge = meta->prog_pgs[RW_PROG_MERGE];
+    io->prog_map = meta->prog_pgs[RW_PROG_MAP];
+}
+
+// gc_policy labels the line for the engines with a GC policy, NULL for the others
+void rw_waf_print(struct rewrite_meta* meta, const char* gc_policy) {
+    uint64_t prog = 0;
+    int i;
+    for (i = 0; i < RW_PROG_NSRC; i++)
+        prog += meta->prog_pgs[i];
+    if (meta->node->wl->op)
+        printf(" Node %d: over-provisioning %d %%, %" PRIu64 " of %" PRIu64 " pages visible to the host\n",
+                meta->node->nid, meta->node->wl->op, meta->logical_pagenum, meta->total_pagenum);
+    printf(" Node %d: %s%s%shost pages %" PRIu64 ", flash pages %" PRIu64 " (user %" PRIu64 ", GC %" PRIu64 ", merge %" PRIu64 ", map %" PRIu64 "), WAF %.3f\n",
+            meta->node->nid, (gc_policy) ? "GC " : "", (gc_policy) ? gc_policy : "", (gc_policy) ? ", " : "", meta->host_pgs, prog, meta->prog_pgs[RW_PROG_USER], meta->prog_pgs[RW_PROG_GC],
+            meta->prog_pgs[RW_PROG_MERGE], meta->prog_pgs[RW_PROG_MAP], (meta->host_pgs) ? (double)prog / meta->host_pgs : 0.0);
+}
+
 int set_nodegeoaddr(struct fox_node* node, struct nodegeoaddr* baddr, uint64_t lbyte_addr) {
     size_t vpg_sz = node->wl->geo->page_nbytes * node->wl->geo->nplanes;
     uint64_t max_addr_in_node = (uint64_t)node->nchs * node->nluns * node->nblks * node->npgs * vpg_sz - 1;
@@ -129,6 +655,18 @@ int set_nodegeoaddr(struct fox_node* node, struct nodegeoaddr* baddr, uint64_t l
     return 0;
 }
 
+// device part of a page read, without the meta updates of rw_inside_page
+int rw_read_page(struct fox_node* node, struct fox_blkbuf* blockbuf, uint8_t* databuf, struct nodegeoaddr* geoaddr, uint64_t size) {
+    size_t vpg_sz = node->wl->geo->page_nbytes * node->wl->geo->nplanes;
+    if (geoaddr->offset_in_page >= vpg_sz || geoaddr->offset_in_page + size > vpg_sz)
+        return 1;
+    fox_vblk_tgt(node, node->ch[geoaddr->ch_i], node->lun[geoaddr->lun_i], geoaddr->blk_i);
+    if (fox_read_blk(&node->vblk_tgt, node, blockbuf, 1, geoaddr->pg_i))
+        return 1;
+    memcpy(databuf, blockbuf->buf_r + vpg_sz * geoaddr->pg_i + geoaddr->offset_in_page, size);
+    return 0;
+}
+
 int rw_inside_page(struct fox_node* node, struct fox_blkbuf* blockbuf, uint8_t* databuf, struct rewrite_meta* meta, struct nodegeoaddr* geoaddr, uint64_t size, int mode) {
     uint64_t ch_i = geoaddr->ch_i;
     uint64_t lun_i = geoaddr->lun_i;
@@ -142,23 +680,26 @@ int rw_inside_page(struct fox_node* node, struct fox_blkbuf* blockbuf, uint8_t*
         return 1;
     }
     if (mode == READ_MODE) {
-        if (fox_read_blk(&node->vblk_tgt, node, blockbuf, 1, pg_i)) {
+        if (rw_read_page(node, blockbuf, databuf, geoaddr, size))
             return 1;
-        }
         meta->heatmap[vpgofgeoaddr].readt++;
-        memcpy(databuf, blockbuf->buf_r + vpg_sz * pg_i + offset, size);
     } else if (mode == WRITE_MODE) {
-        uint8_t* pgst = get_p_page_state(meta, geoaddr);
-        if (*pgst == PAGE_DIRTY) {
+        if (get_pg_state(meta, vpgofgeoaddr) == PAGE_DIRTY) {
             printf("Writing to dirty page!\n");
             printf("%" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %d\n", ch_i, lun_i, blk_i, pg_i, offset, mode);
             return 1;
         } else if (offset == 0 && size == vpg_sz) {
             memcpy(blockbuf->buf_w + vpg_sz * pg_i, databuf, size);
+            if (meta->oob) {
+                struct rw_oob oob;
+                rw_oob_take(meta, vpgofgeoaddr, &oob);
+                rw_oob_stamp(meta, blockbuf, pg_i, &oob);
+            }
             if (fox_write_blk(&node->vblk_tgt, node, blockbuf, 1, pg_i)) {
                 return 1;
             }
             meta->heatmap[vpgofgeoaddr].writet++;
+            rw_prog(meta, 1);
         } else {
             /*
             if (fox_read_blk(&node->vblk_tgt, node, blockbuf, 1, pg_i)) {
@@ -173,9 +714,8 @@ int rw_inside_page(struct fox_node* node, struct fox_blkbuf* blockbuf, uint8_t*
             // cannot rewrite before erasing!
             return 1;
         }
-        *pgst = PAGE_DIRTY;
-        uint8_t* blkst = get_p_blk_state(meta, geoaddr);
-        *blkst = BLOCK_DIRTY;
+        set_pg_state(meta, vpgofgeoaddr, PAGE_DIRTY);
+        set_blk_state(meta, geoaddr, BLOCK_DIRTY);
     }
     return 0;
 }
@@ -187,22 +727,34 @@ int erase_block(struct fox_node* node, struct rewrite_meta* meta, struct nodegeo
     fox_vblk_tgt(node, node->ch[ch_i], node->lun[lun_i], blk_i);
     if (fox_erase_blk(&node->vblk_tgt, node))
         return 1;
-    *get_p_blk_state(meta, geoaddr) = BLOCK_CLEAN;
-    struct nodegeoaddr tgeo = *geoaddr;
-    for (tgeo.pg_i = 0; tgeo.pg_i < node->npgs; tgeo.pg_i++) {
-        *get_p_page_state(meta, &tgeo) = PAGE_CLEAN;
-        uint64_t vpgoftgeo = geoaddr2vpg(node, &tgeo);
-        meta->heatmap[vpgoftgeo].eraset++;
-    }
+    erase_block_meta(node, meta, geoaddr);
     return 0;
 }
 
+// state and erase count updates of erase_block, for callers that erase the
+// block themselves outside the engine lock
+void erase_block_meta(struct fox_node* node, struct rewrite_meta* meta, struct nodegeoaddr* geoaddr) {
+    set_blk_state(meta, geoaddr, BLOCK_CLEAN);
+    meta->blk_erases[geoaddr2vblk(node, geoaddr)]++;
+    // the pages of a block are nchs * nluns apart
+    struct nodegeoaddr tgeo = *geoaddr;
+    tgeo.pg_i = 0;
+    uint64_t vpgi = geoaddr2vpg(node, &tgeo);
+    for (tgeo.pg_i = 0; tgeo.pg_i < node->npgs; tgeo.pg_i++, vpgi += node->nchs * node->nluns)
+        set_pg_state(meta, vpgi, PAGE_CLEAN);
+}
+
 int write_meta_stats(struct rewrite_meta* meta) {
     FILE *fp;
     char filename[40];
 
+    // one set of files per node when running several jobs
+    char suffix[16] = "";
+    if (meta->node->wl->nthreads > 1)
+        sprintf(suffix, "_%d", meta->node->nid);
+
     // write heatmap
-    sprintf(filename, "heatmap_fox_io.csv");
+    sprintf(filename, "heatmap_fox_io%s.csv", suffix);
     fp = fopen(filename, "w");
     uint64_t vpgi = 0;
     for (vpgi = 0; vpgi < meta->total_pagenum; vpgi++) {
@@ -212,17 +764,18 @@ int write_meta_stats(struct rewrite_meta* meta) {
         int ch = meta->node->ch[tgeo.ch_i];
         int lu = meta->node->lun[tgeo.lun_i];
         struct fox_heatmap_unit* hu = &meta->heatmap[vpgi];
-        fprintf(fp, "%d,%d,%d,%d,%" PRId64 ",%" PRId64 ",%" PRId64 "\n", ch, lu, blk, pg, hu->readt, hu->writet, hu->eraset);
+        uint32_t eraset = meta->blk_erases[geoaddr2vblk(meta->node, &tgeo)];
+        fprintf(fp, "%d,%d,%d,%d,%" PRIu32 ",%" PRIu32 ",%" PRIu32 "\n", ch, lu, blk, pg, hu->readt, hu->writet, eraset);
     }
     fclose(fp);
 
     // write io time
-    sprintf(filename, "iotime_fox_io.csv");
+    sprintf(filename, "iotime_fox_io%s.csv", suffix);
     fp = fopen(filename, "w");
     uint64_t io_i = 0;
     for (io_i = 0; io_i < meta->ioseqlen; io_i++) {
         struct fox_iounit* ioseqi = &meta->ioseq[io_i];
-        fprintf(fp, "%" PRId64 ",%" PRId64 ",%c,%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%lf,%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 "\n", ioseqi->offset, ioseqi->size, ioseqi->iotype, ioseqi->exetime, ioseqi->nabandoned, ioseqi->ndirty, ioseqi->nblock, ioseqi->gc_becost, ioseqi->map_change_count, ioseqi->map_set_count, ioseqi->gc_count, ioseqi->gc_time, ioseqi->gc_map_change_count, ioseqi->pgs_r, ioseqi->bread, ioseqi->pgs_w, ioseqi->bwritten, ioseqi->erased_blks, ioseqi->erase_t, ioseqi->read_t, ioseqi->write_t);
+        fprintf(fp, "%" PRId64 ",%" PRId64 ",%c,%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%lf,%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 "\n", ioseqi->offset, ioseqi->size, ioseqi->iotype, ioseqi->exetime, ioseqi->nabandoned, ioseqi->ndirty, ioseqi->nblock, ioseqi->gc_becost, ioseqi->map_change_count, ioseqi->map_set_count, ioseqi->gc_count, ioseqi->gc_time, ioseqi->gc_map_change_count, ioseqi->pgs_r, ioseqi->bread, ioseqi->pgs_w, ioseqi->bwritten, ioseqi->erased_blks, ioseqi->erase_t, ioseqi->read_t, ioseqi->write_t, ioseqi->cache_lookups, ioseqi->cache_hits, ioseqi->cache_saved, ioseqi->host_pgs, ioseqi->prog_user, ioseqi->prog_gc, ioseqi->prog_merge, ioseqi->prog_map, ioseqi->log_pool, ioseqi->log_merges);
     }
     fclose(fp);
 
@@ -11,6 +11,8 @@
 
 #define READ_MODE 1
 #define WRITE_MODE 2
+#define TRIM_MODE 3 // trace op 't'
+#define ERASE_MODE 4 // block erase of a batch, see rw_batch_erase
 
 #define PAGE_CLEAN 0
 #define PAGE_DIRTY 1
@@ -19,6 +21,18 @@
 #define BLOCK_CLEAN 0
 #define BLOCK_DIRTY 1
 
+// sources of flash page programs, see rw_prog
+#define RW_PROG_USER 0
+#define RW_PROG_GC 1
+#define RW_PROG_MERGE 2 // log and data block merges of engines 7-8
+#define RW_PROG_MAP 3 // translation pages and checkpoints
+#define RW_PROG_NSRC 4
+
+// page numbers in the mapping tables are 32-bit, ids above total_pagenum are
+// used for translation pages
+typedef uint32_t rw_pgno;
+#define RW_MAX_PAGES ((uint64_t)UINT32_MAX / 2)
+
 struct nodegeoaddr {
     uint64_t offset_in_page; // parts not aligned to page (in ocssd)
     uint64_t ch_i;
@@ -28,7 +42,7 @@ struct nodegeoaddr {
 };
 
 struct fox_iounit {
-    char iotype; // 'r' for read and 'w' for write
+    char iotype; // 'r' for read, 'w' for write and 't' for trim
     uint64_t offset;
     uint64_t size;
     uint64_t exetime;
@@ -49,20 +63,296 @@ struct fox_iounit {
     uint64_t erase_t;
     uint64_t read_t;
     uint64_t write_t;
+    uint64_t cache_lookups; // read cache, pages looked up
+    uint64_t cache_hits;
+    uint64_t cache_saved; // flash page reads saved, reads and writes
+    uint64_t host_pgs; // pages written by the host so far, see rw_waf_record
+    uint64_t prog_user; // flash pages programmed so far, by source
+    uint64_t prog_gc;
+    uint64_t prog_merge;
+    uint64_t prog_map;
+    uint64_t log_pool; // engine 8, log superblocks allowed after this I/O
+    uint64_t log_merges; // engine 8, merges so far
+};
+
+struct gc_unit {
+    uint64_t id;
+    uint64_t nvalid;
+    uint64_t stamp; // gc clock when the unit became full
+    uint64_t pos; // index in gc_victims.full
+    int full;
+    TAILQ_ENTRY(gc_unit) bt; // in buckets[nvalid]
+    TAILQ_ENTRY(gc_unit) ft; // in fifo, oldest full unit first
+};
+
+TAILQ_HEAD(gc_unit_list, gc_unit);
+
+struct gc_victims {
+    int policy;
+    uint64_t nunits;
+    uint64_t npgs; // pages per unit
+    uint64_t window;
+    uint64_t clock;
+    uint64_t rng;
+    struct gc_unit* units;
+    struct gc_unit_list* buckets; // full units by valid pages, 0..npgs
+    uint64_t min_bucket; // no full unit has fewer valid pages than this
+    struct gc_unit_list fifo;
+    uint64_t* full; // ids of full units
+    uint64_t nfull;
+};
+
+#define RW_BATCH_NPPAS 64 // sectors per GC vector command
+#define RW_BATCH_WORKERS 16 // threads serving the PUs of a batch
+
+// owner of a physical page, in the metadata of its first sector with --oob
+struct rw_oob {
+    rw_pgno vpg; // owner, all ones if none
+    uint32_t seq; // write sequence, wraps
+};
+
+// owner of an allocated page until it is programmed, see rw_oob_write
+struct rw_oob_pend {
+    rw_pgno ppg; // total_pagenum if the slot is free
+    struct rw_oob oob;
+};
+
+struct rw_batch_page {
+    struct nodegeoaddr addr;
+    uint64_t state_i; // index in page_state and heatmap
+    uint8_t* data;
+    int mode;
+    int done; // written, states are set by rw_batch_submit
+    struct rw_oob oob; // metadata of a page written with --oob
+};
+
+struct rw_copy {
+    struct nodegeoaddr src;
+    struct nodegeoaddr dst;
+    uint64_t src_i; // page_state index of src
+    uint64_t dst_i;
+};
+
+struct rw_batch_worker {
+    struct rw_batch* b;
+    struct fox_node node; // own vblk target and stats, merged after each submit
+    struct fox_workload wl; // node workload with the GC vector size
+    struct fox_blkbuf buf;
+    pthread_t tid;
+    int busy;
+    int spawned;
+    int ret;
+};
+
+struct rw_batch {
+    struct fox_node* node;
+    struct rewrite_meta* meta;
+    struct fox_blkbuf* ref; // block buffer of the engine, the -m reference
+    uint64_t max; // pages per submit
+    uint64_t n;
+    struct rw_batch_page* pgs;
+    uint64_t* order; // pages sorted by PU
+    uint64_t* pu_first; // first page of each PU in order
+    uint64_t copypgs; // pages per chunk of rw_batch_copy
+    uint8_t* copybuf; // two chunks
+    uint64_t npus;
+    uint64_t nworkers;
+    struct rw_batch_worker* workers;
+    uint64_t ncmds; // submits
+    uint64_t npages; // pages submitted
+    // --gc-copy device, see rw_batch_copy
+    int devcopy; // cleared when the device rejects a copy
+    struct nvm_addr* dev_src; // sectors of one vector copy
+    struct nvm_addr* dev_dst;
+    uint64_t dev_cmds;
+    uint64_t host_bytes; // moved through host memory, read + write
+    uint64_t dev_bytes; // copied inside the device
+    uint64_t erase_cmds; // rw_batch_erase calls
+    uint64_t erase_blks;
+    uint64_t erase_us; // wall time of the erases
+};
+
+// engine I/O on node logical bytes, data holds size bytes
+typedef int (*rw_io_fn)(void* ctx, uint8_t* data, uint64_t offset, uint64_t size, int mode);
+
+#define RW_WBUF_RUN 64 // max pages of one write buffer flush
+
+struct rw_wbuf_page {
+    uint64_t vpg;
+    uint64_t lo; // valid bytes [lo, hi)
+    uint64_t hi;
+    uint8_t* data;
+    TAILQ_ENTRY(rw_wbuf_page) lt; // in lru or free
+};
+
+TAILQ_HEAD(rw_wbuf_list, rw_wbuf_page);
+
+struct rw_wbuf {
+    struct rewrite_meta* meta;
+    rw_io_fn io;
+    void* ctx;
+    uint64_t npgs; // capacity, 0 if disabled
+    struct rw_wbuf_page* pgs;
+    uint8_t* data;
+    uint32_t* slot; // buffered page + 1 of each logical page, 0 if none
+    struct rw_wbuf_list lru; // least recently written first
+    struct rw_wbuf_list free;
+    uint8_t* runbuf; // RW_WBUF_RUN pages
+    uint64_t w_pgs; // page pieces written by the user
+    uint64_t w_hits; // merged into a buffered page
+    uint64_t absorbed; // bytes rewritten in the buffer
+    uint64_t r_pgs;
+    uint64_t r_hits; // served from the buffer
+    uint64_t r_partial; // flash reads patched with buffered bytes
+    uint64_t flushes;
+    uint64_t flushed_pgs;
+    uint64_t rmw_flushes; // partial pages written back
+    uint64_t trimmed; // buffered pages dropped by trims
 };
 
+#define RW_RCACHE_RUN 64 // max pages of one cache fill
+#define RW_RCACHE_RA_MIN 4 // first readahead window
+
+struct rw_rcache_page {
+    uint64_t vpg;
+    uint8_t* data;
+    uint8_t ref; // clock reference bit
+    uint8_t ra; // read ahead, not hit yet
+    TAILQ_ENTRY(rw_rcache_page) lt; // in lru or free
+};
+
+TAILQ_HEAD(rw_rcache_list, rw_rcache_page);
+
+struct rw_rcache {
+    struct rewrite_meta* meta;
+    rw_io_fn io;
+    void* ctx;
+    uint64_t npgs; // capacity, 0 if disabled
+    int policy; // RCACHE_LRU or RCACHE_CLOCK
+    struct rw_rcache_page* pgs;
+    uint8_t* data;
+    uint32_t* slot; // cached page + 1 of each logical page, 0 if none
+    struct rw_rcache_list lru; // least recently used first, lru only
+    struct rw_rcache_list free;
+    uint64_t hand; // clock hand
+    uint8_t* runbuf; // RW_RCACHE_RUN pages
+    // sequential detection and readahead
+    uint64_t ra_max; // pages, 0 if disabled
+    uint64_t seq_end; // end of the last read
+    uint64_t seq_run; // reads continuing the previous one
+    uint64_t ra_win;
+    uint64_t ra_from; // pending readahead
+    uint64_t ra_len;
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t saved; // flash page reads saved on reads
+    uint64_t trimmed; // cached pages dropped by trims
+    uint64_t rmw_saved; // read-modify-write reads saved on writes
+    uint64_t evictions;
+    uint64_t ra_cmds;
+    uint64_t ra_pgs;
+    uint64_t ra_hits;
+    uint64_t ra_unused; // evicted before any hit
+    uint64_t ra_us; // time of the readahead reads, not in any I/O latency
+};
+
+#define RW_DFTL_NIL UINT32_MAX
+
+struct rw_dftl_ent {
+    rw_pgno vpg;
+    rw_pgno ppg;
+    uint32_t prev; // lru list, next also links the free entries
+    uint32_t next;
+    uint8_t dirty;
+};
+
+// reads the translation page at ppg into data
+typedef int (*rw_dftl_tp_read_fn)(void* ctx, uint64_t ppg, uint8_t* data);
+// writes translation page t to a new flash page and remaps rw_dftl_tp_id(t)
+typedef int (*rw_dftl_tp_write_fn)(void* ctx, uint64_t t, uint8_t* data);
+
+struct rw_dftl {
+    struct rewrite_meta* meta;
+    uint64_t max; // cached entries, 0 if the whole table is in DRAM
+    rw_pgno* table; // whole table
+    uint64_t epp; // entries per translation page
+    uint64_t ntps;
+    rw_pgno* gtd; // flash page of each translation page
+    struct rw_dftl_ent* ents;
+    uint64_t nents;
+    uint64_t cap;
+    uint32_t* hash; // entry + 1 by vpg, linear probing
+    uint64_t hcap;
+    uint32_t lru_head; // least recently used
+    uint32_t lru_tail;
+    uint32_t free_head;
+    uint8_t* rbuf; // translation page of a miss
+    uint8_t* wbuf; // translation page of a write-back
+    uint64_t wb_tp; // translation page in wbuf while tp_write runs, ntps if none
+    rw_dftl_tp_read_fn tp_read;
+    rw_dftl_tp_write_fn tp_write;
+    void* ctx;
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t evictions;
+    uint64_t tp_reads;
+    uint64_t tp_writes;
+    uint64_t wb_ents; // dirty entries written back
+};
+
+// entry idx of the checkpointed image, total_pagenum + blk for block write pointers
+typedef uint64_t (*rw_ckpt_get_fn)(void* ctx, uint64_t idx);
+
+struct rw_ckpt {
+    struct rewrite_meta* meta;
+    uint64_t every; // map updates between checkpoints, 0 if disabled
+    rw_ckpt_get_fn get;
+    void* ctx;
+    struct fox_blkbuf buf; // own, see rw_ckpt_init
+    uint64_t nimg; // entries: vpg2ppg, then the write pointer of each block
+    uint64_t epp; // entries per chunk page
+    uint64_t nchunks;
+    uint64_t* dirty; // chunks changed since the last checkpoint
+    uint64_t ndirty;
+    rw_pgno* dir; // flash page of each chunk
+    uint64_t dpp; // dir entries per root page
+    uint64_t nroot; // root pages
+    uint64_t* blks; // reserved blocks, 2 regions of rblks, filled by the engine
+    uint64_t nblks;
+    uint64_t rblks;
+    uint64_t rpgs; // pages per region
+    int region;
+    uint64_t wp; // next page of the region
+    uint64_t owp; // pages written in the other region
+    uint64_t seq; // of the last checkpoint
+    uint8_t* pagebuf;
+    uint32_t* jrec; // journal records (idx, val) not on flash yet
+    uint64_t jn;
+    uint64_t jcap;
+    uint64_t rpp; // records per journal page
+    uint64_t since; // updates since the last checkpoint
+    uint64_t ckpts;
+    uint64_t full_ckpts;
+    uint64_t chunk_pgs;
+    uint64_t root_pgs;
+    uint64_t jpgs;
+    uint64_t jrecs;
+};
+
+// erases are counted per block, see blk_erases
 struct fox_heatmap_unit {
-    uint64_t readt;
-    uint64_t writet;
-    uint64_t eraset;
+    uint32_t readt;
+    uint32_t writet;
 };
 
 struct rewrite_meta {
     struct fox_node* node;
     uint64_t total_pagenum;
+    uint64_t logical_pagenum; // pages visible to the host, total less --op
     size_t vpg_sz;
-    uint8_t* page_state; // state of all pages in node
-    uint8_t* blk_state; // state of all blocks in node
+    uint64_t* page_state; // state of all pages in node, 2 bits each, see get_pg_state
+    uint64_t* blk_state; // state of all blocks in node, 1 bit each
+    uint32_t* blk_erases; // erases of each block
     uint8_t* temp_page_state_inblk; // temporarily store page state in one block, used for collecting dirty pages in one block before erase it, useful for rewriting dirty pages
     uint8_t* begin_pagebuf;
     uint8_t* end_pagebuf;
@@ -70,6 +360,23 @@ struct rewrite_meta {
     struct fox_iounit* ioseq;
     uint64_t ioseqlen;
     struct fox_heatmap_unit* heatmap;
+    uint8_t oob; // --oob, page owners in the device metadata
+    struct rw_oob_pend* oob_pend; // open addressing on ppg, see rw_oob_write
+    uint64_t oob_cap;
+    uint64_t oob_npend;
+    uint64_t oob_peak; // most slots allocated
+    uint8_t* oob_pgmeta; // metadata of one page, for rw_oob_read
+    uint32_t oob_seq;
+    uint64_t oob_reads;
+    uint64_t trims; // see rw_trim_range
+    uint64_t trim_pgs;
+    uint64_t trim_valid; // mapped pages invalidated by trims
+    uint64_t host_pgs; // pages written by the host, see rw_wbuf_io
+    uint64_t bad_replaced; // blocks swapped for a spare, see rw_replace_blk
+    uint64_t bad_retired; // blocks (superblocks in engines 7 and 8) retired at runtime, no spare left
+    uint64_t bad_retired_pgs;
+    uint64_t prog_pgs[RW_PROG_NSRC]; // flash pages programmed, by source
+    int prog_src; // source of the programs being issued, see rw_prog_src
 };
 
 uint64_t geoaddr2vpg(struct fox_node* node, struct nodegeoaddr* geoaddr);
@@ -84,9 +391,67 @@ uint64_t vpg2vblk(struct fox_node* node, uint64_t vpg_i);
 
 uint64_t vblk2vpg(struct fox_node* node, uint64_t vblk_i);
 
-uint8_t* get_p_page_state(struct rewrite_meta* meta, struct nodegeoaddr* geoaddr);
+// page i is in bits 2 * (i % 32) of word i / 32
+static inline uint8_t get_pg_state(struct rewrite_meta* meta, uint64_t i) {
+    return (meta->page_state[i >> 5] >> ((i & 31) << 1)) & 3;
+}
+
+static inline void set_pg_state(struct rewrite_meta* meta, uint64_t i, uint8_t st) {
+    uint64_t sh = (i & 31) << 1;
+    meta->page_state[i >> 5] = (meta->page_state[i >> 5] & ~(3ULL << sh)) | ((uint64_t)st << sh);
+}
+
+uint8_t get_page_state(struct rewrite_meta* meta, struct nodegeoaddr* geoaddr);
+
+// counts npgs flash page programs for the current source
+static inline void rw_prog(struct rewrite_meta* meta, uint64_t npgs) {
+    meta->prog_pgs[meta->prog_src] += npgs;
+}
+
+// programs issued from now on come from src, returns the previous source
+static inline int rw_prog_src(struct rewrite_meta* meta, int src) {
+    int old = meta->prog_src;
+    meta->prog_src = src;
+    return old;
+}
+
+void rw_waf_record(struct rewrite_meta* meta, struct fox_iounit* io);
+
+void rw_waf_print(struct rewrite_meta* meta, const char* gc_policy);
+
+void rw_oob_write(struct rewrite_meta* meta, uint64_t ppg, uint64_t vpg);
+
+void rw_oob_take(struct rewrite_meta* meta, uint64_t ppg, struct rw_oob* oob);
+
+void rw_oob_stamp(struct rewrite_meta* meta, struct fox_blkbuf* buf, uint64_t pg_i, struct rw_oob* oob);
+
+uint64_t rw_oob_read(struct rewrite_meta* meta, uint64_t ppg);
+
+void rw_oob_print(struct rewrite_meta* meta);
 
-uint8_t* get_p_blk_state(struct rewrite_meta* meta, struct nodegeoaddr* geoaddr);
+int rw_trim_range(struct rewrite_meta* meta, uint64_t offset, uint64_t size, uint64_t* first, uint64_t* end);
+
+void rw_trim_print(struct rewrite_meta* meta);
+
+uint8_t* rw_sb_compose(struct fox_node* node);
+
+int rw_replace_blk(struct rewrite_meta* meta, struct nodegeoaddr* addr);
+
+void rw_bad_print(struct rewrite_meta* meta);
+
+void rw_wear_print(struct rewrite_meta* meta);
+
+void set_page_state(struct rewrite_meta* meta, struct nodegeoaddr* geoaddr, uint8_t st);
+
+uint8_t get_blk_state(struct rewrite_meta* meta, struct nodegeoaddr* geoaddr);
+
+void set_blk_state(struct rewrite_meta* meta, struct nodegeoaddr* geoaddr, uint8_t st);
+
+uint64_t count_pg_state(struct rewrite_meta* meta, uint64_t first, uint64_t n, uint8_t st);
+
+uint64_t next_pg_state(struct rewrite_meta* meta, uint64_t i, uint64_t end, uint8_t st);
+
+void fill_pg_state(struct rewrite_meta* meta, uint64_t first, uint64_t n, uint8_t st);
 
 int init_rewrite_meta(struct fox_node* node, struct rewrite_meta* meta);
 
@@ -94,10 +459,98 @@ int free_rewrite_meta(struct rewrite_meta* meta);
 
 int set_nodegeoaddr(struct fox_node* node, struct nodegeoaddr* baddr, uint64_t lbyte_addr);
 
+int rw_read_page(struct fox_node* node, struct fox_blkbuf* blockbuf, uint8_t* databuf, struct nodegeoaddr* geoaddr, uint64_t size);
+
 int rw_inside_page(struct fox_node* node, struct fox_blkbuf* blockbuf, uint8_t* databuf, struct rewrite_meta* meta, struct nodegeoaddr* geoaddr, uint64_t size, int mode);
 
 int erase_block(struct fox_node* node, struct rewrite_meta* meta, struct nodegeoaddr* geoaddr);
 
+void erase_block_meta(struct fox_node* node, struct rewrite_meta* meta, struct nodegeoaddr* geoaddr);
+
 int write_meta_stats(struct rewrite_meta* meta);
 
+int rw_batch_init(struct rw_batch* b, struct fox_node* node, struct rewrite_meta* meta, struct fox_blkbuf* ref, uint64_t max, uint64_t copypgs);
+
+void rw_batch_free(struct rw_batch* b);
+
+int rw_batch_add(struct rw_batch* b, struct nodegeoaddr* addr, uint64_t state_i, uint8_t* data, int mode);
+
+int rw_batch_submit(struct rw_batch* b);
+
+int rw_batch_copy(struct rw_batch* b, struct rw_copy* cps, uint64_t n);
+
+int rw_batch_erase(struct rw_batch* b, struct nodegeoaddr* blks, uint64_t n);
+
+void rw_batch_print(struct rw_batch* b);
+
+int rw_wbuf_init(struct rw_wbuf* wb, struct rewrite_meta* meta, uint64_t npgs, rw_io_fn io, void* ctx);
+
+void rw_wbuf_free(struct rw_wbuf* wb);
+
+int rw_wbuf_io(struct rw_wbuf* wb, uint8_t* data, uint64_t offset, uint64_t size, int mode);
+
+int rw_wbuf_drain(struct rw_wbuf* wb);
+
+void rw_wbuf_print(struct rw_wbuf* wb);
+
+int rw_rcache_init(struct rw_rcache* rc, struct rewrite_meta* meta, uint64_t npgs, int policy, uint64_t ra_max, rw_io_fn io, void* ctx);
+
+void rw_rcache_free(struct rw_rcache* rc);
+
+int rw_rcache_io(void* ctx, uint8_t* data, uint64_t offset, uint64_t size, int mode);
+
+int rw_rcache_prefetch(struct rw_rcache* rc);
+
+void rw_rcache_print(struct rw_rcache* rc);
+
+int rw_dftl_init(struct rw_dftl* d, struct rewrite_meta* meta, uint64_t max, rw_dftl_tp_read_fn tp_read, rw_dftl_tp_write_fn tp_write, void* ctx);
+
+void rw_dftl_free(struct rw_dftl* d);
+
+uint64_t rw_dftl_tp_id(struct rw_dftl* d, uint64_t t);
+
+uint64_t rw_dftl_get(struct rw_dftl* d, uint64_t id);
+
+void rw_dftl_set(struct rw_dftl* d, uint64_t id, uint64_t ppg);
+
+int rw_dftl_evict(struct rw_dftl* d);
+
+void rw_dftl_print(struct rw_dftl* d);
+
+int rw_ckpt_init(struct rw_ckpt* ck, struct rewrite_meta* meta, uint64_t every, rw_ckpt_get_fn get, void* ctx);
+
+int rw_ckpt_start(struct rw_ckpt* ck);
+
+void rw_ckpt_free(struct rw_ckpt* ck);
+
+void rw_ckpt_log(struct rw_ckpt* ck, uint64_t idx, uint64_t val);
+
+void rw_ckpt_erase(struct rw_ckpt* ck, uint64_t blk);
+
+int rw_ckpt_tick(struct rw_ckpt* ck);
+
+int rw_ckpt_recover(struct rw_ckpt* ck);
+
+void rw_ckpt_print(struct rw_ckpt* ck);
+
+int gen_ioseq(struct fox_node* node, struct rewrite_meta* meta);
+
+int gc_victims_init(struct gc_victims* gv, struct fox_node* node, uint64_t nunits, uint64_t npgs);
+
+void gc_victims_free(struct gc_victims* gv);
+
+void gc_unit_full(struct gc_victims* gv, uint64_t id, uint64_t nvalid);
+
+void gc_unit_invalidate(struct gc_victims* gv, uint64_t id);
+
+void gc_unit_remove(struct gc_victims* gv, uint64_t id);
+
+uint64_t gc_victim(struct gc_victims* gv);
+
+uint64_t gc_victim_idle(struct gc_victims* gv, int (*busy)(void*, uint64_t), void* ctx);
+
+const char* gc_policy_name(int policy);
+
+void gc_print_latency(struct fox_node* node, struct rewrite_meta* meta, uint64_t fg_gc, uint64_t inc_gc, uint64_t bg_gc);
+
 #endif
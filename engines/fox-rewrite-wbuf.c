@@ -0,0 +1,249 @@
+/* DRAM write-back buffer in front of the rewrite engines (4-8).
+ * User writes land in buffered logical pages; each page keeps one extent of
+ * valid bytes [lo, hi):
+ *   - a write that overlaps or touches the extent of a buffered page merges
+ *     into it, a rewrite of buffered bytes never reaches flash;
+ *   - a write that leaves a gap flushes the old extent first;
+ *   - when the buffer is full, the least recently written page is flushed;
+ *     full pages are flushed together with their buffered full neighbours as
+ *     one sequential write, a partial page goes through the engine
+ *     read-modify-write path.
+ * Reads are served from the buffer when it holds all their bytes, otherwise
+ * they go to the engine and buffered bytes are copied over the result.
+ * A trim drops the buffered pages it covers whole and goes to the engine.
+ * The engine is called through rw_io_fn with byte offsets of the node
+ * logical space, the same as the I/O sequence.
+ * Written by Chuizheng Meng <mengcz13@mails.tsinghua.edu.cn>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../fox.h"
+#include "fox-rewrite-utils.h"
+
+// npgs == 0: writes and reads go straight to the engine
+int rw_wbuf_init(struct rw_wbuf* wb, struct rewrite_meta* meta, uint64_t npgs, rw_io_fn io, void* ctx) {
+    uint64_t i;
+    memset(wb, 0, sizeof(struct rw_wbuf));
+    wb->meta = meta;
+    wb->io = io;
+    wb->ctx = ctx;
+    wb->npgs = npgs;
+    TAILQ_INIT(&wb->lru);
+    TAILQ_INIT(&wb->free);
+    if (npgs == 0)
+        return 0;
+    wb->pgs = (struct rw_wbuf_page*)calloc(npgs, sizeof(struct rw_wbuf_page));
+    wb->data = (uint8_t*)calloc(npgs, meta->vpg_sz);
+    wb->slot = (uint32_t*)calloc(meta->total_pagenum, sizeof(uint32_t));
+    wb->runbuf = (uint8_t*)calloc(RW_WBUF_RUN, meta->vpg_sz);
+    if (!wb->pgs || !wb->data || !wb->slot || !wb->runbuf) {
+        rw_wbuf_free(wb);
+        return 1;
+    }
+    for (i = 0; i < npgs; i++) {
+        wb->pgs[i].data = wb->data + i * meta->vpg_sz;
+        TAILQ_INSERT_TAIL(&wb->free, &wb->pgs[i], lt);
+    }
+    return 0;
+}
+
+void rw_wbuf_free(struct rw_wbuf* wb) {
+    free(wb->pgs);
+    free(wb->data);
+    free(wb->slot);
+    free(wb->runbuf);
+    wb->pgs = NULL;
+    wb->data = NULL;
+    wb->slot = NULL;
+    wb->runbuf = NULL;
+    wb->npgs = 0;
+}
+
+static struct rw_wbuf_page* wbuf_find(struct rw_wbuf* wb, uint64_t vpg) {
+    return (wb->slot[vpg]) ? &wb->pgs[wb->slot[vpg] - 1] : NULL;
+}
+
+static int wbuf_full(struct rw_wbuf* wb, struct rw_wbuf_page* p) {
+    return (p->lo == 0 && p->hi == wb->meta->vpg_sz);
+}
+
+static void wbuf_drop(struct rw_wbuf* wb, struct rw_wbuf_page* p) {
+    wb->slot[p->vpg] = 0;
+    TAILQ_REMOVE(&wb->lru, p, lt);
+    TAILQ_INSERT_TAIL(&wb->free, p, lt);
+}
+
+// writes p back, with its full neighbours when p is full
+static int wbuf_flush(struct rw_wbuf* wb, struct rw_wbuf_page* p) {
+    size_t vpg_sz = wb->meta->vpg_sz;
+    uint64_t first, last, vpg;
+    int ret;
+    if (!wbuf_full(wb, p)) {
+        ret = wb->io(wb->ctx, p->data + p->lo, p->vpg * vpg_sz + p->lo, p->hi - p->lo, WRITE_MODE);
+        wb->flushes++;
+        wb->flushed_pgs++;
+        wb->rmw_flushes++;
+        wbuf_drop(wb, p);
+        return ret;
+    }
+    first = last = p->vpg;
+    while (first > 0 && last - first + 1 < RW_WBUF_RUN && wb->slot[first - 1] && wbuf_full(wb, wbuf_find(wb, first - 1)))
+        first--;
+    while (last + 1 < wb->meta->total_pagenum && last - first + 1 < RW_WBUF_RUN && wb->slot[last + 1] && wbuf_full(wb, wbuf_find(wb, last + 1)))
+        last++;
+    for (vpg = first; vpg <= last; vpg++) {
+        struct rw_wbuf_page* q = wbuf_find(wb, vpg);
+        memcpy(wb->runbuf + (vpg - first) * vpg_sz, q->data, vpg_sz);
+        wbuf_drop(wb, q);
+    }
+    ret = wb->io(wb->ctx, wb->runbuf, first * vpg_sz, (last - first + 1) * vpg_sz, WRITE_MODE);
+    wb->flushes++;
+    wb->flushed_pgs += last - first + 1;
+    return ret;
+}
+
+static struct rw_wbuf_page* wbuf_get(struct rw_wbuf* wb, uint64_t vpg) {
+    struct rw_wbuf_page* p;
+    if (TAILQ_EMPTY(&wb->free))
+        wbuf_flush(wb, TAILQ_FIRST(&wb->lru));
+    p = TAILQ_FIRST(&wb->free);
+    TAILQ_REMOVE(&wb->free, p, lt);
+    TAILQ_INSERT_TAIL(&wb->lru, p, lt);
+    p->vpg = vpg;
+    p->lo = p->hi = 0;
+    wb->slot[vpg] = p - wb->pgs + 1;
+    return p;
+}
+
+static int wbuf_write(struct rw_wbuf* wb, uint8_t* data, uint64_t offset, uint64_t size) {
+    size_t vpg_sz = wb->meta->vpg_sz;
+    uint64_t end = offset + size;
+    int ret = 0;
+    while (offset < end) {
+        uint64_t vpg = offset / vpg_sz;
+        uint64_t lo = offset % vpg_sz;
+        uint64_t hi = (end - vpg * vpg_sz < vpg_sz) ? end - vpg * vpg_sz : vpg_sz;
+        struct rw_wbuf_page* p = wbuf_find(wb, vpg);
+        wb->w_pgs++;
+        if (p != NULL && (hi < p->lo || lo > p->hi)) {
+            // not contiguous with the buffered bytes
+            ret |= wbuf_flush(wb, p);
+            p = NULL;
+        }
+        if (p == NULL) {
+            p = wbuf_get(wb, vpg);
+            p->lo = lo;
+            p->hi = hi;
+        } else {
+            wb->w_hits++;
+            if (hi > p->lo && lo < p->hi)
+                wb->absorbed += ((hi < p->hi) ? hi : p->hi) - ((lo > p->lo) ? lo : p->lo);
+            p->lo = (lo < p->lo) ? lo : p->lo;
+            p->hi = (hi > p->hi) ? hi : p->hi;
+            TAILQ_REMOVE(&wb->lru, p, lt);
+            TAILQ_INSERT_TAIL(&wb->lru, p, lt);
+        }
+        memcpy(p->data + lo, data, hi - lo);
+        data += hi - lo;
+        offset += hi - lo;
+    }
+    return ret;
+}
+
+// copies the buffered bytes of [offset, offset + size) over data
+static void wbuf_overlay(struct rw_wbuf* wb, uint8_t* data, uint64_t offset, uint64_t size) {
+    size_t vpg_sz = wb->meta->vpg_sz;
+    uint64_t vpg;
+    for (vpg = offset / vpg_sz; vpg <= (offset + size - 1) / vpg_sz; vpg++) {
+        struct rw_wbuf_page* p = wbuf_find(wb, vpg);
+        uint64_t lo, hi;
+        if (p == NULL)
+            continue;
+        lo = vpg * vpg_sz + p->lo;
+        hi = vpg * vpg_sz + p->hi;
+        lo = (lo > offset) ? lo : offset;
+        hi = (hi < offset + size) ? hi : offset + size;
+        if (lo < hi) {
+            memcpy(data + (lo - offset), p->data + (lo - vpg * vpg_sz), hi - lo);
+            wb->r_partial++;
+        }
+    }
+}
+
+static int wbuf_read(struct rw_wbuf* wb, uint8_t* data, uint64_t offset, uint64_t size) {
+    size_t vpg_sz = wb->meta->vpg_sz;
+    uint64_t base = offset, end = offset + size;
+    uint64_t run = offset; // start of the bytes not served from the buffer yet
+    int ret = 0;
+    while (offset < end) {
+        uint64_t vpg = offset / vpg_sz;
+        uint64_t lo = offset % vpg_sz;
+        uint64_t hi = (end - vpg * vpg_sz < vpg_sz) ? end - vpg * vpg_sz : vpg_sz;
+        struct rw_wbuf_page* p = wbuf_find(wb, vpg);
+        wb->r_pgs++;
+        if (p != NULL && p->lo <= lo && hi <= p->hi) {
+            // hit: read the flash run before it, then copy this page
+            if (run < offset) {
+                ret |= wb->io(wb->ctx, data + (run - base), run, offset - run, READ_MODE);
+                wbuf_overlay(wb, data + (run - base), run, offset - run);
+            }
+            memcpy(data + (offset - base), p->data + lo, hi - lo);
+            wb->r_hits++;
+            run = offset + hi - lo;
+        }
+        offset += hi - lo;
+    }
+    if (run < end) {
+        ret |= wb->io(wb->ctx, data + (run - base), run, end - run, READ_MODE);
+        wbuf_overlay(wb, data + (run - base), run, end - run);
+    }
+    return ret;
+}
+
+// drops the whole pages of the trim, they are never written back
+static int wbuf_trim(struct rw_wbuf* wb, uint8_t* data, uint64_t offset, uint64_t size) {
+    size_t vpg_sz = wb->meta->vpg_sz;
+    uint64_t vpg;
+    for (vpg = (offset + vpg_sz - 1) / vpg_sz; (vpg + 1) * vpg_sz <= offset + size; vpg++) {
+        struct rw_wbuf_page* p = wbuf_find(wb, vpg);
+        if (p != NULL) {
+            wbuf_drop(wb, p);
+            wb->trimmed++;
+        }
+    }
+    return wb->io(wb->ctx, data, offset, size, TRIM_MODE);
+}
+
+int rw_wbuf_io(struct rw_wbuf* wb, uint8_t* data, uint64_t offset, uint64_t size, int mode) {
+    // host side of the WAF, pages touched by each write
+    if (mode == WRITE_MODE && size)
+        wb->meta->host_pgs += (offset + size - 1) / wb->meta->vpg_sz - offset / wb->meta->vpg_sz + 1;
+    if (wb->npgs == 0)
+        return wb->io(wb->ctx, data, offset, size, mode);
+    if (mode == WRITE_MODE)
+        return wbuf_write(wb, data, offset, size);
+    if (mode == TRIM_MODE)
+        return wbuf_trim(wb, data, offset, size);
+    return wbuf_read(wb, data, offset, size);
+}
+
+// writes back every buffered page, oldest first
+int rw_wbuf_drain(struct rw_wbuf* wb) {
+    int ret = 0;
+    while (wb->npgs && !TAILQ_EMPTY(&wb->lru))
+        ret |= wbuf_flush(wb, TAILQ_FIRST(&wb->lru));
+    return ret;
+}
+
+void rw_wbuf_print(struct rw_wbuf* wb) {
+    if (wb->npgs == 0)
+        return;
+    printf(" Node %d: write buffer %" PRIu64 " pages, writes %" PRIu64 " pages (%" PRIu64 " merged, %" PRIu64 " KB absorbed),"
+            " reads %" PRIu64 " pages (%" PRIu64 " hits, %" PRIu64 " partial), flushes %" PRIu64 " (%" PRIu64 " pages, %" PRIu64 " partial)\n",
+            wb->meta->node->nid, wb->npgs, wb->w_pgs, wb->w_hits, wb->absorbed >> 10,
+            wb->r_pgs, wb->r_hits, wb->r_partial, wb->flushes, wb->flushed_pgs, wb->rmw_flushes);
+    if (wb->trimmed)
+        printf(" Node %d: write buffer dropped %" PRIu64 " trimmed pages\n", wb->meta->node->nid, wb->trimmed);
+}
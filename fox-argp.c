@@ -8,6 +8,41 @@
 const char *argp_program_version = "fox v1.2";
 const char *argp_program_bug_address = "Ivan L. Picoli <ivpi@itu.dk>";
 
+/* run options without a short flag */
+enum {
+    OPT_SHARD = 0x100,
+    OPT_GEN,
+    OPT_GEN_IOS,
+    OPT_GEN_THETA,
+    OPT_GEN_HOT,
+    OPT_GEN_SEQ,
+    OPT_GEN_BS,
+    OPT_GEN_SPAN,
+    OPT_GEN_FILL,
+    OPT_GEN_SEED,
+    OPT_GEN_TRIM,
+    OPT_GC,
+    OPT_GC_WINDOW,
+    OPT_GC_BG,
+    OPT_GC_STEP,
+    OPT_GC_BUDGET,
+    OPT_GC_YIELD,
+    OPT_GC_COPY,
+    OPT_STREAMS,
+    OPT_GC_STREAM,
+    OPT_WBUF,
+    OPT_RCACHE,
+    OPT_RCACHE_POLICY,
+    OPT_READAHEAD,
+    OPT_MAP_CACHE,
+    OPT_CKPT,
+    OPT_OOB,
+    OPT_OP,
+    OPT_HYBRID,
+    OPT_LOG_ADAPT,
+    OPT_WL
+};
+
 static char doc_global[] = "\n*** FOX v1.2 ***\n"
         " \n A tool for testing Open-Channel SSDs\n\n"
         " Available commands:\n"
@@ -15,6 +50,7 @@ static char doc_global[] = "\n*** FOX v1.2 ***\n"
         "  erase            Erases a specific range of physical blocks.\n"
         "  write            Writes to a specific range of physical pages.\n"
         "  read             Reads from a specific range of physical pages.\n"
+        "  trace            Imports block traces into the FOX I/O format.\n"
         "\n Examples:"
         "\n  fox run <parameters>     - custom configuration"
         "\n  fox --help               - show available parameters"
@@ -74,6 +110,24 @@ static char doc_run[] =
         "\n     output   = disabled"
         "\n     engine   = 1 (sequential)";
 
+static char doc_trace[] =
+        "\nUse this command to convert block traces into the I/O record file "
+        "used by the rewrite engines (-i in 'fox run').\n"
+        "\n Available trace commands:"
+        "\n     import           Converts a trace file.\n"
+        "\n Supported formats:"
+        "\n     blkparse         blkparse default text output."
+        "\n     fio              fio iolog version 2 or 3."
+        "\n     msr              MSR Cambridge / SNIA IOTTA CSV."
+        "\n     spc              SPC / UMass CSV.\n"
+        "\n The LBA range of the trace is rebased to 0 and, if larger than the"
+        "\n capacity of one node, scaled to fit. The node capacity is given by"
+        "\n -S or computed from the run geometry (-c -l -b -p -j) and the page"
+        "\n size (-z).\n"
+        "\n Example:"
+        "\n     fox trace import -f blkparse -i sda.txt -o input.csv"
+        " -c 8 -l 4 -b 64 -p 512 -j 1 -z 16384";
+
 static struct argp_option opt_run[] = {
     {"device", 'd', "<char>", 0,"Device name. e.g: /dev/nvme0n1"},
     {"runtime", 't', "<int>", 0, "Runtime in seconds. If 0 or not present, "
@@ -101,10 +155,98 @@ static struct argp_option opt_run[] = {
     "(3)real time average information"},
     {"engine", 'e', "<int>", 0, "I/O engine ID. (1)sequential, (2)round-robin,"
     " (3)isolation. Please check documentation for detailed information."},
-    {"inputiopath", 'i', "<char>", 0, "Path to the IO record file."},
+    {"inputiopath", 'i', "<char>", 0, "Path to the IO record file. A comma-"
+    "separated list assigns trace (n % count) to job n."},
     {"sb_pus", 'P', "<int>", 0, "FOR eng7, pus of each superblock"},
     {"sb_blks", 'B', "<int>", 0, "For eng7, blks of each superblock"},
     {"logblknum", 'L', "<int>", 0, "for eng8, number of log blocks"},
+    {"shard", OPT_SHARD, "<char>", 0, "Engines 4-8: split a trace among the "
+    "jobs replaying it instead of replicating it. (none), range or hash."},
+    {"gen", OPT_GEN, "<char>", 0, "Engines 4-8: generate the I/O sequence "
+    "instead of reading -i. uniform, zipf or hotcold. Read/write mix from -r/-w."},
+    {"gen-ios", OPT_GEN_IOS, "<int>", 0, "Generated I/Os per job. (4 x pages in"
+    " the generated space)"},
+    {"gen-theta", OPT_GEN_THETA, "<float>", 0, "Zipf skew, 0 < theta < 1. "
+    "(0.99)"},
+    {"gen-hot", OPT_GEN_HOT, "<int:int>", 0, "hotcold: <data %>:<access %>, "
+    "e.g. 20:80 sends 80% of the I/Os to 20% of the space. (20:80)"},
+    {"gen-seq", OPT_GEN_SEQ, "<0-100>", 0, "Percentage of I/Os continuing "
+    "the previous one (sequential). (0)"},
+    {"gen-bs", OPT_GEN_BS, "<char>", 0, "I/O size distribution in bytes: "
+    "fixed (16384), range (4096-65536) or weighted list (4096:70,65536:30). "
+    "(one page)"},
+    {"gen-span", OPT_GEN_SPAN, "<1-100>", 0, "Percentage of the job capacity "
+    "addressed by the generator. (90)"},
+    {"gen-fill", OPT_GEN_FILL, NULL, 0, "Write the generated space sequentially"
+    " before the generated I/Os."},
+    {"gen-seed", OPT_GEN_SEED, "<int>", 0, "Random seed. (1)"},
+    {"gen-trim", OPT_GEN_TRIM, "<0-100>", 0, "Percentage of the generated I/Os "
+    "that are trims. (0)"},
+    {"gc", OPT_GC, "<char>", 0, "Engines 6-7: GC victim policy. (greedy), cb "
+    "(cost-benefit), window (greedy among the oldest blocks) or random."},
+    {"gc-window", OPT_GC_WINDOW, "<int>", 0, "Oldest full blocks considered "
+    "by --gc window. (16)"},
+    {"gc-bg", OPT_GC_BG, "<int:int>", 0, "Engine 6: background GC between "
+    "<low %>:<high %> free blocks, e.g. 10:20. (disabled)"},
+    {"gc-step", OPT_GC_STEP, "<int>", 0, "Engine 6: incremental GC, migrate "
+    "<int> pages of the victim before each user I/O. (disabled)"},
+    {"gc-budget", OPT_GC_BUDGET, "<int>", 0, "Incremental GC time per user "
+    "I/O in us, at least one step. (0)"},
+    {"gc-yield", OPT_GC_YIELD, NULL, 0, "Reads skip incremental GC, only "
+    "writes pay for it."},
+    {"gc-copy", OPT_GC_COPY, "<char>", 0, "Engines 5, 6, 8: GC copies pages "
+    "through the (host) or on the device, vector copy of NVM_COPY=1 builds."},
+    {"streams", OPT_STREAMS, "<int>", 0, "Engine 6: write streams of user "
+    "data, split by update count, 1-8. (1)"},
+    {"gc-stream", OPT_GC_STREAM, NULL, 0, "Engine 6: pages moved by GC are "
+    "written to a stream of their own."},
+    {"wbuf", OPT_WBUF, "<int>", 0, "Engines 4-8: DRAM write-back buffer of "
+    "<int> logical pages, merges sub-page writes. (0)"},
+    {"rcache", OPT_RCACHE, "<int>", 0, "Engines 4-8: read cache of <int> "
+    "logical pages. (0)"},
+    {"rcache-policy", OPT_RCACHE_POLICY, "<char>", 0, "Read cache "
+    "replacement: lru or clock. (lru)"},
+    {"readahead", OPT_READAHEAD, "<int>", 0, "Sequential reads fill the read "
+    "cache ahead, up to <int> pages. (0)"},
+    {"map-cache", OPT_MAP_CACHE, "<int>", 0, "Engine 6: demand-paged mapping, "
+    "<int> entries cached in DRAM, the table in flash translation pages. "
+    "(0, whole table in DRAM)"},
+    {"ckpt", OPT_CKPT, "<int>", 0, "Engines 5-6: checkpoint the mapping to "
+    "reserved blocks every <int> mapping updates, with a journal in between; "
+    "recovery after a power loss is timed at the end. (0, off)"},
+    {"oob", OPT_OOB, NULL, 0, "Engines 5-6: keep the owner of each physical "
+    "page in its OOB metadata instead of a host reverse map."},
+    {"op", OPT_OP, "<0-90>", 0, "Engines 4-8: over-provisioning, percentage "
+    "of the job capacity hidden from the host; generated and traced I/Os "
+    "stay in the remaining logical space. (0)"},
+    {"hybrid", OPT_HYBRID, "<char>", 0, "Engine 8 log blocks: bast, one per "
+    "data superblock, or fast, a sequential log block and a random log area "
+    "shared by all data superblocks. (bast)"},
+    {"log-adapt", OPT_LOG_ADAPT, "<int:int>", 0, "Engine 8: resize the log "
+    "pool at runtime between <min>:<max> log blocks, from the merge cost and "
+    "the free superblocks; -L is the initial size. (disabled)"},
+    {"wl", OPT_WL, "<int>", 0, "Engines 6-8: wear leveling, new blocks are "
+    "picked by erase count; engine 6 also moves cold data out of the least "
+    "worn block when the erase count spread exceeds <int>. (disabled)"},
+    {0}
+};
+
+static struct argp_option opt_trace[] = {
+    {"format", 'f', "<char>", 0, "Input trace format: blkparse, fio, msr, spc."},
+    {"input", 'i', "<char>", 0, "Input trace file."},
+    {"output", 'o', "<char>", 0, "Output I/O record file. (input.csv)"},
+    {"event", 'E', "<char>", 0, "blkparse event to import, e.g. Q, D or C. (Q)"},
+    {"unit", 'u', "<int>", 0, "Only import records of this disk number (msr) "
+    "or ASU (spc)."},
+    {"count", 'n', "<int>", 0, "Maximum number of records to import."},
+    {"capacity", 'S', "<int>", 0, "Node capacity in bytes."},
+    {"pagesize", 'z', "<int>", 0, "Flash page size in bytes (page size * number"
+    " of planes), used with the geometry to compute the node capacity."},
+    {"channels", 'c', "<int>", 0, "Number of channels."},
+    {"luns", 'l', "<int>", 0, "Number of LUNs per channel."},
+    {"blocks", 'b', "<int>", 0, "Number of blocks per LUN."},
+    {"pages", 'p', "<int>", 0, "Number of pages per block."},
+    {"jobs", 'j', "<int>", 0, "Number of jobs the geometry is split among."},
     {0}
 };
 
@@ -272,6 +414,229 @@ static error_t parse_opt_run (int key, char *arg, struct argp_state *state)
             args->logblknum = atoi(arg);
             args->arg_num++;
             break;
+        case OPT_SHARD:
+            if (!arg)
+                argp_usage(state);
+            if (strcmp(arg, "none") == 0)
+                args->trace_shard = TRACE_SHARD_NONE;
+            else if (strcmp(arg, "range") == 0)
+                args->trace_shard = TRACE_SHARD_RANGE;
+            else if (strcmp(arg, "hash") == 0)
+                args->trace_shard = TRACE_SHARD_HASH;
+            else
+                argp_usage(state);
+            args->arg_num++;
+            break;
+        case OPT_GEN:
+            if (!arg)
+                argp_usage(state);
+            if (strcmp(arg, "uniform") == 0)
+                args->gen_dist = GEN_UNIFORM;
+            else if (strcmp(arg, "zipf") == 0)
+                args->gen_dist = GEN_ZIPF;
+            else if (strcmp(arg, "hotcold") == 0)
+                args->gen_dist = GEN_HOTCOLD;
+            else
+                argp_usage(state);
+            args->arg_num++;
+            break;
+        case OPT_GEN_IOS:
+            if (!arg)
+                argp_usage(state);
+            args->gen_nios = strtoull(arg, NULL, 10);
+            args->arg_num++;
+            break;
+        case OPT_GEN_THETA:
+            if (!arg)
+                argp_usage(state);
+            args->gen_theta = atof(arg);
+            args->arg_num++;
+            break;
+        case OPT_GEN_HOT:
+            if (!arg || sscanf(arg, "%hhu:%hhu", &args->gen_hot_data,
+                                                &args->gen_hot_access) != 2 ||
+                    args->gen_hot_data == 0 || args->gen_hot_data > 100 ||
+                    args->gen_hot_access > 100)
+                argp_usage(state);
+            args->arg_num++;
+            break;
+        case OPT_GEN_SEQ:
+            if (!arg || atoi(arg) < 0 || atoi(arg) > 100)
+                argp_usage(state);
+            args->gen_seq = atoi(arg);
+            args->arg_num++;
+            break;
+        case OPT_GEN_BS:
+            if (!arg || strlen(arg) >= CMDARG_LEN)
+                argp_usage(state);
+            strcpy(args->gen_bs, arg);
+            args->arg_num++;
+            break;
+        case OPT_GEN_SPAN:
+            if (!arg || atoi(arg) < 1 || atoi(arg) > 100)
+                argp_usage(state);
+            args->gen_span = atoi(arg);
+            args->arg_num++;
+            break;
+        case OPT_GEN_FILL:
+            args->gen_fill = 1;
+            args->arg_num++;
+            break;
+        case OPT_GEN_SEED:
+            if (!arg)
+                argp_usage(state);
+            args->gen_seed = strtoull(arg, NULL, 10);
+            args->arg_num++;
+            break;
+        case OPT_GEN_TRIM:
+            if (!arg || atoi(arg) < 0 || atoi(arg) > 100)
+                argp_usage(state);
+            args->gen_trim = atoi(arg);
+            args->arg_num++;
+            break;
+        case OPT_GC:
+            if (!arg)
+                argp_usage(state);
+            if (strcmp(arg, "greedy") == 0)
+                args->gc_policy = GC_GREEDY;
+            else if (strcmp(arg, "cb") == 0)
+                args->gc_policy = GC_COSTBENEFIT;
+            else if (strcmp(arg, "window") == 0)
+                args->gc_policy = GC_WINDOWED;
+            else if (strcmp(arg, "random") == 0)
+                args->gc_policy = GC_RANDOM;
+            else
+                argp_usage(state);
+            args->arg_num++;
+            break;
+        case OPT_GC_WINDOW:
+            if (!arg || strtoull(arg, NULL, 10) == 0)
+                argp_usage(state);
+            args->gc_window = strtoull(arg, NULL, 10);
+            args->arg_num++;
+            break;
+        case OPT_GC_BG:
+            if (!arg || sscanf(arg, "%hhu:%hhu", &args->gc_bg_low,
+                                                &args->gc_bg_high) != 2 ||
+                    args->gc_bg_low == 0 || args->gc_bg_low > 100 ||
+                    args->gc_bg_high < args->gc_bg_low ||
+                    args->gc_bg_high > 100)
+                argp_usage(state);
+            args->arg_num++;
+            break;
+        case OPT_GC_STEP:
+            if (!arg || strtoul(arg, NULL, 10) == 0)
+                argp_usage(state);
+            args->gc_step = strtoul(arg, NULL, 10);
+            args->arg_num++;
+            break;
+        case OPT_GC_BUDGET:
+            if (!arg)
+                argp_usage(state);
+            args->gc_budget = strtoul(arg, NULL, 10);
+            args->arg_num++;
+            break;
+        case OPT_GC_YIELD:
+            args->gc_yield = 1;
+            args->arg_num++;
+            break;
+        case OPT_GC_COPY:
+            if (!arg)
+                argp_usage(state);
+            if (strcmp(arg, "host") == 0)
+                args->gc_copy = GC_COPY_HOST;
+            else if (strcmp(arg, "device") == 0)
+                args->gc_copy = GC_COPY_DEVICE;
+            else
+                argp_usage(state);
+            args->arg_num++;
+            break;
+        case OPT_STREAMS:
+            if (!arg || strtoul(arg, NULL, 10) == 0 ||
+                                                strtoul(arg, NULL, 10) > 8)
+                argp_usage(state);
+            args->streams = strtoul(arg, NULL, 10);
+            args->arg_num++;
+            break;
+        case OPT_GC_STREAM:
+            args->gc_stream = 1;
+            args->arg_num++;
+            break;
+        case OPT_WBUF:
+            if (!arg)
+                argp_usage(state);
+            args->wbuf_pgs = strtoul(arg, NULL, 10);
+            args->arg_num++;
+            break;
+        case OPT_RCACHE:
+            if (!arg)
+                argp_usage(state);
+            args->rcache_pgs = strtoul(arg, NULL, 10);
+            args->arg_num++;
+            break;
+        case OPT_RCACHE_POLICY:
+            if (!arg)
+                argp_usage(state);
+            if (strcmp(arg, "lru") == 0)
+                args->rcache_policy = RCACHE_LRU;
+            else if (strcmp(arg, "clock") == 0)
+                args->rcache_policy = RCACHE_CLOCK;
+            else
+                argp_usage(state);
+            args->arg_num++;
+            break;
+        case OPT_READAHEAD:
+            if (!arg)
+                argp_usage(state);
+            args->readahead = strtoul(arg, NULL, 10);
+            args->arg_num++;
+            break;
+        case OPT_MAP_CACHE:
+            if (!arg)
+                argp_usage(state);
+            args->map_cache = strtoull(arg, NULL, 10);
+            args->arg_num++;
+            break;
+        case OPT_CKPT:
+            if (!arg)
+                argp_usage(state);
+            args->ckpt = strtoull(arg, NULL, 10);
+            args->arg_num++;
+            break;
+        case OPT_OOB:
+            args->oob = 1;
+            args->arg_num++;
+            break;
+        case OPT_OP:
+            if (!arg || atoi(arg) < 0 || atoi(arg) > 90)
+                argp_usage(state);
+            args->op = atoi(arg);
+            args->arg_num++;
+            break;
+        case OPT_HYBRID:
+            if (!arg)
+                argp_usage(state);
+            if (strcmp(arg, "bast") == 0)
+                args->hybrid = HYBRID_BAST;
+            else if (strcmp(arg, "fast") == 0)
+                args->hybrid = HYBRID_FAST;
+            else
+                argp_usage(state);
+            args->arg_num++;
+            break;
+        case OPT_LOG_ADAPT:
+            if (!arg || sscanf(arg, "%u:%u", &args->log_min,
+                                                &args->log_max) != 2 ||
+                    args->log_min == 0 || args->log_max < args->log_min)
+                argp_usage(state);
+            args->arg_num++;
+            break;
+        case OPT_WL:
+            if (!arg || strtoul(arg, NULL, 10) == 0)
+                argp_usage(state);
+            args->wl_spread = strtoul(arg, NULL, 10);
+            args->arg_num++;
+            break;
         case ARGP_KEY_END:
         case ARGP_KEY_ARG:
         case ARGP_KEY_NO_ARGS:
@@ -364,6 +729,125 @@ static error_t parse_opt_io (int key, char *arg, struct argp_state *state)
     return 0;
 }
 
+static error_t parse_opt_trace (int key, char *arg, struct argp_state *state)
+{
+    struct fox_argp *args = state->input;
+
+    switch (key) {
+        case 'f':
+            if (!arg)
+                argp_usage(state);
+            if (strcmp(arg, "blkparse") == 0)
+                args->tr_format = TRACE_FMT_BLKPARSE;
+            else if (strcmp(arg, "fio") == 0)
+                args->tr_format = TRACE_FMT_FIO;
+            else if (strcmp(arg, "msr") == 0 || strcmp(arg, "snia") == 0)
+                args->tr_format = TRACE_FMT_MSR;
+            else if (strcmp(arg, "spc") == 0)
+                args->tr_format = TRACE_FMT_SPC;
+            else
+                argp_usage(state);
+            args->arg_num++;
+            break;
+        case 'i':
+            if (!arg || strlen(arg) == 0 || strlen(arg) >= CMDARG_LEN)
+                argp_usage(state);
+            strcpy(args->tr_input, arg);
+            args->arg_num++;
+            break;
+        case 'o':
+            if (!arg || strlen(arg) == 0 || strlen(arg) >= CMDARG_LEN)
+                argp_usage(state);
+            strcpy(args->tr_output, arg);
+            args->arg_num++;
+            break;
+        case 'E':
+            if (!arg || strlen(arg) != 1)
+                argp_usage(state);
+            args->tr_event = arg[0];
+            args->arg_num++;
+            break;
+        case 'u':
+            if (!arg)
+                argp_usage(state);
+            args->tr_unit = atoi (arg);
+            args->arg_num++;
+            break;
+        case 'n':
+            if (!arg)
+                argp_usage(state);
+            args->tr_maxrecs = strtoull (arg, NULL, 10);
+            args->arg_num++;
+            break;
+        case 'S':
+            if (!arg)
+                argp_usage(state);
+            args->tr_capacity = strtoull (arg, NULL, 10);
+            args->arg_num++;
+            break;
+        case 'z':
+            if (!arg)
+                argp_usage(state);
+            args->tr_pgsz = atoi (arg);
+            args->arg_num++;
+            break;
+        case 'c':
+            if (!arg)
+                argp_usage(state);
+            args->channels = atoi (arg);
+            args->arg_num++;
+            args->arg_flag |= CMDARG_FLAG_C;
+            break;
+        case 'l':
+            if (!arg)
+                argp_usage(state);
+            args->luns = atoi (arg);
+            args->arg_num++;
+            args->arg_flag |= CMDARG_FLAG_L;
+            break;
+        case 'b':
+            if (!arg)
+                argp_usage(state);
+            args->blks = atoi (arg);
+            args->arg_num++;
+            args->arg_flag |= CMDARG_FLAG_B;
+            break;
+        case 'p':
+            if (!arg)
+                argp_usage(state);
+            args->pgs = atoi (arg);
+            args->arg_num++;
+            args->arg_flag |= CMDARG_FLAG_P;
+            break;
+        case 'j':
+            if (!arg)
+                argp_usage(state);
+            args->nthreads = atoi (arg);
+            args->arg_num++;
+            args->arg_flag |= CMDARG_FLAG_J;
+            break;
+        case ARGP_KEY_ARG:
+            if (strcmp(arg, "import") == 0)
+                args->tr_cmd = TRACE_CMD_IMPORT;
+            else
+                argp_usage(state);
+            break;
+        case ARGP_KEY_INIT:
+            args->tr_unit = -1;
+            break;
+        case ARGP_KEY_END:
+        case ARGP_KEY_NO_ARGS:
+        case ARGP_KEY_ERROR:
+        case ARGP_KEY_SUCCESS:
+        case ARGP_KEY_FINI:
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
 static void cmd_prepare(struct argp_state *state, struct fox_argp *args,
                                               char *cmd, struct argp *argp_cmd)
 {
@@ -389,6 +873,8 @@ static struct argp argp_run     = {opt_run, parse_opt_run, 0, doc_run};
 static struct argp argp_erase   = {opt_erase, parse_opt_io, 0, doc_erase};
 static struct argp argp_write   = {opt_write, parse_opt_io, 0, doc_write};
 static struct argp argp_read    = {opt_read, parse_opt_io, 0, doc_read};
+static struct argp argp_trace   = {opt_trace, parse_opt_trace,
+                                                "import [OPTION...]", doc_trace};
 
 error_t parse_opt (int key, char *arg, struct argp_state *state)
 {
@@ -417,6 +903,11 @@ error_t parse_opt (int key, char *arg, struct argp_state *state)
                 args->cmdtype = CMDARG_READ;
                 cmd_prepare(state, args, "read", &argp_read);
 
+            } else if (strcmp(arg, "trace") == 0) {
+
+                args->cmdtype = CMDARG_TRACE;
+                cmd_prepare(state, args, "trace", &argp_trace);
+
             }
             break;
         default:
@@ -443,6 +934,8 @@ int fox_argp_init (int argc, char **argv, struct fox_argp *args_global)
         case CMDARG_WRITE:
         case CMDARG_READ:
             return FOX_IO_MODE;
+        case CMDARG_TRACE:
+            return FOX_TRACE_MODE;
         default:
             printf("Invalid command, please use --help to see more info.\n");
     }
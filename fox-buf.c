@@ -211,12 +211,24 @@ static void *fox_alloc_blk_buf_t (struct fox_node *node, uint8_t type)
 
 int fox_alloc_blk_buf (struct fox_node *node, struct fox_blkbuf *buf)
 {
+    size_t meta_sz = node->npgs * node->wl->geo->nsectors *
+                        node->wl->geo->nplanes * node->wl->geo->meta_nbytes;
+
     buf->buf_r = fox_alloc_blk_buf_t(node, FOX_BUF_READ);
     buf->buf_w = fox_alloc_blk_buf_t(node, FOX_BUF_WRITE);
+    buf->meta = NULL;
 
     if (!buf->buf_w || !buf->buf_r)
         return -1;
 
+    /* Sector metadata goes with the data only when the engine uses it */
+    if (node->wl->oob) {
+        buf->meta = malloc (meta_sz);
+        if (!buf->meta)
+            return -1;
+        memset (buf->meta, 0xff, meta_sz);
+    }
+
     return 0;
 }
 
@@ -233,6 +245,7 @@ void fox_free_blkbuf (struct fox_blkbuf *buf, int count)
     for (i = 0; i < count; i++) {
         free (buf[i].buf_r);
         free (buf[i].buf_w);
+        free (buf[i].meta);
     }
 }
 
@@ -193,6 +193,11 @@ int main (int argc, char **argv) {
         goto ARGP;
     }
 
+    if (mode == FOX_TRACE_MODE) {
+        ret = fox_trace_init (argp);
+        goto ARGP;
+    }
+
     gl_stats = malloc (sizeof (struct fox_stats));
     if (!gl_stats)
         goto ARGP;
@@ -223,6 +228,40 @@ int main (int argc, char **argv) {
     wl->sb_pus = argp->sb_pus;
     wl->sb_blks = argp->sb_blks;
     wl->logblknum = argp->logblknum;
+    wl->trace_shard = argp->trace_shard;
+    wl->gen_dist = argp->gen_dist;
+    wl->gen_nios = argp->gen_nios;
+    wl->gen_theta = (argp->gen_theta > 0) ? argp->gen_theta : 0.99;
+    wl->gen_hot_data = (argp->gen_hot_data) ? argp->gen_hot_data : 20;
+    wl->gen_hot_access = (argp->gen_hot_access) ? argp->gen_hot_access : 80;
+    wl->gen_seq = argp->gen_seq;
+    wl->gen_span = (argp->gen_span) ? argp->gen_span : 90;
+    wl->gen_fill = argp->gen_fill;
+    wl->gen_seed = argp->gen_seed;
+    wl->gen_trim = argp->gen_trim;
+    wl->gen_bs = argp->gen_bs;
+    wl->gc_policy = argp->gc_policy;
+    wl->gc_window = argp->gc_window;
+    wl->gc_bg_low = argp->gc_bg_low;
+    wl->gc_bg_high = argp->gc_bg_high;
+    wl->gc_step = argp->gc_step;
+    wl->gc_budget = argp->gc_budget;
+    wl->gc_yield = argp->gc_yield;
+    wl->gc_copy = argp->gc_copy;
+    wl->streams = argp->streams;
+    wl->gc_stream = argp->gc_stream;
+    wl->wbuf_pgs = argp->wbuf_pgs;
+    wl->rcache_pgs = argp->rcache_pgs;
+    wl->rcache_policy = argp->rcache_policy;
+    wl->readahead = argp->readahead;
+    wl->map_cache = argp->map_cache;
+    wl->ckpt = argp->ckpt;
+    wl->oob = argp->oob;
+    wl->op = argp->op;
+    wl->hybrid = argp->hybrid;
+    wl->log_min = argp->log_min;
+    wl->log_max = argp->log_max;
+    wl->wl_spread = argp->wl_spread;
 
     if (wl->devname[0] == 0) {
         wl->devname = malloc (13);
@@ -280,8 +319,11 @@ int main (int argc, char **argv) {
 
     fox_setup_delay (nodes);
 
-    if (fox_alloc_vblks (wl))
+    /* the nodes wait for the blocks, they must not be joined while waiting */
+    if (fox_alloc_vblks (wl)) {
+        fox_abort_nodes (wl);
         goto EXIT_THREADS;
+    }
 
     fox_monitor (nodes);
 
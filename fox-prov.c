@@ -291,6 +291,78 @@ ssize_t prov_vblk_pwrite(struct nvm_vblk * vblk, const void *buf,
     return nbytes;
 }
 
+/*
+ * vblk I/O of whole pages together with the metadata of their sectors, laid
+ * out as the data: meta_nbytes per sector, sectors of a plane, planes of a
+ * page. The vblk interface carries no metadata, so the sector addresses are
+ * built here and sent with nvm_addr_read/nvm_addr_write.
+ */
+static ssize_t prov_vblk_meta_io (struct nvm_vblk *vblk, void *buf, void *meta,
+                               size_t count, size_t offset, uint8_t write)
+{
+    const struct nvm_geo *geo = virt_dev.geo;
+    size_t vpg_sz = geo->page_nbytes * geo->nplanes;
+    int pg_ppas = geo->nsectors * geo->nplanes;
+    int naddrs = count / vpg_sz * pg_ppas;
+    struct nvm_addr *addrs;
+    struct nvm_ret ret;
+    ssize_t err;
+    int i;
+
+    if (count % vpg_sz || offset % vpg_sz)
+        return -1;
+
+    addrs = malloc (naddrs * sizeof (struct nvm_addr));
+    if (!addrs)
+        return -1;
+
+    for (i = 0; i < naddrs; i++) {
+        addrs[i] = vblk->blks[0];
+        addrs[i].g.pg = offset / vpg_sz + i / pg_ppas;
+        addrs[i].g.pl = (i / geo->nsectors) % geo->nplanes;
+        addrs[i].g.sec = i % geo->nsectors;
+    }
+
+    if (write)
+        err = nvm_addr_write(virt_dev.dev, addrs, naddrs, buf, meta,
+                                    nvm_dev_get_pmode(virt_dev.dev), &ret);
+    else
+        err = nvm_addr_read(virt_dev.dev, addrs, naddrs, buf, meta,
+                                    nvm_dev_get_pmode(virt_dev.dev), &ret);
+    free (addrs);
+
+    return (err < 0) ? -1 : count;
+}
+
+ssize_t prov_vblk_pread_meta(struct nvm_vblk *vblk, void *buf, void *meta,
+                                                  size_t count, size_t offset)
+{
+    return prov_vblk_meta_io (vblk, buf, meta, count, offset, 0);
+}
+
+ssize_t prov_vblk_pwrite_meta(struct nvm_vblk *vblk, const void *buf,
+                              const void *meta, size_t count, size_t offset)
+{
+    return prov_vblk_meta_io (vblk, (void *) buf, (void *) meta, count,
+                                                                  offset, 1);
+}
+
+/*
+ * Device-side copy of naddrs sectors, src[i] to dst[i], without moving the
+ * data through the host. Needs a liblightnvm with the OCSSD 2.0 vector copy
+ * (build with NVM_COPY=1), otherwise fails and the caller copies on the host.
+ */
+ssize_t prov_addr_copy(struct nvm_addr *src, struct nvm_addr *dst, int naddrs)
+{
+#ifdef FOX_NVM_COPY
+    struct nvm_ret ret;
+
+    return nvm_cmd_copy(virt_dev.dev, src, dst, naddrs, 0x0, &ret);
+#else
+    return -1;
+#endif
+}
+
 ssize_t prov_vblk_erase(struct nvm_vblk * vblk)
 {
     int pmode;
@@ -338,7 +410,8 @@ struct nvm_vblk *prov_vblk_get(int ch, int l)
 
     struct prov_lun *p_lun = &virt_dev.luns[lun];
 
-    if (p_lun->nfree_blks > 0) {
+    /* a block failing its first erase is marked bad, try the next one */
+    while (p_lun->nfree_blks > 0) {
 
         struct prov_vblk *vblk = CIRCLEQ_FIRST(&p_lun->free_blk_head);
 
@@ -359,7 +432,7 @@ struct nvm_vblk *prov_vblk_get(int ch, int l)
         if (prov_vblk_erase(vblk->blk) < 0) {
             prov_bbt_mark(vblk);
             nvm_vblk_free(vblk->blk);
-            goto FAIL;
+            continue;
         }
 
         return vblk->blk;
@@ -368,6 +441,19 @@ struct nvm_vblk *prov_vblk_get(int ch, int l)
     return NULL;
 }
 
+/* A block that failed at runtime, marked bad and never handed out again */
+int prov_vblk_retire(struct nvm_vblk *vblk)
+{
+    int lun;
+
+    lun = vblk->blks[0].g.ch * virt_dev.geo->nluns + vblk->blks[0].g.lun;
+
+    prov_bbt_mark(&virt_dev.prov_vblks[lun][vblk->blks[0].g.blk]);
+    nvm_vblk_free(vblk);
+
+    return 0;
+}
+
 int prov_vblk_put(struct nvm_vblk *vblk)
 {
     int ch, l, blk;
@@ -66,6 +66,33 @@ int fox_update_runtime (struct fox_node *node)
     return 0;
 }
 
+/* Page I/O of a block buffer, with the sector metadata if it has any */
+static ssize_t fox_blk_pwrite (struct nvm_vblk *vblk, struct fox_blkbuf *buf,
+                    size_t offset, size_t count, const struct nvm_geo *geo)
+{
+    size_t vpg_sz = geo->page_nbytes * geo->nplanes;
+    size_t meta_pg = geo->nsectors * geo->nplanes * geo->meta_nbytes;
+
+    if (buf->meta)
+        return prov_vblk_pwrite_meta(vblk, buf->buf_w + offset,
+                         buf->meta + offset / vpg_sz * meta_pg, count, offset);
+
+    return prov_vblk_pwrite(vblk, buf->buf_w + offset, count, offset);
+}
+
+static ssize_t fox_blk_pread (struct nvm_vblk *vblk, struct fox_blkbuf *buf,
+                    size_t offset, size_t count, const struct nvm_geo *geo)
+{
+    size_t vpg_sz = geo->page_nbytes * geo->nplanes;
+    size_t meta_pg = geo->nsectors * geo->nplanes * geo->meta_nbytes;
+
+    if (buf->meta)
+        return prov_vblk_pread_meta(vblk, buf->buf_r + offset,
+                         buf->meta + offset / vpg_sz * meta_pg, count, offset);
+
+    return prov_vblk_pread(vblk, buf->buf_r + offset, count, offset);
+}
+
 int fox_write_blk (struct fox_tgt_blk *tgt, struct fox_node *node,
                         struct fox_blkbuf *buf, uint16_t npgs, uint16_t blkoff)
 {
@@ -100,10 +127,8 @@ int fox_write_blk (struct fox_tgt_blk *tgt, struct fox_node *node,
                                                             node->wl->geo, ppa);
         }
 
-        if (prov_vblk_pwrite(tgt->vblk,
-                            buf->buf_w + vpg_sz * i,
-                            tot_bytes,
-                            vpg_sz * i) != tot_bytes){
+        if (fox_blk_pwrite(tgt->vblk, buf, vpg_sz * i, tot_bytes,
+                                      node->wl->geo) != tot_bytes){
             fox_set_stats (FOX_STATS_FAIL_W, &node->stats, cmd_pgs);
             tend = fox_timestamp_end(FOX_STATS_RUNTIME, &node->stats);
             failed++;
@@ -168,10 +193,8 @@ int fox_read_blk (struct fox_tgt_blk *tgt, struct fox_node *node,
         cmd_pgs = (i + cmd_pgs > blkoff + npgs) ? blkoff + npgs - i : cmd_pgs;
         tot_bytes = vpg_sz * cmd_pgs;
 
-        if (prov_vblk_pread(tgt->vblk,
-                            buf->buf_r + vpg_sz * i,
-                            tot_bytes,
-                            vpg_sz * i) != tot_bytes){
+        if (fox_blk_pread(tgt->vblk, buf, vpg_sz * i, tot_bytes,
+                                      node->wl->geo) != tot_bytes){
             fox_set_stats (FOX_STATS_FAIL_R, &node->stats, cmd_pgs);
             tend = fox_timestamp_end(FOX_STATS_RUNTIME, &node->stats);
             failed++;
@@ -247,6 +270,34 @@ FAILED:
     return 0;
 }
 
+/*
+ * Reads one page of a block with the metadata of its sectors, outside of
+ * any block buffer. Counted as a page read, no data comparison.
+ */
+int fox_read_meta (struct fox_tgt_blk *tgt, struct fox_node *node,
+                                    uint16_t pg, uint8_t *data, uint8_t *meta)
+{
+    size_t vpg_sz = node->wl->geo->page_nbytes * node->wl->geo->nplanes;
+
+    fox_timestamp_tmp_start(&node->stats);
+
+    if (prov_vblk_pread_meta(tgt->vblk, data, meta, vpg_sz,
+                                                  vpg_sz * pg) != vpg_sz) {
+        fox_set_stats (FOX_STATS_FAIL_R, &node->stats, 1);
+        fox_timestamp_end(FOX_STATS_RUNTIME, &node->stats);
+        return 1;
+    }
+
+    fox_timestamp_end(FOX_STATS_READ_T, &node->stats);
+    fox_timestamp_end(FOX_STATS_RW_SECT, &node->stats);
+    fox_set_stats (FOX_STATS_BREAD, &node->stats, vpg_sz);
+    fox_set_stats (FOX_STATS_BRW_SEC, &node->stats, vpg_sz);
+    fox_set_stats (FOX_STATS_IOPS, &node->stats, 1);
+    fox_set_stats (FOX_STATS_PGS_R, &node->stats, 1);
+
+    return 0;
+}
+
 int fox_erase_blk (struct fox_tgt_blk *tgt, struct fox_node *node)
 {
     fox_timestamp_tmp_start(&node->stats);
@@ -488,4 +488,114 @@ void fox_show_workload (struct fox_workload *wl)
     sprintf (line, " - Engine       : %d (%s)\n", wl->engine->id,
                                                             wl->engine->name);
     fox_print (line, wl->output);
+    if (wl->engine->id == FOX_ENGINE_6 || wl->engine->id == FOX_ENGINE_7) {
+        switch (wl->gc_policy) {
+            case GC_COSTBENEFIT:
+                sprintf (line, " - GC policy    : cost-benefit\n");
+                break;
+            case GC_WINDOWED:
+                sprintf (line, " - GC policy    : windowed greedy, %lu blocks\n",
+                                    (wl->gc_window) ? wl->gc_window : 16);
+                break;
+            case GC_RANDOM:
+                sprintf (line, " - GC policy    : random\n");
+                break;
+            case GC_GREEDY:
+            default:
+                sprintf (line, " - GC policy    : greedy\n");
+        }
+        fox_print (line, wl->output);
+    }
+    if (wl->engine->id == FOX_ENGINE_6) {
+        if (wl->gc_bg_low) {
+            sprintf (line, " - Background GC: %d %% - %d %% free blocks\n",
+                                                wl->gc_bg_low, wl->gc_bg_high);
+            fox_print (line, wl->output);
+        }
+        if (wl->gc_step) {
+            sprintf (line, " - Incr. GC     : %d pages/step, %d us/IO%s\n",
+                    wl->gc_step, wl->gc_budget, (wl->gc_yield) ? ", reads first" : "");
+            fox_print (line, wl->output);
+        }
+        if (wl->streams > 1 || wl->gc_stream) {
+            sprintf (line, " - Streams      : %d user%s\n",
+                    (wl->streams) ? wl->streams : 1, (wl->gc_stream) ? " + GC" : "");
+            fox_print (line, wl->output);
+        }
+        if (wl->map_cache) {
+            sprintf (line, " - Map cache    : %lu entries\n", wl->map_cache);
+            fox_print (line, wl->output);
+        }
+        if (wl->ckpt) {
+            sprintf (line, " - Checkpoint   : every %lu map updates\n", wl->ckpt);
+            fox_print (line, wl->output);
+        }
+        if (wl->wl_spread) {
+            sprintf (line, " - Wear leveling: erase count spread %u\n",
+                                                            wl->wl_spread);
+            fox_print (line, wl->output);
+        }
+    }
+    if (wl->wl_spread && (wl->engine->id == FOX_ENGINE_7 ||
+                                        wl->engine->id == FOX_ENGINE_8)) {
+        sprintf (line, " - Wear leveling: least erased free superblock\n");
+        fox_print (line, wl->output);
+    }
+    if (wl->hybrid == HYBRID_FAST && wl->engine->id == FOX_ENGINE_8) {
+        uint64_t nlog = (wl->logblknum) ? wl->logblknum : 8;
+        sprintf (line, " - Log blocks   : fast, 1 sequential + %lu random\n",
+                                            (nlog > 2) ? nlog - 1 : 1);
+        fox_print (line, wl->output);
+    }
+    if (wl->log_min && wl->engine->id == FOX_ENGINE_8) {
+        sprintf (line, " - Log pool     : adaptive, %u - %u log blocks\n",
+                                                wl->log_min, wl->log_max);
+        fox_print (line, wl->output);
+    }
+    if (wl->oob && (wl->engine->id == FOX_ENGINE_5 || wl->engine->id == FOX_ENGINE_6)) {
+        sprintf (line, " - Reverse map  : OOB metadata\n");
+        fox_print (line, wl->output);
+    }
+    if (wl->gc_copy == GC_COPY_DEVICE) {
+        sprintf (line, " - GC copy      : device\n");
+        fox_print (line, wl->output);
+    }
+    if (wl->wbuf_pgs) {
+        sprintf (line, " - Write buffer : %d pages\n", wl->wbuf_pgs);
+        fox_print (line, wl->output);
+    }
+    if (wl->op) {
+        sprintf (line, " - Over-provision: %d %% of the capacity\n", wl->op);
+        fox_print (line, wl->output);
+    }
+    if (wl->rcache_pgs) {
+        sprintf (line, " - Read cache   : %d pages, %s, readahead %d pages\n",
+                wl->rcache_pgs, (wl->rcache_policy == RCACHE_CLOCK) ? "clock" : "lru",
+                wl->readahead);
+        fox_print (line, wl->output);
+    }
+
+    switch (wl->gen_dist) {
+        case GEN_UNIFORM:
+            sprintf (line, " - Generator    : uniform, seq %d %%, span %d %%\n",
+                                                    wl->gen_seq, wl->gen_span);
+            break;
+        case GEN_ZIPF:
+            sprintf (line, " - Generator    : zipf %.2f, seq %d %%, span %d %%\n",
+                                    wl->gen_theta, wl->gen_seq, wl->gen_span);
+            break;
+        case GEN_HOTCOLD:
+            sprintf (line, " - Generator    : hotcold %d:%d, seq %d %%, "
+                    "span %d %%\n", wl->gen_hot_data, wl->gen_hot_access,
+                    wl->gen_seq, wl->gen_span);
+            break;
+        default:
+            return;
+    }
+    fox_print (line, wl->output);
+    if (wl->gen_trim) {
+        sprintf (line, " - Trims        : %d %% of the generated I/Os\n",
+                                                                wl->gen_trim);
+        fox_print (line, wl->output);
+    }
 }
\ No newline at end of file
@@ -41,24 +41,43 @@ static uint8_t  *th_ch;
 static uint8_t  *nodes_ch; /* set in config lun, used to pick a
                             *                     node id within the channel */
 
+/* A node of an aborted run exits here, before its engine touches the device */
 void fox_wait_for_ready (struct fox_workload *wl)
 {
     pthread_mutex_lock(&wl->start_mut);
 
-    if (wl->stats->flags ^ FOX_FLAG_READY)
+    while (!(wl->stats->flags & (FOX_FLAG_READY | FOX_FLAG_ABORT)))
         pthread_cond_wait(&wl->start_con, &wl->start_mut);
 
     pthread_mutex_unlock(&wl->start_mut);
+
+    if (wl->stats->flags & FOX_FLAG_ABORT)
+        pthread_exit(NULL);
 }
 
 void fox_wait_for_monitor (struct fox_workload *wl)
 {
     pthread_mutex_lock(&wl->monitor_mut);
 
-    if (wl->stats->flags ^ FOX_FLAG_MONITOR)
+    while (!(wl->stats->flags & (FOX_FLAG_MONITOR | FOX_FLAG_ABORT)))
         pthread_cond_wait(&wl->monitor_con, &wl->monitor_mut);
 
     pthread_mutex_unlock(&wl->monitor_mut);
+
+    if (wl->stats->flags & FOX_FLAG_ABORT)
+        pthread_exit(NULL);
+}
+
+/* Wakes the nodes waiting to start so they exit, see fox_wait_for_ready */
+void fox_abort_nodes (struct fox_workload *wl)
+{
+    pthread_mutex_lock(&wl->monitor_mut);
+    pthread_mutex_lock(&wl->start_mut);
+    wl->stats->flags |= FOX_FLAG_ABORT;
+    pthread_cond_broadcast(&wl->start_con);
+    pthread_mutex_unlock(&wl->start_mut);
+    pthread_cond_broadcast(&wl->monitor_con);
+    pthread_mutex_unlock(&wl->monitor_mut);
 }
 
 static int fox_config_ch (struct fox_node *node)
@@ -213,6 +232,7 @@ struct fox_node *fox_create_threads (struct fox_workload *wl)
         node[ci].nblks = wl->blks;
         node[ci].npgs = wl->pgs;
         node[ci].delay = 0;
+        node[ci].lost_pgs = 0;
 
         if (fox_init_stats (&node[ci].stats))
             goto EXIT_CH;
@@ -268,11 +288,12 @@ void fox_exit_threads (struct fox_node *nodes)
 {
     int i;
 
+    /* engines may still report after fox_end_node, join before freeing */
     for (i = 0; i < nodes[0].wl->nthreads; i++) {
+        pthread_join(nodes[i].tid, NULL);
         free (nodes[i].ch);
         free (nodes[i].lun);
         fox_exit_stats (&nodes[i].stats);
-        pthread_join(nodes[i].tid, NULL);
     }
     free (nodes);
     free(th_ch);
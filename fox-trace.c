@@ -0,0 +1,429 @@
+/*  - FOX - A tool for testing Open-Channel SSDs
+ *      - Block trace import
+ *
+ * Converts block traces collected on real systems into the I/O record
+ * format consumed by the rewrite engines (4-8):
+ *
+ *      <record count>
+ *      <offset>,<size>,<type>
+ *      ...
+ *
+ * where offset and size are in bytes and type is 'r', 'w' or 't' (trim).
+ *
+ * Supported input formats:
+ *  - blkparse: default text output of blkparse(1)
+ *  - fio:      fio iolog version 2 and 3 (read_iolog / write_iolog)
+ *  - msr:      MSR Cambridge / SNIA IOTTA CSV
+ *              (Timestamp,Hostname,DiskNumber,Type,Offset,Size,ResponseTime)
+ *  - spc:      SPC / UMass CSV (ASU,LBA,Size,Opcode,Timestamp)
+ *
+ * Written by Chuizheng Meng <mengcz13@mails.tsinghua.edu.cn>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include "fox.h"
+
+#define TRACE_SECTOR        512
+#define TRACE_LINE_LEN      4096
+#define TRACE_MAX_FIELDS    16
+
+struct fox_trace_rec {
+    uint64_t offset;
+    uint64_t size;
+    char     type;
+};
+
+struct fox_trace {
+    struct fox_trace_rec *recs;
+    uint64_t              nrecs;
+    uint64_t              maxrecs;
+    uint64_t              nlines;
+    uint64_t              skipped;
+    uint64_t              min_offset;
+    uint64_t              max_end;
+};
+
+static int fox_trace_add (struct fox_trace *tr, uint64_t offset,
+                                                     uint64_t size, char type)
+{
+    struct fox_trace_rec *recs;
+
+    if (!size) {
+        tr->skipped++;
+        return 0;
+    }
+
+    if (tr->nrecs == tr->maxrecs) {
+        tr->maxrecs = (tr->maxrecs) ? tr->maxrecs * 2 : 4096;
+        recs = realloc (tr->recs, tr->maxrecs * sizeof (*recs));
+        if (!recs)
+            return -1;
+        tr->recs = recs;
+    }
+
+    tr->recs[tr->nrecs].offset = offset;
+    tr->recs[tr->nrecs].size = size;
+    tr->recs[tr->nrecs].type = type;
+    tr->nrecs++;
+
+    if (tr->nrecs == 1 || offset < tr->min_offset)
+        tr->min_offset = offset;
+    if (offset + size > tr->max_end)
+        tr->max_end = offset + size;
+
+    return 0;
+}
+
+/* Splits 'line' in place, returns the number of fields */
+static int fox_trace_split (char *line, const char *delim, char **field)
+{
+    int n = 0;
+    char *save, *tok;
+
+    tok = strtok_r (line, delim, &save);
+    while (tok && n < TRACE_MAX_FIELDS) {
+        while (isspace ((unsigned char) *tok))
+            tok++;
+        field[n++] = tok;
+        tok = strtok_r (NULL, delim, &save);
+    }
+
+    return n;
+}
+
+static int fox_trace_isnum (const char *str)
+{
+    return (str && isdigit ((unsigned char) *str));
+}
+
+/*
+ * blkparse default format:
+ *   8,0  3  1  0.000000000  697  Q  WS 223490 + 8 [kjournald]
+ * Only events of type 'event' (default Q) are imported. Sectors are 512 bytes.
+ */
+static int fox_trace_line_blkparse (struct fox_trace *tr, char *line,
+                                                                   char event)
+{
+    char *f[TRACE_MAX_FIELDS];
+    int n;
+
+    n = fox_trace_split (line, " \t\n", f);
+    if (n < 10 || !strchr (f[0], ',') || strcmp (f[8], "+"))
+        return 1;
+
+    if (f[5][0] != event || f[5][1] != '\0')
+        return 1;
+
+    if (strchr (f[6], 'D'))
+        return fox_trace_add (tr, strtoull (f[7], NULL, 10) * TRACE_SECTOR,
+                              strtoull (f[9], NULL, 10) * TRACE_SECTOR, 't');
+    if (strchr (f[6], 'R'))
+        return fox_trace_add (tr, strtoull (f[7], NULL, 10) * TRACE_SECTOR,
+                              strtoull (f[9], NULL, 10) * TRACE_SECTOR, 'r');
+    if (strchr (f[6], 'W'))
+        return fox_trace_add (tr, strtoull (f[7], NULL, 10) * TRACE_SECTOR,
+                              strtoull (f[9], NULL, 10) * TRACE_SECTOR, 'w');
+
+    /* flushes and barriers carry no data */
+    return 1;
+}
+
+/*
+ * fio iolog:
+ *   v2: <filename> <action> <offset> <length>
+ *   v3: <timestamp> <filename> <action> <offset> <length>
+ * File management actions (add, open, close) and syncs are skipped.
+ */
+static int fox_trace_line_fio (struct fox_trace *tr, char *line, int version)
+{
+    char *f[TRACE_MAX_FIELDS];
+    int n, act;
+
+    n = fox_trace_split (line, " \t\n", f);
+    act = (version == 3) ? 2 : 1;
+    if (n < act + 3)
+        return 1;
+
+    if (!strcmp (f[act], "read"))
+        return fox_trace_add (tr, strtoull (f[act + 1], NULL, 10),
+                                       strtoull (f[act + 2], NULL, 10), 'r');
+    if (!strcmp (f[act], "write"))
+        return fox_trace_add (tr, strtoull (f[act + 1], NULL, 10),
+                                       strtoull (f[act + 2], NULL, 10), 'w');
+    if (!strcmp (f[act], "trim"))
+        return fox_trace_add (tr, strtoull (f[act + 1], NULL, 10),
+                                       strtoull (f[act + 2], NULL, 10), 't');
+
+    return 1;
+}
+
+/* MSR Cambridge: Timestamp,Hostname,DiskNumber,Type,Offset,Size,RespTime */
+static int fox_trace_line_msr (struct fox_trace *tr, char *line, int unit)
+{
+    char *f[TRACE_MAX_FIELDS];
+    int n;
+
+    n = fox_trace_split (line, ",\n", f);
+    if (n < 6 || !fox_trace_isnum (f[0]) || !fox_trace_isnum (f[4]))
+        return 1;
+
+    if (unit >= 0 && atoi (f[2]) != unit)
+        return 1;
+
+    if (!strncasecmp (f[3], "read", 4))
+        return fox_trace_add (tr, strtoull (f[4], NULL, 10),
+                                              strtoull (f[5], NULL, 10), 'r');
+    if (!strncasecmp (f[3], "write", 5))
+        return fox_trace_add (tr, strtoull (f[4], NULL, 10),
+                                              strtoull (f[5], NULL, 10), 'w');
+    return 1;
+}
+
+/* SPC / UMass: ASU,LBA,Size,Opcode,Timestamp. LBA in 512-byte sectors */
+static int fox_trace_line_spc (struct fox_trace *tr, char *line, int unit)
+{
+    char *f[TRACE_MAX_FIELDS];
+    int n;
+
+    n = fox_trace_split (line, ",\n", f);
+    if (n < 4 || !fox_trace_isnum (f[0]) || !fox_trace_isnum (f[1]))
+        return 1;
+
+    if (unit >= 0 && atoi (f[0]) != unit)
+        return 1;
+
+    if (tolower ((unsigned char) f[3][0]) == 'r')
+        return fox_trace_add (tr, strtoull (f[1], NULL, 10) * TRACE_SECTOR,
+                                              strtoull (f[2], NULL, 10), 'r');
+    if (tolower ((unsigned char) f[3][0]) == 'w')
+        return fox_trace_add (tr, strtoull (f[1], NULL, 10) * TRACE_SECTOR,
+                                              strtoull (f[2], NULL, 10), 'w');
+    return 1;
+}
+
+static int fox_trace_parse (struct fox_argp *argp, struct fox_trace *tr)
+{
+    FILE *fp;
+    char line[TRACE_LINE_LEN];
+    int ret, fio_ver = 0;
+
+    fp = fopen (argp->tr_input, "r");
+    if (!fp) {
+        printf (" Trace file not found: %s\n", argp->tr_input);
+        return -1;
+    }
+
+    while (fgets (line, TRACE_LINE_LEN, fp)) {
+        if (argp->tr_maxrecs && tr->nrecs >= argp->tr_maxrecs)
+            break;
+
+        tr->nlines++;
+        switch (argp->tr_format) {
+            case TRACE_FMT_BLKPARSE:
+                ret = fox_trace_line_blkparse (tr, line, argp->tr_event);
+                break;
+            case TRACE_FMT_FIO:
+                if (!fio_ver) {
+                    if (sscanf (line, "fio version %d iolog", &fio_ver) != 1 ||
+                                            (fio_ver != 2 && fio_ver != 3)) {
+                        printf (" Unsupported fio iolog header: %s", line);
+                        goto CLOSE;
+                    }
+                    continue;
+                }
+                ret = fox_trace_line_fio (tr, line, fio_ver);
+                break;
+            case TRACE_FMT_MSR:
+                ret = fox_trace_line_msr (tr, line, argp->tr_unit);
+                break;
+            case TRACE_FMT_SPC:
+                ret = fox_trace_line_spc (tr, line, argp->tr_unit);
+                break;
+            default:
+                goto CLOSE;
+        }
+
+        if (ret < 0) {
+            printf (" Memory allocation failed.\n");
+            goto CLOSE;
+        }
+        if (ret > 0)
+            tr->skipped++;
+    }
+
+    fclose (fp);
+    return 0;
+
+CLOSE:
+    fclose (fp);
+    return -1;
+}
+
+/* Smallest per-node capacity in bytes, 0 if the geometry is not given */
+static uint64_t fox_trace_node_capacity (struct fox_argp *argp)
+{
+    uint64_t npus;
+    uint8_t nthreads = (argp->nthreads) ? argp->nthreads : 1;
+
+    if (argp->tr_capacity)
+        return argp->tr_capacity;
+
+    if (!argp->tr_pgsz)
+        return 0;
+
+    npus = ((argp->channels) ? argp->channels : 1) *
+                                        ((argp->luns) ? argp->luns : 1);
+    if (npus < nthreads)
+        return 0;
+
+    return (npus / nthreads) * ((argp->blks) ? argp->blks : 1) *
+                    ((argp->pgs) ? argp->pgs : 1) * (uint64_t) argp->tr_pgsz;
+}
+
+/*
+ * Maps the LBA range touched by the trace onto [0, capacity). The range is
+ * first rebased to 0; if it still does not fit, offsets are scaled linearly
+ * so the access pattern keeps its shape. I/O sizes are never scaled.
+ */
+static uint64_t fox_trace_rescale (struct fox_trace *tr, uint64_t capacity)
+{
+    uint64_t i, span, clamped = 0;
+    long double factor = 1.0;
+    struct fox_trace_rec *rec;
+
+    span = tr->max_end - tr->min_offset;
+    if (capacity && span > capacity)
+        factor = (long double) capacity / span;
+
+    for (i = 0; i < tr->nrecs; i++) {
+        rec = &tr->recs[i];
+        rec->offset -= tr->min_offset;
+
+        if (factor < 1.0)
+            rec->offset = (uint64_t) (rec->offset * factor);
+        rec->offset -= rec->offset % TRACE_SECTOR;
+
+        if (!capacity)
+            continue;
+
+        if (rec->size > capacity)
+            rec->size = capacity;
+        if (rec->offset + rec->size > capacity) {
+            rec->offset = capacity - rec->size;
+            rec->offset -= rec->offset % TRACE_SECTOR;
+            clamped++;
+        }
+    }
+
+    return clamped;
+}
+
+static int fox_trace_write (struct fox_trace *tr, const char *path)
+{
+    FILE *fp;
+    uint64_t i;
+
+    fp = fopen (path, "w");
+    if (!fp) {
+        printf (" Cannot create output file: %s\n", path);
+        return -1;
+    }
+
+    fprintf (fp, "%" PRIu64 "\n", tr->nrecs);
+    for (i = 0; i < tr->nrecs; i++)
+        fprintf (fp, "%" PRIu64 ",%" PRIu64 ",%c\n", tr->recs[i].offset,
+                                        tr->recs[i].size, tr->recs[i].type);
+
+    fclose (fp);
+    return 0;
+}
+
+static int fox_trace_import (struct fox_argp *argp)
+{
+    struct fox_trace tr;
+    uint64_t i, capacity, clamped, nreads = 0, ntrims = 0;
+    int ret = -1;
+
+    memset (&tr, 0, sizeof (tr));
+
+    if (fox_trace_parse (argp, &tr))
+        goto FREE;
+
+    if (!tr.nrecs) {
+        printf (" No read/write records found in %s\n", argp->tr_input);
+        goto FREE;
+    }
+
+    capacity = fox_trace_node_capacity (argp);
+    clamped = fox_trace_rescale (&tr, capacity);
+
+    if (fox_trace_write (&tr, argp->tr_output))
+        goto FREE;
+
+    for (i = 0; i < tr.nrecs; i++) {
+        if (tr.recs[i].type == 'r')
+            nreads++;
+        else if (tr.recs[i].type == 't')
+            ntrims++;
+    }
+
+    printf ("\n --- TRACE IMPORT ---\n\n");
+    printf (" - Input        : %s\n", argp->tr_input);
+    printf (" - Output       : %s\n", argp->tr_output);
+    printf (" - Lines read   : %" PRIu64 "\n", tr.nlines);
+    printf (" - Records      : %" PRIu64 " (%" PRIu64 " reads, %" PRIu64
+                        " writes, %" PRIu64 " trims)\n", tr.nrecs, nreads,
+                        tr.nrecs - nreads - ntrims, ntrims);
+    printf (" - Skipped      : %" PRIu64 "\n", tr.skipped);
+    printf (" - LBA range    : 0x%" PRIx64 " - 0x%" PRIx64 " (%" PRIu64
+                            " KB)\n", tr.min_offset, tr.max_end,
+                            (tr.max_end - tr.min_offset) / 1024);
+    if (capacity) {
+        printf (" - Node capacity: %" PRIu64 " KB\n", capacity / 1024);
+        printf (" - Scale factor : %.6Lf\n",
+                (tr.max_end - tr.min_offset > capacity) ?
+                (long double) capacity / (tr.max_end - tr.min_offset) : 1.0L);
+        printf (" - Clamped I/Os : %" PRIu64 "\n", clamped);
+    } else {
+        printf (" - Node capacity: not given, offsets only rebased\n");
+    }
+    printf ("\n");
+
+    ret = 0;
+
+FREE:
+    free (tr.recs);
+    return ret;
+}
+
+int fox_trace_init (struct fox_argp *argp)
+{
+    if (argp->tr_cmd != TRACE_CMD_IMPORT) {
+        printf (" Invalid trace command, please use --help to see more "
+                                                                  "info.\n");
+        return -1;
+    }
+
+    if (!argp->tr_format) {
+        printf (" Trace format is required (-f).\n");
+        return -1;
+    }
+
+    if (argp->tr_input[0] == 0) {
+        printf (" Input trace file is required (-i).\n");
+        return -1;
+    }
+
+    if (argp->tr_output[0] == 0)
+        memcpy (argp->tr_output, "input.csv", 10);
+
+    if (!argp->tr_event)
+        argp->tr_event = 'Q';
+
+    return fox_trace_import (argp);
+}
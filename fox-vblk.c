@@ -121,9 +121,18 @@ int fox_alloc_vblks (struct fox_workload *wl)
 
         wl->vblks[blk_i] = prov_vblk_get(ch_i, lun_i);
 
-        /* TODO: treat error */
-        if(wl->vblks[blk_i] == NULL)
-            return -1;
+        /* The superblock engines leave out the superblocks of a LUN short
+           of good blocks, the others need every block */
+        if(wl->vblks[blk_i] == NULL) {
+            if (wl->engine->id != FOX_ENGINE_7 &&
+                                        wl->engine->id != FOX_ENGINE_8) {
+                printf ("\n - Not enough good blocks in (%d %d).\n",
+                                                                ch_i, lun_i);
+                return -1;
+            }
+            wl->vblk_holes++;
+            continue;
+        }
 
         fox_timestamp_end(FOX_STATS_ERASE_T, wl->stats);
         fox_set_stats (FOX_STATS_ERASED_BLK, wl->stats, 1);
@@ -133,10 +142,33 @@ int fox_alloc_vblks (struct fox_workload *wl)
             fox_write_vblk_100r (wl->vblks[blk_i], wl);
     }
     printf ("\r - Preparing blocks... [%d/%d]\n", blk_i, t_blks);
+    if (wl->vblk_holes)
+        printf (" - %d blocks without a good block behind them.\n",
+                                                            wl->vblk_holes);
 
     return 0;
 }
 
+/* Swap a failed block of the workload for a spare of the same LUN */
+struct nvm_vblk *fox_vblk_replace (struct fox_workload *wl, uint16_t ch,
+                                                    uint16_t lun, uint32_t blk)
+{
+    uint32_t boff;
+    struct nvm_vblk *spare;
+
+    boff = fox_vblk_get_pblk (wl, ch, lun, blk);
+
+    spare = prov_vblk_get (ch, lun);
+    if (!spare)
+        return NULL;
+
+    if (wl->vblks[boff])
+        prov_vblk_retire (wl->vblks[boff]);
+    wl->vblks[boff] = spare;
+
+    return spare;
+}
+
 void fox_free_vblks (struct fox_workload *wl)
 {
     int blk_i, t_blks;
@@ -144,7 +176,8 @@ void fox_free_vblks (struct fox_workload *wl)
     t_blks = wl->blks * wl->luns * wl->channels;
 
     for (blk_i = 0; blk_i < t_blks; blk_i++)
-        prov_vblk_put(wl->vblks[blk_i]);
+        if (wl->vblks[blk_i])
+            prov_vblk_put(wl->vblks[blk_i]);
 
     free (wl->vblks);
 }
\ No newline at end of file
@@ -71,6 +71,7 @@ enum {
 #define FOX_FLAG_READY      (1 << 0)
 #define FOX_FLAG_DONE       (1 << 1)
 #define FOX_FLAG_MONITOR    (1 << 2)
+#define FOX_FLAG_ABORT      (1 << 3)
 
 #define CMDARG_LEN          512
 #define CMDARG_FLAG_D       (1 << 0)
@@ -90,6 +91,7 @@ enum {
 
 #define FOX_RUN_MODE         0x0
 #define FOX_IO_MODE          0x1
+#define FOX_TRACE_MODE       0x2
 
 #define WB_GEO_FILL         0x1
 #define WB_GEO_CMP          0x2
@@ -105,7 +107,54 @@ enum cmdtypes {
     CMDARG_RUN      = 1,
     CMDARG_ERASE    = 2,
     CMDARG_WRITE    = 3,
-    CMDARG_READ     = 4
+    CMDARG_READ     = 4,
+    CMDARG_TRACE    = 5
+};
+
+enum {
+    TRACE_CMD_IMPORT    = 1
+};
+
+enum {
+    TRACE_SHARD_NONE    = 0,
+    TRACE_SHARD_RANGE   = 1,
+    TRACE_SHARD_HASH    = 2
+};
+
+enum {
+    GEN_NONE            = 0,
+    GEN_UNIFORM         = 1,
+    GEN_ZIPF            = 2,
+    GEN_HOTCOLD         = 3
+};
+
+enum {
+    GC_GREEDY           = 0,
+    GC_COSTBENEFIT      = 1,
+    GC_WINDOWED         = 2,
+    GC_RANDOM           = 3
+};
+
+enum {
+    GC_COPY_HOST        = 0,
+    GC_COPY_DEVICE      = 1
+};
+
+enum {
+    RCACHE_LRU          = 0,
+    RCACHE_CLOCK        = 1
+};
+
+enum {
+    HYBRID_BAST         = 0,
+    HYBRID_FAST         = 1
+};
+
+enum {
+    TRACE_FMT_BLKPARSE  = 1,
+    TRACE_FMT_FIO       = 2,
+    TRACE_FMT_MSR       = 3,
+    TRACE_FMT_SPC       = 4
 };
 
 struct fox_argp
@@ -134,6 +183,40 @@ struct fox_argp
     uint64_t    sb_pus;
     uint64_t    sb_blks;
     uint64_t    logblknum;
+    uint8_t     trace_shard;
+    uint8_t     gen_dist;
+    uint64_t    gen_nios;
+    double      gen_theta;
+    uint8_t     gen_hot_data;
+    uint8_t     gen_hot_access;
+    uint8_t     gen_seq;
+    uint8_t     gen_span;
+    uint8_t     gen_fill;
+    uint64_t    gen_seed;
+    uint8_t     gen_trim;
+    char        gen_bs[CMDARG_LEN];
+    uint8_t     gc_policy;
+    uint64_t    gc_window;
+    uint8_t     gc_bg_low;
+    uint8_t     gc_bg_high;
+    uint32_t    gc_step;
+    uint32_t    gc_budget;
+    uint8_t     gc_yield;
+    uint8_t     gc_copy;
+    uint8_t     streams;
+    uint8_t     gc_stream;
+    uint32_t    wbuf_pgs;
+    uint32_t    rcache_pgs;
+    uint8_t     rcache_policy;
+    uint32_t    readahead;
+    uint64_t    map_cache;
+    uint64_t    ckpt;
+    uint8_t     oob;
+    uint8_t     op;
+    uint8_t     hybrid;
+    uint32_t    log_min;
+    uint32_t    log_max;
+    uint32_t    wl_spread;
 
     /* r/w/e parameters */
     uint8_t     io_ch;
@@ -144,6 +227,17 @@ struct fox_argp
     uint8_t     io_random;
     uint8_t     io_verb;
     uint8_t     io_out;
+
+    /* trace parameters */
+    uint8_t     tr_cmd;
+    uint8_t     tr_format;
+    char        tr_event;
+    int         tr_unit;
+    uint32_t    tr_pgsz;
+    uint64_t    tr_capacity;
+    uint64_t    tr_maxrecs;
+    char        tr_input[CMDARG_LEN];
+    char        tr_output[CMDARG_LEN];
 };
 
 struct fox_node;
@@ -213,6 +307,7 @@ struct fox_workload {
     struct nvm_dev          *dev;
     const struct nvm_geo    *geo;
     struct nvm_vblk         **vblks;
+    uint32_t                vblk_holes; /* blocks short of good ones */
     struct fox_stats        *stats;
     pthread_mutex_t         start_mut;
     pthread_cond_t          start_con;
@@ -222,11 +317,46 @@ struct fox_workload {
     uint64_t                sb_pus;
     uint64_t                sb_blks;
     uint64_t                logblknum;
+    uint8_t                 trace_shard;
+    uint8_t                 gen_dist;       /* synthetic I/O, engines 4-8 */
+    uint64_t                gen_nios;
+    double                  gen_theta;
+    uint8_t                 gen_hot_data;
+    uint8_t                 gen_hot_access;
+    uint8_t                 gen_seq;
+    uint8_t                 gen_span;
+    uint8_t                 gen_fill;
+    uint64_t                gen_seed;
+    uint8_t                 gen_trim;       /* % of generated I/Os that trim */
+    char*                   gen_bs;
+    uint8_t                 gc_policy;      /* GC victim policy, engine 6 */
+    uint64_t                gc_window;
+    uint8_t                 gc_bg_low;      /* background GC watermarks, % */
+    uint8_t                 gc_bg_high;
+    uint32_t                gc_step;        /* incremental GC, pages per step */
+    uint32_t                gc_budget;      /* incremental GC time per I/O, us */
+    uint8_t                 gc_yield;       /* reads skip incremental GC */
+    uint8_t                 gc_copy;        /* GC_COPY_HOST or GC_COPY_DEVICE */
+    uint8_t                 streams;        /* user write streams, 0 = 1 */
+    uint8_t                 gc_stream;      /* GC writes to its own stream */
+    uint32_t                wbuf_pgs;       /* write buffer pages, 0 = off */
+    uint32_t                rcache_pgs;     /* read cache pages, 0 = off */
+    uint8_t                 rcache_policy;  /* RCACHE_LRU or RCACHE_CLOCK */
+    uint32_t                readahead;      /* max readahead pages, 0 = off */
+    uint64_t                map_cache;      /* cached map entries, 0 = all */
+    uint64_t                ckpt;           /* map updates per checkpoint, 0 = off */
+    uint8_t                 oob;            /* page owners in OOB metadata */
+    uint8_t                 op;             /* over-provisioning, % of capacity */
+    uint8_t                 hybrid;         /* HYBRID_BAST or HYBRID_FAST */
+    uint32_t                log_min;        /* adaptive log pool, engine 8, 0 = off */
+    uint32_t                log_max;
+    uint32_t                wl_spread;      /* wear leveling threshold, 0 = off */
 };
 
 struct fox_blkbuf {
     uint8_t     *buf_w;
     uint8_t     *buf_r;
+    uint8_t     *meta;      /* sector metadata of the pages with --oob */
 };
 
 struct fox_tgt_blk {
@@ -246,6 +376,7 @@ struct fox_node {
     uint8_t             *lun;
     uint8_t             *blk;
     uint32_t            delay;
+    uint64_t            lost_pgs; /* bad block pages the host cannot use */
     pthread_t           tid;
     struct fox_workload *wl;
     struct fox_stats    stats;
@@ -370,11 +501,15 @@ int              fox_init_stats (struct fox_stats *);
 void             fox_exit_stats (struct fox_stats *);
 void             fox_wait_for_ready (struct fox_workload *);
 void             fox_wait_for_monitor (struct fox_workload *);
+void             fox_abort_nodes (struct fox_workload *);
 int              fox_mio_init (struct fox_argp *);
+int              fox_trace_init (struct fox_argp *);
 
 /* fox-vblk */
 int              fox_alloc_vblks (struct fox_workload *);
 void             fox_free_vblks (struct fox_workload *);
+struct nvm_vblk *fox_vblk_replace (struct fox_workload *, uint16_t, uint16_t,
+                                                                      uint32_t);
 int              fox_vblk_tgt (struct fox_node *, uint16_t, uint16_t, uint32_t);
 uint32_t         fox_vblk_get_pblk (struct fox_workload *, uint16_t,
                                                             uint16_t, uint32_t);
@@ -415,6 +550,8 @@ int    fox_read_blk (struct fox_tgt_blk *, struct fox_node *,
                                       struct fox_blkbuf *, uint16_t, uint16_t);
 int    fox_write_blk (struct fox_tgt_blk *, struct fox_node *,
                                       struct fox_blkbuf *, uint16_t, uint16_t);
+int    fox_read_meta (struct fox_tgt_blk *, struct fox_node *, uint16_t,
+                                                        uint8_t *, uint8_t *);
 int    fox_update_runtime (struct fox_node *);
 double fox_check_progress_runtime (struct fox_node *);
 double fox_check_progress_pgs (struct fox_node *);
@@ -451,9 +588,15 @@ ssize_t prov_vblk_pread(struct nvm_vblk *vblk, void *buf, size_t count,
 ssize_t prov_vblk_pwrite(struct nvm_vblk *vblk, const void *buf,
                                                   size_t count, size_t offset);
 ssize_t prov_vblk_erase(struct nvm_vblk *vblk);
+ssize_t prov_addr_copy(struct nvm_addr *src, struct nvm_addr *dst, int naddrs);
+ssize_t prov_vblk_pread_meta(struct nvm_vblk *vblk, void *buf, void *meta,
+                                                  size_t count, size_t offset);
+ssize_t prov_vblk_pwrite_meta(struct nvm_vblk *vblk, const void *buf,
+                              const void *meta, size_t count, size_t offset);
 
 struct nvm_vblk	*prov_vblk_get(int ch, int lun);
 int    	prov_vblk_put(struct nvm_vblk *vblk);
+int     prov_vblk_retire(struct nvm_vblk *vblk);
 void 	prov_dev_pr();
 void 	prov_ublk_pr(int lun);
 void 	prov_fblk_pr(int lun);